@@ -128,7 +128,31 @@ struct kevent {
  * data/hint flags for EVFILT_{READ|WRITE}
  */
 #define NOTE_LOWAT	0x0001			/* low water mark */
-#undef  NOTE_LOWAT                  /* Not supported on Linux */
+
+/* libkqueue extensions for EVFILT_{READ|WRITE} */
+#define NOTE_LAZYDISABLE 0x01000000		/* stay armed while disabled */
+#define NOTE_NODATA	0x02000000		/* leave data unset, see kevent_data() */
+#define NOTE_ACCEPT	0x04000000		/* return accepted sockets in data (needs O_NONBLOCK) */
+#define NOTE_EXCLUSIVE	0x08000000		/* wake one of the kqueues sharing the fd */
+#define NOTE_FD_SOCKET	0x10000000		/* EV_ADD hint: fd is a connected socket */
+#define NOTE_FD_PIPE	0x20000000		/* EV_ADD hint: fd is a pipe or FIFO */
+
+/*
+ * data/hint flags for EVFILT_TIMER
+ */
+#define NOTE_SECONDS	0x00000001		/* data is seconds */
+#define NOTE_MSECONDS	0x00000002		/* data is milliseconds (default) */
+#define NOTE_USECONDS	0x00000004		/* data is microseconds */
+#define NOTE_NSECONDS	0x00000008		/* data is nanoseconds */
+#define NOTE_ABSTIME	0x00000010		/* data is an absolute CLOCK_REALTIME time */
+#define NOTE_ABSOLUTE	NOTE_ABSTIME		/* Darwin name */
+
+/* libkqueue extensions for EVFILT_TIMER */
+#define NOTE_BOOTTIME	0x00000080		/* use CLOCK_BOOTTIME, which counts suspend */
+/* The CPU-time clocks take SIGRTMAX; EBUSY if the application handles it */
+#define NOTE_PROCESS_CPUTIME 0x00000100		/* count the CPU time of the process */
+#define NOTE_THREAD_CPUTIME 0x00000200		/* count the CPU time of the thread */
+#define NOTE_IDLE	0x00000400		/* idle timeout, see kevent_idle_timeout() */
 
 /*
  * data/hint flags for EVFILT_VNODE
@@ -186,6 +210,40 @@ KQ_EXPORT
 int kevent(int kq, const struct kevent *changelist, int nchanges,
            struct kevent *eventlist, int nevents, const kq_timespec_s *timeout);
 
+/* libkqueue extension: fill in the data field of a NOTE_NODATA event */
+KQ_EXPORT
+int kevent_data(int kq, struct kevent *kev);
+
+/* libkqueue extension: apply changes to each socket accepted by NOTE_ACCEPT */
+KQ_EXPORT
+int kevent_accept_template(int kq, int ident, const struct kevent *changelist,
+           int nchanges);
+
+/* libkqueue extension: report a READ or WRITE knote that stays quiet */
+KQ_EXPORT
+int kevent_idle_timeout(int kq, int ident, short filter, intptr_t timeout);
+
+/* libkqueue extension: let a timer expire late, to share a wakeup */
+KQ_EXPORT
+int kevent_timer_leeway(int kq, int ident, intptr_t leeway);
+
+/* libkqueue extension: the sender of the last signal seen by EVFILT_SIGNAL */
+struct kevent_siginfo {
+	int		ksi_code;	/* si_code, e.g. SI_USER or SI_QUEUE */
+	int		ksi_pid;	/* process that sent the signal */
+	unsigned int	ksi_uid;	/* real user ID of that process */
+	intptr_t	ksi_value;	/* value passed to sigqueue(3) */
+};
+
+KQ_EXPORT
+int kevent_signal_info(int kq, int signo, struct kevent_siginfo *info);
+
+/* libkqueue extension: the resource usage of a child reported by EVFILT_PROC */
+struct rusage;
+
+KQ_EXPORT
+int kevent_proc_rusage(int kq, int pid, struct rusage *ru);
+
 #endif /* !__KERNEL__* */
 
 #endif /* !_SYS_EVENT_H_ */
@@ -17,10 +17,10 @@
 #include <assert.h>
 #include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "./lite.h"
-#include "./utarray.h"
 
 /* The maximum number of events that can be returned in
    a single kq_event() call
@@ -30,9 +30,14 @@
 #include <unistd.h>
 
 /* Debugging macros */
+#ifdef KQ_DEBUG
 #define dbg_puts(s)    dbg_printf("%s", (s))
 #define dbg_printf(fmt,...)  fprintf(stderr, "kq [%d]: %s(): "fmt"\n",                     \
              0 /*TODO: thread id */, __func__, __VA_ARGS__)
+#else
+#define dbg_puts(s)             do {} while (0)
+#define dbg_printf(fmt,...)     do {} while (0)
+#endif
 
 /* Determine what type of kernel event system to use. */
 #if defined(__FreeBSD__) || defined(__APPLE__) || defined(__OpenBSD__) || defined(__NetBSD__)
@@ -40,26 +45,49 @@
 #include <sys/event.h>
 #elif defined(__linux__)
 #define USE_EPOLL
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <linux/sockios.h>
 #include <sys/epoll.h>
 #include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/queue.h>
+#include <sys/resource.h>
 #include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/timerfd.h>
-#include <signal.h>
-#include <stdlib.h>
-#include <string.h>
+#else
+#error Unsupported operating system type
+#endif
 
-//XXX - TEMPORARY DURING DEVELOPMENT
-#define KQ_THREADSAFE 1
+#if defined(USE_EPOLL)
 
-#ifdef KQ_THREADSAFE
-#include <pthread.h>
-#endif
+/*
+ * Filters are numbered from zero in lite.h, and from -1 downwards in
+ * <sys/event.h>. Either way, this gives an index into kq->knote[].
+ */
+#define kq_filter_index(f)  ((f) < 0 ? ~(f) : (f))
 
+/* Idents above this are rejected, since knotes are stored by ident */
+#define KQ_IDENT_MAX    (1 << 24)
+
+/* A table of knote pointers, indexed by ident (or by inotify wd) */
+struct knote_table {
+    size_t      kt_size;
+    struct knote_table *kt_retired; /* The table this one replaced */
+    struct knote *kt_slot[];
+};
+
+#ifdef KQ_DEBUG
 static char * epoll_event_to_str(struct epoll_event *);
-#else
-#error Unsupported operating system type
 #endif
 
+#endif /* defined(USE_EPOLL) */
+
 struct kqueue {
 #if defined(USE_KQUEUE)
     int kqfd;            /* kqueue(2) descriptor */
@@ -70,58 +98,159 @@ struct kqueue {
     int timefd;         /* timerfd */
     int readfd, writefd;  /* epoll descriptors for EVFILT_READ & EVFILT_WRITE */
     sigset_t sigmask;
-    /* All of the active knotes for each filter. The index in the array matches
-       the 'ident' parameter of the 'struct kevent' in the knote.
+    /* All of the active knotes for each filter. The index in the table
+       matches the 'ident' parameter of the 'struct kevent' in the knote.
+       Lookups do not take kq_mtx; see knote_lookup().
      */
-    UT_array *knote[EVFILT_SYSCOUNT];
+    struct knote_table *knote[EVFILT_SYSCOUNT];
 
     /* This allows all kevents to share a single inotify descriptor.
      * Key: inotify watch descriptor returned by inotify_add_watch()
-     * Value: pointer to knote
+     * Value: list of knotes watching that inode
      */
-    UT_array *ino_knote;
+    struct knote_table *ino_knote;
+
+    /* EVFILT_TIMER knotes, as a min-heap ordered by expiration time.
+       The timerfd is always armed for the root of the heap.
+     */
+    struct knote **timer_heap;
+    size_t      timer_cnt, timer_max;
+
+    /* Knotes of the signal, timer and vnode filters with pending events */
+    TAILQ_HEAD(, knote) ready;
+
+    /* Deleted knotes, kept for reuse until the kqueue is freed */
+    struct knote *kn_free;
 
-#ifdef KQ_THREADSAFE
     pthread_mutex_t kq_mtx;
-#endif
 
 #else
 #error Undefined event system
 #endif
 };
 
+#if defined(USE_EPOLL)
+
 /* A knote is used to store information about a kevent while it is
    being monitored. Once it fires, information from the knote is returned
    to the caller.
  */
 struct knote {
     struct kevent kev;
+
+    /* Incremented before and after every change to the knote, so that
+       a lock-free reader can detect that its copy is inconsistent. */
+    volatile uint32_t kn_gen;
+
+    int         kn_ready;   /* Non-zero if on kq->ready */
+    int         kn_file;    /* EVFILT_READ on a regular file */
+    intptr_t    kn_count;   /* Signals received or timer expirations */
+    unsigned int kn_fflags; /* EVFILT_VNODE: pending fflags */
     union {
-        int timerfd;        /* Each EVFILT_TIMER kevent has a timerfd */
-        int ino_wd;         /* EVFILT_VNODE: index within kq->ino_knote */
+        struct {
+            uint64_t deadline;  /* CLOCK_MONOTONIC, in nanoseconds */
+            uint64_t period;
+            size_t   heap_idx;  /* Index within kq->timer_heap */
+        } timer;
+        struct {
+            int      wd;        /* Index within kq->ino_knote */
+            nlink_t  nlink;
+            off_t    size;
+            struct knote *next; /* Other knotes sharing the watch */
+        } vnode;
     } aux;
-    int deleted;            /* When EV_DELETE is used, it marks the knote deleted instead of freeing the object. This helps with threadsafety by ensuring that threads don't try to access a freed object. It doesn't help with memory usage, as the memory is never reclaimed. */
+    TAILQ_ENTRY(knote) kn_entries;  /* Entry in kq->ready */
+    struct knote *kn_free_next;     /* Entry in kq->kn_free */
 };
 
 static inline void
 kq_lock(kqueue_t kq)
 {
-#ifdef KQ_THREADSAFE
     if (pthread_mutex_lock(&kq->kq_mtx) != 0)
         abort();
-#endif
 }
 
 static inline void
 kq_unlock(kqueue_t kq)
 {
-#ifdef KQ_THREADSAFE
     if (pthread_mutex_unlock(&kq->kq_mtx) != 0)
         abort();
-#endif
 }
 
-UT_icd knote_icd = { sizeof(struct knote), NULL, NULL, NULL };
+static inline void
+knote_write_begin(struct knote *kn)
+{
+    __atomic_add_fetch(&kn->kn_gen, 1, __ATOMIC_ACQ_REL);
+}
+
+static inline void
+knote_write_end(struct knote *kn)
+{
+    __atomic_add_fetch(&kn->kn_gen, 1, __ATOMIC_RELEASE);
+}
+
+static uint64_t
+monotonic_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+#endif /* defined(USE_EPOLL) */
+
+void
+kq_free(kqueue_t kq)
+{
+#if defined(USE_KQUEUE)
+    close(kq->kqfd);
+
+#elif defined(USE_EPOLL)
+    struct knote_table *kt, *next;
+    struct knote *kn;
+    size_t j;
+    int i;
+
+    if (kq->sigfd >= 0)
+        close(kq->sigfd);
+    if (kq->inofd >= 0)
+        close(kq->inofd);
+    if (kq->epfd >= 0)
+        close(kq->epfd);
+    if (kq->readfd >= 0)
+        close(kq->readfd);
+    if (kq->writefd >= 0)
+        close(kq->writefd);
+    if (kq->timefd >= 0)
+        close(kq->timefd);
+
+    /* Every knote is either in one of the tables, or on the free list */
+    for (i = 0; i < EVFILT_SYSCOUNT; i++) {
+        kt = kq->knote[i];
+        if (kt != NULL) {
+            for (j = 0; j < kt->kt_size; j++)
+                free(kt->kt_slot[j]);
+        }
+        for (; kt != NULL; kt = next) {
+            next = kt->kt_retired;
+            free(kt);
+        }
+    }
+    for (kt = kq->ino_knote; kt != NULL; kt = next) {
+        next = kt->kt_retired;
+        free(kt);
+    }
+    while ((kn = kq->kn_free) != NULL) {
+        kq->kn_free = kn->kn_free_next;
+        free(kn);
+    }
+    free(kq->timer_heap);
+
+    pthread_mutex_destroy(&kq->kq_mtx);
+#endif
+    free(kq);
+}
 
 /* Initialize the event descriptor */
 kqueue_t
@@ -142,64 +271,52 @@ kq_init(void)
 #elif defined(USE_EPOLL)
     struct epoll_event epev;
 
-    if ((kq = malloc(sizeof(*kq))) == NULL)
+    if ((kq = calloc(1, sizeof(*kq))) == NULL)
         return (NULL);
+    kq->sigfd = kq->inofd = kq->epfd = -1;
+    kq->readfd = kq->writefd = kq->timefd = -1;
+    TAILQ_INIT(&kq->ready);
 
-#ifdef KQ_THREADSAFE
-    if (pthread_mutex_init(&kq->kq_mtx, NULL) != 0)
-        goto errout;
-#endif
-
-    /* Create an index of kevents to allow lookups from epev.data.u32 */
-
-    for (int i = 0; i < EVFILT_SYSCOUNT; i++)
-        utarray_new(kq->knote[i], &knote_icd);
+    if (pthread_mutex_init(&kq->kq_mtx, NULL) != 0) {
+        free(kq);
+        return (NULL);
+    }
 
     /* Initialize all the event descriptors */
     sigemptyset(&kq->sigmask);
-    kq->sigfd = signalfd(-1, &kq->sigmask, 0);
-    kq->inofd = inotify_init();
-    kq->epfd = epoll_create(10);
-    kq->readfd = epoll_create(10);
-    kq->writefd = epoll_create(10);
-    kq->timefd = timerfd_create(CLOCK_MONOTONIC, 0);
+    kq->sigfd = signalfd(-1, &kq->sigmask, SFD_NONBLOCK | SFD_CLOEXEC);
+    kq->inofd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    kq->epfd = epoll_create1(EPOLL_CLOEXEC);
+    kq->readfd = epoll_create1(EPOLL_CLOEXEC);
+    kq->writefd = epoll_create1(EPOLL_CLOEXEC);
+    kq->timefd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
     if (kq->sigfd < 0 || kq->inofd < 0 || kq->epfd < 0
             || kq->readfd < 0 || kq->writefd < 0 || kq->timefd < 0)
         goto errout;
 
-    /* Add the signalfd descriptor to the epollset */
+    /* Add each of the event descriptors to the epollset */
+    memset(&epev, 0, sizeof(epev));
     epev.events = EPOLLIN;
-    epev.data.u32 = EVFILT_SIGNAL;
+
+    epev.data.u32 = kq_filter_index(EVFILT_SIGNAL);
     if (epoll_ctl(kq->epfd, EPOLL_CTL_ADD, kq->sigfd, &epev) < 0)
         goto errout;
 
-    /* Add the readfd descriptor to the epollset */
-    epev.events = EPOLLIN;
-    epev.data.u32 = EVFILT_READ;
+    epev.data.u32 = kq_filter_index(EVFILT_READ);
     if (epoll_ctl(kq->epfd, EPOLL_CTL_ADD, kq->readfd, &epev) < 0)
         goto errout;
 
-    /* Add the writefd descriptor to the epollset */
-    epev.events = EPOLLIN;
-    epev.data.u32 = EVFILT_WRITE;
+    epev.data.u32 = kq_filter_index(EVFILT_WRITE);
     if (epoll_ctl(kq->epfd, EPOLL_CTL_ADD, kq->writefd, &epev) < 0)
         goto errout;
 
-    /* Add the inotify descriptor to the epollset */
-    /*
-    if ((kev = malloc(sizeof(*kev))) == NULL)
-        goto errout;
-    EV_SET(kev, EVFILT_VNODE, EVFILT_VNODE, 0, 0, 0, NULL);
-    epev.events = EPOLLIN;
-    epev.data.u32 = 1;
-    utarray_push_back(kq->kev, kev);
+    epev.data.u32 = kq_filter_index(EVFILT_VNODE);
     if (epoll_ctl(kq->epfd, EPOLL_CTL_ADD, kq->inofd, &epev) < 0)
         goto errout;
-        */
 
-    //TODO: consider applying FD_CLOEXEC to all descriptors
-
-    // FIXME: check that all members of kq->wfd are valid
+    epev.data.u32 = kq_filter_index(EVFILT_TIMER);
+    if (epoll_ctl(kq->epfd, EPOLL_CTL_ADD, kq->timefd, &epev) < 0)
+        goto errout;
 
     return (kq);
 
@@ -209,280 +326,1234 @@ errout:
 #endif
 }
 
-void
-kq_free(kqueue_t kq)
+#if defined(USE_EPOLL)
+
+/*
+ * Knote storage
+ *
+ * Lookups are lock-free: the table pointer and each slot are published
+ * with release stores while holding kq_mtx, and read with acquire loads.
+ * A table that is outgrown is kept (see kt_retired) until kq_free(), since
+ * a reader may still be using it. Deleted knotes are likewise recycled
+ * through kq->kn_free rather than freed, and kn_gen tells a reader whether
+ * the knote changed while it was being copied.
+ */
+
+static struct knote *
+table_lookup(struct knote_table **ktp, uintptr_t idx)
 {
-#if defined(USE_KQUEUE)
-    close(kq.kqfd);
+    struct knote_table *kt;
 
-#elif defined(USE_EPOLL)
-    close(kq->sigfd);
-    close(kq->inofd);
-    close(kq->epfd);
-    close(kq->readfd);
-    close(kq->writefd);
-    close(kq->timefd);
-
-    //FIXME: need to free each individual knote
-    for (int i = 0; i < EVFILT_SYSCOUNT; i++)
-        utarray_free(kq->knote[i]);
-
-# ifdef KQ_THREADSAFE
-    pthread_mutex_destroy(&kq->kq_mtx);
-# endif
+    kt = __atomic_load_n(ktp, __ATOMIC_ACQUIRE);
+    if (kt == NULL || idx >= kt->kt_size)
+        return (NULL);
+    return (__atomic_load_n(&kt->kt_slot[idx], __ATOMIC_ACQUIRE));
+}
 
-#endif
-    free(kq);
+/* Store a knote in a table, growing it if needed. Called with kq_mtx held. */
+static int
+table_store(struct knote_table **ktp, uintptr_t idx, struct knote *kn)
+{
+    struct knote_table *kt, *old;
+    size_t size;
+
+    old = *ktp;
+    if (old == NULL || idx >= old->kt_size) {
+        size = (old == NULL) ? 64 : old->kt_size;
+        while (size <= idx)
+            size *= 2;
+        kt = calloc(1, sizeof(*kt) + size * sizeof(kt->kt_slot[0]));
+        if (kt == NULL)
+            return (-1);
+        kt->kt_size = size;
+        if (old != NULL) {
+            memcpy(&kt->kt_slot[0], &old->kt_slot[0],
+                    old->kt_size * sizeof(kt->kt_slot[0]));
+            kt->kt_retired = old;
+        }
+        __atomic_store_n(ktp, kt, __ATOMIC_RELEASE);
+    } else {
+        kt = old;
+    }
+
+    __atomic_store_n(&kt->kt_slot[idx], kn, __ATOMIC_RELEASE);
+    return (0);
 }
 
-#if defined(USE_EPOLL)
+static inline struct knote *
+knote_lookup(kqueue_t kq, int filt, uintptr_t ident)
+{
+    return (table_lookup(&kq->knote[filt], ident));
+}
 
-/* Create a knote object */
+/*
+ * Copy the kevent of a knote without taking kq_mtx. Returns -1 if there
+ * is no knote for the ident.
+ */
 static int
-knote_add(kqueue_t kq, const struct kevent *kev)
+knote_snapshot(struct kevent *dst, kqueue_t kq, int filt, uintptr_t ident)
 {
     struct knote *kn;
+    uint32_t gen;
 
-    assert(kev->filter < EVFILT_SYSCOUNT);
+    for (;;) {
+        kn = knote_lookup(kq, filt, ident);
+        if (kn == NULL)
+            return (-1);
+        gen = __atomic_load_n(&kn->kn_gen, __ATOMIC_ACQUIRE);
+        if (gen & 1)
+            continue;
+        memcpy(dst, &kn->kev, sizeof(*dst));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&kn->kn_gen, __ATOMIC_RELAXED) != gen)
+            continue;
+
+        /* The knote may have been deleted and reused for another ident */
+        if (dst->ident == ident && kq_filter_index(dst->filter) == filt)
+            return (0);
+    }
+}
 
-    kn = malloc(sizeof(*kn));
-    if (kn == NULL)
+static struct knote *
+knote_new(kqueue_t kq, const struct kevent *kev)
+{
+    struct knote *kn;
+    uint32_t gen;
+
+    kn = kq->kn_free;
+    if (kn != NULL) {
+        /* A lock-free reader may still be looking at the old contents */
+        kq->kn_free = kn->kn_free_next;
+        knote_write_begin(kn);
+        gen = kn->kn_gen;
+    } else {
+        kn = malloc(sizeof(*kn));
+        if (kn == NULL)
+            return (NULL);
+        gen = 1;
+    }
+    memset(kn, 0, sizeof(*kn));
+    kn->kn_gen = gen;
+    memcpy(&kn->kev, kev, sizeof(kn->kev));
+    kn->kev.flags &= ~(EV_ENABLE | EV_DELETE | EV_RECEIPT);
+    knote_write_end(kn);
+
+    return (kn);
+}
+
+/* Remove a knote from the lookup table, and keep it for reuse */
+static void
+knote_release(kqueue_t kq, struct knote *kn, int filt)
+{
+    knote_write_begin(kn);
+    (void) table_store(&kq->knote[filt], kn->kev.ident, NULL);
+    knote_write_end(kn);
+
+    kn->kn_free_next = kq->kn_free;
+    kq->kn_free = kn;
+}
+
+/*
+ * The ready list holds knotes of the signal, timer and vnode filters
+ * that have pending events.
+ */
+static void
+ready_insert(kqueue_t kq, struct knote *kn)
+{
+    if (!kn->kn_ready) {
+        TAILQ_INSERT_TAIL(&kq->ready, kn, kn_entries);
+        kn->kn_ready = 1;
+    }
+}
+
+static void
+ready_remove(kqueue_t kq, struct knote *kn)
+{
+    if (kn->kn_ready) {
+        TAILQ_REMOVE(&kq->ready, kn, kn_entries);
+        kn->kn_ready = 0;
+    }
+    kn->kn_count = 0;
+    kn->kn_fflags = 0;
+}
+
+/*
+ * EVFILT_READ and EVFILT_WRITE
+ */
+
+static uint32_t
+socket_events(const struct knote *kn, int filt)
+{
+    uint32_t events;
+
+    if (kn->kev.flags & EV_DISABLE)
+        return (0);
+
+    events = (filt == kq_filter_index(EVFILT_READ)) ? EPOLLIN | EPOLLRDHUP
+                                                   : EPOLLOUT;
+    if (kn->kev.flags & (EV_ONESHOT | EV_DISPATCH))
+        events |= EPOLLONESHOT;
+    if (kn->kev.flags & EV_CLEAR)
+        events |= EPOLLET;
+
+    return (events);
+}
+
+static int
+socket_ctl(kqueue_t kq, struct knote *kn, int filt, int op)
+{
+    struct epoll_event epev;
+    int epfd;
+
+    epfd = (filt == kq_filter_index(EVFILT_READ)) ? kq->readfd : kq->writefd;
+    memset(&epev, 0, sizeof(epev));
+    epev.events = socket_events(kn, filt);
+    epev.data.fd = kn->kev.ident;
+
+    return (epoll_ctl(epfd, op, kn->kev.ident, &epev));
+}
+
+static void
+socket_data(struct kevent *dst, int filt)
+{
+    int n;
+
+    if (filt == kq_filter_index(EVFILT_READ)) {
+        /* A listening socket has no FIONREAD; report one connection */
+        if (ioctl(dst->ident, FIONREAD, &n) < 0)
+            n = 1;
+    } else {
+        if (ioctl(dst->ident, SIOCOUTQ, &n) < 0)
+            n = 0;
+    }
+    dst->data = n;
+}
+
+/* Returns -1 if the event should be discarded */
+static int
+socket_fill(struct kevent *dst, const struct epoll_event *epev, int filt)
+{
+#if defined(NOTE_NODATA)
+    int nodata = (dst->fflags & NOTE_NODATA);
+#else
+    int nodata = 0;
+#endif
+
+#if defined(NOTE_ACCEPT)
+    /* Accept one connection per event; templates are not supported */
+    if (filt == kq_filter_index(EVFILT_READ) && (dst->fflags & NOTE_ACCEPT)) {
+        int fd;
+
+        fd = accept4(dst->ident, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EAGAIN || errno == ECONNABORTED)
+                return (-1);
+            dst->flags |= EV_ERROR;
+            dst->data = errno;
+        } else {
+            dst->data = fd;
+        }
+        return (0);
+    }
+#endif
+
+    if (epev->events & (EPOLLRDHUP | EPOLLHUP))
+        dst->flags |= EV_EOF;
+    if (epev->events & EPOLLERR)
+        dst->fflags = 1; /* FIXME: Return the actual socket error */
+
+    if (nodata)
+        dst->data = 0;
+    else
+        socket_data(dst, filt);
+
+    return (0);
+}
+
+/*
+ * Regular files cannot be added to an epoll set, and are always readable.
+ * Their knotes are kept on the ready list instead.
+ */
+
+static int
+file_create(kqueue_t kq, struct knote *kn)
+{
+    struct stat sb;
+
+    if (fstat(kn->kev.ident, &sb) < 0 || !S_ISREG(sb.st_mode)) {
+        errno = EPERM;
         return (-1);
-    memcpy (&kn->kev, kev, sizeof(kn->kev));
+    }
+    kn->kn_file = 1;
+    if (!(kn->kev.flags & EV_DISABLE))
+        ready_insert(kq, kn);
+
+    return (0);
+}
+
+static intptr_t
+file_remaining(int fd)
+{
+    struct stat sb;
+    off_t pos;
 
-    kq_lock(kq);
-    utarray_insert(kq->knote[kev->filter], kn, kev->ident);
-    kq_unlock(kq);
+    pos = lseek(fd, 0, SEEK_CUR);
+    if (pos < 0 || fstat(fd, &sb) < 0 || sb.st_size < pos)
+        return (0);
+    return (sb.st_size - pos);
+}
+
+/*
+ * EVFILT_SIGNAL
+ */
 
+static int
+signal_update(kqueue_t kq)
+{
+    if (signalfd(kq->sigfd, &kq->sigmask, SFD_NONBLOCK | SFD_CLOEXEC) < 0)
+        return (-1);
     return (0);
 }
 
-/* Lookup a 'struct kevent' that was previously stored in a knote object */
-static struct knote *
-knote_lookup(kqueue_t kq, short filter, uint32_t ident)
+static int
+signal_add(kqueue_t kq, struct knote *kn)
 {
-    struct knote *p;
+    sigset_t mask;
+
+    if (kn->kev.ident == 0 || kn->kev.ident >= NSIG) {
+        errno = EINVAL;
+        return (-1);
+    }
 
-    kq_lock(kq);
-    p = (struct knote *) utarray_eltptr(kq->knote[filter], ident);
-    //TODO: refcounting
-    kq_unlock(kq);
+    /* Block the signal handler from being invoked */
+    sigemptyset(&mask);
+    sigaddset(&mask, kn->kev.ident);
+    if (pthread_sigmask(SIG_BLOCK, &mask, NULL) != 0)
+        return (-1);
 
-    return (p);
+    sigaddset(&kq->sigmask, kn->kev.ident);
+    kn->kev.flags |= EV_CLEAR;
+    return (signal_update(kq));
 }
 
-/* Add a new item to the list of events to be monitored */
-static inline int
-kq_add(kqueue_t kq, const struct kevent *ev)
+static int
+signal_delete(kqueue_t kq, struct knote *kn)
 {
-    int rv = 0;
-    struct epoll_event epev;
-    int sigfd;
+    /* NOTE: like libkqueue, this does not unblock the signal. */
+    sigdelset(&kq->sigmask, kn->kev.ident);
+    return (signal_update(kq));
+}
 
-    epev.data.u32 = ev->filter;
-    if (knote_add(kq, ev) < 0)
-        abort(); //TODO: errorhandle
+/* Read all pending signals from the signalfd */
+static void
+signal_drain(kqueue_t kq)
+{
+    struct signalfd_siginfo sig[16];
+    struct knote *kn;
+    ssize_t i, n;
 
-    switch (ev->filter) {
-        case EVFILT_READ:
-            epev.events = EPOLLIN;
-            rv = epoll_ctl(kq->readfd, EPOLL_CTL_ADD, ev->ident, &epev);
+    for (;;) {
+        n = read(kq->sigfd, &sig, sizeof(sig));
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR)
+                continue;
             break;
+        }
+        for (i = 0; i < n / (ssize_t) sizeof(sig[0]); i++) {
+            kn = knote_lookup(kq, kq_filter_index(EVFILT_SIGNAL),
+                    sig[i].ssi_signo);
+            if (kn == NULL || (kn->kev.flags & EV_DISABLE))
+                continue;
+            kn->kn_count++;
+            ready_insert(kq, kn);
+        }
+    }
+}
+
+/*
+ * EVFILT_TIMER
+ *
+ * All timers share the kqueue's timerfd, which is armed for the earliest
+ * expiration. The knotes are kept in a binary min-heap.
+ */
+
+static void
+heap_set(kqueue_t kq, size_t i, struct knote *kn)
+{
+    kq->timer_heap[i] = kn;
+    kn->aux.timer.heap_idx = i;
+}
 
-        case EVFILT_WRITE:
-            epev.events = EPOLLOUT;
-            rv = epoll_ctl(kq->writefd, EPOLL_CTL_ADD, ev->ident, &epev);
+static void
+heap_sift_up(kqueue_t kq, size_t i)
+{
+    struct knote *kn = kq->timer_heap[i];
+    size_t parent;
+
+    while (i > 0) {
+        parent = (i - 1) / 2;
+        if (kq->timer_heap[parent]->aux.timer.deadline <= kn->aux.timer.deadline)
             break;
+        heap_set(kq, i, kq->timer_heap[parent]);
+        i = parent;
+    }
+    heap_set(kq, i, kn);
+}
 
-        case EVFILT_VNODE:
-            epev.events = EPOLLIN;
-            rv = epoll_ctl(kq->epfd, EPOLL_CTL_ADD, ev->ident, &epev);
-            rv = -1;
+static void
+heap_sift_down(kqueue_t kq, size_t i)
+{
+    struct knote *kn = kq->timer_heap[i];
+    size_t child;
+
+    for (;;) {
+        child = 2 * i + 1;
+        if (child >= kq->timer_cnt)
             break;
+        if (child + 1 < kq->timer_cnt
+                && kq->timer_heap[child + 1]->aux.timer.deadline
+                    < kq->timer_heap[child]->aux.timer.deadline)
+            child++;
+        if (kn->aux.timer.deadline <= kq->timer_heap[child]->aux.timer.deadline)
+            break;
+        heap_set(kq, i, kq->timer_heap[child]);
+        i = child;
+    }
+    heap_set(kq, i, kn);
+}
 
-        case EVFILT_SIGNAL:
-            kq_lock(kq);
-            sigaddset(&kq->sigmask, ev->ident);
-            sigfd = signalfd(kq->sigfd, &kq->sigmask, 0);
-            kq_unlock(kq);
-            if (sigfd < 0) {
-                rv = -1;
-            } else {
-                rv = 0;
-            }
-            dbg_printf("added signal %d, rv = %d", (int)ev->ident, rv);
+static int
+heap_insert(kqueue_t kq, struct knote *kn)
+{
+    struct knote **p;
+    size_t max;
+
+    if (kq->timer_cnt == kq->timer_max) {
+        max = (kq->timer_max == 0) ? 64 : kq->timer_max * 2;
+        p = realloc(kq->timer_heap, max * sizeof(*p));
+        if (p == NULL)
+            return (-1);
+        kq->timer_heap = p;
+        kq->timer_max = max;
+    }
+    heap_set(kq, kq->timer_cnt++, kn);
+    heap_sift_up(kq, kn->aux.timer.heap_idx);
+    return (0);
+}
+
+static void
+heap_remove(kqueue_t kq, struct knote *kn)
+{
+    size_t i = kn->aux.timer.heap_idx;
+
+    if (i == (size_t) -1)
+        return;
+    kn->aux.timer.heap_idx = (size_t) -1;
+    if (--kq->timer_cnt == i)
+        return;
+    heap_set(kq, i, kq->timer_heap[kq->timer_cnt]);
+    heap_sift_up(kq, i);
+    heap_sift_down(kq, kq->timer_heap[i]->aux.timer.heap_idx);
+}
+
+/* Arm the timerfd for the earliest expiration, or disarm it */
+static int
+timer_update(kqueue_t kq)
+{
+    struct itimerspec its;
+    uint64_t deadline;
+
+    memset(&its, 0, sizeof(its));
+    if (kq->timer_cnt > 0) {
+        deadline = kq->timer_heap[0]->aux.timer.deadline;
+        if (deadline == 0)
+            deadline = 1;   /* Zero would disarm the timer */
+        its.it_value.tv_sec = deadline / 1000000000;
+        its.it_value.tv_nsec = deadline % 1000000000;
+    }
+
+    return (timerfd_settime(kq->timefd, TFD_TIMER_ABSTIME, &its, NULL));
+}
+
+static int
+timer_arm(kqueue_t kq, struct knote *kn)
+{
+    int first;
+
+    if (kn->kev.data < 0) {
+        errno = EINVAL;
+        return (-1);
+    }
+    kn->aux.timer.period = (uint64_t) kn->kev.data * 1000000;
+    kn->aux.timer.deadline = monotonic_now() + kn->aux.timer.period;
+    if (heap_insert(kq, kn) < 0)
+        return (-1);
+
+    first = (kn->aux.timer.heap_idx == 0);
+    return (first ? timer_update(kq) : 0);
+}
+
+static int
+timer_disarm(kqueue_t kq, struct knote *kn)
+{
+    int first;
+
+    first = (kn->aux.timer.heap_idx == 0);
+    heap_remove(kq, kn);
+    return (first ? timer_update(kq) : 0);
+}
+
+/* Move every expired timer to the ready list */
+static void
+timer_expire(kqueue_t kq)
+{
+    struct knote *kn;
+    uint64_t now, n, expired;
+
+    (void) read(kq->timefd, &expired, sizeof(expired));
+
+    now = monotonic_now();
+    while (kq->timer_cnt > 0) {
+        kn = kq->timer_heap[0];
+        if (kn->aux.timer.deadline > now)
             break;
 
-        case EVFILT_TIMER:
-            //TODO
-            rv = -1;
+        if ((kn->kev.flags & EV_ONESHOT) || kn->aux.timer.period == 0) {
+            n = 1;
+            heap_remove(kq, kn);
+        } else {
+            n = 1 + (now - kn->aux.timer.deadline) / kn->aux.timer.period;
+            kn->aux.timer.deadline += n * kn->aux.timer.period;
+            heap_sift_down(kq, 0);
+        }
+        kn->kn_count += n;
+        ready_insert(kq, kn);
+    }
+    (void) timer_update(kq);
+}
+
+/*
+ * EVFILT_VNODE
+ *
+ * All watches share the kqueue's inotify descriptor. Several knotes can
+ * watch the same inode, in which case inotify returns the same watch
+ * descriptor for each of them and the knotes are chained together.
+ */
+
+static uint32_t
+vnode_mask(const struct kevent *kev)
+{
+    uint32_t mask = 0;
+
+    if (kev->fflags & NOTE_DELETE)
+        mask |= IN_ATTRIB | IN_DELETE_SELF;
+    if (kev->fflags & (NOTE_WRITE | NOTE_EXTEND))
+        mask |= IN_MODIFY | IN_ATTRIB;
+    if (kev->fflags & (NOTE_ATTRIB | NOTE_LINK))
+        mask |= IN_ATTRIB;
+    if (kev->fflags & NOTE_RENAME)
+        mask |= IN_MOVE_SELF;
+
+    return (mask);
+}
+
+static int
+vnode_add(kqueue_t kq, struct knote *kn)
+{
+    char path[PATH_MAX], link[64];
+    struct stat sb;
+    ssize_t len;
+    int wd;
+
+    if (fstat(kn->kev.ident, &sb) < 0)
+        return (-1);
+    kn->aux.vnode.nlink = sb.st_nlink;
+    kn->aux.vnode.size = sb.st_size;
+
+    snprintf(link, sizeof(link), "/proc/self/fd/%d", (int) kn->kev.ident);
+    len = readlink(link, path, sizeof(path) - 1);
+    if (len < 0)
+        return (-1);
+    path[len] = '\0';
+
+    wd = inotify_add_watch(kq->inofd, path, vnode_mask(&kn->kev) | IN_MASK_ADD);
+    if (wd < 0)
+        return (-1);
+
+    kn->aux.vnode.wd = wd;
+    kn->aux.vnode.next = table_lookup(&kq->ino_knote, wd);
+    if (table_store(&kq->ino_knote, wd, kn) < 0) {
+        if (kn->aux.vnode.next == NULL)
+            (void) inotify_rm_watch(kq->inofd, wd);
+        return (-1);
+    }
+
+    return (0);
+}
+
+static void
+vnode_delete(kqueue_t kq, struct knote *kn)
+{
+    struct knote **p;
+    int wd = kn->aux.vnode.wd;
+
+    if (wd < 0)
+        return;
+    kn->aux.vnode.wd = -1;
+
+    for (p = &kq->ino_knote->kt_slot[wd]; *p != NULL; p = &(*p)->aux.vnode.next) {
+        if (*p == kn) {
+            *p = kn->aux.vnode.next;
             break;
+        }
+    }
+
+    /* The watch mask is not narrowed, since the events are filtered anyway */
+    if (kq->ino_knote->kt_slot[wd] == NULL)
+        (void) inotify_rm_watch(kq->inofd, wd);
+}
+
+/* Convert an inotify event into the fflags that a knote is watching for */
+static unsigned int
+vnode_fflags(struct knote *kn, uint32_t mask)
+{
+    unsigned int fflags = 0;
+    struct stat sb;
+
+    if ((mask & (IN_ATTRIB | IN_MODIFY)) && fstat(kn->kev.ident, &sb) == 0) {
+        if (sb.st_nlink == 0)
+            fflags |= NOTE_DELETE;
+        if (sb.st_nlink != kn->aux.vnode.nlink)
+            fflags |= NOTE_LINK;
+        /* Like BSD, growth is reported to NOTE_WRITE watchers as well */
+        if (sb.st_size > kn->aux.vnode.size
+                && (kn->kev.fflags & (NOTE_WRITE | NOTE_EXTEND)))
+            fflags |= NOTE_EXTEND;
+        kn->aux.vnode.nlink = sb.st_nlink;
+        kn->aux.vnode.size = sb.st_size;
+    }
+    if (mask & IN_MODIFY)
+        fflags |= NOTE_WRITE;
+    if (mask & IN_ATTRIB)
+        fflags |= NOTE_ATTRIB;
+    if (mask & IN_MOVE_SELF)
+        fflags |= NOTE_RENAME;
+    if (mask & IN_DELETE_SELF)
+        fflags |= NOTE_DELETE;
+
+    return (fflags & (kn->kev.fflags | NOTE_EXTEND));
+}
+
+/* Read all pending events from the inotify descriptor */
+static void
+vnode_drain(kqueue_t kq)
+{
+    char buf[4096]
+        __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    struct inotify_event *evt;
+    struct knote *kn, *next;
+    unsigned int fflags;
+    ssize_t n;
+    char *p;
+
+    for (;;) {
+        n = read(kq->inofd, buf, sizeof(buf));
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR)
+                continue;
+            break;
+        }
+        for (p = buf; p < buf + n; p += sizeof(*evt) + evt->len) {
+            evt = (struct inotify_event *) p;
+            kn = table_lookup(&kq->ino_knote, evt->wd);
+
+            if (evt->mask & IN_IGNORED) {
+                /* The watch is gone, e.g. because the file was deleted */
+                for (; kn != NULL; kn = next) {
+                    next = kn->aux.vnode.next;
+                    kn->aux.vnode.wd = -1;
+                    kn->aux.vnode.next = NULL;
+                }
+                (void) table_store(&kq->ino_knote, evt->wd, NULL);
+                continue;
+            }
+
+            for (; kn != NULL; kn = kn->aux.vnode.next) {
+                if (kn->kev.flags & EV_DISABLE)
+                    continue;
+                fflags = vnode_fflags(kn, evt->mask);
+                if (fflags == 0)
+                    continue;
+                kn->kn_fflags |= fflags;
+                ready_insert(kq, kn);
+            }
+        }
+    }
+}
+
+/*
+ * Knote operations, called with kq_mtx held
+ */
+
+static int
+knote_enable(kqueue_t kq, struct knote *kn, int filt)
+{
+    switch (filt) {
+        case kq_filter_index(EVFILT_READ):
+        case kq_filter_index(EVFILT_WRITE):
+            if (kn->kn_file) {
+                ready_insert(kq, kn);
+                return (0);
+            }
+            return (socket_ctl(kq, kn, filt, EPOLL_CTL_MOD));
+
+        case kq_filter_index(EVFILT_TIMER):
+            if (kn->aux.timer.heap_idx == (size_t) -1)
+                return (timer_arm(kq, kn));
+            return (0);
 
         default:
-            rv = -1;
-            return (-1);
+            return (0);
     }
+}
 
-    if (rv < 0) {
-        dbg_printf("failed; errno = %s", strerror(errno));
+static int
+knote_disable(kqueue_t kq, struct knote *kn, int filt)
+{
+    switch (filt) {
+        case kq_filter_index(EVFILT_READ):
+        case kq_filter_index(EVFILT_WRITE):
+            if (kn->kn_file) {
+                ready_remove(kq, kn);
+                return (0);
+            }
+            return (socket_ctl(kq, kn, filt, EPOLL_CTL_MOD));
+
+        case kq_filter_index(EVFILT_TIMER):
+            ready_remove(kq, kn);
+            return (timer_disarm(kq, kn));
+
+        default:
+            ready_remove(kq, kn);
+            return (0);
     }
+}
 
-    dbg_printf("done. rv = %d", rv);
-//    if (rv < 0)
-//        free(evcopy);
-    return (rv);
+static int
+knote_create(kqueue_t kq, struct knote *kn, int filt)
+{
+    switch (filt) {
+        case kq_filter_index(EVFILT_READ):
+        case kq_filter_index(EVFILT_WRITE):
+            if (socket_ctl(kq, kn, filt, EPOLL_CTL_ADD) < 0) {
+                if (errno == EPERM && filt == kq_filter_index(EVFILT_READ))
+                    return (file_create(kq, kn));
+                return (-1);
+            }
+            return (0);
+
+        case kq_filter_index(EVFILT_SIGNAL):
+            return (signal_add(kq, kn));
+
+        case kq_filter_index(EVFILT_TIMER):
+            kn->kev.flags |= EV_CLEAR;
+            kn->aux.timer.heap_idx = (size_t) -1;
+            if (kn->kev.flags & EV_DISABLE)
+                return (0);
+            return (timer_arm(kq, kn));
+
+        case kq_filter_index(EVFILT_VNODE):
+            return (vnode_add(kq, kn));
+
+        default:
+            errno = EINVAL;
+            return (-1);
+    }
 }
 
-/* Delete an item from the list of events to be monitored */
 static int
-kq_delete(kqueue_t kq, const struct kevent *ev)
+knote_delete(kqueue_t kq, struct knote *kn, int filt)
 {
     int rv = 0;
-    int sigfd;
-    struct epoll_event epev;
 
-    switch (ev->ident) {
-        case EVFILT_READ:
-        case EVFILT_WRITE:
-            rv = epoll_ctl(kq->epfd, EPOLL_CTL_DEL, ev->ident, &epev);
+    switch (filt) {
+        case kq_filter_index(EVFILT_READ):
+        case kq_filter_index(EVFILT_WRITE):
+            /* The descriptor may already have been closed */
+            if (!kn->kn_file)
+                (void) socket_ctl(kq, kn, filt, EPOLL_CTL_DEL);
             break;
 
-        case EVFILT_VNODE:
-            //TODO
+        case kq_filter_index(EVFILT_SIGNAL):
+            rv = signal_delete(kq, kn);
             break;
 
-        case EVFILT_SIGNAL:
-            kq_lock(kq);
-            sigdelset(&kq->sigmask, ev->ident);
-            sigfd = signalfd(kq->sigfd, &kq->sigmask, 0);
-            kq_unlock(kq);
-            if (sigfd < 0) {
-                rv = -1;
-            } else {
-                rv = 0;
-            }
+        case kq_filter_index(EVFILT_TIMER):
+            rv = timer_disarm(kq, kn);
             break;
 
-        case EVFILT_TIMER:
-            //TODO
+        case kq_filter_index(EVFILT_VNODE):
+            vnode_delete(kq, kn);
             break;
+    }
+    ready_remove(kq, kn);
+    knote_release(kq, kn, filt);
+
+    return (rv);
+}
+
+static int
+knote_modify(kqueue_t kq, struct knote *kn, int filt, const struct kevent *kev)
+{
+    const unsigned short mask = EV_CLEAR | EV_ONESHOT | EV_DISPATCH;
+
+    kn->kev.udata = kev->udata;
+
+    switch (filt) {
+        case kq_filter_index(EVFILT_READ):
+        case kq_filter_index(EVFILT_WRITE):
+            if ((kn->kev.flags & mask) == (kev->flags & mask))
+                return (0);
+            kn->kev.flags = (kn->kev.flags & ~mask) | (kev->flags & mask);
+            if (kn->kn_file)
+                return (0);
+            return (socket_ctl(kq, kn, filt, EPOLL_CTL_MOD));
+
+        case kq_filter_index(EVFILT_TIMER):
+            if (kn->kev.data == kev->data)
+                return (0);
+            kn->kev.data = kev->data;
+            ready_remove(kq, kn);
+            if (timer_disarm(kq, kn) < 0)
+                return (-1);
+            if (kn->kev.flags & EV_DISABLE)
+                return (0);
+            return (timer_arm(kq, kn));
+
+        case kq_filter_index(EVFILT_VNODE):
+            if ((kn->kev.fflags | kev->fflags) == kn->kev.fflags)
+                return (0);
+            kn->kev.fflags |= kev->fflags;
+            if (kn->aux.vnode.wd >= 0) {
+                /* inotify updates the mask of the existing watch */
+                vnode_delete(kq, kn);
+                return (vnode_add(kq, kn));
+            }
+            return (0);
 
         default:
-            rv = 0;
-            break;
+            return (0);
     }
-    return (rv);
 }
 
-#endif /* defined(USE_EPOLL) */
+/* Apply one kevent from the changelist. Called with kq_mtx held. */
+static int
+kq_change(kqueue_t kq, const struct kevent *kev)
+{
+    struct knote *kn;
+    int filt, rv;
 
-/* Read a signal from the signalfd */
-static inline int
-_get_signal(struct kevent *dst, kqueue_t kq)
+    if (kev->flags & EV_DISPATCH && kev->flags & EV_ONESHOT) {
+        errno = EINVAL;
+        return (-1);
+    }
+    filt = kq_filter_index(kev->filter);
+    if (filt >= EVFILT_SYSCOUNT || kev->ident >= KQ_IDENT_MAX) {
+        errno = EINVAL;
+        return (-1);
+    }
+
+    kn = knote_lookup(kq, filt, kev->ident);
+    if (kn == NULL) {
+        if (!(kev->flags & EV_ADD)) {
+            errno = ENOENT;
+            return (-1);
+        }
+        if ((kn = knote_new(kq, kev)) == NULL)
+            return (-1);
+        if (table_store(&kq->knote[filt], kev->ident, kn) < 0) {
+            kn->kn_free_next = kq->kn_free;
+            kq->kn_free = kn;
+            return (-1);
+        }
+        if (knote_create(kq, kn, filt) < 0) {
+            knote_release(kq, kn, filt);
+            return (-1);
+        }
+        dbg_printf("added ident=%d filter=%d", (int) kev->ident, kev->filter);
+        return (0);
+    }
+
+    if (kev->flags & EV_DELETE)
+        return (knote_delete(kq, kn, filt));
+
+    knote_write_begin(kn);
+    if (kev->flags & EV_DISABLE) {
+        kn->kev.flags |= EV_DISABLE;
+        rv = knote_disable(kq, kn, filt);
+    } else if (kev->flags & EV_ENABLE) {
+        kn->kev.flags &= ~EV_DISABLE;
+        rv = knote_enable(kq, kn, filt);
+    } else {
+        rv = knote_modify(kq, kn, filt, kev);
+    }
+    knote_write_end(kn);
+
+    return (rv);
+}
+
+/* Handle EV_ONESHOT and EV_DISPATCH once an event has been returned */
+static void
+knote_fired(kqueue_t kq, const struct kevent *kev)
 {
     struct knote *kn;
-    struct signalfd_siginfo sig;
-    ssize_t n;
+    int filt;
 
-    n = read(kq->sigfd, &sig, sizeof(sig));
-    if (n < 0 || n != sizeof(sig)) {
-        abort();
+    filt = kq_filter_index(kev->filter);
+    kn = knote_lookup(kq, filt, kev->ident);
+    if (kn == NULL)
+        return;
+    if (kev->flags & EV_ONESHOT) {
+        (void) knote_delete(kq, kn, filt);
+    } else if (kev->flags & EV_DISPATCH) {
+        knote_write_begin(kn);
+        kn->kev.flags |= EV_DISABLE;
+        (void) knote_disable(kq, kn, filt);
+        knote_write_end(kn);
     }
+}
 
-    kn = knote_lookup(kq, EVFILT_SIGNAL, sig.ssi_signo);
-    memcpy(dst, &kn->kev, sizeof(*dst));
+/* Copy events from one of the socket epoll descriptors */
+static int
+socket_copyout(kqueue_t kq, int filt, struct kevent *eventlist, int nevents)
+{
+    struct epoll_event epev_buf[EPEV_BUF_MAX];
+    struct kevent *dst;
+    int epfd, i, n, nret;
+
+    epfd = (filt == kq_filter_index(EVFILT_READ)) ? kq->readfd : kq->writefd;
+    n = epoll_wait(epfd, &epev_buf[0], nevents, 0);
+    if (n <= 0)
+        return (0);
+
+    nret = 0;
+    for (i = 0; i < n; i++) {
+        dst = &eventlist[nret];
+        dbg_printf("got event: %s", epoll_event_to_str(&epev_buf[i]));
+        if (knote_snapshot(dst, kq, filt, epev_buf[i].data.fd) < 0)
+            continue;   /* Deleted by another thread */
+        if (socket_fill(dst, &epev_buf[i], filt) < 0)
+            continue;
+        if (dst->flags & (EV_ONESHOT | EV_DISPATCH)) {
+            kq_lock(kq);
+            knote_fired(kq, dst);
+            kq_unlock(kq);
+        }
+        nret++;
+    }
 
-    return (0);
+    return (nret);
 }
 
+/* Copy events from the ready list. Called with kq_mtx held. */
+static int
+ready_copyout(kqueue_t kq, struct kevent *eventlist, int nevents)
+{
+    TAILQ_HEAD(, knote) again = TAILQ_HEAD_INITIALIZER(again);
+    struct knote *kn;
+    struct kevent *dst;
+    int filt, nret;
+
+    for (nret = 0; nret < nevents; ) {
+        kn = TAILQ_FIRST(&kq->ready);
+        if (kn == NULL)
+            break;
+        dst = &eventlist[nret++];
+        memcpy(dst, &kn->kev, sizeof(*dst));
+        filt = kq_filter_index(kn->kev.filter);
+        if (filt == kq_filter_index(EVFILT_VNODE)) {
+            dst->fflags = kn->kn_fflags;
+            dst->data = 0;
+        } else if (kn->kn_file) {
+            dst->data = file_remaining(kn->kev.ident);
+            if (dst->data == 0) {
+                /* Nothing to read, so wait for the position to change */
+                nret--;
+                ready_remove(kq, kn);
+                TAILQ_INSERT_TAIL(&again, kn, kn_entries);
+                kn->kn_ready = 1;
+                continue;
+            }
+        } else {
+            dst->data = kn->kn_count;
+        }
+        ready_remove(kq, kn);
+
+        /* A level-triggered regular file stays ready */
+        if (kn->kn_file && !(kn->kev.flags & (EV_CLEAR | EV_ONESHOT | EV_DISPATCH))) {
+            TAILQ_INSERT_TAIL(&again, kn, kn_entries);
+            kn->kn_ready = 1;
+            continue;
+        }
+        knote_fired(kq, dst);
+    }
+    TAILQ_CONCAT(&kq->ready, &again, kn_entries);
+
+    return (nret);
+}
+
+#endif /* defined(USE_EPOLL) */
+
 /* Equivalent to kevent() */
 int kq_event(kqueue_t kq, const struct kevent *changelist, int nchanges,
         struct kevent *eventlist, int nevents,
         const struct timespec *timeout)
 {
-    int rv = 0;
-    struct kevent *dst;
-    //struct knote *kn;
-
 #if defined(USE_KQUEUE)
     return kevent(kq->kqfd, changelist, nchanges, eventlist, nevents, timeout);
 
 #elif defined(USE_EPOLL)
-    struct epoll_event epev_buf[EPEV_BUF_MAX];
-    struct epoll_event *epev;
-    size_t epev_wait_max;
-    int i, epev_cnt, eptimeout;
+    struct epoll_event epev_buf[8];
+    int i, n, nret, eptimeout, t, idle, filt;
 
     /* Process each item on the changelist */
-    for (i = 0; i < nchanges; i++) {
-        if (changelist[i].flags & EV_ADD) {
-            rv = kq_add(kq, &changelist[i]);
-        } else if (changelist[i].flags & EV_DELETE) {
-            rv = kq_delete(kq, &changelist[i]);
-        } else {
-            rv = -1;
+    nret = 0;
+    if (nchanges > 0) {
+        kq_lock(kq);
+        for (i = 0; i < nchanges; i++) {
+            if (kq_change(kq, &changelist[i]) < 0) {
+                dbg_printf("failed; errno = %s", strerror(errno));
+                if (nret >= nevents) {
+                    kq_unlock(kq);
+                    return (-1);
+                }
+                memcpy(&eventlist[nret], &changelist[i], sizeof(*eventlist));
+                eventlist[nret].flags |= EV_ERROR;
+                eventlist[nret].data = errno;
+                nret++;
+            } else if (changelist[i].flags & EV_RECEIPT) {
+                if (nret >= nevents)
+                    continue;
+                memcpy(&eventlist[nret], &changelist[i], sizeof(*eventlist));
+                eventlist[nret].flags |= EV_ERROR;
+                eventlist[nret].data = 0;
+                nret++;
+            }
         }
-        if (rv < 0)
-            return (-1);
+        kq_unlock(kq);
+        if (nret > 0)
+            return (nret);
     }
+    if (nevents <= 0)
+        return (0);
+    if (nevents > EPEV_BUF_MAX)
+        nevents = EPEV_BUF_MAX;
 
-    /* Convert timeout to the format used by epoll_wait() */
+    /* Convert timeout to the format used by epoll_wait(), rounding up */
     if (timeout == NULL)
         eptimeout = -1;
     else
-        eptimeout = (1000 * timeout->tv_sec) + (timeout->tv_nsec / 1000000);
+        eptimeout = (1000 * timeout->tv_sec)
+            + (timeout->tv_nsec + 999999) / 1000000;
 
-    /* Wait for events and put them into a buffer */
-    if (nevents > EPEV_BUF_MAX) {
-        epev_wait_max = EPEV_BUF_MAX;
-    } else {
-        epev_wait_max = nevents;
+    for (idle = 0;;) {
+        /* Events that are already pending must not be delayed */
+        t = eptimeout;
+        if (!idle && !TAILQ_EMPTY(&kq->ready))
+            t = 0;
+
+        n = epoll_wait(kq->epfd, &epev_buf[0], 8, t);
+        if (n < 0)
+            return (-1);
+
+        /* Determine what events have occurred */
+        kq_lock(kq);
+        for (i = 0; i < n; i++) {
+            filt = epev_buf[i].data.u32;
+            if (filt == kq_filter_index(EVFILT_SIGNAL))
+                signal_drain(kq);
+            else if (filt == kq_filter_index(EVFILT_TIMER))
+                timer_expire(kq);
+            else if (filt == kq_filter_index(EVFILT_VNODE))
+                vnode_drain(kq);
+        }
+        nret = ready_copyout(kq, eventlist, nevents);
+        kq_unlock(kq);
+
+        /* Copy the socket events to the caller */
+        for (i = 0; i < n && nret < nevents; i++) {
+            filt = epev_buf[i].data.u32;
+            if (filt == kq_filter_index(EVFILT_READ)
+                    || filt == kq_filter_index(EVFILT_WRITE))
+                nret += socket_copyout(kq, filt, &eventlist[nret],
+                        nevents - nret);
+        }
+
+        if (nret > 0)
+            break;
+        if (t == eptimeout) {
+            /* Another thread may have taken the events; keep waiting */
+            if (n == 0 || eptimeout >= 0)
+                break;
+        } else {
+            /* Nothing on the ready list was reportable; really wait */
+            idle = (n == 0);
+        }
     }
-    epev_cnt = epoll_wait(kq->epfd, &epev_buf[0], epev_wait_max, eptimeout);
-    if (epev_cnt < 0) {
-        return (-1);        //FIXME: handle timeout
+
+    return (nret);
+#endif
+}
+
+#if defined(KQLITE_LIBKQUEUE) && defined(USE_EPOLL)
+
+/*
+ * Provide kqueue() and kevent(), so that kqlite can be used in place of
+ * libkqueue. The kqueue descriptor is the top-level epoll descriptor.
+ */
+
+#define VISIBLE __attribute__((visibility("default")))
+
+static struct kqueue **kq_fdmap;
+static size_t kq_fdmap_size;
+static pthread_mutex_t kq_fdmap_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t kq_fdmap_once = PTHREAD_ONCE_INIT;
+
+static void
+kq_fdmap_init(void)
+{
+    struct rlimit rlim;
+
+    kq_fdmap_size = 65536;
+    if (getrlimit(RLIMIT_NOFILE, &rlim) == 0 && rlim.rlim_max != RLIM_INFINITY)
+        kq_fdmap_size = rlim.rlim_max;
+    if (kq_fdmap_size > (1 << 20))
+        kq_fdmap_size = (1 << 20);
+    kq_fdmap = calloc(kq_fdmap_size, sizeof(*kq_fdmap));
+}
+
+int VISIBLE
+kqueue(void)
+{
+    struct kqueue *kq, *old;
+    int fd;
+
+    (void) pthread_once(&kq_fdmap_once, kq_fdmap_init);
+    if (kq_fdmap == NULL) {
+        errno = ENOMEM;
+        return (-1);
     }
-    else if (epev_cnt == 0) {
-        dbg_puts("timed out");
+
+    if ((kq = kq_init()) == NULL)
+        return (-1);
+    fd = kq->epfd;
+    if ((size_t) fd >= kq_fdmap_size) {
+        kq_free(kq);
+        errno = EMFILE;
+        return (-1);
     }
 
-    dbg_printf("whee -- got %d event(s)", epev_cnt);
+    /* A previous kqueue may have used the same descriptor and been closed */
+    pthread_mutex_lock(&kq_fdmap_mtx);
+    old = kq_fdmap[fd];
+    __atomic_store_n(&kq_fdmap[fd], kq, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&kq_fdmap_mtx);
+    if (old != NULL) {
+        old->epfd = -1;
+        kq_free(old);
+    }
 
-    /* Determine what events have occurred and copy the result to the caller */
-    for (i = 0; i < epev_cnt; i++) {
-        dst = &eventlist[i];
-        epev = &epev_buf[i];
+    return (fd);
+}
 
-        dbg_printf("got event: %s", epoll_event_to_str(epev));
+int VISIBLE
+kevent(int kqfd, const struct kevent *changelist, int nchanges,
+        struct kevent *eventlist, int nevents,
+        const struct timespec *timeout)
+{
+    struct kqueue *kq = NULL;
 
-        switch (epev->data.u32) {
-            case EVFILT_SIGNAL:
-                (void)_get_signal(dst, kq);//FIXME: errorhandle
-                break;
+    if (kqfd >= 0 && (size_t) kqfd < kq_fdmap_size)
+        kq = __atomic_load_n(&kq_fdmap[kqfd], __ATOMIC_ACQUIRE);
+    if (kq == NULL) {
+        errno = EBADF;
+        return (-1);
+    }
 
-            case EVFILT_VNODE:
-                //TODO
-                break;
+    return (kq_event(kq, changelist, nchanges, eventlist, nevents, timeout));
+}
 
-            case EVFILT_TIMER:
-                //TODO
-                break;
+int VISIBLE
+kevent_data(int kqfd, struct kevent *kev)
+{
+    if (kqfd < 0 || (size_t) kqfd >= kq_fdmap_size
+            || __atomic_load_n(&kq_fdmap[kqfd], __ATOMIC_ACQUIRE) == NULL) {
+        errno = EBADF;
+        return (-1);
+    }
 
-            case EVFILT_READ:
-            case EVFILT_WRITE:
-                //memcpy(dst, kevp, sizeof(*dst));
-                break;
+    if (kev->filter == EVFILT_READ || kev->filter == EVFILT_WRITE)
+        socket_data(kev, kq_filter_index(kev->filter));
 
-            default:
-                abort();
-        }
-    }
+    return (0);
+}
 
-    return (rv == 1 ? 0 : -1);
-#endif
+int VISIBLE
+kevent_accept_template(int kqfd, int ident,
+        const struct kevent *changelist, int nchanges)
+{
+    (void) kqfd;
+    (void) ident;
+    (void) changelist;
+    (void) nchanges;
+    errno = ENOTSUP;
+    return (-1);
 }
 
-#if defined(USE_EPOLL)
+int VISIBLE
+kevent_idle_timeout(int kqfd, int ident, short filter, intptr_t timeout)
+{
+    (void) kqfd;
+    (void) ident;
+    (void) filter;
+    (void) timeout;
+    errno = ENOTSUP;
+    return (-1);
+}
+
+int VISIBLE
+kevent_timer_leeway(int kqfd, int ident, intptr_t leeway)
+{
+    (void) kqfd;
+    (void) ident;
+    (void) leeway;
+    errno = ENOTSUP;
+    return (-1);
+}
+
+int VISIBLE
+kevent_signal_info(int kqfd, int signo, struct kevent_siginfo *info)
+{
+    (void) kqfd;
+    (void) signo;
+    (void) info;
+    errno = ENOTSUP;
+    return (-1);
+}
+
+int VISIBLE
+kevent_proc_rusage(int kqfd, int pid, struct rusage *ru)
+{
+    (void) kqfd;
+    (void) pid;
+    (void) ru;
+    errno = ENOTSUP;
+    return (-1);
+}
+
+#endif /* defined(KQLITE_LIBKQUEUE) && defined(USE_EPOLL) */
+
+#if defined(USE_EPOLL) && defined(KQ_DEBUG)
 static char *
 epoll_event_to_str(struct epoll_event *evt)
 {
@@ -498,9 +1569,7 @@ epoll_event_to_str(struct epoll_event *evt)
     snprintf(&buf[0], 128, " { data = %p, events = ", evt->data.ptr);
     EPEVT_DUMP(EPOLLIN);
     EPEVT_DUMP(EPOLLOUT);
-#if defined(HAVE_EPOLLRDHUP)
     EPEVT_DUMP(EPOLLRDHUP);
-#endif
     EPEVT_DUMP(EPOLLONESHOT);
     EPEVT_DUMP(EPOLLET);
     strcat(&buf[0], "}\n");
@@ -32,6 +32,9 @@
 
 #if defined(__FreeBSD__) || defined(__APPLE__) || defined(__OpenBSD__) || defined(__NetBSD__)
 #include <sys/event.h>
+#elif defined(KQLITE_LIBKQUEUE)
+/* Built as a replacement for libkqueue; use its definitions */
+#include <sys/event.h>
 #else
 
 #include <sys/time.h>
@@ -16,14 +16,50 @@
 
 #include "./lite.h"
 
+#include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <signal.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
+static const struct timespec zero_ts = { 0, 0 };
+
+/* Wait for a single event, and abort unless it matches */
+static void
+expect_event(kqueue_t kq, uintptr_t ident, int filter, const struct timespec *ts)
+{
+    struct kevent kev;
+
+    if (kq_event(kq, NULL, 0, &kev, 1, ts) != 1)
+        abort();
+    if (kev.ident != ident || kev.filter != filter || (kev.flags & EV_ERROR))
+        abort();
+}
+
+static void
+expect_no_event(kqueue_t kq)
+{
+    struct kevent kev;
+
+    if (kq_event(kq, NULL, 0, &kev, 1, &zero_ts) != 0)
+        abort();
+}
+
+static void
+change(kqueue_t kq, uintptr_t ident, int filter, int flags,
+        unsigned int fflags, intptr_t data)
+{
+    struct kevent kev;
+
+    EV_SET(&kev, ident, filter, flags, fflags, data, NULL);
+    if (kq_event(kq, &kev, 1, NULL, 0, NULL) < 0)
+        abort();
+}
+
 void test_evfilt_write(kqueue_t kq) {
     struct kevent kev;
     int sockfd[2];
@@ -72,12 +108,124 @@ void test_evfilt_signal(kqueue_t kq) {
     puts ("got it");
 }
 
+void test_evfilt_read(kqueue_t kq) {
+    struct kevent kev;
+    int sockfd[2];
+
+    puts("testing EVFILT_READ.. ");
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockfd) < 0)
+      abort();
+
+    change(kq, sockfd[0], EVFILT_READ, EV_ADD, 0, 0);
+    expect_no_event(kq);
+
+    if (write(sockfd[1], "hi", 2) < 2)
+        abort();
+    if (kq_event(kq, NULL, 0, &kev, 1, NULL) != 1 || kev.data != 2)
+        abort();
+
+    /* Level-triggered, so the event is returned until the data is read */
+    expect_event(kq, sockfd[0], EVFILT_READ, &zero_ts);
+
+    /* EV_DISPATCH disables the knote once the event is returned */
+    change(kq, sockfd[0], EVFILT_READ, EV_ADD | EV_DISPATCH, 0, 0);
+    expect_event(kq, sockfd[0], EVFILT_READ, &zero_ts);
+    expect_no_event(kq);
+    change(kq, sockfd[0], EVFILT_READ, EV_ENABLE, 0, 0);
+    expect_event(kq, sockfd[0], EVFILT_READ, &zero_ts);
+
+    change(kq, sockfd[0], EVFILT_READ, EV_DELETE, 0, 0);
+    expect_no_event(kq);
+
+    /* Deleting a knote that does not exist is an error */
+    EV_SET(&kev, sockfd[0], EVFILT_READ, EV_DELETE, 0, 0, NULL);
+    if (kq_event(kq, &kev, 1, &kev, 1, NULL) != 1
+            || !(kev.flags & EV_ERROR) || kev.data != ENOENT)
+        abort();
+
+    close(sockfd[0]);
+    close(sockfd[1]);
+}
+
+void test_evfilt_timer(kqueue_t kq) {
+    struct timespec ts = { 1, 0 };
+    struct kevent kev;
+    int i;
+
+    puts("testing EVFILT_TIMER.. ");
+
+    /* Timers share one timerfd; the earliest one must fire first */
+    change(kq, 2, EVFILT_TIMER, EV_ADD, 0, 50);
+    change(kq, 1, EVFILT_TIMER, EV_ADD | EV_ONESHOT, 0, 10);
+    expect_event(kq, 1, EVFILT_TIMER, &ts);
+    expect_event(kq, 2, EVFILT_TIMER, &ts);
+
+    /* A periodic timer reports the number of expirations */
+    usleep(120 * 1000);
+    if (kq_event(kq, NULL, 0, &kev, 1, &ts) != 1 || kev.data < 2)
+        abort();
+
+    change(kq, 2, EVFILT_TIMER, EV_DISABLE, 0, 0);
+    usleep(60 * 1000);
+    expect_no_event(kq);
+    change(kq, 2, EVFILT_TIMER, EV_ENABLE, 0, 0);
+    expect_event(kq, 2, EVFILT_TIMER, &ts);
+    change(kq, 2, EVFILT_TIMER, EV_DELETE, 0, 0);
+
+    /* Deleted knotes are reused */
+    for (i = 0; i < 1000; i++) {
+        change(kq, i, EVFILT_TIMER, EV_ADD, 0, 1000);
+        change(kq, i, EVFILT_TIMER, EV_DELETE, 0, 0);
+    }
+    expect_no_event(kq);
+}
+
+void test_evfilt_vnode(kqueue_t kq) {
+    struct timespec ts = { 1, 0 };
+    char path[] = "/tmp/kqlite-XXXXXX";
+    struct kevent kev;
+    int fd, fd2;
+
+    puts("testing EVFILT_VNODE.. ");
+
+    if ((fd = mkstemp(path)) < 0)
+        abort();
+    if ((fd2 = open(path, O_RDONLY)) < 0)
+        abort();
+
+    /* Both knotes share one inotify watch */
+    change(kq, fd, EVFILT_VNODE, EV_ADD, NOTE_WRITE | NOTE_EXTEND, 0);
+    change(kq, fd2, EVFILT_VNODE, EV_ADD | EV_ONESHOT, NOTE_DELETE, 0);
+
+    if (write(fd, "hi", 2) < 2)
+        abort();
+    if (kq_event(kq, NULL, 0, &kev, 1, &ts) != 1 || kev.ident != (uintptr_t) fd
+            || kev.fflags != (NOTE_WRITE | NOTE_EXTEND))
+        abort();
+    expect_no_event(kq);
+
+    change(kq, fd, EVFILT_VNODE, EV_DELETE, 0, 0);
+    if (unlink(path) < 0)
+        abort();
+    if (kq_event(kq, NULL, 0, &kev, 1, &ts) != 1 || kev.ident != (uintptr_t) fd2
+            || kev.fflags != NOTE_DELETE)
+        abort();
+    expect_no_event(kq);
+
+    close(fd);
+    close(fd2);
+}
+
 int main() {
     kqueue_t kq;
 
     kq = kq_init();
     test_evfilt_signal(kq);
     test_evfilt_write(kq);
+    test_evfilt_read(kq);
+    test_evfilt_timer(kq);
+    test_evfilt_vnode(kq);
     kq_free(kq);
 
     puts("ok");
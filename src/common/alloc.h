@@ -25,7 +25,11 @@
  *
  * The allocator must be initialized by calling mem_init(). This
  * function takes two arguments: the object size, and the maximum
- * number of objects in the cache.
+ * number of objects in the cache. Since the cache is thread-local,
+ * mem_init() must be called once in every thread that uses it; until
+ * then, mem_alloc() and mem_free() fall through to malloc() and free().
+ * The objects left in the cache of a thread are freed when it exits.
+ * The Windows port has no thread-exit hook, so it does not cache.
  *
  * The functions mem_alloc() and mem_free() have similar semantics
  * to the traditional malloc() and free() calls. The main difference
@@ -36,29 +40,78 @@
 #include <stdlib.h>
 
 #ifndef _WIN32
+# include <pthread.h>
 # include <unistd.h>
 #endif
 
-static __thread struct {
+struct mem_cache {
     void  **ac_cache;       /* An array of reusable memory objects */
     size_t  ac_count;       /* The number of objects in the cache */
     size_t  ac_max;         /* The maximum number of cached objects */
     size_t  ac_size;        /* The size, in bytes, of each object */
-} _ma;
+};
+
+static __thread struct mem_cache _ma;
+
+/* The cache of a thread that cannot free it at exit, which stays empty */
+static void *_ma_none[1];
+
+#ifndef _WIN32
+static pthread_key_t  _ma_key;
+static pthread_once_t _ma_once = PTHREAD_ONCE_INIT;
+static int            _ma_key_ok;
+
+/* Called at thread exit, with the cache of the thread */
+static void
+mem_destroy(void *arg)
+{
+    struct mem_cache *ma = arg;
+
+    while (ma->ac_count > 0)
+        free(ma->ac_cache[--ma->ac_count]);
+    free(ma->ac_cache);
+    ma->ac_cache = _ma_none;
+    ma->ac_max = 0;
+}
+
+static void
+mem_key_init(void)
+{
+    _ma_key_ok = (pthread_key_create(&_ma_key, mem_destroy) == 0);
+}
+#endif
 
 static inline int
 mem_init(size_t objsize, size_t cachesize)
 {
     _ma.ac_size = objsize;
+    _ma.ac_count = 0;
+    _ma.ac_cache = _ma_none;
+    _ma.ac_max = 0;
+#ifndef _WIN32
+    (void) pthread_once(&_ma_once, mem_key_init);
+    if (!_ma_key_ok)
+        return (0);
     _ma.ac_cache = malloc(cachesize * sizeof(void *));
-    return (_ma.ac_cache == NULL ? -1 : 0);
+    if (_ma.ac_cache == NULL) {
+        _ma.ac_cache = _ma_none;
+        return (-1);
+    }
+    if (pthread_setspecific(_ma_key, &_ma) != 0) {
+        free(_ma.ac_cache);
+        _ma.ac_cache = _ma_none;
+        return (0);
+    }
+    _ma.ac_max = cachesize;
+#endif
+    return (0);
 }
 
 static inline void *
 mem_alloc(void)
 {
     if (_ma.ac_count > 0)
-        return (_ma.ac_cache[_ma.ac_count--]);
+        return (_ma.ac_cache[--_ma.ac_count]);
     else
         return (malloc(_ma.ac_size));
 }
@@ -22,6 +22,7 @@
 #include <stdio.h>
 #include <sys/types.h>
 #include <string.h>
+#include <time.h>
 
 #include "private.h"
 
@@ -112,7 +113,7 @@ kevent_dump(const struct kevent *kev)
     return ((const char *) &buf[0]);
 }
 
-static int
+int
 kevent_copyin_one(struct kqueue *kq, const struct kevent *src)
 {
     struct knote  *kn = NULL;
@@ -145,7 +146,12 @@ kevent_copyin_one(struct kqueue *kq, const struct kevent *src)
             assert(filt->kn_create);
             if (filt->kn_create(filt, kn) < 0) {
                 knote_release(kn);
-                errno = EFAULT;
+                /*
+                 * An invalid argument, or a resource that the application
+                 * holds, is reported as such
+                 */
+                if (errno != EINVAL && errno != EBUSY)
+                    errno = EFAULT;
                 return (-1);
             }
             knote_insert(filt, kn);
@@ -226,12 +232,43 @@ err_path:
     return (nret);
 }
 
+#ifndef _WIN32
+/*
+ * The part of a timeout that is left, given the time the wait started.
+ * Returns zero once it has run out.
+ */
+static int
+kevent_timeout_left(const struct timespec *timeout, const struct timespec *start,
+        struct timespec *left)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    left->tv_sec = start->tv_sec + timeout->tv_sec - now.tv_sec;
+    left->tv_nsec = start->tv_nsec + timeout->tv_nsec - now.tv_nsec;
+    while (left->tv_nsec < 0) {
+        left->tv_nsec += 1000000000;
+        left->tv_sec--;
+    }
+    while (left->tv_nsec >= 1000000000) {
+        left->tv_nsec -= 1000000000;
+        left->tv_sec++;
+    }
+
+    return (left->tv_sec > 0 || (left->tv_sec == 0 && left->tv_nsec > 0));
+}
+#endif
+
 int VISIBLE
 kevent(int kqfd, const struct kevent *changelist, int nchanges,
         struct kevent *eventlist, int nevents,
         const struct timespec *timeout)
 {
     struct kqueue *kq;
+    const struct timespec *wait = timeout;
+#ifndef _WIN32
+    struct timespec start, left;
+#endif
     int rv = 0;
 #ifndef NDEBUG
     static unsigned int _kevent_counter = 0;
@@ -278,19 +315,35 @@ kevent(int kqfd, const struct kevent *changelist, int nchanges,
      */
     if (nevents > MAX_KEVENT)
         nevents = MAX_KEVENT;
-    if (nevents > 0) {
-        rv = kqops.kevent_wait(kq, nevents, timeout);
+#ifndef _WIN32
+    if (timeout != NULL && (timeout->tv_sec != 0 || timeout->tv_nsec != 0))
+        clock_gettime(CLOCK_MONOTONIC, &start);
+#endif
+    while (nevents > 0) {
+        rv = kqops.kevent_wait(kq, nevents, wait);
         dbg_printf("kqops.kevent_wait returned %d", rv);
         if (fastpath(rv > 0)) {
             kqueue_lock(kq);
             rv = kqops.kevent_copyout(kq, rv, eventlist, nevents);
             kqueue_unlock(kq);
+
+            /* Every event was discarded, so keep waiting until the timeout */
+            if (rv == 0 && timeout == NULL)
+                continue;
+#ifndef _WIN32
+            if (rv == 0 && (timeout->tv_sec != 0 || timeout->tv_nsec != 0) &&
+                    kevent_timeout_left(timeout, &start, &left)) {
+                wait = &left;
+                continue;
+            }
+#endif
         } else if (rv == 0) {
             /* Timeout reached */
         } else {
             dbg_printf("(%u) kevent_wait failed", myid);
             goto out;
         }
+        break;
     }
 
 #ifndef NDEBUG
@@ -309,3 +362,36 @@ out:
     dbg_printf("--- END kevent %u ret %d ---", myid, rv);
     return (rv);
 }
+
+int VISIBLE
+kevent_data(int kqfd, struct kevent *kev)
+{
+    struct kqueue *kq;
+    struct filter *filt;
+    struct knote *kn;
+    int rv;
+
+    kq = kqueue_lookup(kqfd);
+    if (kq == NULL) {
+        errno = ENOENT;
+        return (-1);
+    }
+    if (filter_lookup(&filt, kq, kev->filter) < 0)
+        return (-1);
+
+    /* Filters without kn_data always fill in the data field */
+    if (filt->kn_data == NULL)
+        return (0);
+
+    kqueue_lock(kq);
+    kn = knote_lookup(filt, kev->ident);
+    if (kn == NULL) {
+        kqueue_unlock(kq);
+        errno = ENOENT;
+        return (-1);
+    }
+    rv = filt->kn_data(filt, kn, kev);
+    kqueue_unlock(kq);
+
+    return (rv);
+}
@@ -23,11 +23,13 @@
 
 #include "alloc.h"
 
+/* The number of free knotes that each thread keeps for reuse */
+#define KNOTE_CACHE_SIZE 1024
+
 int
 knote_init(void)
 {
-    return 0;
-//    return (mem_init(sizeof(struct knote), 1024));
+    return (mem_init(sizeof(struct knote), KNOTE_CACHE_SIZE));
 }
 
 static int
@@ -43,7 +45,11 @@ knote_new(void)
 {
     struct knote *res;
 
-    res = calloc(1, sizeof(struct knote));
+    /* The cache is per-thread, so initialize it on first use */
+    if (slowpath(_ma.ac_cache == NULL) && knote_init() < 0)
+        return (NULL);
+
+    res = mem_calloc();
     if (res == NULL)
         return (NULL);
 
@@ -60,7 +66,7 @@ knote_release(struct knote *kn)
     if (atomic_dec(&kn->kn_ref) == 0) {
         if (kn->kn_flags & KNFL_KNOTE_DELETED) {
             dbg_printf("freeing knote at %p", kn);
-            free(kn);
+            mem_free(kn);
         } else {
             dbg_puts("this should never happen");
         }
@@ -132,8 +138,8 @@ knote_disable(struct filter *filt, struct knote *kn)
 {
     assert(!(kn->kev.flags & EV_DISABLE));
 
-    filt->kn_disable(filt, kn); //TODO: Error checking
     KNOTE_DISABLE(kn);
+    filt->kn_disable(filt, kn); //TODO: Error checking
     return (0);
 }
 
@@ -22,6 +22,7 @@
 #include <string.h>
 #include "config/config.h"
 #include "tree.h"
+#include "timer.h"
 
 /* Maximum events returnable in a single kevent() call */
 #define MAX_KEVENT  512
@@ -39,6 +40,9 @@ struct evfilt_data;
 # if !defined(NDEBUG) && !defined(__GNUC__)
 #  include <crtdbg.h>
 # endif
+#elif defined(KQUEUE_MOCK)
+# include "../posix/platform.h"
+# include "../mock/platform.h"
 #elif defined(__linux__)
 # include "../posix/platform.h"
 # include "../linux/platform.h"
@@ -68,7 +72,11 @@ struct eventfd {
  */
 #define KNFL_PASSIVE_SOCKET  (0x01)  /* Socket is in listen(2) mode */
 #define KNFL_REGULAR_FILE    (0x02)  /* File descriptor is a regular file */
+#define KNFL_SOCKET          (0x04)  /* File descriptor is a socket */
+#define KNFL_PIPE            (0x08)  /* File descriptor is a pipe or FIFO */
 #define KNFL_KNOTE_DELETED   (0x10)  /* The knote object is no longer valid */
+#define KNFL_UNIX_SOCKET     (0x20)  /* Socket is a listening AF_UNIX socket */
+#define KNFL_TYPE_CACHED     (0x40)  /* The type was found in the cache */
 
 struct knote {
     struct kevent     kev;
@@ -82,7 +90,7 @@ struct knote {
             off_t     size;   /* Used by vnode */
         } vnode;
         timer_t       timerid;
-        struct sleepreq *sleepreq; /* Used by posix/timer.c */
+        struct ptimer *ptimer;     /* Used by posix/timer.c */
         void          *handle;      /* Used by win32 filters */
     } data;
     struct kqueue*       kn_kq;
@@ -118,6 +126,7 @@ struct filter {
     int     (*kn_delete)(struct filter *, struct knote *);
     int     (*kn_enable)(struct filter *, struct knote *);
     int     (*kn_disable)(struct filter *, struct knote *);
+    int     (*kn_data)(struct filter *, struct knote *, struct kevent *);
 
     struct eventfd kf_efd;             /* Used by user.c */
 
@@ -200,6 +209,7 @@ void         filter_unregister_all(struct kqueue *);
 const char *filter_name(short);
 
 int         kevent_wait(struct kqueue *, const struct timespec *);
+int         kevent_copyin_one(struct kqueue *, const struct kevent *);
 int         kevent_copyout(struct kqueue *, int, struct kevent *, int);
 void         kevent_free(struct kqueue *);
 const char *kevent_dump(const struct kevent *);
@@ -0,0 +1,182 @@
+/*
+ * Copyright (c) 2026 libkqueue contributors
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * The parts of EVFILT_TIMER that do not depend on how the timers are run:
+ * the conversion of a kevent into an interval, and the binary min-heap
+ * that the Linux timer queue and the POSIX timer thread keep their
+ * timers in. The heap does no locking of its own.
+ */
+
+#include <stdlib.h>
+
+#include "private.h"
+
+#define TIMER_HEAP_INITIAL_SIZE 64
+
+static void
+timer_heap_set(struct timer_heap *th, unsigned int i, struct timer_node *tn)
+{
+    th->th_nodes[i] = tn;
+    tn->tn_index = i + 1;
+}
+
+static void
+timer_heap_sift_up(struct timer_heap *th, unsigned int i)
+{
+    struct timer_node *tn = th->th_nodes[i];
+    unsigned int parent;
+
+    while (i > 0) {
+        parent = (i - 1) / 2;
+        if (th->th_nodes[parent]->tn_key <= tn->tn_key)
+            break;
+        timer_heap_set(th, i, th->th_nodes[parent]);
+        i = parent;
+    }
+    timer_heap_set(th, i, tn);
+}
+
+static void
+timer_heap_sift_down(struct timer_heap *th, unsigned int i)
+{
+    struct timer_node *tn = th->th_nodes[i];
+    unsigned int child;
+
+    for (;;) {
+        child = 2 * i + 1;
+        if (child >= th->th_count)
+            break;
+        if (child + 1 < th->th_count &&
+                th->th_nodes[child + 1]->tn_key < th->th_nodes[child]->tn_key)
+            child++;
+        if (tn->tn_key <= th->th_nodes[child]->tn_key)
+            break;
+        timer_heap_set(th, i, th->th_nodes[child]);
+        i = child;
+    }
+    timer_heap_set(th, i, tn);
+}
+
+/* Make room for at least n timers */
+int
+timer_heap_reserve(struct timer_heap *th, unsigned int n)
+{
+    struct timer_node **nodes;
+    unsigned int size;
+
+    if (n <= th->th_size)
+        return (0);
+
+    size = th->th_size ? th->th_size : TIMER_HEAP_INITIAL_SIZE;
+    while (size < n)
+        size *= 2;
+    nodes = realloc(th->th_nodes, size * sizeof(*nodes));
+    if (nodes == NULL)
+        return (-1);
+    th->th_nodes = nodes;
+    th->th_size = size;
+
+    return (0);
+}
+
+int
+timer_heap_insert(struct timer_heap *th, struct timer_node *tn)
+{
+    if (timer_heap_reserve(th, th->th_count + 1) < 0)
+        return (-1);
+    th->th_nodes[th->th_count] = tn;
+    timer_heap_sift_up(th, th->th_count++);
+
+    return (0);
+}
+
+void
+timer_heap_remove(struct timer_heap *th, struct timer_node *tn)
+{
+    unsigned int i = tn->tn_index - 1;
+
+    tn->tn_index = 0;
+    if (i == --th->th_count)
+        return;
+
+    /* Move the last timer into the hole, then restore the heap order */
+    timer_heap_set(th, i, th->th_nodes[th->th_count]);
+    timer_heap_update(th, th->th_nodes[i]);
+}
+
+/* Restore the heap order after the key of a timer in it has changed */
+void
+timer_heap_update(struct timer_heap *th, struct timer_node *tn)
+{
+    unsigned int i = tn->tn_index - 1;
+
+    if (i > 0 && th->th_nodes[(i - 1) / 2]->tn_key > tn->tn_key)
+        timer_heap_sift_up(th, i);
+    else
+        timer_heap_sift_down(th, i);
+}
+
+/* Convert the data of a timer into nanoseconds */
+int
+timer_interval(const struct kevent *kev, uint64_t *ns)
+{
+    uint64_t unit;
+
+    switch (kev->fflags & NOTE_TIMER_UNITS) {
+    case NOTE_SECONDS:
+        unit = 1000000000;
+        break;
+    case 0:
+    case NOTE_MSECONDS:
+        unit = 1000000;
+        break;
+    case NOTE_USECONDS:
+        unit = 1000;
+        break;
+    case NOTE_NSECONDS:
+        unit = 1;
+        break;
+    default:
+        errno = EINVAL;
+        return (-1);
+    }
+    if (kev->data < 0) {
+        errno = EINVAL;
+        return (-1);
+    }
+
+    /* Far enough in the future to never expire, without overflowing */
+    if ((uint64_t) kev->data > INT64_MAX / unit)
+        *ns = INT64_MAX;
+    else
+        *ns = (uint64_t) kev->data * unit;
+
+    return (0);
+}
+
+/* Take the period or deadline of a timer from a kevent */
+void
+timer_kevent_set(struct knote *kn, const struct kevent *kev)
+{
+    kn->kev.fflags = kev->fflags;
+    kn->kev.data = kev->data;
+
+    /* A periodic timer of zero would expire continuously */
+    if (kn->kev.data == 0 && !(kn->kev.flags & EV_ONESHOT) &&
+            !(kn->kev.fflags & NOTE_ABSTIME))
+        kn->kev.data = 1;
+}
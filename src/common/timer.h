@@ -0,0 +1,55 @@
+/*
+ * Copyright (c) 2026 libkqueue contributors
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef  _KQUEUE_TIMER_H
+#define  _KQUEUE_TIMER_H
+
+#include <stdint.h>
+
+struct kevent;
+struct knote;
+
+#define NOTE_TIMER_UNITS \
+    (NOTE_SECONDS | NOTE_MSECONDS | NOTE_USECONDS | NOTE_NSECONDS)
+
+/*
+ * A timer in a binary min-heap, ordered by its key. The node is embedded
+ * in the timer of a platform, which finds itself from the node with
+ * offsetof().
+ */
+struct timer_node {
+    uint64_t            tn_key;         /* A time, in nanoseconds */
+    unsigned int        tn_index;       /* Position in the heap + 1, or 0 */
+};
+
+struct timer_heap {
+    struct timer_node **th_nodes;
+    unsigned int        th_count;
+    unsigned int        th_size;
+};
+
+#define timer_heap_first(th) \
+    ((th)->th_count > 0 ? (th)->th_nodes[0] : NULL)
+
+int     timer_heap_insert(struct timer_heap *, struct timer_node *);
+void    timer_heap_remove(struct timer_heap *, struct timer_node *);
+void    timer_heap_update(struct timer_heap *, struct timer_node *);
+int     timer_heap_reserve(struct timer_heap *, unsigned int);
+
+int     timer_interval(const struct kevent *, uint64_t *);
+void    timer_kevent_set(struct knote *, const struct kevent *);
+
+#endif  /* ! _KQUEUE_TIMER_H */
@@ -0,0 +1,319 @@
+/*
+ * Copyright (c) 2026 libkqueue contributors
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * EVFILT_TIMER on a CPU-time clock. With NOTE_PROCESS_CPUTIME or
+ * NOTE_THREAD_CPUTIME, a timer counts the CPU time used by the process, or
+ * by the thread that adds it, instead of the time that passes. A timerfd
+ * cannot run on these clocks, so the timer is a POSIX timer that raises
+ * CPUTIMER_SIGNAL when it expires. The handler of the signal adds the
+ * number of expirations, overruns included, to an eventfd of the knote;
+ * the eventfd is in the epoll set of the kqueue, and reading it gives the
+ * data of the kevent.
+ *
+ * The value of the signal is the index of a slot in cputimer_slots, and a
+ * generation. A signal that is still queued when its timer is deleted
+ * finds the slot empty, or used by another timer, and is ignored. The
+ * slot is marked busy while the handler writes to the eventfd, so that it
+ * is not closed under the handler.
+ *
+ * The library takes CPUTIMER_SIGNAL (SIGRTMAX) for itself: the handler is
+ * installed, with SA_RESTART, when the first such timer is created. If the
+ * application has a handler of its own for the signal, or ignores it, the
+ * timer cannot be created and EBUSY is returned; an application that
+ * installs one later takes the signals of the existing timers. The signal
+ * must not be blocked in every thread.
+ */
+
+#include <sched.h>
+#include <time.h>
+
+#include "private.h"
+
+#ifndef EFD_NONBLOCK
+#define EFD_NONBLOCK 04000
+#endif
+
+#define CPUTIMER_SIGNAL     (SIGRTMAX)
+
+#define CPUTIMER_SLOT_BITS  10
+#define CPUTIMER_SLOTS      (1 << CPUTIMER_SLOT_BITS)
+#define CPUTIMER_GEN_MASK   ((1 << (30 - CPUTIMER_SLOT_BITS)) - 1)
+#define CPUTIMER_BUSY       (1 << 30)
+
+struct cputimer_slot {
+    int cs_key;     /* Generation and index, or 0 if free */
+    int cs_fd;      /* eventfd of the knote */
+};
+
+static struct cputimer_slot cputimer_slots[CPUTIMER_SLOTS];
+static pthread_mutex_t cputimer_mtx = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int cputimer_gen;
+static unsigned int cputimer_next;
+
+static void
+cputimer_handler(int signum UNUSED, siginfo_t *si, void *ctx UNUSED)
+{
+    struct cputimer_slot *cs;
+    uint64_t n;
+    int key, saved_errno = errno;
+
+    if (si->si_code != SI_TIMER)
+        return;
+    key = si->si_value.sival_int;
+    cs = &cputimer_slots[key & (CPUTIMER_SLOTS - 1)];
+    if (key == 0 || atomic_cas(&cs->cs_key, key, key | CPUTIMER_BUSY) != key)
+        return;
+
+    n = 1 + (si->si_overrun > 0 ? si->si_overrun : 0);
+    if (write(cs->cs_fd, &n, sizeof(n)) < 0) {
+        /* Only an overflow of the counter, which cannot happen */
+    }
+
+    (void) atomic_cas(&cs->cs_key, key | CPUTIMER_BUSY, key);
+    errno = saved_errno;
+}
+
+/* Install the handler, unless the application has one of its own */
+static int
+cputimer_install(void)
+{
+    struct sigaction sa, osa;
+    int rv = 0;
+
+    pthread_mutex_lock(&cputimer_mtx);
+    if (sigaction(CPUTIMER_SIGNAL, NULL, &osa) < 0) {
+        dbg_perror("sigaction(2)");
+        rv = -1;
+    } else if ((osa.sa_flags & SA_SIGINFO) && osa.sa_sigaction == cputimer_handler) {
+        /* Already installed */
+    } else if ((osa.sa_flags & SA_SIGINFO) || osa.sa_handler != SIG_DFL) {
+        dbg_puts("the application has a handler for the CPU timer signal");
+        errno = EBUSY;
+        rv = -1;
+    } else {
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_sigaction = cputimer_handler;
+        sa.sa_flags = SA_SIGINFO | SA_RESTART;
+        sigemptyset(&sa.sa_mask);
+        if (sigaction(CPUTIMER_SIGNAL, &sa, NULL) < 0) {
+            dbg_perror("sigaction(2)");
+            rv = -1;
+        }
+    }
+    pthread_mutex_unlock(&cputimer_mtx);
+
+    return (rv);
+}
+
+/* Take a free slot for an eventfd, and return its key */
+static int
+cputimer_slot_get(int fd)
+{
+    struct cputimer_slot *cs;
+    unsigned int i;
+    int key = -1;
+
+    pthread_mutex_lock(&cputimer_mtx);
+    for (i = 0; i < CPUTIMER_SLOTS; i++) {
+        cs = &cputimer_slots[(cputimer_next + i) % CPUTIMER_SLOTS];
+        if (cs->cs_key != 0)
+            continue;
+
+        cputimer_gen = (cputimer_gen + 1) & CPUTIMER_GEN_MASK;
+        if (cputimer_gen == 0)
+            cputimer_gen = 1;
+        key = (cputimer_gen << CPUTIMER_SLOT_BITS) | (cs - cputimer_slots);
+        cs->cs_fd = fd;
+        (void) atomic_cas(&cs->cs_key, 0, key);
+        cputimer_next = (cs - cputimer_slots) + 1;
+        break;
+    }
+    pthread_mutex_unlock(&cputimer_mtx);
+
+    if (key < 0)
+        errno = EAGAIN;
+    return (key);
+}
+
+/* Free a slot, once the handler is no longer using it */
+static void
+cputimer_slot_put(int key)
+{
+    struct cputimer_slot *cs = &cputimer_slots[key & (CPUTIMER_SLOTS - 1)];
+
+    while (atomic_cas(&cs->cs_key, key, 0) != key)
+        sched_yield();
+}
+
+int
+linux_cputimer_create(struct filter *filt, struct knote *kn)
+{
+    struct sigevent sev;
+    struct epoll_event ev;
+    clockid_t clock;
+    int fd;
+
+    if (cputimer_install() < 0)
+        return (-1);
+
+    fd = eventfd(0, EFD_NONBLOCK);
+    if (fd < 0) {
+        dbg_perror("eventfd(2)");
+        return (-1);
+    }
+    kn->kdata.kn_eventfd = fd;
+    kn->kn_cputimer_key = cputimer_slot_get(fd);
+    if (kn->kn_cputimer_key < 0)
+        goto errout;
+
+    if (kn->kev.fflags & NOTE_THREAD_CPUTIME)
+        clock = CLOCK_THREAD_CPUTIME_ID;
+    else
+        clock = CLOCK_PROCESS_CPUTIME_ID;
+    memset(&sev, 0, sizeof(sev));
+    sev.sigev_notify = SIGEV_SIGNAL;
+    sev.sigev_signo = CPUTIMER_SIGNAL;
+    sev.sigev_value.sival_int = kn->kn_cputimer_key;
+    if (timer_create(clock, &sev, &kn->kn_cputimer) < 0) {
+        dbg_perror("timer_create(2)");
+        goto errout;
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = kn;
+    if (epoll_ctl(filter_epfd(filt), EPOLL_CTL_ADD, fd, &ev) < 0) {
+        dbg_perror("epoll_ctl(2)");
+        (void) timer_delete(kn->kn_cputimer);
+        goto errout;
+    }
+
+    return (0);
+
+errout:
+    if (kn->kn_cputimer_key > 0)
+        cputimer_slot_put(kn->kn_cputimer_key);
+    (void) close(fd);
+    kn->kdata.kn_eventfd = -1;
+    return (-1);
+}
+
+/*
+ * Start the timer, with its first expiration after the given CPU time, or
+ * at the given absolute CPU time, and the given period. The expirations
+ * that were not reported are discarded.
+ */
+int
+linux_cputimer_arm(struct knote *kn, uint64_t value, uint64_t period,
+        int abstime)
+{
+    struct itimerspec its;
+    uint64_t n;
+
+    /* A zero value would disarm the timer */
+    if (value == 0)
+        value = 1;
+    its.it_value.tv_sec = value / 1000000000;
+    its.it_value.tv_nsec = value % 1000000000;
+    its.it_interval.tv_sec = period / 1000000000;
+    its.it_interval.tv_nsec = period % 1000000000;
+    if (timer_settime(kn->kn_cputimer, abstime ? TIMER_ABSTIME : 0, &its, NULL) < 0) {
+        dbg_perror("timer_settime(2)");
+        return (-1);
+    }
+    (void) read(kn->kdata.kn_eventfd, &n, sizeof(n));
+
+    return (0);
+}
+
+static int
+cputimer_watch(struct filter *filt, struct knote *kn, uint32_t events)
+{
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = kn;
+    if (epoll_ctl(filter_epfd(filt), EPOLL_CTL_MOD, kn->kdata.kn_eventfd, &ev) < 0) {
+        dbg_perror("epoll_ctl(2)");
+        return (-1);
+    }
+
+    return (0);
+}
+
+/* The timer is armed again by linux_cputimer_arm() */
+int
+linux_cputimer_enable(struct filter *filt, struct knote *kn)
+{
+    return (cputimer_watch(filt, kn, EPOLLIN));
+}
+
+/*
+ * A disabled timer is disarmed, and its eventfd is left out of the epoll
+ * set, as a signal may still be on its way.
+ */
+int
+linux_cputimer_disable(struct filter *filt, struct knote *kn)
+{
+    struct itimerspec its;
+
+    memset(&its, 0, sizeof(its));
+    if (timer_settime(kn->kn_cputimer, 0, &its, NULL) < 0) {
+        dbg_perror("timer_settime(2)");
+        return (-1);
+    }
+
+    return (cputimer_watch(filt, kn, 0));
+}
+
+int
+linux_cputimer_delete(struct filter *filt, struct knote *kn)
+{
+    if (kn->kdata.kn_eventfd < 0)
+        return (0);
+
+    if (timer_delete(kn->kn_cputimer) < 0)
+        dbg_perror("timer_delete(2)");
+    if (epoll_ctl(filter_epfd(filt), EPOLL_CTL_DEL, kn->kdata.kn_eventfd, NULL) < 0)
+        dbg_perror("epoll_ctl(2)");
+    cputimer_slot_put(kn->kn_cputimer_key);
+    (void) close(kn->kdata.kn_eventfd);
+    kn->kdata.kn_eventfd = -1;
+
+    return (0);
+}
+
+/*
+ * Copy out the expirations that the signal handler has counted. After the
+ * timer is re-armed, a signal of the old one may have left nothing.
+ */
+int
+linux_cputimer_copyout(struct kevent *dst, struct knote *src)
+{
+    uint64_t n;
+
+    if (read(src->kdata.kn_eventfd, &n, sizeof(n)) != sizeof(n)) {
+        memset(dst, 0, sizeof(*dst));
+        return (0);
+    }
+
+    memcpy(dst, &src->kev, sizeof(*dst));
+    dst->data = n;
+
+    return (0);
+}
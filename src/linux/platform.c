@@ -17,14 +17,12 @@
 # include <poll.h>
 #include "../common/private.h"
 
-//XXX-FIXME TEMP
-const struct filter evfilt_proc = EVFILT_NOTIMPL;
-
 /*
  * Per-thread epoll event buffer used to ferry data between
  * kevent_wait() and kevent_copyout().
  */
 static __thread struct epoll_event epevt[MAX_KEVENT];
+static __thread int nepevt;
 
 const struct kqueue_vtable kqops = {
     linux_kqueue_init,
@@ -43,11 +41,18 @@ const struct kqueue_vtable kqops = {
 int
 linux_kqueue_init(struct kqueue *kq)
 {
+    int i;
+
     kq->kq_id = epoll_create(1);
     if (kq->kq_id < 0) {
         dbg_perror("epoll_create(2)");
         return (-1);
     }
+    TAILQ_INIT(&kq->kq_fds_pending);
+    for (i = 0; i < TIMERQ_NCLOCKS; i++) {
+        kq->kq_timerq[i].tq_fd = -1;
+        kq->kq_timerq[i].tq_clock = i;
+    }
 
     if (filter_register_all(kq) < 0) {
         close(kq->kq_id);
@@ -110,10 +115,21 @@ linux_kevent_wait(
         int nevents,
         const struct timespec *ts)
 {
-    int timeout, nret;
+    int timeout, nret, npending;
 
-    /* Use a high-resolution syscall if the timeout value is less than one millisecond.  */
-    if (ts != NULL && ts->tv_sec == 0 && ts->tv_nsec > 0 && ts->tv_nsec < 1000000) {
+    /*
+     * Events left over from the last copyout are returned without waiting,
+     * and there must be room for them after the new events.
+     */
+    npending = kq->kq_npending;
+    if (npending > 0) {
+        nepevt = 0;
+        if (npending >= nevents)
+            return (npending);
+        nevents -= npending;
+        timeout = 0;
+    } else if (ts != NULL && ts->tv_sec == 0 && ts->tv_nsec > 0 && ts->tv_nsec < 1000000) {
+        /* Use a high-resolution syscall if the timeout value is less than one millisecond.  */
         nret = linux_kevent_wait_hires(kq, ts);
         if (nret <= 0)
             return (nret);
@@ -134,25 +150,81 @@ linux_kevent_wait(
         dbg_perror("epoll_wait");
         return (-1);
     }
+    nepevt = nret;
 
-    return (nret);
+    return (nret + npending);
 }
 
 int
-linux_kevent_copyout(struct kqueue *kq, int nready,
-        struct kevent *eventlist, int nevents UNUSED)
+linux_kevent_copyout(struct kqueue *kq, int nready UNUSED,
+        struct kevent *eventlist, int nevents)
 {
     struct epoll_event *ev;
     struct filter *filt;
     struct knote *kn;
-    int i, nret, rv;
+    int i, nret, rv, files = 0, signals = 0, vnodes = 0;
 
-    nret = nready;
-    for (i = 0; i < nready; i++) {
+    nret = 0;
+    for (i = 0; i < nepevt; i++) {
         ev = &epevt[i];
+
+        /*
+         * A READ and/or WRITE event. Each of the remaining epoll events
+         * needs a slot, so any extra kevent may have to wait.
+         */
+        if (epoll_is_fd_state(ev->data.ptr)) {
+            nret += linux_fd_state_copyout(kq, epoll_fd_state(ev->data.ptr),
+                    ev->events, &eventlist[nret],
+                    nevents - nret - (nepevt - i - 1));
+            continue;
+        }
+
+        /* Timers that share a timerfd of the kqueue */
+        if (ev->data.ptr >= (void *) &kq->kq_timerq[0] &&
+                ev->data.ptr < (void *) &kq->kq_timerq[TIMERQ_NCLOCKS]) {
+            nret += linux_timerq_copyout(kq, ev->data.ptr, &eventlist[nret],
+                    nevents - nret - (nepevt - i - 1));
+            continue;
+        }
+
+        /* Timers of the POSIX timer service (see posix/timer.c) */
+        if (ev->data.ptr == &kq->kq_filt[~EVFILT_TIMER]) {
+            nret += posix_evfilt_timer_copyout(ev->data.ptr, &eventlist[nret],
+                    nevents - nret - (nepevt - i - 1));
+            continue;
+        }
+
+        /*
+         * The regular files that are ready for EVFILT_READ, or have grown.
+         * Both the eventfd and the inotify instance of the filter lead here,
+         * and the files are only copied out once.
+         */
+        if (ev->data.ptr == &kq->kq_filt[~EVFILT_READ]) {
+            if (!files++)
+                nret += evfilt_read_copyout_ready(ev->data.ptr,
+                        &eventlist[nret], nevents - nret - (nepevt - i - 1));
+            continue;
+        }
+
+        /* Signals, from the signalfd or the eventfd of the filter */
+        if (ev->data.ptr == &kq->kq_filt[~EVFILT_SIGNAL]) {
+            if (!signals++)
+                nret += evfilt_signal_copyout_ready(ev->data.ptr,
+                        &eventlist[nret], nevents - nret - (nepevt - i - 1));
+            continue;
+        }
+
+        /* Files, from the inotify instance or the eventfd of the filter */
+        if (ev->data.ptr == &kq->kq_filt[~EVFILT_VNODE]) {
+            if (!vnodes++)
+                nret += evfilt_vnode_copyout_ready(ev->data.ptr,
+                        &eventlist[nret], nevents - nret - (nepevt - i - 1));
+            continue;
+        }
+
         kn = (struct knote *) ev->data.ptr;
         filt = &kq->kq_filt[~(kn->kev.filter)];
-        rv = filt->kf_copyout(eventlist, kn, ev);
+        rv = filt->kf_copyout(&eventlist[nret], kn, ev);
         if (slowpath(rv < 0)) {
             dbg_puts("knote_copyout failed");
             /* XXX-FIXME: hard to handle this without losing events */
@@ -163,22 +235,26 @@ linux_kevent_copyout(struct kqueue *kq, int nready,
          * Certain flags cause the associated knote to be deleted
          * or disabled.
          */
-        if (eventlist->flags & EV_DISPATCH)
+        if (eventlist[nret].flags & EV_DISPATCH)
             knote_disable(filt, kn); //FIXME: Error checking
-        if (eventlist->flags & EV_ONESHOT) {
+        if (eventlist[nret].flags & EV_ONESHOT) {
             knote_delete(filt, kn); //FIXME: Error checking
         }
 
         /* If an empty kevent structure is returned, the event is discarded. */
         /* TODO: add these semantics to windows + solaris platform.c */
-        if (fastpath(eventlist->filter != 0)) {
-            eventlist++;
+        if (fastpath(eventlist[nret].filter != 0)) {
+            nret++;
         } else {
             dbg_puts("spurious wakeup, discarding event");
-            nret--;
         }
     }
 
+    /* Events that did not fit in an earlier eventlist */
+    if (slowpath(kq->kq_npending > 0) && nret < nevents)
+        nret += linux_fd_state_copyout_pending(kq, &eventlist[nret],
+                nevents - nret);
+
     return (nret);
 }
 
@@ -273,35 +349,76 @@ linux_eventfd_descriptor(struct eventfd *e)
     return (e->ef_id);
 }
 
-int
-linux_get_descriptor_type(struct knote *kn)
+/*
+ * A per-process cache of descriptor types, so that only the first knote
+ * of an open file pays for getsockopt(2). Each entry holds the KNFL_* type
+ * flags and the device and inode that fstat(2) found for the descriptor,
+ * and is kept after the last knote is deleted, so that a file whose
+ * knotes are deleted and added again finds its type there. Every knote
+ * still calls fstat(2), and a descriptor number that was closed and reused
+ * for another file does not match the entry, which is then looked up
+ * again; every new connection is such a file, so a server that accepts
+ * and closes connections only saves the lookup with the NOTE_FD_SOCKET
+ * hint.
+ */
+#define FD_TYPE_FLAGS   (KNFL_PASSIVE_SOCKET | KNFL_REGULAR_FILE | KNFL_SOCKET \
+                         | KNFL_PIPE | KNFL_UNIX_SOCKET)
+
+struct fd_type {
+    dev_t        ft_dev;
+    ino_t        ft_ino;
+    int          ft_type;       /* KNFL_* type flags */
+    int          ft_known;      /* ft_type is that of ft_dev and ft_ino */
+};
+
+static struct map *fd_type_map;
+static pthread_mutex_t fd_type_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t fd_type_once = PTHREAD_ONCE_INIT;
+
+static void
+fd_type_init(void)
+{
+    struct rlimit rlim;
+
+    /* Without a cache, every knote looks up the type itself */
+    if (getrlimit(RLIMIT_NOFILE, &rlim) < 0 || rlim.rlim_max == RLIM_INFINITY)
+        return;
+    fd_type_map = map_new(rlim.rlim_max + 1);
+}
+
+/* Find the type of a descriptor from its fstat(2) and getsockopt(2) */
+static int
+fd_type_lookup(int fd, const struct stat *sb, int *type)
 {
     socklen_t slen;
-    struct stat sb;
-    int i, lsock;
+    int i, lsock, domain;
+
+    *type = 0;
 
     /*
      * Test if the descriptor is a socket.
      */
-    if (fstat(kn->kev.ident, &sb) < 0) {
-        dbg_perror("fstat(2)");
-        return (-1);
+    if (S_ISREG(sb->st_mode)) {
+        *type = KNFL_REGULAR_FILE;
+        dbg_printf("fd %d is a regular file\n", fd);
+        return (0);
     }
-    if (S_ISREG(sb.st_mode)) {
-        kn->kn_flags |= KNFL_REGULAR_FILE;
-        dbg_printf("fd %d is a regular file\n", (int)kn->kev.ident);
+
+    if (S_ISFIFO(sb->st_mode)) {
+        *type = KNFL_PIPE;
         return (0);
     }
 
     /*
      * Test if the socket is active or passive.
      */
-    if (! S_ISSOCK(sb.st_mode))
+    if (! S_ISSOCK(sb->st_mode))
         return (0);
+    *type = KNFL_SOCKET;
 
     slen = sizeof(lsock);
     lsock = 0;
-    i = getsockopt(kn->kev.ident, SOL_SOCKET, SO_ACCEPTCONN, (char *) &lsock, &slen);
+    i = getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, (char *) &lsock, &slen);
     if (i < 0) {
         switch (errno) {
             case ENOTSOCK:   /* same as lsock = 0 */
@@ -311,11 +428,114 @@ linux_get_descriptor_type(struct knote *kn)
                 dbg_perror("getsockopt(3)");
                 return (-1);
         }
-    } else {
-        if (lsock)
-            kn->kn_flags |= KNFL_PASSIVE_SOCKET;
+    }
+    if (!lsock)
+        return (0);
+    *type |= KNFL_PASSIVE_SOCKET;
+
+    /* The length of the accept queue is found differently for AF_UNIX */
+    slen = sizeof(domain);
+    if (getsockopt(fd, SOL_SOCKET, SO_DOMAIN, &domain, &slen) == 0
+            && domain == AF_UNIX)
+        *type |= KNFL_UNIX_SOCKET;
+
+    return (0);
+}
+
+int
+linux_get_descriptor_type(struct knote *kn)
+{
+    const int fd = kn->kev.ident;
+    struct fd_type *ft;
+    struct stat sb;
+    int type;
+
+    /* The caller vouches for the type of the descriptor */
+    if (kn->kev.fflags & NOTE_FD_SOCKET) {
+        kn->kn_flags |= KNFL_SOCKET;
+        return (0);
+    }
+    if (kn->kev.fflags & NOTE_FD_PIPE) {
+        kn->kn_flags |= KNFL_PIPE;
         return (0);
     }
+
+    if (fstat(fd, &sb) < 0) {
+        dbg_perror("fstat(2)");
+        return (-1);
+    }
+
+    (void) pthread_once(&fd_type_once, fd_type_init);
+    if (fd_type_map == NULL) {
+        if (fd_type_lookup(fd, &sb, &type) < 0)
+            return (-1);
+        kn->kn_flags |= type;
+        return (0);
+    }
+
+    pthread_mutex_lock(&fd_type_mtx);
+    ft = map_lookup(fd_type_map, fd);
+    if (ft == NULL) {
+        ft = calloc(1, sizeof(*ft));
+        if (ft == NULL || map_insert(fd_type_map, fd, ft) < 0) {
+            free(ft);
+            pthread_mutex_unlock(&fd_type_mtx);
+            if (fd_type_lookup(fd, &sb, &type) < 0)
+                return (-1);
+            kn->kn_flags |= type;
+            return (0);
+        }
+    }
+
+    /*
+     * A new entry, or one left by a file that the number belonged to
+     * before. The knotes of that file keep their own copy of its type.
+     */
+    if (!ft->ft_known || ft->ft_dev != sb.st_dev || ft->ft_ino != sb.st_ino) {
+        if (fd_type_lookup(fd, &sb, &type) < 0) {
+            ft->ft_known = 0;
+            pthread_mutex_unlock(&fd_type_mtx);
+            return (-1);
+        }
+        ft->ft_dev = sb.st_dev;
+        ft->ft_ino = sb.st_ino;
+        ft->ft_type = type;
+        ft->ft_known = 1;
+    }
+    kn->kn_flags |= ft->ft_type | KNFL_TYPE_CACHED;
+    pthread_mutex_unlock(&fd_type_mtx);
+
+    return (0);
+}
+
+/* Make the next knote of a descriptor that was closed look its type up */
+void
+linux_forget_descriptor_type(int fd)
+{
+    struct fd_type *ft;
+
+    if (fd_type_map == NULL)
+        return;
+
+    pthread_mutex_lock(&fd_type_mtx);
+    ft = map_lookup(fd_type_map, fd);
+    if (ft != NULL)
+        ft->ft_known = 0;
+    pthread_mutex_unlock(&fd_type_mtx);
+}
+
+/*
+ * Look up the type of the descriptor of a knote again, bypassing the
+ * cache, for a descriptor that was reused between the fstat(2) and the
+ * use of its type.
+ */
+int
+linux_reset_descriptor_type(struct knote *kn)
+{
+    linux_forget_descriptor_type(kn->kev.ident);
+    kn->kn_flags &= ~(KNFL_TYPE_CACHED | FD_TYPE_FLAGS);
+
+    return (linux_get_descriptor_type(kn));
 }
 
 char *
@@ -18,6 +18,7 @@
 #define  _KQUEUE_LINUX_PLATFORM_H
 
 struct filter;
+struct file_watch;
 
 #include <sys/syscall.h>
 #include <sys/epoll.h>
@@ -52,6 +53,89 @@ struct filter;
 extern long int syscall (long int __sysno, ...);
 #endif
 
+/*
+ * The EVFILT_READ and EVFILT_WRITE knotes of a descriptor, which share
+ * a single epoll registration. Its address, tagged with EPOLL_FDS_TAG,
+ * is the epoll user data of the registration.
+ */
+struct fd_state {
+    struct knote       *fds_read;
+    struct knote       *fds_write;
+    uint32_t            fds_events;     /* Events armed in the epoll set */
+    int                 fds_registered; /* Non-zero if added to the epoll set */
+    int                 fds_busy;       /* Being copied out; do not free */
+    uint32_t            fds_pending[2]; /* READ and WRITE events not yet
+                                           copied out, for lack of room */
+    TAILQ_ENTRY(fd_state) fds_entries;  /* Entry in kq_fds_pending */
+};
+
+#define EPOLL_FDS_TAG       ((uintptr_t) 1)
+#define epoll_is_fd_state(ptr)  ((uintptr_t) (ptr) & EPOLL_FDS_TAG)
+#define epoll_fd_state(ptr) \
+    ((struct fd_state *) ((uintptr_t) (ptr) & ~EPOLL_FDS_TAG))
+
+/*
+ * A deadline in the timer queue of a kqueue. The callback is called once
+ * the timer has expired and been removed from the queue, and returns the
+ * number of kevents (0 or 1) that it wrote. The timer may expire as late
+ * as kt_latest, so that it shares a wakeup with other timers; that is
+ * also its key in the heap of the queue.
+ */
+struct ktimer {
+    uint64_t            kt_deadline;    /* On the clock, in nanoseconds */
+    uint64_t            kt_leeway;      /* How late it may expire, in ns */
+    struct timer_node   kt_node;        /* Entry in tq_heap */
+    LIST_ENTRY(ktimer)  kt_entries;     /* Entry in a slot of tq_wheel */
+    unsigned int        kt_slot;        /* Slot in tq_wheel + 1, or 0 */
+    int                 kt_clock;       /* TIMERQ_MONOTONIC, ... */
+    int               (*kt_expire)(struct kqueue *, struct ktimer *,
+                            uint64_t, struct kevent *);
+};
+
+#define kt_latest           kt_node.tn_key  /* kt_deadline + kt_leeway */
+
+#define ktimer_of(tn) \
+    ((struct ktimer *) ((char *) (tn) - offsetof(struct ktimer, kt_node)))
+
+LIST_HEAD(ktimer_list, ktimer);
+
+/*
+ * The timers of a kqueue on one clock, which share a single timerfd. See
+ * timerq.c.
+ */
+#define TIMERQ_MONOTONIC    0
+#define TIMERQ_BOOTTIME     1
+#define TIMERQ_REALTIME     2
+#define TIMERQ_NCLOCKS      3
+
+#define TIMERQ_LEVELS       5
+
+struct timerq {
+    int                 tq_fd;          /* timerfd, or -1 until first used */
+    int                 tq_clock;
+    uint64_t            tq_armed;       /* Deadline it is armed for, or 0 */
+    uint64_t            tq_tick;        /* First tick still on the wheel */
+    uint64_t            tq_leeway;      /* Largest leeway ever queued */
+    uint64_t            tq_map[TIMERQ_LEVELS]; /* Non-empty slots */
+    struct ktimer_list *tq_wheel;       /* TIMERQ_LEVELS * 64 slots */
+    struct timer_heap   tq_heap;        /* The due timers */
+};
+
+/*
+ * A watch on the inotify instance of a filter. The descriptors of the same
+ * file get the same watch descriptor, so all of their knotes share it.
+ */
+struct file_watch {
+    int                  fw_wd;
+    uint32_t             fw_mask;   /* EVFILT_VNODE: mask of all the knotes */
+    dev_t                fw_dev;    /* EVFILT_VNODE: the file watched */
+    ino_t                fw_ino;
+    LIST_HEAD(, knote)   fw_knotes;
+    RB_ENTRY(file_watch) fw_entries;
+};
+RB_HEAD(file_watches, file_watch);
+RB_PROTOTYPE(file_watches, file_watch, fw_entries, file_watch_cmp)
+
 /* Convenience macros to access the epoll descriptor for the kqueue */
 #define kqueue_epfd(kq)     ((kq)->kq_id)
 #define filter_epfd(filt)   ((filt)->kf_kqueue->kq_id)
@@ -59,26 +143,51 @@ extern long int syscall (long int __sysno, ...);
 /*
  * Additional members of struct filter
  */
-#undef FILTER_PLATFORM_SPECIFIC
+#define FILTER_PLATFORM_SPECIFIC \
+    int kf_diagfd; /* EVFILT_READ: sock_diag socket, or -1 */ \
+    TAILQ_HEAD(, knote) kf_ready; /* READ: readable files, SIGNAL and VNODE: fired */ \
+    int kf_nready; \
+    int kf_inotifyfd; /* EVFILT_READ and VNODE: watches files, or -1 */ \
+    struct file_watches kf_watches; \
+    uint64_t kf_signals /* EVFILT_SIGNAL: signals watched, see SIGNAL_BIT() */
 
 /*
  * Additional members of struct knote
  */
 #define KNOTE_PLATFORM_SPECIFIC \
     int kn_epollfd; /* A copy of filter->epfd */      \
+    struct fd_state *kn_fds; /* Used by EVFILT_READ and EVFILT_WRITE */ \
+    int kn_bufsz; /* EVFILT_WRITE: size of the send buffer or pipe */ \
+    int kn_lowat; /* NOTE_LOWAT threshold, or 0 */ \
+    int kn_lowat_opt; /* Socket option set for NOTE_LOWAT, or 0 */ \
+    struct kevent *kn_accept; /* NOTE_ACCEPT: changes for accepted sockets */ \
+    int kn_naccept; \
+    TAILQ_ENTRY(knote) kn_ready; /* EVFILT_READ, SIGNAL and VNODE: in kf_ready */ \
+    off_t kn_size; /* EVFILT_READ: cached size of a regular file */ \
+    struct file_watch *kn_watch; /* EVFILT_READ and VNODE: inotify watch */ \
+    LIST_ENTRY(knote) kn_watch_entries; \
+    struct ktimer kn_timer; /* EVFILT_TIMER, or the idle timer of READ/WRITE */ \
+    uint64_t kn_period; /* EVFILT_TIMER: period in nanoseconds, or 0 */ \
+    timer_t kn_cputimer; /* EVFILT_TIMER: POSIX timer on a CPU-time clock */ \
+    int kn_cputimer_key; /* Its slot in the table of the signal handler */ \
+    uint64_t kn_idle_timeout; /* Idle timeout in nanoseconds, or 0 */ \
+    uint64_t kn_idle_last; /* Time the knote last fired */ \
+    intptr_t kn_nsignals; /* EVFILT_SIGNAL: deliveries not yet reported */ \
+    unsigned long kn_sigseen; /* EVFILT_SIGNAL: deliveries counted so far */ \
+    unsigned int kn_vnode_fflags; /* EVFILT_VNODE: changes not yet reported */ \
     union { \
         int kn_timerfd; \
-        int kn_signalfd; \
-        int kn_inotifyfd; \
         int kn_eventfd; \
+        int kn_pidfd; \
     } kdata
 
 /*
  * Additional members of struct kqueue
  */
 #define KQUEUE_PLATFORM_SPECIFIC \
-    struct epoll_event kq_plist[MAX_KEVENT]; \
-    size_t kq_nplist
+    TAILQ_HEAD(, fd_state) kq_fds_pending; \
+    int kq_npending; \
+    struct timerq kq_timerq[TIMERQ_NCLOCKS]
 
 int     linux_kqueue_init(struct kqueue *);
 void    linux_kqueue_free(struct kqueue *);
@@ -97,10 +206,43 @@ int     linux_eventfd_descriptor(struct eventfd *);
 /* utility functions */
 
 int     linux_get_descriptor_type(struct knote *);
+void    linux_forget_descriptor_type(int);
+int     linux_reset_descriptor_type(struct knote *);
 int     linux_fd_to_path(char *, size_t, int);
 
 /* epoll-related functions */
 
+int     linux_fd_state_attach(struct filter *, struct knote *);
+int     linux_fd_state_detach(struct filter *, struct knote *);
+int     linux_fd_state_update(struct knote *);
+int     linux_fd_state_modify(struct knote *, const struct kevent *);
+void    linux_fd_state_mode(struct knote *);
+void    linux_fd_state_lowat(struct knote *);
+int     linux_fd_state_copyout(struct kqueue *, struct fd_state *, uint32_t,
+            struct kevent *, int);
+int     linux_fd_state_copyout_pending(struct kqueue *, struct kevent *, int);
+
+/* timer queue functions */
+
+uint64_t linux_timerq_now(int);
+int     linux_timerq_insert(struct kqueue *, struct ktimer *, uint64_t);
+void    linux_timerq_remove(struct kqueue *, struct ktimer *);
+void    linux_timerq_destroy(struct kqueue *);
+int     linux_timerq_leeway(struct kqueue *, struct ktimer *, uint64_t);
+int     linux_timerq_copyout(struct kqueue *, struct timerq *, struct kevent *, int);
+
+int     linux_cputimer_create(struct filter *, struct knote *);
+int     linux_cputimer_arm(struct knote *, uint64_t, uint64_t, int);
+int     linux_cputimer_enable(struct filter *, struct knote *);
+int     linux_cputimer_disable(struct filter *, struct knote *);
+int     linux_cputimer_delete(struct filter *, struct knote *);
+int     linux_cputimer_copyout(struct kevent *, struct knote *);
+
+int     evfilt_read_accept(struct filter *, struct knote *, struct kevent *, int);
+int     evfilt_read_copyout_ready(struct filter *, struct kevent *, int);
+int     evfilt_signal_copyout_ready(struct filter *, struct kevent *, int);
+int     evfilt_vnode_copyout_ready(struct filter *, struct kevent *, int);
+
 int     epoll_update(int, struct filter *, struct knote *, struct epoll_event *);
 char *  epoll_event_dump(struct epoll_event *);
 
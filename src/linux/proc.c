@@ -14,226 +14,199 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
-#include <errno.h>
-#include <err.h>
-#include <fcntl.h>
-#include <pthread.h>
-#include <signal.h>
-#include <stdlib.h>
-#include <stdio.h>
-#include <sys/queue.h>
-#include <sys/types.h>
-#include <sys/wait.h>
-#include <string.h>
-#include <unistd.h>
+/*
+ * EVFILT_PROC, with NOTE_EXIT only. Each knote has a pidfd of the process,
+ * in the epoll set of the kqueue, which becomes readable when the process
+ * exits; any process can be watched, and not only the children of the
+ * caller. This needs Linux 5.3 or later.
+ *
+ * The exit is always reported, with EV_EOF and EV_ONESHOT, as on the BSDs.
+ * For a child process, data is its status, as returned by waitpid(2); the
+ * child is not reaped, which is left to the caller, and its resource usage
+ * can be had with kevent_proc_rusage() until then. For other processes,
+ * the status is not available and data is 0.
+ *
+ * NOTE_FORK, NOTE_EXEC and NOTE_TRACK are accepted but never reported.
+ */
 
-#include <limits.h>
-#include <sys/inotify.h>
-#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
 
-#include "sys/event.h"
 #include "private.h"
 
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
 
-/* XXX-FIXME Should only have one wait_thread per process.
-   Now, there is one thread per kqueue
- */
-struct evfilt_data {
-    pthread_t       wthr_id;
-    pthread_cond_t   wait_cond;
-    pthread_mutex_t  wait_mtx;
-};
+#ifndef P_PIDFD
+#define P_PIDFD 3
+#endif
 
-//FIXME: WANT: static void *
-void *
-wait_thread(void *arg)
+/*
+ * The waitid(2) system call has a fifth argument for the resource usage,
+ * which the C library does not pass.
+ */
+static int
+proc_waitid(struct knote *kn, siginfo_t *si, struct rusage *ru)
 {
-    struct filter *filt = (struct filter *) arg;
-    uint64_t counter = 1;
-    const int options = WEXITED | WNOWAIT;
-    struct knote *kn;
-    siginfo_t si;
-    sigset_t sigmask;
-
-    /* Block all signals */
-    sigfillset (&sigmask);
-    pthread_sigmask(SIG_BLOCK, &sigmask, NULL);
-
-    for (;;) {
-
-        /* Wait for a child process to exit(2) */
-        if (waitid(P_ALL, 0, &si, options) != 0) {
-            if (errno == ECHILD) {
-                dbg_puts("got ECHILD, waiting for wakeup condition");
-                pthread_mutex_lock(&filt->kf_data->wait_mtx);
-                pthread_cond_wait(&filt->kf_data->wait_cond, &filt->kf_data->wait_mtx);
-                pthread_mutex_unlock(&filt->kf_data->wait_mtx);
-                dbg_puts("awoken from ECHILD-induced sleep");
-                continue;
-            }
-
-            dbg_puts("  waitid(2) returned");
-            if (errno == EINTR)
-                continue;
-            dbg_perror("waitid(2)");
-            break;
-        }
-
-        /* Scan the wait queue to see if anyone is interested */
-        kn = knote_lookup(filt, si.si_pid);
-        if (kn == NULL)
-            continue;
-
-        /* Create a proc_event */
-        if (si.si_code == CLD_EXITED) {
-            kn->kev.data = si.si_status;
-        } else if (si.si_code == CLD_KILLED) {
-            /* FIXME: probably not true on BSD */
-            /* FIXME: arbitrary non-zero number */
-            kn->kev.data = 254;
-        } else {
-            /* Should never happen. */
-            /* FIXME: arbitrary non-zero number */
-            kn->kev.data = 1;
-        }
-
-        knote_enqueue(filt, kn);
-
-        /* Indicate read(2) readiness */
-        if (write(filt->kf_pfd, &counter, sizeof(counter)) < 0) {
-            if (errno != EAGAIN) {
-                dbg_printf("write(2): %s", strerror(errno));
-                /* TODO: set filter error flag */
-                break;
-                }
-        }
-    }
+    int rv;
 
-    /* TODO: error handling */
+    memset(si, 0, sizeof(*si));
+    rv = syscall(SYS_waitid, P_PIDFD, kn->kdata.kn_pidfd, si,
+            WEXITED | WNOHANG | WNOWAIT, ru);
 
-    return (NULL);
+    /* P_PIDFD needs Linux 5.4 */
+    if (rv < 0 && errno == EINVAL)
+        rv = syscall(SYS_waitid, P_PID, (id_t) kn->kev.ident, si,
+                WEXITED | WNOHANG | WNOWAIT, ru);
+
+    return (rv);
 }
 
-int
-evfilt_proc_init(struct filter *filt)
+/* Convert the siginfo of waitid(2) into the status of waitpid(2) */
+static intptr_t
+proc_status(const siginfo_t *si)
 {
-#if FIXME
-    struct evfilt_data *ed;
-    int efd = -1;
-
-    if ((ed = calloc(1, sizeof(*ed))) == NULL)
-        return (-1);
-    filt->kf_data = ed;
+    switch (si->si_code) {
+    case CLD_EXITED:
+        return ((si->si_status & 0xff) << 8);
+    case CLD_KILLED:
+        return (si->si_status & 0x7f);
+    case CLD_DUMPED:
+        return ((si->si_status & 0x7f) | 0x80);
+    default:
+        return (0);
+    }
+}
 
-    pthread_mutex_init(&ed->wait_mtx, NULL);
-    pthread_cond_init(&ed->wait_cond, NULL);
-    if ((efd = eventfd(0, 0)) < 0)
-        goto errout;
-    if (fcntl(filt->kf_pfd, F_SETFL, O_NONBLOCK) < 0)
-        goto errout;
-    filt->kf_pfd = efd;
-    if (pthread_create(&ed->wthr_id, NULL, wait_thread, filt) != 0)
-        goto errout;
+static int
+proc_watch(struct filter *filt, struct knote *kn, int op, uint32_t events)
+{
+    struct epoll_event ev;
 
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = kn;
+    if (epoll_ctl(filter_epfd(filt), op, kn->kdata.kn_pidfd, &ev) < 0) {
+        dbg_perror("epoll_ctl(2)");
+        return (-1);
+    }
 
     return (0);
-
-errout:
-    if (efd >= 0)
-        close(efd);
-    free(ed);
-    close(filt->kf_pfd);
-    return (-1);
-#endif
-    return (-1); /*STUB*/
 }
 
-void
-evfilt_proc_destroy(struct filter *filt)
+int
+evfilt_proc_copyout(struct kevent *dst, struct knote *src, void *ptr UNUSED)
 {
-//TODO:    pthread_cancel(filt->kf_data->wthr_id);
-    close(filt->kf_pfd);
+    siginfo_t si;
+
+    memcpy(dst, &src->kev, sizeof(*dst));
+    dst->fflags = NOTE_EXIT;
+    dst->flags |= EV_EOF | EV_ONESHOT;
+
+    /* Not a child, or already reaped */
+    if (proc_waitid(src, &si, NULL) < 0 || si.si_pid == 0)
+        dst->data = 0;
+    else
+        dst->data = proc_status(&si);
+
+    return (0);
 }
 
 int
-evfilt_proc_copyout(struct filter *filt,
-            struct kevent *dst,
-            int maxevents)
+evfilt_proc_knote_create(struct filter *filt, struct knote *kn)
 {
-    struct knote *kn;
-    int nevents = 0;
-    uint64_t cur;
-
-    /* Reset the counter */
-    if (read(filt->kf_pfd, &cur, sizeof(cur)) < sizeof(cur)) {
-        dbg_printf("read(2): %s", strerror(errno));
+    if ((pid_t) kn->kev.ident <= 0) {
+        errno = EINVAL;
         return (-1);
     }
-    dbg_printf("  counter=%llu", (unsigned long long) cur);
-
-    for (kn = knote_dequeue(filt); kn != NULL; kn = knote_dequeue(filt)) {
-        kevent_dump(&kn->kev);
-        memcpy(dst, &kn->kev, sizeof(*dst));
-
-        if (kn->kev.flags & EV_DISPATCH) {
-            KNOTE_DISABLE(kn);
-        }
-        if (kn->kev.flags & EV_ONESHOT) {
-            knote_free(filt, kn);
-        } else {
-            kn->kev.data = 0; //why??
-        }
-
 
-        if (++nevents > maxevents)
-            break;
-        dst++;
+    kn->kdata.kn_pidfd = syscall(SYS_pidfd_open, (pid_t) kn->kev.ident, 0);
+    if (kn->kdata.kn_pidfd < 0) {
+        dbg_perror("pidfd_open(2)");
+        return (-1);
     }
+    if (fcntl(kn->kdata.kn_pidfd, F_SETFD, FD_CLOEXEC) < 0)
+        dbg_perror("fcntl(2)");
 
-    if (knote_events_pending(filt)) {
-    /* XXX-FIXME: If there are leftover events on the waitq,
-       re-arm the eventfd. list */
-        abort();
+    if (proc_watch(filt, kn, EPOLL_CTL_ADD, EPOLLIN) < 0) {
+        (void) close(kn->kdata.kn_pidfd);
+        kn->kdata.kn_pidfd = -1;
+        return (-1);
     }
 
-    return (nevents);
-}
-
-int
-evfilt_proc_knote_create(struct filter *filt, struct knote *kn)
-{
-    return (0); /* STUB */
+    return (0);
 }
 
 int
-evfilt_proc_knote_modify(struct filter *filt, struct knote *kn,
+evfilt_proc_knote_modify(struct filter *filt UNUSED, struct knote *kn,
         const struct kevent *kev)
 {
-    return (0); /* STUB */
+    kn->kev.fflags = kev->fflags;
+    return (0);
 }
 
 int
 evfilt_proc_knote_delete(struct filter *filt, struct knote *kn)
 {
-    return (0); /* STUB */
+    if (kn->kdata.kn_pidfd < 0)
+        return (0);
+
+    if (epoll_ctl(filter_epfd(filt), EPOLL_CTL_DEL, kn->kdata.kn_pidfd, NULL) < 0)
+        dbg_perror("epoll_ctl(2)");
+    (void) close(kn->kdata.kn_pidfd);
+    kn->kdata.kn_pidfd = -1;
+
+    return (0);
 }
 
 int
 evfilt_proc_knote_enable(struct filter *filt, struct knote *kn)
 {
-    return (0); /* STUB */
+    return (proc_watch(filt, kn, EPOLL_CTL_MOD, EPOLLIN));
 }
 
 int
 evfilt_proc_knote_disable(struct filter *filt, struct knote *kn)
 {
-    return (0); /* STUB */
+    return (proc_watch(filt, kn, EPOLL_CTL_MOD, 0));
+}
+
+/*
+ * The resource usage of a child that has exited, and has not been reaped
+ * yet. It does not need a knote.
+ */
+int VISIBLE
+kevent_proc_rusage(int kqfd, int pid, struct rusage *ru)
+{
+    struct kqueue *kq;
+    siginfo_t si;
+
+    kq = kqueue_lookup(kqfd);
+    if (kq == NULL) {
+        errno = ENOENT;
+        return (-1);
+    }
+
+    memset(&si, 0, sizeof(si));
+    if (syscall(SYS_waitid, P_PID, (id_t) pid, &si,
+                WEXITED | WNOHANG | WNOWAIT, ru) < 0)
+        return (-1);
+
+    /* Still running */
+    if (si.si_pid == 0) {
+        errno = EBUSY;
+        return (-1);
+    }
+
+    return (0);
 }
 
-const struct filter evfilt_proc_DEADWOOD = {
-    0, //XXX-FIXME broken: EVFILT_PROC,
-    evfilt_proc_init,
-    evfilt_proc_destroy,
+const struct filter evfilt_proc = {
+    EVFILT_PROC,
+    NULL,
+    NULL,
     evfilt_proc_copyout,
     evfilt_proc_knote_create,
     evfilt_proc_knote_modify,
@@ -16,7 +16,13 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/sock_diag.h>
 #include <linux/sockios.h>
+#include <linux/unix_diag.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <pthread.h>
 #include <signal.h>
 #include <stdlib.h>
@@ -32,100 +38,357 @@
 
 /*
  * Return the offset from the current position to end of file.
+ *
+ * The size of the file is cached, and only refreshed once the position
+ * reaches it, so most events cost a single lseek(2). The data may lag
+ * behind a file that is growing, until the cached end is read.
  */
 static intptr_t
-get_eof_offset(int fd)
+regular_file_data(struct knote *kn)
 {
     off_t curpos;
     struct stat sb;
 
-    curpos = lseek(fd, 0, SEEK_CUR);
+    curpos = lseek(kn->kev.ident, 0, SEEK_CUR);
     if (curpos == (off_t) -1) {
         dbg_perror("lseek(2)");
         curpos = 0;
     }
-    if (fstat(fd, &sb) < 0) {
-        dbg_perror("fstat(2)");
-        sb.st_size = 1;
+    if (curpos >= kn->kn_size) {
+        if (fstat(kn->kev.ident, &sb) < 0) {
+            /* race condition with close, so report one byte */
+            dbg_perror("fstat(2)");
+            return (1);
+        }
+        kn->kn_size = sb.st_size;
     }
 
-    dbg_printf("curpos=%zu size=%zu\n", (size_t)curpos, (size_t)sb.st_size);
-    return (sb.st_size - curpos); //FIXME: can overflow
+    dbg_printf("curpos=%zu size=%zu\n", (size_t)curpos, (size_t)kn->kn_size);
+    if (curpos >= kn->kn_size)
+        return (0);
+    return (kn->kn_size - curpos); //FIXME: can overflow
 }
 
-int
-evfilt_read_copyout(struct kevent *dst, struct knote *src, void *ptr)
+/*
+ * A regular file is always readable until the end of file, so rather than
+ * holding a kernel object, its knote is kept on the kf_ready list of the
+ * filter, and copied out from there. The eventfd of the filter is readable
+ * while the list is not empty, to wake up kevent().
+ */
+static int
+regular_file_ready(struct filter *filt, struct knote *kn)
 {
-    struct epoll_event * const ev = (struct epoll_event *) ptr;
+    struct epoll_event ev;
 
-    /* Special case: for regular files, return the offset from current position to end of file */
-    if (src->kn_flags & KNFL_REGULAR_FILE) {
-        memcpy(dst, &src->kev, sizeof(*dst));
-        dst->data = get_eof_offset(src->kev.ident);
+    if (kn->kn_ready.tqe_prev != NULL)
+        return (0);
 
-        if (dst->data == 0) {
-            dst->filter = 0;    /* Will cause the kevent to be discarded */
-            if (epoll_ctl(src->kn_epollfd, EPOLL_CTL_DEL, src->kdata.kn_eventfd, NULL) < 0) {
-                dbg_perror("epoll_ctl(2)");
-                return (-1);
-            }
+    /* The eventfd is created on first use */
+    if (filt->kf_efd.ef_id < 0) {
+        if (kqops.eventfd_init(&filt->kf_efd) < 0)
+            return (-1);
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = filt;
+        if (epoll_ctl(filter_epfd(filt), EPOLL_CTL_ADD,
+                    filt->kf_efd.ef_id, &ev) < 0) {
+            dbg_perror("epoll_ctl(2)");
+            kqops.eventfd_close(&filt->kf_efd);
+            return (-1);
+        }
+    }
+    if (filt->kf_nready == 0 && kqops.eventfd_raise(&filt->kf_efd) < 0)
+        return (-1);
+
+    TAILQ_INSERT_TAIL(&filt->kf_ready, kn, kn_ready);
+    filt->kf_nready++;
 
-#if FIXME
-            /* XXX-FIXME Switch to using kn_inotifyfd to monitor for IN_ATTRIB events
-                         that may signify the file size has changed.
+    return (0);
+}
 
-                         This code is not tested.
-             */
-            int inofd;
-            char path[PATH_MAX];
+static void
+regular_file_unready(struct filter *filt, struct knote *kn)
+{
+    if (kn->kn_ready.tqe_prev == NULL)
+        return;
 
-            inofd = inotify_init();
-            if (inofd < 0) {
-                dbg_perror("inotify_init(2)");
-                (void) close(inofd);
-                return (-1);
-            }
-            src->kdata.kn_inotifyfd = inofd;
-            if (linux_fd_to_path(&path[0], sizeof(path), src->kev.ident) < 0)
-                return (-1);
-            if (inotify_add_watch(inofd, path, IN_ATTRIB) < 0) {
-                dbg_perror("inotify_add_watch");
-                return (-1);
+    TAILQ_REMOVE(&filt->kf_ready, kn, kn_ready);
+    kn->kn_ready.tqe_prev = NULL;
+    if (--filt->kf_nready == 0)
+        (void) kqops.eventfd_lower(&filt->kf_efd);
+}
+
+/*
+ * A regular file that has been read to the end, or reported with EV_CLEAR,
+ * is watched for IN_MODIFY on the inotify instance of the filter, and its
+ * knotes are put back on the kf_ready list when it grows. The descriptors
+ * of the same file get the same watch descriptor, so its knotes share it.
+ */
+static int
+file_watch_cmp(struct file_watch *a, struct file_watch *b)
+{
+    return (a->fw_wd - b->fw_wd);
+}
+
+RB_GENERATE(file_watches, file_watch, fw_entries, file_watch_cmp)
+
+static int
+regular_file_watch(struct filter *filt, struct knote *kn)
+{
+    struct epoll_event ev;
+    struct file_watch *fw, key;
+    char path[64];
+
+    if (kn->kn_watch != NULL)
+        return (0);
+
+    /* The inotify instance is created on first use */
+    if (filt->kf_inotifyfd < 0) {
+        filt->kf_inotifyfd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (filt->kf_inotifyfd < 0) {
+            dbg_perror("inotify_init1(2)");
+            return (-1);
+        }
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = filt;
+        if (epoll_ctl(filter_epfd(filt), EPOLL_CTL_ADD,
+                    filt->kf_inotifyfd, &ev) < 0) {
+            dbg_perror("epoll_ctl(2)");
+            (void) close(filt->kf_inotifyfd);
+            filt->kf_inotifyfd = -1;
+            return (-1);
+        }
+    }
+
+    /* The link follows the descriptor, even if the file is renamed */
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", (int) kn->kev.ident);
+    key.fw_wd = inotify_add_watch(filt->kf_inotifyfd, path, IN_MODIFY);
+    if (key.fw_wd < 0) {
+        dbg_perror("inotify_add_watch(2)");
+        return (-1);
+    }
+
+    fw = RB_FIND(file_watches, &filt->kf_watches, &key);
+    if (fw == NULL) {
+        fw = malloc(sizeof(*fw));
+        if (fw == NULL) {
+            (void) inotify_rm_watch(filt->kf_inotifyfd, key.fw_wd);
+            return (-1);
+        }
+        fw->fw_wd = key.fw_wd;
+        LIST_INIT(&fw->fw_knotes);
+        RB_INSERT(file_watches, &filt->kf_watches, fw);
+    }
+    LIST_INSERT_HEAD(&fw->fw_knotes, kn, kn_watch_entries);
+    kn->kn_watch = fw;
+
+    return (0);
+}
+
+static void
+regular_file_unwatch(struct filter *filt, struct knote *kn)
+{
+    struct file_watch *fw = kn->kn_watch;
+
+    if (fw == NULL)
+        return;
+    LIST_REMOVE(kn, kn_watch_entries);
+    kn->kn_watch = NULL;
+    if (!LIST_EMPTY(&fw->fw_knotes))
+        return;
+
+    if (inotify_rm_watch(filt->kf_inotifyfd, fw->fw_wd) < 0)
+        dbg_perror("inotify_rm_watch(2)");
+    RB_REMOVE(file_watches, &filt->kf_watches, fw);
+    free(fw);
+}
+
+/*
+ * A watched file was modified, so its size may have changed. Its knotes
+ * are checked against the new size when they are copied out.
+ */
+static void
+regular_file_grown(struct filter *filt, struct file_watch *fw)
+{
+    struct knote *kn;
+
+    LIST_FOREACH(kn, &fw->fw_knotes, kn_watch_entries) {
+        kn->kn_size = 0;
+        if (!(kn->kev.flags & EV_DISABLE))
+            (void) regular_file_ready(filt, kn);
+    }
+}
+
+/* Read the pending inotify events of the filter */
+static void
+regular_file_inotify(struct filter *filt)
+{
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct inotify_event *iev;
+    struct file_watch *fw, key;
+    struct knote *kn;
+    ssize_t n, off;
+
+    for (;;) {
+        n = read(filt->kf_inotifyfd, buf, sizeof(buf));
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN)
+                dbg_perror("read(2)");
+            return;
+        }
+        if (n == 0)
+            return;
+
+        for (off = 0; off < n; off += sizeof(*iev) + iev->len) {
+            iev = (struct inotify_event *) &buf[off];
+
+            /* Some events were lost, so check every file */
+            if (iev->mask & IN_Q_OVERFLOW) {
+                RB_FOREACH(fw, file_watches, &filt->kf_watches)
+                    regular_file_grown(filt, fw);
+                continue;
             }
-            if (epoll_ctl(src->kn_epollfd, EPOLL_CTL_ADD, src->kdata.kn_inotifyfd, NULL) < 0) {
-                dbg_perror("epoll_ctl(2)");
-                return (-1);
+
+            key.fw_wd = iev->wd;
+            fw = RB_FIND(file_watches, &filt->kf_watches, &key);
+            if (fw == NULL)
+                continue;
+
+            /* The file is gone, e.g. unmounted */
+            if (iev->mask & IN_IGNORED) {
+                while ((kn = LIST_FIRST(&fw->fw_knotes)) != NULL) {
+                    LIST_REMOVE(kn, kn_watch_entries);
+                    kn->kn_watch = NULL;
+                }
+                RB_REMOVE(file_watches, &filt->kf_watches, fw);
+                free(fw);
+                continue;
             }
-            /* FIXME: race here, should we check the EOF status again ? */
-#endif
+
+            regular_file_grown(filt, fw);
         }
+    }
+}
 
-        return (0);
+/*
+ * Return the number of connections waiting to be accepted on a
+ * listening UNIX domain socket, as reported by sock_diag(7).
+ */
+static int
+unix_accept_backlog(struct filter *filt, int fd)
+{
+    struct {
+        struct nlmsghdr         nlh;
+        struct unix_diag_req    udr;
+    } req;
+    union {
+        struct nlmsghdr         nlh;
+        char                    buf[256];
+    } resp;
+    struct unix_diag_msg *msg;
+    struct rtattr *rta;
+    struct stat sb;
+    ssize_t n;
+    int len;
+
+    if (fstat(fd, &sb) < 0) {
+        dbg_perror("fstat(2)");
+        return (-1);
     }
 
-    dbg_printf("epoll: %s", epoll_event_dump(ev));
-    memcpy(dst, &src->kev, sizeof(*dst));
-#if defined(HAVE_EPOLLRDHUP)
-    if (ev->events & EPOLLRDHUP || ev->events & EPOLLHUP)
-        dst->flags |= EV_EOF;
-#else
-    if (ev->events & EPOLLHUP)
-        dst->flags |= EV_EOF;
-#endif
-    if (ev->events & EPOLLERR)
-        dst->fflags = 1; /* FIXME: Return the actual socket error */
+    /* The sock_diag socket is opened on first use */
+    if (filt->kf_diagfd < 0) {
+        filt->kf_diagfd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC,
+                NETLINK_SOCK_DIAG);
+        if (filt->kf_diagfd < 0) {
+            dbg_perror("socket(2)");
+            return (-1);
+        }
+    }
 
-    if (src->kn_flags & KNFL_PASSIVE_SOCKET) {
+    memset(&req, 0, sizeof(req));
+    req.nlh.nlmsg_len = sizeof(req);
+    req.nlh.nlmsg_type = SOCK_DIAG_BY_FAMILY;
+    req.nlh.nlmsg_flags = NLM_F_REQUEST;
+    req.udr.sdiag_family = AF_UNIX;
+    req.udr.udiag_states = 1 << TCP_LISTEN;
+    req.udr.udiag_ino = sb.st_ino;
+    req.udr.udiag_show = UDIAG_SHOW_RQLEN;
+    req.udr.udiag_cookie[0] = req.udr.udiag_cookie[1] = ~0U;
+    if (send(filt->kf_diagfd, &req, sizeof(req), 0) < 0) {
+        dbg_perror("send(2)");
+        return (-1);
+    }
+    n = recv(filt->kf_diagfd, &resp, sizeof(resp), 0);
+    if (n < 0) {
+        dbg_perror("recv(2)");
+        return (-1);
+    }
+    if (!NLMSG_OK(&resp.nlh, n) || resp.nlh.nlmsg_type != SOCK_DIAG_BY_FAMILY
+            || resp.nlh.nlmsg_len < NLMSG_LENGTH(sizeof(*msg))) {
+        dbg_puts("unexpected sock_diag response");
+        return (-1);
+    }
+
+    /* For a listening socket, the receive queue holds the connections */
+    msg = (struct unix_diag_msg *) NLMSG_DATA(&resp.nlh);
+    rta = (struct rtattr *) (msg + 1);
+    len = resp.nlh.nlmsg_len - NLMSG_LENGTH(sizeof(*msg));
+    for (; RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+        if (rta->rta_type == UNIX_DIAG_RQLEN)
+            return (((struct unix_diag_rqlen *) RTA_DATA(rta))->udiag_rqueue);
+    }
+
+    return (-1);
+}
+
+/*
+ * Return the number of connections waiting to be accepted on a
+ * listening socket, or -1 if it cannot be determined.
+ */
+static int
+get_accept_backlog(struct filter *filt, struct knote *kn)
+{
+    struct tcp_info ti;
+    socklen_t slen;
+
+    if (kn->kn_flags & KNFL_UNIX_SOCKET)
+        return (unix_accept_backlog(filt, kn->kev.ident));
+
+    /* On a listener, tcpi_unacked is the length of the accept queue */
+    slen = sizeof(ti);
+    if (getsockopt(kn->kev.ident, IPPROTO_TCP, TCP_INFO, &ti, &slen) < 0) {
+        dbg_perror("getsockopt(2)");
+        return (-1);
+    }
+
+    return (ti.tcpi_unacked);
+}
+
+int
+evfilt_read_knote_data(struct filter *filt, struct knote *kn,
+        struct kevent *dst)
+{
+    int backlog;
+
+    if (kn->kn_flags & KNFL_REGULAR_FILE) {
+        dst->data = regular_file_data(kn);
+    } else if (kn->kn_flags & KNFL_PASSIVE_SOCKET) {
         /* On return, data contains the length of the
-           socket backlog. This is not available under Linux.
+           socket backlog. If it is unknown, report one
+           connection.
          */
-        dst->data = 1;
+        backlog = get_accept_backlog(filt, kn);
+        dst->data = (backlog < 0) ? 1 : backlog;
     } else {
         /* On return, data contains the number of bytes of protocol
            data available to read.
          */
         int i;
-        if (ioctl(dst->ident, SIOCINQ, &i) < 0) {
+        if (ioctl(kn->kev.ident, SIOCINQ, &i) < 0) {
             /* race condition with socket close, so ignore this error */
             dbg_puts("ioctl(2) of socket failed");
             dst->data = 0;
@@ -139,133 +402,371 @@ evfilt_read_copyout(struct kevent *dst, struct knote *src, void *ptr)
     return (0);
 }
 
+int
+evfilt_read_copyout(struct kevent *dst, struct knote *src, void *ptr)
+{
+    struct epoll_event * const ev = (struct epoll_event *) ptr;
+
+    dbg_printf("epoll: %s", epoll_event_dump(ev));
+    memcpy(dst, &src->kev, sizeof(*dst));
+#if defined(HAVE_EPOLLRDHUP)
+    if (ev->events & EPOLLRDHUP || ev->events & EPOLLHUP)
+        dst->flags |= EV_EOF;
+#else
+    if (ev->events & EPOLLHUP)
+        dst->flags |= EV_EOF;
+#endif
+    if (ev->events & EPOLLERR)
+        dst->fflags = 1; /* FIXME: Return the actual socket error */
+
+    /* The caller will use kevent_data() if it needs the data field */
+    if ((src->kev.fflags & NOTE_NODATA) && src->kn_lowat == 0) {
+        dst->data = 0;
+        return (0);
+    }
+
+    /*
+     * With SO_RCVLOWAT set, the kernel only reports a socket below the
+     * threshold when waiting any longer could stall the connection.
+     */
+    (void) evfilt_read_knote_data(&src->kn_kq->kq_filt[~EVFILT_READ], src, dst);
+    if (dst->data < src->kn_lowat && !(dst->flags & EV_EOF) &&
+            src->kn_lowat_opt != SO_RCVLOWAT)
+        dst->filter = 0;    /* Will cause the kevent to be discarded */
+
+    return (0);
+}
+
+/*
+ * Copy out the regular files on the kf_ready list, after adding the ones
+ * that have grown. Each one that is still readable moves to the back of
+ * the list, so that all of them get a turn when the eventlist is too small.
+ */
+int
+evfilt_read_copyout_ready(struct filter *filt, struct kevent *eventlist,
+        int nevents)
+{
+    struct knote *kn;
+    int n, nret = 0;
+
+    if (filt->kf_inotifyfd >= 0)
+        regular_file_inotify(filt);
+
+    for (n = filt->kf_nready; n > 0 && nret < nevents; n--) {
+        kn = TAILQ_FIRST(&filt->kf_ready);
+        TAILQ_REMOVE(&filt->kf_ready, kn, kn_ready);
+        TAILQ_INSERT_TAIL(&filt->kf_ready, kn, kn_ready);
+
+        memcpy(&eventlist[nret], &kn->kev, sizeof(eventlist[nret]));
+        eventlist[nret].data = regular_file_data(kn);
+        if (eventlist[nret].data == 0) {
+            /* Nothing more to read, until the file grows */
+            regular_file_unready(filt, kn);
+            if (kn->kn_watch == NULL && regular_file_watch(filt, kn) == 0
+                    && regular_file_data(kn) > 0)
+                (void) regular_file_ready(filt, kn);
+            continue;
+        }
+
+        if (kn->kev.flags & EV_CLEAR) {
+            regular_file_unready(filt, kn);
+            (void) regular_file_watch(filt, kn);
+        }
+        if (kn->kev.flags & EV_DISPATCH)
+            knote_disable(filt, kn); //FIXME: Error checking
+        if (kn->kev.flags & EV_ONESHOT)
+            knote_delete(filt, kn); //FIXME: Error checking
+        nret++;
+    }
+
+    return (nret);
+}
+
+/*
+ * Accept connections on the listening socket of a NOTE_ACCEPT knote. Each
+ * new socket is non-blocking and close-on-exec, and is returned in the
+ * data field of its own kevent, after the template changes are applied.
+ * At most kev.data connections are accepted, if it is positive, and no
+ * more than are known to be waiting. Another process may take them first,
+ * or a connection may be aborted, so the listening socket must be
+ * non-blocking; see accept_check().
+ *
+ * Returns the number of kevents.
+ */
+int
+evfilt_read_accept(struct filter *filt, struct knote *kn,
+        struct kevent *eventlist, int nevents)
+{
+    struct kevent kev;
+    int i, fd, backlog, nret = 0;
+
+    if (kn->kev.data > 0 && kn->kev.data < nevents)
+        nevents = kn->kev.data;
+    backlog = get_accept_backlog(filt, kn);
+    if (backlog < 0)
+        backlog = 1;
+    if (backlog < nevents)
+        nevents = backlog;
+
+    while (nret < nevents) {
+        fd = accept4(kn->kev.ident, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        memcpy(&eventlist[nret], &kn->kev, sizeof(eventlist[nret]));
+        if (fd < 0) {
+            if (errno == EINTR)
+                continue;
+            /* The count of waiting connections is stale */
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNABORTED)
+                break;
+
+            /* e.g. EMFILE; the connection stays in the queue */
+            dbg_perror("accept4(2)");
+            eventlist[nret].flags |= EV_ERROR;
+            eventlist[nret].data = errno;
+            nret++;
+            break;
+        }
+        eventlist[nret].data = fd;
+
+        for (i = 0; i < kn->kn_naccept; i++) {
+            memcpy(&kev, &kn->kn_accept[i], sizeof(kev));
+            kev.ident = fd;
+            if (kevent_copyin_one(kn->kn_kq, &kev) == 0)
+                continue;
+
+            /* Undo the changes that were applied, and drop the connection */
+            eventlist[nret].flags |= EV_ERROR;
+            eventlist[nret].data = errno;
+            while (i-- > 0) {
+                memcpy(&kev, &kn->kn_accept[i], sizeof(kev));
+                kev.ident = fd;
+                kev.flags = EV_DELETE;
+                (void) kevent_copyin_one(kn->kn_kq, &kev);
+            }
+            (void) close(fd);
+            break;
+        }
+        nret++;
+    }
+
+    return (nret);
+}
+
+int VISIBLE
+kevent_accept_template(int kqfd, int ident, const struct kevent *changelist,
+        int nchanges)
+{
+    struct kevent *tmpl = NULL;
+    struct kqueue *kq;
+    struct filter *filt;
+    struct knote *kn;
+
+    kq = kqueue_lookup(kqfd);
+    if (kq == NULL) {
+        errno = ENOENT;
+        return (-1);
+    }
+    if (filter_lookup(&filt, kq, EVFILT_READ) < 0)
+        return (-1);
+    if (nchanges < 0) {
+        errno = EINVAL;
+        return (-1);
+    }
+    if (nchanges > 0) {
+        tmpl = malloc(nchanges * sizeof(*tmpl));
+        if (tmpl == NULL)
+            return (-1);
+        memcpy(tmpl, changelist, nchanges * sizeof(*tmpl));
+    }
+
+    kqueue_lock(kq);
+    kn = knote_lookup(filt, ident);
+    if (kn == NULL || !(kn->kn_flags & KNFL_PASSIVE_SOCKET)) {
+        kqueue_unlock(kq);
+        free(tmpl);
+        errno = (kn == NULL) ? ENOENT : EINVAL;
+        return (-1);
+    }
+    free(kn->kn_accept);
+    kn->kn_accept = tmpl;
+    kn->kn_naccept = nchanges;
+    kqueue_unlock(kq);
+
+    return (0);
+}
+
+/*
+ * NOTE_ACCEPT calls accept4(2) with the kqueue locked, so it is only allowed
+ * on a listening socket that is non-blocking.
+ */
+static int
+accept_check(struct knote *kn, unsigned int fflags)
+{
+    int flags;
+
+    if (!(fflags & NOTE_ACCEPT) || !(kn->kn_flags & KNFL_PASSIVE_SOCKET))
+        return (0);
+
+    flags = fcntl(kn->kev.ident, F_GETFL);
+    if (flags < 0) {
+        dbg_perror("fcntl(2)");
+        return (-1);
+    }
+    if (!(flags & O_NONBLOCK)) {
+        dbg_puts("NOTE_ACCEPT needs a non-blocking listening socket");
+        errno = EINVAL;
+        return (-1);
+    }
+
+    return (0);
+}
+
 int
 evfilt_read_knote_create(struct filter *filt, struct knote *kn)
 {
-    struct epoll_event ev;
+    struct stat sb;
+    int retried = 0;
 
     if (linux_get_descriptor_type(kn) < 0)
         return (-1);
 
+again:
+    /* Special case: regular files are readable without asking epoll */
+    if (kn->kn_flags & KNFL_REGULAR_FILE) {
+        /* The descriptor may have been reused since its type was found */
+        if (fstat(kn->kev.ident, &sb) < 0 || !S_ISREG(sb.st_mode))
+            goto errout;
+        kn->kn_size = sb.st_size;
+        if (regular_file_ready(filt, kn) < 0)
+            goto errout;
+        return (0);
+    }
+
+    if (accept_check(kn, kn->kev.fflags) < 0)
+        return (-1);
+
     /* Convert the kevent into an epoll_event */
 #if defined(HAVE_EPOLLRDHUP)
     kn->data.events = EPOLLIN | EPOLLRDHUP;
 #else
     kn->data.events = EPOLLIN;
 #endif
-    if (kn->kev.flags & EV_ONESHOT || kn->kev.flags & EV_DISPATCH)
-        kn->data.events |= EPOLLONESHOT;
-    if (kn->kev.flags & EV_CLEAR)
-        kn->data.events |= EPOLLET;
-
-    memset(&ev, 0, sizeof(ev));
-    ev.events = kn->data.events;
-    ev.data.ptr = kn;
-
-    /* Special case: for regular files, add a surrogate eventfd that is always readable */
-    if (kn->kn_flags & KNFL_REGULAR_FILE) {
-        int evfd;
+    linux_fd_state_lowat(kn);
+    linux_fd_state_mode(kn);
 
-        kn->kn_epollfd = filter_epfd(filt);
-        evfd = eventfd(0, 0);
-        if (evfd < 0) {
-            dbg_perror("eventfd(2)");
-            return (-1);
-        }
-        if (eventfd_write(evfd, 1) < 0) {
-            dbg_perror("eventfd_write(3)");
-            (void) close(evfd);
-            return (-1);
-        }
+    if (linux_fd_state_attach(filt, kn) < 0)
+        goto errout;
 
-        kn->kdata.kn_eventfd = evfd;
+    return (0);
 
-        if (epoll_ctl(kn->kn_epollfd, EPOLL_CTL_ADD, kn->kdata.kn_eventfd, &ev) < 0) {
-            dbg_printf("epoll_ctl(2): %s", strerror(errno));
+errout:
+    /* The cached type of the descriptor may be stale, so look it up once more */
+    if ((kn->kn_flags & KNFL_TYPE_CACHED) && !retried) {
+        retried = 1;
+        if (linux_reset_descriptor_type(kn) < 0)
             return (-1);
-        }
-        return (0);
+        goto again;
     }
-
-    return epoll_update(EPOLL_CTL_ADD, filt, kn, &ev);
+    return (-1);
 }
 
 int
 evfilt_read_knote_modify(struct filter *filt, struct knote *kn,
         const struct kevent *kev)
 {
-    (void) filt;
-    (void) kn;
-    (void) kev;
-    return (-1); /* STUB */
+    if (!(kn->kn_flags & KNFL_REGULAR_FILE)) {
+        if (accept_check(kn, kev->fflags) < 0)
+            return (-1);
+        return linux_fd_state_modify(kn, kev);
+    }
+
+    kn->kev.flags = (kn->kev.flags & ~(EV_ONESHOT | EV_CLEAR | EV_DISPATCH))
+        | (kev->flags & (EV_ONESHOT | EV_CLEAR | EV_DISPATCH));
+    kn->kev.fflags = kev->fflags;
+    kn->kev.data = kev->data;
+    kn->kn_size = 0;
+    if (kn->kev.flags & EV_DISABLE)
+        return (0);
+
+    return (regular_file_ready(filt, kn));
 }
 
 int
 evfilt_read_knote_delete(struct filter *filt, struct knote *kn)
 {
-    if (kn->kev.flags & EV_DISABLE)
+    if (kn->kn_flags & KNFL_REGULAR_FILE) {
+        regular_file_unready(filt, kn);
+        regular_file_unwatch(filt, kn);
         return (0);
-
-    if ((kn->kn_flags & KNFL_REGULAR_FILE) && (kn->kdata.kn_eventfd != -1)) {
-        if (epoll_ctl(kn->kn_epollfd, EPOLL_CTL_DEL, kn->kdata.kn_eventfd, NULL) < 0) {
-            dbg_perror("epoll_ctl(2)");
-            return (-1);
-        }
-        (void) close(kn->kdata.kn_eventfd);
-        kn->kdata.kn_eventfd = -1;
-    } else {
-        return epoll_update(EPOLL_CTL_DEL, filt, kn, NULL);
     }
 
-    // clang will complain about not returning a value otherwise
-    return (-1);
+    free(kn->kn_accept);
+    kn->kn_accept = NULL;
+    kn->kn_naccept = 0;
+    return linux_fd_state_detach(filt, kn);
 }
 
 int
 evfilt_read_knote_enable(struct filter *filt, struct knote *kn)
 {
-    struct epoll_event ev;
-
-    memset(&ev, 0, sizeof(ev));
-    ev.events = kn->data.events;
-    ev.data.ptr = kn;
-
     if (kn->kn_flags & KNFL_REGULAR_FILE) {
-        if (epoll_ctl(kn->kn_epollfd, EPOLL_CTL_ADD, kn->kdata.kn_eventfd, &ev) < 0) {
-            dbg_perror("epoll_ctl(2)");
-            return (-1);
-        }
-        return (0);
-    } else {
-        return epoll_update(EPOLL_CTL_ADD, filt, kn, &ev);
+        kn->kn_size = 0;
+        return (regular_file_ready(filt, kn));
     }
 
-    // clang will complain about not returning a value otherwise
-    return (-1);
+    return linux_fd_state_update(kn);
 }
 
 int
 evfilt_read_knote_disable(struct filter *filt, struct knote *kn)
 {
     if (kn->kn_flags & KNFL_REGULAR_FILE) {
-        if (epoll_ctl(kn->kn_epollfd, EPOLL_CTL_DEL, kn->kdata.kn_eventfd, NULL) < 0) {
-            dbg_perror("epoll_ctl(2)");
-            return (-1);
-        }
+        regular_file_unready(filt, kn);
         return (0);
-    } else {
-        return epoll_update(EPOLL_CTL_DEL, filt, kn, NULL);
+    }
+
+    return linux_fd_state_update(kn);
+}
+
+int
+evfilt_read_init(struct filter *filt)
+{
+    filt->kf_diagfd = -1;
+    filt->kf_efd.ef_id = -1;
+    TAILQ_INIT(&filt->kf_ready);
+    filt->kf_nready = 0;
+    filt->kf_inotifyfd = -1;
+    RB_INIT(&filt->kf_watches);
+    return (0);
+}
+
+void
+evfilt_read_destroy(struct filter *filt)
+{
+    struct file_watch *fw;
+
+    if (filt->kf_diagfd >= 0)
+        (void) close(filt->kf_diagfd);
+    filt->kf_diagfd = -1;
+    if (filt->kf_efd.ef_id >= 0)
+        kqops.eventfd_close(&filt->kf_efd);
+    if (filt->kf_inotifyfd >= 0)
+        (void) close(filt->kf_inotifyfd);
+    filt->kf_inotifyfd = -1;
+    while ((fw = RB_MIN(file_watches, &filt->kf_watches)) != NULL) {
+        RB_REMOVE(file_watches, &filt->kf_watches, fw);
+        free(fw);
     }
 }
 
 const struct filter evfilt_read = {
     EVFILT_READ,
-    NULL,
-    NULL,
+    evfilt_read_init,
+    evfilt_read_destroy,
     evfilt_read_copyout,
     evfilt_read_knote_create,
     evfilt_read_knote_modify,
     evfilt_read_knote_delete,
     evfilt_read_knote_enable,
     evfilt_read_knote_disable,
+    evfilt_read_knote_data,
 };
@@ -14,6 +14,8 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <sched.h>
+
 #include "private.h"
 
 #if HAVE_SYS_SIGNALFD_H
@@ -43,35 +45,225 @@ struct signalfd_siginfo
 };
 #endif
 
+/*
+ * The signal hub. All the signals watched by EVFILT_SIGNAL, in any kqueue
+ * of the process, go to a single signalfd, so that several kqueues can
+ * watch the same signal. Each signal has a counter of its deliveries, and
+ * each knote remembers the value of the counter when its kqueue last
+ * looked at it; the difference is the data of the kevent.
+ *
+ * The signalfd is in the epoll set of every kqueue that watches a signal,
+ * and whichever kqueue sees it first drains it with a single read(2). The
+ * kqueues that watch one of the signals that were read are then woken up
+ * through the eventfd of their filter, which is edge-triggered and never
+ * needs to be lowered. The kqueue adds up the new deliveries of each of
+ * its signals, and puts the knotes on the kf_ready list of the filter;
+ * the knotes that do not fit into the eventlist stay there, and the
+ * eventfd is raised again for the next call to kevent().
+ *
+ * Nothing is locked on the way from the signalfd to the kqueues. The
+ * counters are updated atomically, and the array of filters to wake up
+ * is replaced as a whole when a kqueue starts or stops watching signals;
+ * the old array is freed once no drain is reading it. The siginfo of the
+ * last delivery of each signal is stored under a sequence counter, which
+ * is odd while a drain is storing it: kevent_signal_info() reads it again
+ * if it changed in the meantime, and a drain that finds another one
+ * storing the same signal leaves the siginfo to it, so a drain never
+ * waits.
+ *
+ * A signal is blocked, in the thread that adds the first knote for it,
+ * and unblocked in that thread when the last knote is deleted, unless it
+ * was blocked already. The mask of a thread can only be changed by the
+ * thread itself, so if another thread deletes the last knote, no mask is
+ * changed, and the signal stays blocked in the first one; the knotes of a
+ * signal should be added and deleted in the same thread. Other threads
+ * must block the signal themselves, or it may run their handler instead
+ * of reaching the signalfd. Standard signals do not
+ * queue: a signal that is sent again before the signalfd is drained is
+ * only counted once. Real-time signals are counted exactly.
+ *
+ * Signals that arrive while a knote is disabled are discarded.
+ */
+
+#define SIGNALFD_BATCH 64
+
+/* The signals of a filter are bits of kf_signals */
+#define SIGNAL_BIT(signo)   ((uint64_t) 1 << ((signo) - 1))
+
+struct sighub_subs {
+    unsigned int    ss_count;
+    struct filter  *ss_filt[];
+};
+
+static pthread_mutex_t sighub_mtx = PTHREAD_MUTEX_INITIALIZER;
+static int sighub_fd = -1;
+static sigset_t sighub_mask;            /* Signals in the signalfd */
+static sigset_t sighub_blocked;         /* Signals blocked by the hub */
+static pthread_t sighub_blocker[NSIG];  /* Thread they were blocked in */
+static unsigned int sighub_refs[NSIG];  /* Knotes watching each signal */
+
+static volatile unsigned long sighub_count[NSIG];
+static volatile unsigned int sighub_seq[NSIG];  /* Odd while storing */
+static volatile struct kevent_siginfo sighub_info[NSIG];
+static struct sighub_subs * volatile sighub_subs;
+static volatile unsigned int sighub_readers;
+
+static int
+sighub_update(void)
+{
+    static int flags = SFD_NONBLOCK;
+    int sigfd;
+
+    sigfd = signalfd(sighub_fd, &sighub_mask, flags);
+
+    /* WORKAROUND: Flags are broken on kernels older than Linux 2.6.27 */
+    if (sigfd < 0 && errno == EINVAL && flags != 0) {
+        flags = 0;
+        sigfd = signalfd(sighub_fd, &sighub_mask, flags);
+    }
+    if (sigfd < 0) {
+        dbg_perror("signalfd(2)");
+        return (-1);
+    }
+    sighub_fd = sigfd;
+
+    return (0);
+}
+
+/* Wake up the other kqueues that watch one of the signals */
+static void
+sighub_wake(struct filter *self, uint64_t signals)
+{
+    struct sighub_subs *subs;
+    struct filter *filt;
+    unsigned int i;
+
+    atomic_inc(&sighub_readers);
+    subs = sighub_subs;
+    for (i = 0; subs != NULL && i < subs->ss_count; i++) {
+        filt = subs->ss_filt[i];
+        if (filt != self && (filt->kf_signals & signals))
+            (void) kqops.eventfd_raise(&filt->kf_efd);
+    }
+    atomic_dec(&sighub_readers);
+}
+
+/* Store the siginfo of the last delivery of a signal */
 static void
-signalfd_reset(int sigfd)
+sighub_info_store(int signo, const struct signalfd_siginfo *sig)
 {
-    struct signalfd_siginfo sig;
-    ssize_t n;
+    volatile struct kevent_siginfo *info = &sighub_info[signo];
+    unsigned int seq;
 
-    /* Discard any pending signal */
-    n = read(sigfd, &sig, sizeof(sig));
-    if (n < 0 || n != sizeof(sig)) {
-        if (errno == EWOULDBLOCK)
+    do {
+        seq = sighub_seq[signo];
+        if (seq & 1)
+            return;
+    } while (atomic_cas(&sighub_seq[signo], seq, seq + 1) != seq);
+
+    info->ksi_code = sig->ssi_code;
+    info->ksi_pid = sig->ssi_pid;
+    info->ksi_uid = sig->ssi_uid;
+    info->ksi_value = (intptr_t) sig->ssi_ptr;
+    atomic_inc(&sighub_seq[signo]);
+}
+
+/* Copy the siginfo of a signal, without holding up the drains */
+static void
+sighub_info_load(int signo, struct kevent_siginfo *dst)
+{
+    volatile struct kevent_siginfo *info = &sighub_info[signo];
+    unsigned int seq;
+
+    for (;;) {
+        seq = sighub_seq[signo];
+        __sync_synchronize();
+        dst->ksi_code = info->ksi_code;
+        dst->ksi_pid = info->ksi_pid;
+        dst->ksi_uid = info->ksi_uid;
+        dst->ksi_value = info->ksi_value;
+        __sync_synchronize();
+        if (!(seq & 1) && seq == sighub_seq[signo])
             return;
-        //FIXME: eintr?
-        dbg_perror("read(2) from signalfd");
-        abort();
     }
 }
 
+/*
+ * Read every pending signal, and count them. The kqueue of the filter
+ * that drains the signalfd in kevent() is not woken up; any other drain
+ * passes NULL.
+ */
+static void
+sighub_drain(struct filter *self)
+{
+    struct signalfd_siginfo sig[SIGNALFD_BATCH];
+    uint64_t signals;
+    int i, n, signo;
+    ssize_t len;
+
+    for (;;) {
+        len = read(sighub_fd, &sig, sizeof(sig));
+        if (len < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN)
+                dbg_perror("read(2) from signalfd");
+            return;
+        }
+
+        n = len / sizeof(sig[0]);
+        signals = 0;
+        for (i = 0; i < n; i++) {
+            signo = sig[i].ssi_signo;
+            if (signo <= 0 || signo >= NSIG)
+                continue;
+            sighub_info_store(signo, &sig[i]);
+            atomic_inc(&sighub_count[signo]);
+            signals |= SIGNAL_BIT(signo);
+        }
+        if (signals != 0)
+            sighub_wake(self, signals);
+
+        if (len < (ssize_t) sizeof(sig))
+            return;
+    }
+}
+
+/* Replace the array of filters to wake up, with or without one filter */
 static int
-signalfd_add(int epfd, int sigfd, void *ptr)
+sighub_subscribe(struct filter *filt, int add)
+{
+    struct sighub_subs *old = sighub_subs, *subs;
+    unsigned int i, n = 0, count = old ? old->ss_count : 0;
+
+    subs = malloc(sizeof(*subs) + (count + 1) * sizeof(subs->ss_filt[0]));
+    if (subs == NULL)
+        return (-1);
+    for (i = 0; i < count; i++) {
+        if (old->ss_filt[i] != filt)
+            subs->ss_filt[n++] = old->ss_filt[i];
+    }
+    if (add)
+        subs->ss_filt[n++] = filt;
+    subs->ss_count = n;
+
+    (void) atomic_ptr_cas(&sighub_subs, old, subs);
+    while (sighub_readers != 0)
+        sched_yield();
+    free(old);
+
+    return (0);
+}
+
+static int
+sighub_watch(struct filter *filt, int fd, uint32_t events)
 {
     struct epoll_event ev;
-    int rv;
 
-    /* Add the signalfd to the kqueue's epoll descriptor set */
     memset(&ev, 0, sizeof(ev));
-    ev.events = EPOLLIN;
-    ev.data.ptr = ptr;
-    rv = epoll_ctl(epfd, EPOLL_CTL_ADD, sigfd, &ev);
-    if (rv < 0) {
+    ev.events = events;
+    ev.data.ptr = filt;
+    if (epoll_ctl(filter_epfd(filt), EPOLL_CTL_ADD, fd, &ev) < 0) {
         dbg_perror("epoll_ctl(2)");
         return (-1);
     }
@@ -79,80 +271,228 @@ signalfd_add(int epfd, int sigfd, void *ptr)
     return (0);
 }
 
-static int
-signalfd_create(int epfd, void *ptr, int signum)
+/* Discard the instances of a signal that are pending for the thread */
+static void
+signal_discard(int signum)
 {
-    static int flags = SFD_NONBLOCK;
+    struct timespec ts = { 0, 0 };
     sigset_t sigmask;
-    int sigfd;
 
-    /* Create a signalfd */
     sigemptyset(&sigmask);
     sigaddset(&sigmask, signum);
-    sigfd = signalfd(-1, &sigmask, flags);
+    while (sigtimedwait(&sigmask, NULL, &ts) == signum)
+        ;
+}
 
-    /* WORKAROUND: Flags are broken on kernels older than Linux 2.6.27 */
-    if (sigfd < 0 && errno == EINVAL && flags != 0) {
-        flags = 0;
-        sigfd = signalfd(-1, &sigmask, flags);
+/* Stop watching a signal in any kqueue, and restore the signal mask */
+static void
+sighub_release(int signum)
+{
+    sigset_t sigmask;
+
+    sigdelset(&sighub_mask, signum);
+    if (sighub_fd >= 0)
+        (void) sighub_update();
+
+    if (sigismember(&sighub_blocked, signum)) {
+        sigdelset(&sighub_blocked, signum);
+        if (!pthread_equal(sighub_blocker[signum], pthread_self())) {
+            dbg_printf("signal %d stays blocked in the thread that added it",
+                    signum);
+            return;
+        }
+        sigemptyset(&sigmask);
+        sigaddset(&sigmask, signum);
+        if (pthread_sigmask(SIG_UNBLOCK, &sigmask, NULL) != 0)
+            dbg_perror("pthread_sigmask(3)");
     }
-    if (sigfd < 0) {
-        dbg_perror("signalfd(2)");
-        goto errout;
+}
+
+/* Start watching a signal, for the first time in this filter or not */
+static int
+sighub_add(struct filter *filt, int signum)
+{
+    sigset_t sigmask, omask;
+    int first = (filt->kf_signals == 0);
+
+    pthread_mutex_lock(&sighub_mtx);
+    if (sighub_refs[signum] == 0) {
+        /* Block the signal handler from being invoked */
+        sigemptyset(&sigmask);
+        sigaddset(&sigmask, signum);
+        if (pthread_sigmask(SIG_BLOCK, &sigmask, &omask) != 0) {
+            dbg_perror("pthread_sigmask(3)");
+            goto errout;
+        }
+        if (!sigismember(&omask, signum)) {
+            sigaddset(&sighub_blocked, signum);
+            sighub_blocker[signum] = pthread_self();
+        }
+
+        /* Signals that are already pending are not reported */
+        signal_discard(signum);
+
+        sigaddset(&sighub_mask, signum);
+        if (sighub_update() < 0) {
+            sigdelset(&sighub_mask, signum);
+            goto errout;
+        }
     }
 
-    /* Block the signal handler from being invoked */
-    if (sigprocmask(SIG_BLOCK, &sigmask, NULL) < 0) {
-        dbg_perror("sigprocmask(2)");
-        goto errout;
+    if (first) {
+        if (filt->kf_efd.ef_id < 0 && kqops.eventfd_init(&filt->kf_efd) < 0)
+            goto errout;
+        if (sighub_watch(filt, sighub_fd, EPOLLIN) < 0)
+            goto errout;
+        if (sighub_watch(filt, kqops.eventfd_descriptor(&filt->kf_efd),
+                    EPOLLIN | EPOLLET) < 0) {
+            (void) epoll_ctl(filter_epfd(filt), EPOLL_CTL_DEL, sighub_fd, NULL);
+            goto errout;
+        }
+        if (sighub_subscribe(filt, 1) < 0) {
+            (void) epoll_ctl(filter_epfd(filt), EPOLL_CTL_DEL, sighub_fd, NULL);
+            (void) epoll_ctl(filter_epfd(filt), EPOLL_CTL_DEL,
+                    kqops.eventfd_descriptor(&filt->kf_efd), NULL);
+            goto errout;
+        }
     }
+    filt->kf_signals |= SIGNAL_BIT(signum);
+    sighub_refs[signum]++;
+    pthread_mutex_unlock(&sighub_mtx);
 
-    signalfd_reset(sigfd);
+    return (0);
 
-    if (signalfd_add(epfd, sigfd, ptr) < 0)
-        goto errout;
+errout:
+    if (sighub_refs[signum] == 0)
+        sighub_release(signum);
+    pthread_mutex_unlock(&sighub_mtx);
+    return (-1);
+}
 
-    dbg_printf("added sigfd %d to epfd %d (signum=%d)", sigfd, epfd, signum);
+/* Stop watching a signal, for the last time in this filter or not */
+static void
+sighub_del(struct filter *filt, int signum)
+{
+    pthread_mutex_lock(&sighub_mtx);
+    filt->kf_signals &= ~SIGNAL_BIT(signum);
+    if (filt->kf_signals == 0) {
+        if (sighub_subscribe(filt, 0) < 0)
+            dbg_puts("unable to unsubscribe from the signal hub");
+        if (epoll_ctl(filter_epfd(filt), EPOLL_CTL_DEL, sighub_fd, NULL) < 0)
+            dbg_perror("epoll_ctl(2)");
+        if (epoll_ctl(filter_epfd(filt), EPOLL_CTL_DEL,
+                    kqops.eventfd_descriptor(&filt->kf_efd), NULL) < 0)
+            dbg_perror("epoll_ctl(2)");
+    }
 
-    return (sigfd);
+    /* The pending instances of the signal were meant for the knotes */
+    if (--sighub_refs[signum] == 0) {
+        sighub_drain(NULL);
+        sighub_release(signum);
+    }
+    pthread_mutex_unlock(&sighub_mtx);
+}
 
-errout:
-    (void) close(sigfd);
-    return (-1);
+static void
+signal_unready(struct filter *filt, struct knote *kn)
+{
+    if (kn->kn_nsignals == 0)
+        return;
+    kn->kn_nsignals = 0;
+    TAILQ_REMOVE(&filt->kf_ready, kn, kn_ready);
+    filt->kf_nready--;
 }
 
-int
-evfilt_signal_copyout(struct kevent *dst, struct knote *src, void *x UNUSED)
+/* Catch up with the deliveries of the signals of the filter */
+static void
+signal_update(struct filter *filt)
 {
-    int sigfd;
+    struct knote *kn;
+    unsigned long count;
+    uint64_t signals;
+    int signo;
+
+    for (signals = filt->kf_signals; signals != 0; signals &= signals - 1) {
+        signo = __builtin_ctzll(signals) + 1;
+        count = sighub_count[signo];
+        kn = knote_lookup(filt, signo);
+        if (kn == NULL || kn->kn_sigseen == count)
+            continue;
+
+        if (!(kn->kev.flags & EV_DISABLE)) {
+            if (kn->kn_nsignals == 0) {
+                TAILQ_INSERT_TAIL(&filt->kf_ready, kn, kn_ready);
+                filt->kf_nready++;
+            }
+            kn->kn_nsignals += count - kn->kn_sigseen;
+        }
+        kn->kn_sigseen = count;
+    }
+}
 
-    sigfd = src->kdata.kn_signalfd;
+/*
+ * Copy out the knotes on the kf_ready list, with the number of times that
+ * their signal was received, after draining the signalfd.
+ */
+int
+evfilt_signal_copyout_ready(struct filter *filt, struct kevent *eventlist,
+        int nevents)
+{
+    struct knote *kn;
+    int nret = 0;
+
+    sighub_drain(filt);
+    signal_update(filt);
+
+    while (nret < nevents && (kn = TAILQ_FIRST(&filt->kf_ready)) != NULL) {
+        memcpy(&eventlist[nret], &kn->kev, sizeof(eventlist[nret]));
+        eventlist[nret].data = kn->kn_nsignals;
+        signal_unready(filt, kn);
+
+        if (kn->kev.flags & EV_DISPATCH)
+            knote_disable(filt, kn); //FIXME: Error checking
+        else if (kn->kev.flags & EV_ONESHOT)
+            knote_delete(filt, kn); //FIXME: Error checking
+        nret++;
+    }
 
-    signalfd_reset(sigfd);
+    /* Come back for the others */
+    if (filt->kf_nready > 0 && kqops.eventfd_raise(&filt->kf_efd) < 0)
+        dbg_puts("unable to raise the signal eventfd");
 
-    memcpy(dst, &src->kev, sizeof(*dst));
-    /* NOTE: dst->data should be the number of times the signal occurred,
-       but that information is not available.
-     */
-    dst->data = 1;
+    return (nret);
+}
 
+/* Signals are copied out by evfilt_signal_copyout_ready() */
+int
+evfilt_signal_copyout(struct kevent *dst, struct knote *src UNUSED,
+        void *x UNUSED)
+{
+    memset(dst, 0, sizeof(*dst));
     return (0);
 }
 
 int
 evfilt_signal_knote_create(struct filter *filt, struct knote *kn)
 {
-    int fd;
+    int signum = kn->kev.ident;
 
-    fd = signalfd_create(filter_epfd(filt), kn, kn->kev.ident);
-    if (fd > 0) {
-        kn->kev.flags |= EV_CLEAR;
-        kn->kdata.kn_signalfd = fd;
-        return (0);
-    } else {
-        kn->kdata.kn_signalfd = -1;
+    /* MIPS has 127 signals, which do not all fit into kf_signals */
+    if (signum <= 0 || signum >= NSIG || signum > 64) {
+        errno = EINVAL;
         return (-1);
     }
+
+    if (sighub_add(filt, signum) < 0)
+        return (-1);
+
+    /* Only the signals that arrive from now on are reported */
+    sighub_drain(NULL);
+    kn->kev.flags |= EV_CLEAR;
+    kn->kn_nsignals = 0;
+    kn->kn_sigseen = sighub_count[signum];
+
+    return (0);
 }
 
 int
@@ -168,47 +508,83 @@ evfilt_signal_knote_modify(struct filter *filt UNUSED,
 int
 evfilt_signal_knote_delete(struct filter *filt, struct knote *kn)
 {
-    const int sigfd = kn->kdata.kn_signalfd;
-
-    /* Needed so that delete() can be called after disable() */
-    if (kn->kdata.kn_signalfd == -1)
-        return (0);
-
-    if (epoll_ctl(filter_epfd(filt), EPOLL_CTL_DEL, sigfd, NULL) < 0) {
-        dbg_perror("epoll_ctl(2)");
-        return (-1);
-    }
-
-    if (close(sigfd) < 0) {
-        dbg_perror("close(2)");
-        return (-1);
-    }
-
-    /* NOTE: This does not call sigprocmask(3) to unblock the signal. */
-    kn->kdata.kn_signalfd = -1;
-
+    signal_unready(filt, kn);
+    sighub_del(filt, kn->kev.ident);
     return (0);
 }
 
+/*
+ * The signal stays in the signalfd while the knote is disabled; the
+ * signals that arrive in the meantime are discarded.
+ */
 int
 evfilt_signal_knote_enable(struct filter *filt, struct knote *kn)
 {
     dbg_printf("enabling ident %u", (unsigned int) kn->kev.ident);
-    return evfilt_signal_knote_create(filt, kn);
+
+    /* Signals that arrived while the knote was disabled are not reported */
+    sighub_drain(NULL);
+    signal_unready(filt, kn);
+    kn->kn_sigseen = sighub_count[kn->kev.ident];
+
+    return (0);
 }
 
 int
 evfilt_signal_knote_disable(struct filter *filt, struct knote *kn)
 {
     dbg_printf("disabling ident %u", (unsigned int) kn->kev.ident);
-    return evfilt_signal_knote_delete(filt, kn);
+    signal_unready(filt, kn);
+    return (0);
 }
 
+int
+evfilt_signal_init(struct filter *filt)
+{
+    filt->kf_signals = 0;
+    filt->kf_efd.ef_id = -1;
+    TAILQ_INIT(&filt->kf_ready);
+    filt->kf_nready = 0;
+    return (0);
+}
+
+void
+evfilt_signal_destroy(struct filter *filt)
+{
+    if (filt->kf_efd.ef_id >= 0)
+        kqops.eventfd_close(&filt->kf_efd);
+}
+
+int VISIBLE
+kevent_signal_info(int kqfd, int signo, struct kevent_siginfo *info)
+{
+    struct kqueue *kq;
+    struct filter *filt;
+
+    kq = kqueue_lookup(kqfd);
+    if (kq == NULL) {
+        errno = ENOENT;
+        return (-1);
+    }
+    if (filter_lookup(&filt, kq, EVFILT_SIGNAL) < 0)
+        return (-1);
+
+    kqueue_lock(kq);
+    if (knote_lookup(filt, signo) == NULL) {
+        kqueue_unlock(kq);
+        errno = ENOENT;
+        return (-1);
+    }
+    sighub_info_load(signo, info);
+    kqueue_unlock(kq);
+
+    return (0);
+}
 
 const struct filter evfilt_signal = {
     EVFILT_SIGNAL,
-    NULL,
-    NULL,
+    evfilt_signal_init,
+    evfilt_signal_destroy,
     evfilt_signal_copyout,
     evfilt_signal_knote_create,
     evfilt_signal_knote_modify,
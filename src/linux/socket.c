@@ -0,0 +1,663 @@
+/*
+ * Copyright (c) 2026 libkqueue contributors
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * epoll allows a descriptor to be added to an epoll set only once, so the
+ * EVFILT_READ and EVFILT_WRITE knotes of a descriptor share a struct
+ * fd_state. It owns the registration, whose event mask is the union of
+ * the masks of its enabled knotes, and splits each epoll event into a
+ * READ and/or WRITE kevent on copyout.
+ *
+ * EPOLLET and EPOLLONESHOT apply to the whole registration. If the two
+ * knotes disagree, the registration uses the stronger mode and is re-armed
+ * with EPOLL_CTL_MOD after an event for the other knote is copied out.
+ * The re-arm reports every condition that is still true, so an EV_CLEAR
+ * knote paired with a level-triggered one may be reported more than once
+ * per edge; it is never reported less often.
+ *
+ * Enabling, disabling and modifying a knote cost at most one EPOLL_CTL_MOD,
+ * and none if the combined mask does not change. With NOTE_LAZYDISABLE,
+ * disabling a knote leaves the descriptor armed: its events are dropped
+ * on copyout, and only then is the mask narrowed.
+ *
+ * NOTE_LOWAT is checked on copyout. On TCP sockets, SO_RCVLOWAT makes the
+ * kernel apply the READ threshold itself, and TCP_NOTSENT_LOWAT holds back
+ * most WRITE wakeups. Elsewhere the knote is registered edge-triggered, so
+ * that a descriptor below the threshold does not wake the kqueue again
+ * until its state changes.
+ *
+ * A READ knote on a listening socket with NOTE_ACCEPT accepts the waiting
+ * connections itself on copyout, and returns one kevent per connection.
+ * The socket must be non-blocking, or the knote is rejected with EINVAL.
+ *
+ * With NOTE_EXCLUSIVE, the registration uses EPOLLEXCLUSIVE, so that a
+ * descriptor watched by many kqueues wakes up only some of them. Such a
+ * registration cannot be modified: it is removed and added again instead,
+ * which makes enabling, disabling and re-arming it cost two syscalls.
+ * EV_ONESHOT and EV_DISPATCH knotes are removed from the epoll set after
+ * their event is copied out, and EOF is only detected through EPOLLIN.
+ *
+ * A knote with an idle timeout, set by kevent_idle_timeout(), has a timer
+ * in the timer queue of the kqueue. Copying out an event only records the
+ * time; the timer is pushed back to the new deadline when it expires, and
+ * reports an EVFILT_TIMER kevent with NOTE_IDLE if the knote has been
+ * quiet for the whole timeout.
+ */
+
+#include <limits.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "private.h"
+
+#include "alloc.h"
+
+/* The number of free fd_state objects that each thread keeps for reuse */
+#define FD_STATE_CACHE_SIZE 1024
+
+#define FDS_READ    0
+#define FDS_WRITE   1
+
+/* Events that only concern one of the knotes */
+#if defined(HAVE_EPOLLRDHUP)
+# define FDS_READ_ONLY      (EPOLLIN | EPOLLRDHUP)
+#else
+# define FDS_READ_ONLY      (EPOLLIN)
+#endif
+#define FDS_WRITE_ONLY      (EPOLLOUT)
+
+static struct fd_state *
+fd_state_new(void)
+{
+    /* The cache is per-thread, so initialize it on first use */
+    if (slowpath(_ma.ac_cache == NULL)
+            && mem_init(sizeof(struct fd_state), FD_STATE_CACHE_SIZE) < 0)
+        return (NULL);
+
+    return (mem_calloc());
+}
+
+static inline struct filter *
+fd_state_filter(struct knote *kn)
+{
+    return (&kn->kn_kq->kq_filt[~(kn->kev.filter)]);
+}
+
+static inline int
+fd_state_ident(struct fd_state *fds)
+{
+    return ((fds->fds_read != NULL) ? fds->fds_read->kev.ident
+                                    : fds->fds_write->kev.ident);
+}
+
+static void
+fd_state_pending_clear(struct kqueue *kq, struct fd_state *fds, int dir)
+{
+    if (fds->fds_pending[dir] == 0)
+        return;
+    fds->fds_pending[dir] = 0;
+    if (fds->fds_pending[!dir] == 0) {
+        TAILQ_REMOVE(&kq->kq_fds_pending, fds, fds_entries);
+        kq->kq_npending--;
+    }
+}
+
+static void
+fd_state_pending_set(struct kqueue *kq, struct fd_state *fds, int dir,
+        uint32_t events)
+{
+    if (fds->fds_pending[FDS_READ] == 0 && fds->fds_pending[FDS_WRITE] == 0) {
+        TAILQ_INSERT_TAIL(&kq->kq_fds_pending, fds, fds_entries);
+        kq->kq_npending++;
+    }
+    fds->fds_pending[dir] |= events;
+}
+
+/* The combined event mask of the enabled knotes */
+static uint32_t
+fd_state_events(struct fd_state *fds)
+{
+    struct knote *kn[2] = { fds->fds_read, fds->fds_write };
+    uint32_t events = 0;
+    int i, exclusive = 0;
+
+    for (i = 0; i < 2; i++) {
+        if (kn[i] != NULL && !(kn[i]->kev.flags & EV_DISABLE)) {
+            events |= kn[i]->data.events;
+            if (kn[i]->kev.fflags & NOTE_EXCLUSIVE)
+                exclusive = 1;
+        }
+    }
+
+#if defined(EPOLLEXCLUSIVE)
+    /* EPOLLONESHOT and EPOLLRDHUP are not allowed with EPOLLEXCLUSIVE */
+    if (exclusive)
+        events = (events & (EPOLLIN | EPOLLOUT | EPOLLET)) | EPOLLEXCLUSIVE;
+#else
+    (void) exclusive;
+#endif
+
+    return (events);
+}
+
+#if defined(EPOLLEXCLUSIVE)
+/*
+ * The kernel only accepts EPOLLEXCLUSIVE with EPOLL_CTL_ADD, so an
+ * exclusive registration is replaced rather than modified, and removed
+ * rather than disarmed.
+ */
+static int
+fd_state_sync_exclusive(struct kqueue *kq, struct fd_state *fds, int fd,
+        uint32_t events)
+{
+    struct epoll_event ev;
+
+    if (fds->fds_registered) {
+        dbg_printf("op=%d fd=%d", EPOLL_CTL_DEL, fd);
+        if (epoll_ctl(kqueue_epfd(kq), EPOLL_CTL_DEL, fd, NULL) < 0
+                && errno != ENOENT) {
+            dbg_printf("epoll_ctl(2): %s", strerror(errno));
+            return (-1);
+        }
+        fds->fds_registered = 0;
+        fds->fds_events = 0;
+    }
+    if (events == 0)
+        return (0);
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = (void *) ((uintptr_t) fds | EPOLL_FDS_TAG);
+
+    dbg_printf("op=%d fd=%d events=%s", EPOLL_CTL_ADD, fd, epoll_event_dump(&ev));
+    if (epoll_ctl(kqueue_epfd(kq), EPOLL_CTL_ADD, fd, &ev) < 0) {
+        dbg_printf("epoll_ctl(2): %s", strerror(errno));
+        return (-1);
+    }
+    fds->fds_registered = 1;
+    fds->fds_events = events;
+
+    return (0);
+}
+#endif
+
+/* Bring the epoll registration in line with the knotes */
+static int
+fd_state_sync(struct kqueue *kq, struct fd_state *fds, int fd)
+{
+    struct epoll_event ev;
+    uint32_t events;
+    int op;
+
+    events = fd_state_events(fds);
+    if (events == fds->fds_events)
+        return (0);
+
+#if defined(EPOLLEXCLUSIVE)
+    if ((events | fds->fds_events) & EPOLLEXCLUSIVE)
+        return (fd_state_sync_exclusive(kq, fds, fd, events));
+#endif
+
+    if (events == 0) {
+        /* Nothing to do if the registration is already disarmed */
+        if (!fds->fds_registered || (fds->fds_events & ~(EPOLLONESHOT | EPOLLET)) == 0)
+            return (0);
+
+        /*
+         * Keep the descriptor in the epoll set, so that enabling a knote
+         * is a single EPOLL_CTL_MOD. EPOLLHUP and EPOLLERR cannot be
+         * masked, so at most one of them is reported and dropped.
+         */
+        events = EPOLLONESHOT;
+        op = EPOLL_CTL_MOD;
+    } else {
+        op = fds->fds_registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = (void *) ((uintptr_t) fds | EPOLL_FDS_TAG);
+
+    dbg_printf("op=%d fd=%d events=%s", op, fd, epoll_event_dump(&ev));
+    if (epoll_ctl(kqueue_epfd(kq), op, fd, &ev) < 0) {
+        /* Closing the descriptor removed it from the epoll set */
+        if (!(op == EPOLL_CTL_MOD && errno == ENOENT)
+                || epoll_ctl(kqueue_epfd(kq), EPOLL_CTL_ADD, fd, &ev) < 0) {
+            dbg_printf("epoll_ctl(2): %s", strerror(errno));
+            return (-1);
+        }
+
+        /* The number may now belong to another descriptor */
+        linux_forget_descriptor_type(fd);
+    }
+    fds->fds_registered = 1;
+    fds->fds_events = events;
+
+    return (0);
+}
+
+/* Set the socket option that applies the NOTE_LOWAT threshold */
+static int
+fd_state_lowat_setsockopt(struct knote *kn, int opt, int value)
+{
+    int level = (opt == SO_RCVLOWAT) ? SOL_SOCKET : IPPROTO_TCP;
+
+    if (setsockopt(kn->kev.ident, level, opt, &value, sizeof(value)) < 0) {
+        dbg_perror("setsockopt(2)");
+        return (-1);
+    }
+
+    return (0);
+}
+
+/* Remove the socket option set for NOTE_LOWAT */
+static void
+fd_state_lowat_clear(struct knote *kn)
+{
+    /* Restore the defaults; zero means the sysctl value for TCP_NOTSENT_LOWAT */
+    if (kn->kn_lowat_opt != 0)
+        (void) fd_state_lowat_setsockopt(kn, kn->kn_lowat_opt,
+                (kn->kn_lowat_opt == SO_RCVLOWAT) ? 1 : 0);
+    kn->kn_lowat_opt = 0;
+}
+
+/*
+ * Apply the NOTE_LOWAT threshold of a knote, which is in its data field.
+ * A WRITE knote must have its buffer size set.
+ */
+void
+linux_fd_state_lowat(struct knote *kn)
+{
+    socklen_t slen;
+    int opt, proto, value;
+
+    fd_state_lowat_clear(kn);
+    kn->kn_lowat = 0;
+    if (!(kn->kev.fflags & NOTE_LOWAT) || kn->kev.data <= 1)
+        return;
+
+    /*
+     * Reading from a pipe only wakes up a writer if the pipe was full,
+     * so a WRITE knote below the threshold could wait forever.
+     */
+    if (kn->kev.filter == EVFILT_WRITE && !(kn->kn_flags & KNFL_SOCKET))
+        return;
+    kn->kn_lowat = (kn->kev.data > INT_MAX) ? INT_MAX : kn->kev.data;
+
+    if (!(kn->kn_flags & KNFL_SOCKET) || (kn->kn_flags & KNFL_PASSIVE_SOCKET))
+        return;
+    slen = sizeof(proto);
+    if (getsockopt(kn->kev.ident, SOL_SOCKET, SO_PROTOCOL, &proto, &slen) < 0
+            || proto != IPPROTO_TCP)
+        return;
+
+    if (kn->kev.filter == EVFILT_READ) {
+        opt = SO_RCVLOWAT;
+        value = kn->kn_lowat;
+    } else {
+#if defined(TCP_NOTSENT_LOWAT)
+        /* Wake up once the unsent data would leave enough space */
+        opt = TCP_NOTSENT_LOWAT;
+        value = (kn->kn_bufsz > kn->kn_lowat) ? kn->kn_bufsz - kn->kn_lowat : 1;
+#else
+        return;
+#endif
+    }
+    if (fd_state_lowat_setsockopt(kn, opt, value) == 0)
+        kn->kn_lowat_opt = opt;
+}
+
+/* Set the EPOLLONESHOT and EPOLLET bits of a knote from its flags */
+void
+linux_fd_state_mode(struct knote *kn)
+{
+    kn->data.events &= ~(EPOLLONESHOT | EPOLLET);
+    if (kn->kev.flags & EV_ONESHOT || kn->kev.flags & EV_DISPATCH)
+        kn->data.events |= EPOLLONESHOT;
+    if (kn->kev.flags & EV_CLEAR)
+        kn->data.events |= EPOLLET;
+
+    /*
+     * Only SO_RCVLOWAT is exact; otherwise some events are dropped. Those
+     * knotes cannot be EPOLLONESHOT, as re-arming one that is below the
+     * threshold would report it again at once.
+     */
+    if (kn->kn_lowat > 0 && kn->kn_lowat_opt != SO_RCVLOWAT)
+        kn->data.events = (kn->data.events & ~EPOLLONESHOT) | EPOLLET;
+}
+
+/*
+ * Add a READ or WRITE knote to the fd_state of its descriptor, creating
+ * the fd_state if the descriptor has no knote of the other filter.
+ */
+int
+linux_fd_state_attach(struct filter *filt, struct knote *kn)
+{
+    struct kqueue *kq = filt->kf_kqueue;
+    struct fd_state *fds = NULL;
+    struct knote *peer;
+    short other;
+
+    other = (kn->kev.filter == EVFILT_READ) ? EVFILT_WRITE : EVFILT_READ;
+    peer = knote_lookup(&kq->kq_filt[~other], kn->kev.ident);
+    if (peer != NULL)
+        fds = peer->kn_fds;
+    if (fds == NULL) {
+        fds = fd_state_new();
+        if (fds == NULL)
+            return (-1);
+    }
+
+    if (kn->kev.filter == EVFILT_READ)
+        fds->fds_read = kn;
+    else
+        fds->fds_write = kn;
+    kn->kn_fds = fds;
+
+    if (fd_state_sync(kq, fds, kn->kev.ident) < 0) {
+        (void) linux_fd_state_detach(filt, kn);
+        return (-1);
+    }
+
+    return (0);
+}
+
+/* Remove a knote from its fd_state, and free the fd_state if it is unused */
+int
+linux_fd_state_detach(struct filter *filt, struct knote *kn)
+{
+    struct kqueue *kq = filt->kf_kqueue;
+    struct fd_state *fds = kn->kn_fds;
+    int dir, rv;
+
+    if (fds == NULL)
+        return (0);
+
+    fd_state_lowat_clear(kn);
+    linux_timerq_remove(kq, &kn->kn_timer);
+    kn->kn_idle_timeout = 0;
+
+    dir = (kn->kev.filter == EVFILT_READ) ? FDS_READ : FDS_WRITE;
+    fd_state_pending_clear(kq, fds, dir);
+    if (dir == FDS_READ)
+        fds->fds_read = NULL;
+    else
+        fds->fds_write = NULL;
+    kn->kn_fds = NULL;
+
+    if (fds->fds_read != NULL || fds->fds_write != NULL)
+        return (fd_state_sync(kq, fds, kn->kev.ident));
+
+    rv = 0;
+    if (fds->fds_registered) {
+        if (epoll_ctl(kqueue_epfd(kq), EPOLL_CTL_DEL, kn->kev.ident, NULL) < 0) {
+            dbg_printf("epoll_ctl(2): %s", strerror(errno));
+            rv = -1;
+        }
+        fds->fds_registered = 0;
+    }
+    if (!fds->fds_busy)
+        mem_free(fds);
+
+    return (rv);
+}
+
+/* Update the registration after a knote is enabled or disabled */
+int
+linux_fd_state_update(struct knote *kn)
+{
+    struct fd_state *fds = kn->kn_fds;
+
+    if (kn->kev.fflags & NOTE_LAZYDISABLE) {
+        if (kn->kev.flags & EV_DISABLE)
+            return (0);
+
+        /* An edge that came while disabled is only reported after a re-arm */
+        if (kn->data.events & EPOLLET)
+            fds->fds_events = 0;
+    }
+
+    return (fd_state_sync(kn->kn_kq, fds, kn->kev.ident));
+}
+
+/* Apply the flags of an EV_ADD on an existing knote */
+int
+linux_fd_state_modify(struct knote *kn, const struct kevent *kev)
+{
+    const unsigned short mode = EV_ONESHOT | EV_CLEAR | EV_DISPATCH;
+
+    kn->kev.flags = (kn->kev.flags & ~mode) | (kev->flags & mode);
+    kn->kev.fflags = kev->fflags;
+    kn->kev.data = kev->data;
+    linux_fd_state_lowat(kn);
+    linux_fd_state_mode(kn);
+
+    /* The new flags or threshold may apply to an edge already seen */
+    if ((kn->data.events & EPOLLET) && !(kn->kev.flags & EV_DISABLE))
+        kn->kn_fds->fds_events = 0;
+
+    return (fd_state_sync(kn->kn_kq, kn->kn_fds, kn->kev.ident));
+}
+
+/*
+ * Copy out the READ and WRITE kevents for the given events, handling
+ * EV_DISPATCH and EV_ONESHOT. Returns the number of kevents.
+ */
+static int
+fd_state_report(struct kqueue *kq, struct fd_state *fds, uint32_t revents[2],
+        struct kevent *eventlist, int nevents)
+{
+    struct knote *kn[2] = { fds->fds_read, fds->fds_write };
+    struct epoll_event ev;
+    struct filter *filt;
+    int i, n, fd, nret = 0, rearm = 0;
+
+    fd = fd_state_ident(fds);
+    fds->fds_busy = 1;
+    for (i = 0; i < 2; i++) {
+        if (revents[i] == 0 || kn[i] == NULL || (kn[i]->kev.flags & EV_DISABLE))
+            continue;
+        if (nret == nevents) {
+            fd_state_pending_set(kq, fds, i, revents[i]);
+            continue;
+        }
+
+        filt = fd_state_filter(kn[i]);
+        if (i == FDS_READ && (kn[i]->kev.fflags & NOTE_ACCEPT)
+                && (kn[i]->kn_flags & KNFL_PASSIVE_SOCKET)) {
+            n = evfilt_read_accept(filt, kn[i], &eventlist[nret], nevents - nret);
+            if (n == 0)
+                continue;
+            nret += n;
+
+            /* There may be more connections than there was room for */
+            if (fds->fds_events & EPOLLET)
+                rearm = 1;
+        } else {
+            ev.events = revents[i];
+            ev.data.ptr = kn[i];
+            if (filt->kf_copyout(&eventlist[nret], kn[i], &ev) < 0) {
+                dbg_puts("knote_copyout failed");
+                continue;
+            }
+
+            /* Below the NOTE_LOWAT threshold */
+            if (eventlist[nret].filter == 0)
+                continue;
+            nret++;
+        }
+
+        /* The idle timer is pushed back when it expires */
+        if (kn[i]->kn_idle_timeout != 0)
+            kn[i]->kn_idle_last = linux_timerq_now(TIMERQ_MONOTONIC);
+
+        if (eventlist[nret - 1].flags & EV_DISPATCH) {
+            knote_disable(filt, kn[i]); //FIXME: Error checking
+        } else if (eventlist[nret - 1].flags & EV_ONESHOT) {
+            knote_delete(filt, kn[i]); //FIXME: Error checking
+        } else if ((fds->fds_events & EPOLLET) && !(kn[i]->kev.flags & EV_CLEAR)) {
+            /* A level-triggered knote must be reported again */
+            rearm = 1;
+        }
+    }
+    fds->fds_busy = 0;
+
+    if (fds->fds_read == NULL && fds->fds_write == NULL) {
+        /* Both knotes were deleted */
+        mem_free(fds);
+        return (nret);
+    }
+    if (rearm)
+        fds->fds_events = 0;
+    if (fd_state_sync(kq, fds, fd) < 0)
+        dbg_puts("unable to re-arm the descriptor");
+
+    return (nret);
+}
+
+/* Split an epoll event into READ and WRITE kevents */
+int
+linux_fd_state_copyout(struct kqueue *kq, struct fd_state *fds,
+        uint32_t events, struct kevent *eventlist, int nevents)
+{
+    uint32_t revents[2];
+
+    /* The kernel disarmed the registration */
+    if (fds->fds_events & EPOLLONESHOT)
+        fds->fds_events = 0;
+
+    /* EPOLLHUP and EPOLLERR are reported to both knotes */
+    revents[FDS_READ] = events & ~FDS_WRITE_ONLY;
+    revents[FDS_WRITE] = events & ~FDS_READ_ONLY;
+
+    return (fd_state_report(kq, fds, revents, eventlist, nevents));
+}
+
+/* Copy out the events that did not fit in the eventlist last time */
+int
+linux_fd_state_copyout_pending(struct kqueue *kq, struct kevent *eventlist,
+        int nevents)
+{
+    struct fd_state *fds;
+    uint32_t revents[2];
+    int nret = 0;
+
+    while (nret < nevents && (fds = TAILQ_FIRST(&kq->kq_fds_pending)) != NULL) {
+        revents[FDS_READ] = fds->fds_pending[FDS_READ];
+        revents[FDS_WRITE] = fds->fds_pending[FDS_WRITE];
+        fd_state_pending_clear(kq, fds, FDS_READ);
+        fd_state_pending_clear(kq, fds, FDS_WRITE);
+        nret += fd_state_report(kq, fds, revents, &eventlist[nret],
+                nevents - nret);
+    }
+
+    return (nret);
+}
+
+/* The end of an idle timeout, which saturates rather than wrap */
+static uint64_t
+idle_deadline(uint64_t last, uint64_t timeout)
+{
+    return ((last > UINT64_MAX - timeout) ? UINT64_MAX : last + timeout);
+}
+
+/* The idle timer of a knote has expired */
+static int
+fd_state_idle_expire(struct kqueue *kq, struct ktimer *kt, uint64_t now,
+        struct kevent *dst)
+{
+    struct knote *kn;
+    uint64_t deadline;
+
+    kn = (struct knote *) ((char *) kt - offsetof(struct knote, kn_timer));
+    deadline = idle_deadline(kn->kn_idle_last, kn->kn_idle_timeout);
+    if (deadline > now) {
+        /* The knote has fired since the timer was set */
+        if (linux_timerq_insert(kq, kt, deadline) < 0)
+            dbg_puts("unable to set the idle timer");
+        return (0);
+    }
+
+    /* On return, data contains the number of timeouts that have passed */
+    memset(dst, 0, sizeof(*dst));
+    dst->ident = kn->kev.ident;
+    dst->filter = EVFILT_TIMER;
+    dst->flags = EV_CLEAR;
+    dst->fflags = NOTE_IDLE;
+    dst->data = 1 + (now - deadline) / kn->kn_idle_timeout;
+    dst->udata = kn->kev.udata;
+
+    kn->kn_idle_last = now;
+    if (linux_timerq_insert(kq, kt, idle_deadline(now, kn->kn_idle_timeout)) < 0)
+        dbg_puts("unable to set the idle timer");
+
+    return (1);
+}
+
+int VISIBLE
+kevent_idle_timeout(int kqfd, int ident, short filter, intptr_t timeout)
+{
+    struct kqueue *kq;
+    struct filter *filt;
+    struct knote *kn;
+    struct kevent kev;
+    uint64_t now, ns;
+    int rv = 0;
+
+    kq = kqueue_lookup(kqfd);
+    if (kq == NULL) {
+        errno = ENOENT;
+        return (-1);
+    }
+    if ((filter != EVFILT_READ && filter != EVFILT_WRITE) || timeout < 0) {
+        errno = EINVAL;
+        return (-1);
+    }
+    if (filter_lookup(&filt, kq, filter) < 0)
+        return (-1);
+
+    /* In milliseconds, as the data of a timer, and saturated in the same way */
+    memset(&kev, 0, sizeof(kev));
+    kev.data = timeout;
+    if (timer_interval(&kev, &ns) < 0)
+        return (-1);
+
+    kqueue_lock(kq);
+    kn = knote_lookup(filt, ident);
+    if (kn == NULL || kn->kn_fds == NULL) {
+        /* Regular files are always readable, so they are never idle */
+        kqueue_unlock(kq);
+        errno = (kn == NULL) ? ENOENT : EINVAL;
+        return (-1);
+    }
+
+    linux_timerq_remove(kq, &kn->kn_timer);
+    kn->kn_idle_timeout = ns;
+    if (timeout > 0) {
+        now = linux_timerq_now(TIMERQ_MONOTONIC);
+        kn->kn_idle_last = now;
+        kn->kn_timer.kt_expire = fd_state_idle_expire;
+        rv = linux_timerq_insert(kq, &kn->kn_timer, idle_deadline(now, ns));
+        if (rv < 0)
+            kn->kn_idle_timeout = 0;
+    }
+    kqueue_unlock(kq);
+
+    return (rv);
+}
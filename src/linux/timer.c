@@ -14,6 +14,8 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <stddef.h>
+
 #include "private.h"
 
 #ifndef HAVE_SYS_TIMERFD_H
@@ -43,6 +45,10 @@
 #define SYS_timerfd_gettime (SYS_timerfd_create + 2)
 #endif
 
+#ifndef TFD_NONBLOCK
+#define TFD_NONBLOCK 04000
+#endif
+
 int timerfd_create(int clockid, int flags)
 {
   return syscall(SYS_timerfd_create, clockid, flags);
@@ -61,68 +67,144 @@ int timerfd_gettime(int ufc, struct itimerspec *otmr)
 
 #endif
 
-#ifndef NDEBUG
-static char *
-itimerspec_dump(struct itimerspec *ts)
+/*
+ * Timers do not have a timerfd of their own: they are kept in the timer
+ * queue of the kqueue (see timerq.c), which multiplexes all of them onto
+ * a single timerfd. Creating, deleting, enabling and disabling a timer
+ * makes no system calls, unless it becomes the next one to expire.
+ *
+ * The data is in milliseconds, unless fflags has NOTE_SECONDS,
+ * NOTE_USECONDS or NOTE_NSECONDS. Timers run on CLOCK_MONOTONIC, or on
+ * CLOCK_BOOTTIME with NOTE_BOOTTIME. With NOTE_ABSTIME, the data is a
+ * time on CLOCK_REALTIME (or CLOCK_BOOTTIME) and the timer fires once.
+ *
+ * With NOTE_PROCESS_CPUTIME or NOTE_THREAD_CPUTIME, the timer counts CPU
+ * time instead, and is a POSIX timer of its own, which takes SIGRTMAX
+ * (see cputimer.c).
+ *
+ * kevent_timer_leeway() lets a timer expire late, by up to its leeway, in
+ * the same unit as its data. The timer queue uses it to handle timers with
+ * nearby deadlines in a single wakeup. Darwin passes the leeway of
+ * NOTE_LEEWAY in the ext field of a kevent64, which struct kevent lacks.
+ *
+ * If a timerfd cannot be created, as under a seccomp policy that does not
+ * allow it, or if KQUEUE_POSIX_TIMER is set in the environment, the filter
+ * takes the timers of posix/timer.c instead, which only need a thread.
+ * They have no leeway and no CPU-time clocks.
+ */
+
+#define NOTE_TIMER_CPUTIME \
+    (NOTE_PROCESS_CPUTIME | NOTE_THREAD_CPUTIME)
+
+#define timer_knote(kt) \
+    ((struct knote *) ((char *) (kt) - offsetof(struct knote, kn_timer)))
+
+static pthread_once_t timer_once = PTHREAD_ONCE_INIT;
+static int timer_posix;
+
+static void
+timer_probe(void)
 {
-    static __thread char buf[1024];
+    int fd;
 
-    snprintf(buf, sizeof(buf),
-            "itimer: [ interval=%lu s %lu ns, next expire=%lu s %lu ns ]",
-            ts->it_interval.tv_sec,
-            ts->it_interval.tv_nsec,
-            ts->it_value.tv_sec,
-            ts->it_value.tv_nsec
-           );
+    if (getenv("KQUEUE_POSIX_TIMER") != NULL) {
+        timer_posix = 1;
+        return;
+    }
 
-    return (buf);
+    fd = timerfd_create(CLOCK_MONOTONIC, 0);
+    if (fd < 0) {
+        dbg_perror("timerfd_create(2)");
+        timer_posix = 1;
+        return;
+    }
+    (void) close(fd);
 }
-#endif
 
-/* Convert milliseconds into seconds+nanoseconds */
-static void
-convert_msec_to_itimerspec(struct itimerspec *dst, int src, int oneshot)
+/* The timer of a knote has expired */
+static int
+timer_expire(struct kqueue *kq, struct ktimer *kt, uint64_t now,
+        struct kevent *dst)
+{
+    struct knote *kn = timer_knote(kt);
+    struct filter *filt = &kq->kq_filt[~EVFILT_TIMER];
+    uint64_t expired = 1;
+
+    /*
+     * On return, data contains the number of times the timer has expired
+     * since it was last reported. The next deadline stays on the period
+     * of the first one, however late this expiration is handled.
+     */
+    if (kn->kn_period != 0) {
+        expired += (now - kt->kt_deadline) / kn->kn_period;
+        if (linux_timerq_insert(kq, kt, kt->kt_deadline + expired * kn->kn_period) < 0)
+            dbg_puts("unable to re-arm the timer");
+    }
+
+    memcpy(dst, &kn->kev, sizeof(*dst));
+    dst->data = expired;
+
+    if (kn->kev.flags & EV_DISPATCH)
+        knote_disable(filt, kn); //FIXME: Error checking
+    else if (kn->kev.flags & EV_ONESHOT)
+        knote_delete(filt, kn); //FIXME: Error checking
+
+    return (1);
+}
+
+/*
+ * Start the timer, with its first expiration one period from now, or at
+ * the absolute time.
+ */
+static int
+timer_arm(struct filter *filt, struct knote *kn)
 {
-    time_t sec, nsec;
+    struct ktimer *kt = &kn->kn_timer;
+    uint64_t interval, deadline;
 
-    sec = src / 1000;
-    nsec = (src % 1000) * 1000000;
+    if (timer_interval(&kn->kev, &interval) < 0)
+        return (-1);
+
+    if (kn->kev.fflags & NOTE_TIMER_CPUTIME) {
+        kn->kn_period = (kn->kev.flags & EV_ONESHOT) ? 0 : interval;
+        if (kn->kev.fflags & NOTE_ABSTIME)
+            kn->kn_period = 0;
+        return (linux_cputimer_arm(kn, interval, kn->kn_period,
+                    kn->kev.fflags & NOTE_ABSTIME));
+    }
 
-    /* Set the interval */
-    if (oneshot) {
-        dst->it_interval.tv_sec = 0;
-        dst->it_interval.tv_nsec = 0;
+    linux_timerq_remove(filt->kf_kqueue, kt);
+    if (kn->kev.fflags & NOTE_BOOTTIME)
+        kt->kt_clock = TIMERQ_BOOTTIME;
+    else if (kn->kev.fflags & NOTE_ABSTIME)
+        kt->kt_clock = TIMERQ_REALTIME;
+    else
+        kt->kt_clock = TIMERQ_MONOTONIC;
+    kt->kt_expire = timer_expire;
+
+    if (kn->kev.fflags & NOTE_ABSTIME) {
+        deadline = interval;
+        kn->kn_period = 0;
     } else {
-        dst->it_interval.tv_sec = sec;
-        dst->it_interval.tv_nsec = nsec;
+        deadline = linux_timerq_now(kt->kt_clock) + interval;
+        kn->kn_period = (kn->kev.flags & EV_ONESHOT) ? 0 : interval;
     }
 
-    /* Set the initial expiration */
-    dst->it_value.tv_sec = sec;
-    dst->it_value.tv_nsec = nsec;
-    dbg_printf("%s", itimerspec_dump(dst));
+    return (linux_timerq_insert(filt->kf_kqueue, kt, deadline));
 }
 
+/*
+ * Timers are copied out by timer_expire(), through the timer queue, and
+ * CPU-time timers through their eventfd.
+ */
 int
-evfilt_timer_copyout(struct kevent *dst, struct knote *src, void *ptr)
+evfilt_timer_copyout(struct kevent *dst, struct knote *src, void *ptr UNUSED)
 {
-    struct epoll_event * const ev = (struct epoll_event *) ptr;
-    uint64_t expired;
-    ssize_t n;
+    if (src->kev.fflags & NOTE_TIMER_CPUTIME)
+        return (linux_cputimer_copyout(dst, src));
 
     memcpy(dst, &src->kev, sizeof(*dst));
-    if (ev->events & EPOLLERR)
-        dst->fflags = 1; /* FIXME: Return the actual timer error */
-
-    /* On return, data contains the number of times the
-       timer has been trigered.
-     */
-    n = read(src->data.pfd, &expired, sizeof(expired));
-    if (n != sizeof(expired)) {
-        dbg_puts("invalid read from timerfd");
-        expired = 1;  /* Fail gracefully */
-    }
-    dst->data = expired;
+    dst->data = 1;
 
     return (0);
 }
@@ -130,89 +212,167 @@ evfilt_timer_copyout(struct kevent *dst, struct knote *src, void *ptr)
 int
 evfilt_timer_knote_create(struct filter *filt, struct knote *kn)
 {
-    struct epoll_event ev;
-    struct itimerspec ts;
-    int tfd;
-
+    timer_kevent_set(kn, &kn->kev);
     kn->kev.flags |= EV_CLEAR;
 
-    tfd = timerfd_create(CLOCK_MONOTONIC, 0);
-    if (tfd < 0) {
-        dbg_printf("timerfd_create(2): %s", strerror(errno));
-        return (-1);
+    if (kn->kev.fflags & NOTE_TIMER_CPUTIME) {
+        if ((kn->kev.fflags & NOTE_TIMER_CPUTIME) == NOTE_TIMER_CPUTIME) {
+            errno = EINVAL;
+            return (-1);
+        }
+        if (linux_cputimer_create(filt, kn) < 0)
+            return (-1);
+        if (timer_arm(filt, kn) < 0) {
+            (void) linux_cputimer_delete(filt, kn);
+            return (-1);
+        }
+        return (0);
     }
-    dbg_printf("created timerfd %d", tfd);
 
-    convert_msec_to_itimerspec(&ts, kn->kev.data, kn->kev.flags & EV_ONESHOT);
-    if (timerfd_settime(tfd, 0, &ts, NULL) < 0) {
-        dbg_printf("timerfd_settime(2): %s", strerror(errno));
-        close(tfd);
-        return (-1);
-    }
+    return timer_arm(filt, kn);
+}
+
+/*
+ * EV_ADD on an existing timer restarts it with the new period or deadline,
+ * by moving it in the timer queue. The expirations that were not reported
+ * are discarded. A disabled timer starts when it is enabled. If the new
+ * values are invalid, the timer is left as it was.
+ */
+int
+evfilt_timer_knote_modify(struct filter *filt, struct knote *kn,
+        const struct kevent *kev)
+{
+    uint64_t interval;
 
-    memset(&ev, 0, sizeof(ev));
-    ev.events = EPOLLIN | EPOLLET;
-    if (kn->kev.flags & (EV_ONESHOT | EV_DISPATCH))
-        ev.events |= EPOLLONESHOT;
+    if (!(kev->flags & EV_ADD))
+        return (0);
+    if (timer_interval(kev, &interval) < 0)
+        return (-1);
 
-    ev.data.ptr = kn;
-    if (epoll_ctl(filter_epfd(filt), EPOLL_CTL_ADD, tfd, &ev) < 0) {
-        dbg_printf("epoll_ctl(2): %d", errno);
-        close(tfd);
+    /* The clock of a CPU-time timer is chosen when it is created */
+    if ((kev->fflags & NOTE_TIMER_CPUTIME) != (kn->kev.fflags & NOTE_TIMER_CPUTIME)) {
+        errno = EINVAL;
         return (-1);
     }
 
-    kn->data.pfd = tfd;
+    timer_kevent_set(kn, kev);
+    if (kn->kev.flags & EV_DISABLE)
+        return (0);
+
+    return timer_arm(filt, kn);
+}
+
+int
+evfilt_timer_knote_delete(struct filter *filt, struct knote *kn)
+{
+    if (kn->kev.fflags & NOTE_TIMER_CPUTIME)
+        return (linux_cputimer_delete(filt, kn));
+
+    linux_timerq_remove(filt->kf_kqueue, &kn->kn_timer);
     return (0);
 }
 
 int
-evfilt_timer_knote_modify(struct filter *filt, struct knote *kn,
-        const struct kevent *kev)
+evfilt_timer_knote_enable(struct filter *filt, struct knote *kn)
 {
-    (void)filt;
-    (void)kn;
-    (void)kev;
-    return (0); /* STUB */
+    if ((kn->kev.fflags & NOTE_TIMER_CPUTIME) && linux_cputimer_enable(filt, kn) < 0)
+        return (-1);
+
+    return timer_arm(filt, kn);
 }
 
+/* Disabling the timer also discards any expirations that were not reported */
 int
-evfilt_timer_knote_delete(struct filter *filt, struct knote *kn)
+evfilt_timer_knote_disable(struct filter *filt, struct knote *kn)
 {
-    int rv = 0;
+    if (kn->kev.fflags & NOTE_TIMER_CPUTIME)
+        return (linux_cputimer_disable(filt, kn));
 
-    if (kn->data.pfd == -1)
-        return (0);
+    linux_timerq_remove(filt->kf_kqueue, &kn->kn_timer);
+    return (0);
+}
+
+int VISIBLE
+kevent_timer_leeway(int kqfd, int ident, intptr_t leeway)
+{
+    struct kqueue *kq;
+    struct filter *filt;
+    struct knote *kn;
+    struct kevent kev;
+    uint64_t ns;
+    int rv;
+
+    kq = kqueue_lookup(kqfd);
+    if (kq == NULL) {
+        errno = ENOENT;
+        return (-1);
+    }
+    if (filter_lookup(&filt, kq, EVFILT_TIMER) < 0)
+        return (-1);
+    if (timer_posix) {
+        errno = ENOTSUP;
+        return (-1);
+    }
 
-    if (epoll_ctl(filter_epfd(filt), EPOLL_CTL_DEL, kn->data.pfd, NULL) < 0) {
-        dbg_printf("epoll_ctl(2): %s", strerror(errno));
-        rv = -1;
+    kqueue_lock(kq);
+    kn = knote_lookup(filt, ident);
+    if (kn == NULL) {
+        kqueue_unlock(kq);
+        errno = ENOENT;
+        return (-1);
     }
-    if (close(kn->data.pfd) < 0) {
-        dbg_printf("close(2): %s", strerror(errno));
-        rv = -1;
+
+    /* The leeway is in the unit of the timer */
+    memcpy(&kev, &kn->kev, sizeof(kev));
+    kev.data = leeway;
+    if (timer_interval(&kev, &ns) < 0) {
+        kqueue_unlock(kq);
+        return (-1);
     }
 
-    kn->data.pfd = -1;
+    rv = linux_timerq_leeway(kq, &kn->kn_timer, ns);
+    kqueue_unlock(kq);
+
     return (rv);
 }
 
-int
-evfilt_timer_knote_enable(struct filter *filt, struct knote *kn)
+/* Replace the filter with the one of posix/timer.c, if need be */
+static int
+evfilt_timer_init(struct filter *filt)
 {
-    return evfilt_timer_knote_create(filt, kn);
+    (void) pthread_once(&timer_once, timer_probe);
+    if (!timer_posix)
+        return (0);
+
+    dbg_puts("using the POSIX timer service");
+    filt->kf_init = posix_evfilt_timer.kf_init;
+    filt->kf_copyout = posix_evfilt_timer.kf_copyout;
+    filt->kn_create = posix_evfilt_timer.kn_create;
+    filt->kn_modify = posix_evfilt_timer.kn_modify;
+    filt->kn_delete = posix_evfilt_timer.kn_delete;
+    filt->kn_enable = posix_evfilt_timer.kn_enable;
+    filt->kn_disable = posix_evfilt_timer.kn_disable;
+
+    return (filt->kf_init(filt));
 }
 
-int
-evfilt_timer_knote_disable(struct filter *filt, struct knote *kn)
+/*
+ * The timer queues belong to the kqueue, and also hold the idle timeouts
+ * of EVFILT_READ and EVFILT_WRITE, so they are released even when the
+ * POSIX timer service replaced the filter.
+ */
+static void
+evfilt_timer_destroy(struct filter *filt)
 {
-    return evfilt_timer_knote_delete(filt, kn);
+    if (timer_posix && posix_evfilt_timer.kf_destroy != NULL)
+        posix_evfilt_timer.kf_destroy(filt);
+    linux_timerq_destroy(filt->kf_kqueue);
 }
 
 const struct filter evfilt_timer = {
     EVFILT_TIMER,
-    NULL,
-    NULL,
+    evfilt_timer_init,
+    evfilt_timer_destroy,
     evfilt_timer_copyout,
     evfilt_timer_knote_create,
     evfilt_timer_knote_modify,
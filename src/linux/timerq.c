@@ -0,0 +1,471 @@
+/*
+ * Copyright (c) 2026 libkqueue contributors
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * The timer queue of a kqueue holds deadlines that do not need a timerfd
+ * of their own. A single timerfd, registered in the epoll set, is armed
+ * for the next deadline; when it fires, the expired timers are removed
+ * from the queue and their expire callbacks produce the kevents.
+ *
+ * Time is divided into ticks of 2^20 ns (about 1 ms), and the timers are
+ * kept on a hierarchical timing wheel of TIMERQ_LEVELS levels with 64
+ * slots each. A timer that expires within 64 ticks goes into a slot of
+ * level 0, one that expires within 64^2 ticks into a slot of level 1, and
+ * so on. Inserting and removing a timer is a list operation. When the
+ * wheel reaches the first tick of a slot on a higher level, the slot is
+ * cascaded: its timers are inserted again, into lower levels. A bitmap
+ * of the non-empty slots of each level gives the next tick at which
+ * anything happens without walking the slots.
+ *
+ * Timers in the slot of the current tick are moved into a binary
+ * min-heap, so that they expire at their exact deadline rather than at
+ * the end of the tick. The heap only holds the timers of a tick or two.
+ *
+ * The timerfd is only re-armed when the next deadline moves earlier, or
+ * after the expired timers have been handled. Removing a timer leaves it
+ * armed, at the cost of an occasional wakeup with nothing to report.
+ *
+ * Each clock has a queue of its own. The CLOCK_REALTIME timerfd is armed
+ * with TFD_TIMER_CANCEL_ON_SET: when the clock is set, the wheel no longer
+ * matches the time, and it is rebuilt around the new one.
+ *
+ * A timer with a leeway may expire at any time from its deadline to its
+ * deadline plus the leeway. The queue is ordered by the latest time, and
+ * the timerfd is armed for the earliest of them; when it fires, every
+ * timer whose deadline has passed expires with it, as long as it comes
+ * before the first one that is not due yet. Timers whose windows overlap
+ * thus share a single wakeup. To find them, the wheel is moved forward by
+ * the largest leeway in the queue, rather than only to the current time.
+ */
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "private.h"
+
+#ifndef TFD_TIMER_CANCEL_ON_SET
+#define TFD_TIMER_CANCEL_ON_SET (1 << 1)
+#endif
+
+#define TICK_SHIFT      20
+#define SLOT_BITS       6
+#define SLOTS           (1 << SLOT_BITS)
+
+/* The first tick of the slot of a level that a tick falls into */
+#define level_shift(l)  ((l) * SLOT_BITS)
+#define slot_index(t, l) (((t) >> level_shift(l)) & (SLOTS - 1))
+
+static const clockid_t timerq_clockid[TIMERQ_NCLOCKS] = {
+    CLOCK_MONOTONIC,
+    CLOCK_BOOTTIME,
+    CLOCK_REALTIME,
+};
+
+/* A time plus a leeway, which saturates rather than wrap */
+static uint64_t
+timerq_latest(uint64_t t, uint64_t leeway)
+{
+    return ((t > UINT64_MAX - leeway) ? UINT64_MAX : t + leeway);
+}
+
+/* The time on a clock of the timer queue, in nanoseconds */
+uint64_t
+linux_timerq_now(int clock)
+{
+    struct timespec ts;
+
+    clock_gettime(timerq_clockid[clock], &ts);
+    return ((uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+/* Put a timer that expires in a tick after tq_tick on the wheel */
+static void
+timerq_wheel_insert(struct timerq *tq, struct ktimer *kt)
+{
+    uint64_t tick = kt->kt_latest >> TICK_SHIFT;
+    uint64_t delta = tick - tq->tq_tick;
+    unsigned int level, slot;
+
+    for (level = 0; level < TIMERQ_LEVELS - 1; level++) {
+        if (delta < ((uint64_t) SLOTS << level_shift(level)))
+            break;
+    }
+
+    /* Beyond the last level, the timer is cascaded until it is in range */
+    if (delta >= ((uint64_t) SLOTS << level_shift(level)))
+        tick = tq->tq_tick + ((uint64_t) SLOTS << level_shift(level)) - 1;
+
+    slot = level * SLOTS + slot_index(tick, level);
+    LIST_INSERT_HEAD(&tq->tq_wheel[slot], kt, kt_entries);
+    kt->kt_slot = slot + 1;
+    tq->tq_map[level] |= (uint64_t) 1 << (slot % SLOTS);
+}
+
+static void
+timerq_wheel_remove(struct timerq *tq, struct ktimer *kt)
+{
+    unsigned int slot = kt->kt_slot - 1;
+
+    LIST_REMOVE(kt, kt_entries);
+    kt->kt_slot = 0;
+    if (LIST_EMPTY(&tq->tq_wheel[slot]))
+        tq->tq_map[slot / SLOTS] &= ~((uint64_t) 1 << (slot % SLOTS));
+}
+
+/*
+ * The first tick, at or after the given one, at which a slot is cascaded
+ * or moved into the heap. Each level is a ring: a slot that comes before
+ * the current position is reached after the next wrap.
+ */
+static uint64_t
+timerq_wheel_next(const struct timerq *tq, uint64_t tick)
+{
+    uint64_t next = UINT64_MAX, pos, map, t;
+    unsigned int level, i;
+
+    for (level = 0; level < TIMERQ_LEVELS; level++) {
+        map = tq->tq_map[level];
+        if (map == 0)
+            continue;
+        pos = (tick + ((uint64_t) 1 << level_shift(level)) - 1) >> level_shift(level);
+        i = pos & (SLOTS - 1);
+        map = (map >> i) | (i ? map << (SLOTS - i) : 0);
+        t = (pos + __builtin_ctzll(map)) << level_shift(level);
+        if (t < next)
+            next = t;
+    }
+
+    return (next);
+}
+
+/*
+ * Move the wheel forward to the given tick: the slots of the ticks up to
+ * and including it are cascaded, and their timers moved into the heap.
+ */
+static int
+timerq_advance(struct timerq *tq, uint64_t now)
+{
+    struct ktimer_list *list;
+    struct ktimer *kt;
+    uint64_t tick;
+    int level;
+
+    while (tq->tq_tick <= now) {
+        tick = timerq_wheel_next(tq, tq->tq_tick);
+        if (tick > now) {
+            tq->tq_tick = now + 1;
+            break;
+        }
+        tq->tq_tick = tick;
+
+        for (level = TIMERQ_LEVELS - 1; level >= 0; level--) {
+            if (tick & (((uint64_t) 1 << level_shift(level)) - 1))
+                continue;
+            list = &tq->tq_wheel[level * SLOTS + slot_index(tick, level)];
+            while ((kt = LIST_FIRST(list)) != NULL) {
+                timerq_wheel_remove(tq, kt);
+                if (level > 0 && (kt->kt_latest >> TICK_SHIFT) > tick) {
+                    timerq_wheel_insert(tq, kt);
+                } else if (timer_heap_insert(&tq->tq_heap, &kt->kt_node) < 0) {
+                    /* Try again on the next wakeup */
+                    timerq_wheel_insert(tq, kt);
+                    return (-1);
+                }
+            }
+        }
+        tq->tq_tick = tick + 1;
+    }
+
+    return (0);
+}
+
+/*
+ * Arm the timerfd for the next deadline, if it is not already. A slot of
+ * level 0 that comes up before the earliest timer in the heap is moved
+ * into the heap ahead of time, so that the timerfd fires at the deadline
+ * of its first timer rather than at the start of its tick. Slots further
+ * out are cascaded when their tick comes.
+ */
+static int
+timerq_arm(struct timerq *tq)
+{
+    struct itimerspec its;
+    struct timer_node *tn;
+    uint64_t deadline, tick;
+    int flags;
+
+    for (;;) {
+        deadline = UINT64_MAX;
+        if ((tn = timer_heap_first(&tq->tq_heap)) != NULL)
+            deadline = tn->tn_key;
+        tick = timerq_wheel_next(tq, tq->tq_tick);
+        if (tick == UINT64_MAX || (tick << TICK_SHIFT) >= deadline)
+            break;
+        if (tick - tq->tq_tick >= SLOTS || timerq_advance(tq, tick) < 0) {
+            deadline = tick << TICK_SHIFT;
+            break;
+        }
+    }
+    if (deadline == UINT64_MAX || deadline == tq->tq_armed)
+        return (0);
+
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = deadline / 1000000000;
+    its.it_value.tv_nsec = deadline % 1000000000;
+    flags = TFD_TIMER_ABSTIME;
+    if (tq->tq_clock == TIMERQ_REALTIME)
+        flags |= TFD_TIMER_CANCEL_ON_SET;
+    if (timerfd_settime(tq->tq_fd, flags, &its, NULL) < 0) {
+        dbg_perror("timerfd_settime(2)");
+        return (-1);
+    }
+    tq->tq_armed = deadline;
+
+    return (0);
+}
+
+/*
+ * Put every timer back in the place it belongs at the current time: the
+ * timers that are due in the current tick, or overdue, in the heap, and
+ * the others on the wheel.
+ */
+static void
+timerq_rebuild(struct timerq *tq)
+{
+    struct ktimer *kt;
+    unsigned int i, n;
+
+    /* Make room for every timer in the heap */
+    n = tq->tq_heap.th_count;
+    for (i = 0; i < TIMERQ_LEVELS * SLOTS; i++) {
+        LIST_FOREACH(kt, &tq->tq_wheel[i], kt_entries)
+            n++;
+    }
+    /* The wheel is still correct, only slower to catch up */
+    if (timer_heap_reserve(&tq->tq_heap, n) < 0)
+        return;
+    for (i = 0; i < TIMERQ_LEVELS * SLOTS; i++) {
+        while ((kt = LIST_FIRST(&tq->tq_wheel[i])) != NULL) {
+            timerq_wheel_remove(tq, kt);
+            (void) timer_heap_insert(&tq->tq_heap, &kt->kt_node);
+        }
+    }
+
+    /*
+     * The timers are taken from the front of the heap as it is refilled
+     * from the front, which never overtakes them.
+     */
+    tq->tq_tick = (linux_timerq_now(tq->tq_clock) >> TICK_SHIFT) + 1;
+    tq->tq_heap.th_count = 0;
+    for (i = 0; i < n; i++) {
+        kt = ktimer_of(tq->tq_heap.th_nodes[i]);
+        kt->kt_node.tn_index = 0;
+        if ((kt->kt_latest >> TICK_SHIFT) < tq->tq_tick)
+            (void) timer_heap_insert(&tq->tq_heap, &kt->kt_node);
+        else
+            timerq_wheel_insert(tq, kt);
+    }
+}
+
+/* Create the timerfd on first use, and add it to the epoll set */
+static int
+timerq_init(struct kqueue *kq, struct timerq *tq)
+{
+    struct epoll_event ev;
+    unsigned int i;
+
+    tq->tq_wheel = malloc(TIMERQ_LEVELS * SLOTS * sizeof(*tq->tq_wheel));
+    if (tq->tq_wheel == NULL)
+        goto errout;
+    for (i = 0; i < TIMERQ_LEVELS * SLOTS; i++)
+        LIST_INIT(&tq->tq_wheel[i]);
+    tq->tq_tick = linux_timerq_now(tq->tq_clock) >> TICK_SHIFT;
+
+    tq->tq_fd = timerfd_create(timerq_clockid[tq->tq_clock], TFD_NONBLOCK);
+    if (tq->tq_fd < 0) {
+        dbg_perror("timerfd_create(2)");
+        goto errout;
+    }
+
+    /*
+     * Edge-triggered, so that the timerfd need not be read: arming it
+     * again clears it, and each expiration is a new edge.
+     */
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = tq;
+    if (epoll_ctl(kqueue_epfd(kq), EPOLL_CTL_ADD, tq->tq_fd, &ev) < 0) {
+        dbg_perror("epoll_ctl(2)");
+        (void) close(tq->tq_fd);
+        tq->tq_fd = -1;
+        goto errout;
+    }
+
+    return (0);
+
+errout:
+    free(tq->tq_wheel);
+    tq->tq_wheel = NULL;
+    return (-1);
+}
+
+/*
+ * Add a timer that expires at the given deadline, on its clock. The timer
+ * must not be queued, and kt_clock, kt_leeway and kt_expire must be set.
+ */
+int
+linux_timerq_insert(struct kqueue *kq, struct ktimer *kt, uint64_t deadline)
+{
+    struct timerq *tq = &kq->kq_timerq[kt->kt_clock];
+    uint64_t tick;
+
+    if (tq->tq_fd < 0 && timerq_init(kq, tq) < 0)
+        return (-1);
+
+    /*
+     * Bring the wheel up to date first; otherwise a timer could be put on
+     * a higher level than it needs, and cost an extra wakeup to cascade.
+     */
+    if (timerq_advance(tq, linux_timerq_now(tq->tq_clock) >> TICK_SHIFT) < 0)
+        return (-1);
+
+    kt->kt_deadline = deadline;
+    kt->kt_latest = timerq_latest(deadline, kt->kt_leeway);
+    if (kt->kt_leeway > tq->tq_leeway)
+        tq->tq_leeway = kt->kt_leeway;
+
+    deadline = kt->kt_latest;
+    tick = deadline >> TICK_SHIFT;
+    if (tick < tq->tq_tick) {
+        if (timer_heap_insert(&tq->tq_heap, &kt->kt_node) < 0)
+            return (-1);
+    } else {
+        timerq_wheel_insert(tq, kt);
+        deadline = timerq_wheel_next(tq, tq->tq_tick) << TICK_SHIFT;
+    }
+
+    /* Only an earlier deadline needs the timerfd to be re-armed */
+    if (tq->tq_armed == 0 || deadline < tq->tq_armed)
+        return (timerq_arm(tq));
+
+    return (0);
+}
+
+/* Remove a timer from the queue, if it is queued */
+void
+linux_timerq_remove(struct kqueue *kq, struct ktimer *kt)
+{
+    struct timerq *tq = &kq->kq_timerq[kt->kt_clock];
+
+    if (kt->kt_slot != 0)
+        timerq_wheel_remove(tq, kt);
+    else if (kt->kt_node.tn_index != 0)
+        timer_heap_remove(&tq->tq_heap, &kt->kt_node);
+}
+
+/*
+ * Close the timerfds of a kqueue and free its wheels and heaps. The timers
+ * that are still queued are simply forgotten.
+ */
+void
+linux_timerq_destroy(struct kqueue *kq)
+{
+    struct timerq *tq;
+    int i;
+
+    for (i = 0; i < TIMERQ_NCLOCKS; i++) {
+        tq = &kq->kq_timerq[i];
+        if (tq->tq_fd >= 0) {
+            if (epoll_ctl(kqueue_epfd(kq), EPOLL_CTL_DEL, tq->tq_fd, NULL) < 0)
+                dbg_perror("epoll_ctl(2)");
+            (void) close(tq->tq_fd);
+            tq->tq_fd = -1;
+        }
+        free(tq->tq_wheel);
+        tq->tq_wheel = NULL;
+        free(tq->tq_heap.th_nodes);
+        memset(&tq->tq_heap, 0, sizeof(tq->tq_heap));
+        memset(tq->tq_map, 0, sizeof(tq->tq_map));
+        tq->tq_armed = 0;
+        tq->tq_leeway = 0;
+    }
+}
+
+/*
+ * Change the leeway of a timer, and move it if it is queued. If the
+ * timerfd is armed for its old latest time, it is armed again, rather
+ * than fire then for a timer that can now wait.
+ */
+int
+linux_timerq_leeway(struct kqueue *kq, struct ktimer *kt, uint64_t leeway)
+{
+    struct timerq *tq = &kq->kq_timerq[kt->kt_clock];
+
+    kt->kt_leeway = leeway;
+    if (kt->kt_slot == 0 && kt->kt_node.tn_index == 0)
+        return (0);
+
+    linux_timerq_remove(kq, kt);
+    if (tq->tq_armed == kt->kt_latest)
+        tq->tq_armed = 0;
+
+    return (linux_timerq_insert(kq, kt, kt->kt_deadline));
+}
+
+/*
+ * Handle the timers that have expired, and return the number of kevents
+ * that their callbacks produced. Those that do not fit are left in the
+ * queue, and the timerfd fires again at once. A timer that has reached its
+ * deadline but not its latest time is handled now, unless a timer that is
+ * not due yet comes before it.
+ */
+int
+linux_timerq_copyout(struct kqueue *kq, struct timerq *tq,
+        struct kevent *eventlist, int nevents)
+{
+    struct timer_node *tn;
+    struct ktimer *kt;
+    uint64_t now, expired;
+    int nret = 0;
+
+    /* The timerfd has fired, and is armed again below */
+    tq->tq_armed = 0;
+
+    /* Only reading the timerfd tells whether the clock has been set */
+    if (tq->tq_clock == TIMERQ_REALTIME &&
+            read(tq->tq_fd, &expired, sizeof(expired)) < 0 && errno == ECANCELED) {
+        dbg_puts("the realtime clock has been set");
+        timerq_rebuild(tq);
+    }
+
+    now = linux_timerq_now(tq->tq_clock);
+    if (timerq_advance(tq, timerq_latest(now, tq->tq_leeway) >> TICK_SHIFT) < 0)
+        dbg_puts("unable to advance the timer queue");
+    while (nret < nevents && (tn = timer_heap_first(&tq->tq_heap)) != NULL) {
+        kt = ktimer_of(tn);
+        if (kt->kt_deadline > now)
+            break;
+        timer_heap_remove(&tq->tq_heap, tn);
+        nret += kt->kt_expire(kq, kt, now, &eventlist[nret]);
+    }
+
+    if (timerq_arm(tq) < 0)
+        dbg_puts("unable to arm the timer queue");
+
+    return (nret);
+}
@@ -125,6 +125,10 @@ linux_evfilt_user_knote_create(struct filter *filt, struct knote *kn)
         dbg_perror("eventfd");
         goto errout;
     }
+    if (fcntl(evfd, F_SETFL, O_NONBLOCK) < 0) {
+        dbg_perror("fcntl");
+        goto errout;
+    }
 
     /* Add the eventfd to the epoll set */
     memset(&ev, 0, sizeof(ev));
@@ -203,18 +207,23 @@ linux_evfilt_user_knote_delete(struct filter *filt, struct knote *kn)
     return (0);
 }
 
+/*
+ * The eventfd stays registered while the knote is disabled. Triggers
+ * are ignored in that state (see knote_modify), so it is enough to
+ * clear the current level.
+ */
 int
-linux_evfilt_user_knote_enable(struct filter *filt, struct knote *kn)
+linux_evfilt_user_knote_enable(struct filter *filt UNUSED, struct knote *kn UNUSED)
 {
     /* FIXME: what happens if NOTE_TRIGGER is in fflags?
        should the event fire? */
-    return linux_evfilt_user_knote_create(filt, kn);
+    return (0);
 }
 
 int
-linux_evfilt_user_knote_disable(struct filter *filt, struct knote *kn)
+linux_evfilt_user_knote_disable(struct filter *filt UNUSED, struct knote *kn)
 {
-    return linux_evfilt_user_knote_delete(filt, kn);
+    return eventfd_lower(kn->kdata.kn_eventfd);
 }
 
 const struct filter evfilt_user = {
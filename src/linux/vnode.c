@@ -59,47 +59,25 @@ inotify_event_dump(struct inotify_event *evt)
 #endif /* !NDEBUG */
 
 
-/* TODO: USE this to get events with name field */
-int
-get_one_event(struct inotify_event *dst, int inofd)
-{
-    ssize_t n;
-
-    dbg_puts("reading one inotify event");
-    for (;;) {
-        n = read(inofd, dst, sizeof(*dst));
-        if (n < 0) {
-            if (errno == EINTR)
-                continue;
-            dbg_perror("read");
-            return (-1);
-        } else {
-            break;
-        }
-    }
-    dbg_printf("read(2) from inotify wd: %ld bytes", (long) n);
-
-    /* FIXME-TODO: if len > 0, read(len) */
-    if (dst->len != 0)
-        abort();
-
-
-    return (0);
-}
+/*
+ * All the knotes of a filter share its inotify instance, which is in the
+ * epoll set of the kqueue. The knotes on the same file share one watch,
+ * whose mask is the union of theirs. The changes seen on a file are added
+ * to the kn_vnode_fflags of its knotes, which wait on the kf_ready list of
+ * the filter until they are copied out, like the regular files of
+ * EVFILT_READ. The eventfd of the filter is readable while the list is not
+ * empty, so the knotes that did not fit in an eventlist are not lost.
+ *
+ * The changes seen while a knote is disabled are discarded.
+ */
 
-static int
-add_watch(struct filter *filt, struct knote *kn)
+/* Convert the fflags to the inotify mask */
+static uint32_t
+vnode_mask(const struct knote *kn)
 {
-    struct epoll_event ev;
-    int ifd;
-    char path[PATH_MAX];
     uint32_t mask;
 
-    /* Convert the fd to a pathname */
-    if (linux_fd_to_path(&path[0], sizeof(path), kn->kev.ident) < 0)
-        return (-1);
-
-    /* Convert the fflags to the inotify mask */
+    /* To notice that the descriptor is closed */
     mask = IN_CLOSE;
     if (kn->kev.fflags & NOTE_DELETE)
         mask |= IN_ATTRIB | IN_DELETE_SELF;
@@ -112,126 +90,327 @@ add_watch(struct filter *filt, struct knote *kn)
         mask |= IN_ATTRIB;
     if (kn->kev.fflags & NOTE_RENAME)
         mask |= IN_MOVE_SELF;
-    if (kn->kev.flags & EV_ONESHOT)
-        mask |= IN_ONESHOT;
 
-    /* Create an inotify descriptor */
-    ifd = inotify_init();
-    if (ifd < 0) {
-        dbg_perror("inotify_init(2)");
-        return (-1);
-    }
+    return (mask);
+}
 
-    /* Add the watch */
-    dbg_printf("inotify_add_watch(2); inofd=%d, %s, path=%s",
-            ifd, inotify_mask_dump(mask), path);
-    kn->kev.data = inotify_add_watch(ifd, path, mask);
-    if (kn->kev.data < 0) {
-        dbg_perror("inotify_add_watch(2)");
-        goto errout;
-    }
+static int
+vnode_ready(struct filter *filt, struct knote *kn)
+{
+    struct epoll_event ev;
+
+    if (kn->kn_ready.tqe_prev != NULL)
+        return (0);
 
-    /* Add the inotify fd to the epoll set */
-    memset(&ev, 0, sizeof(ev));
-    ev.events = EPOLLIN;
-    ev.data.ptr = kn;
-    if (epoll_ctl(filter_epfd(filt), EPOLL_CTL_ADD, ifd, &ev) < 0) {
-        dbg_perror("epoll_ctl(2)");
-        goto errout;
+    /* The eventfd is created on first use */
+    if (filt->kf_efd.ef_id < 0) {
+        if (kqops.eventfd_init(&filt->kf_efd) < 0)
+            return (-1);
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = filt;
+        if (epoll_ctl(filter_epfd(filt), EPOLL_CTL_ADD,
+                    filt->kf_efd.ef_id, &ev) < 0) {
+            dbg_perror("epoll_ctl(2)");
+            kqops.eventfd_close(&filt->kf_efd);
+            return (-1);
+        }
     }
+    if (filt->kf_nready == 0 && kqops.eventfd_raise(&filt->kf_efd) < 0)
+        return (-1);
 
-    kn->kdata.kn_inotifyfd = ifd;
+    TAILQ_INSERT_TAIL(&filt->kf_ready, kn, kn_ready);
+    filt->kf_nready++;
 
     return (0);
+}
 
-errout:
-    kn->kdata.kn_inotifyfd = -1;
-    (void) close(ifd);
-    return (-1);
+static void
+vnode_unready(struct filter *filt, struct knote *kn)
+{
+    if (kn->kn_ready.tqe_prev == NULL)
+        return;
+
+    TAILQ_REMOVE(&filt->kf_ready, kn, kn_ready);
+    kn->kn_ready.tqe_prev = NULL;
+    if (--filt->kf_nready == 0)
+        (void) kqops.eventfd_lower(&filt->kf_efd);
 }
 
+/*
+ * Add a watch with the given mask, or add the mask to the watch that the
+ * file already has, and return the watch descriptor.
+ */
 static int
-delete_watch(struct filter *filt, struct knote *kn)
+vnode_add_watch(struct filter *filt, struct knote *kn, uint32_t mask)
 {
-    int ifd = kn->kdata.kn_inotifyfd;
+    char path[64];
+    int wd;
 
-    if (ifd < 0)
-        return (0);
-    if (epoll_ctl(filter_epfd(filt), EPOLL_CTL_DEL, ifd, NULL) < 0) {
-        dbg_perror("epoll_ctl(2)");
-        return (-1);
-    }
-    (void) close(ifd);
-    kn->kdata.kn_inotifyfd = -1;
+    /* The link follows the descriptor, even if the file is renamed */
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", (int) kn->kev.ident);
+    dbg_printf("inotify_add_watch(2); inofd=%d, %s, path=%s",
+            filt->kf_inotifyfd, inotify_mask_dump(mask), path);
+    wd = inotify_add_watch(filt->kf_inotifyfd, path, mask);
+    if (wd < 0)
+        dbg_perror("inotify_add_watch(2)");
 
-    return (0);
+    return (wd);
 }
 
-int
-evfilt_vnode_copyout(struct kevent *dst, struct knote *src, void *ptr UNUSED)
+static int
+vnode_watch(struct filter *filt, struct knote *kn, const struct stat *sb)
 {
-    struct inotify_event evt;
-    struct stat sb;
+    struct epoll_event ev;
+    struct file_watch *fw, key;
+    uint32_t mask = vnode_mask(kn);
+
+    /* The inotify instance is created on first use */
+    if (filt->kf_inotifyfd < 0) {
+        filt->kf_inotifyfd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (filt->kf_inotifyfd < 0) {
+            dbg_perror("inotify_init1(2)");
+            return (-1);
+        }
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = filt;
+        if (epoll_ctl(filter_epfd(filt), EPOLL_CTL_ADD,
+                    filt->kf_inotifyfd, &ev) < 0) {
+            dbg_perror("epoll_ctl(2)");
+            (void) close(filt->kf_inotifyfd);
+            filt->kf_inotifyfd = -1;
+            return (-1);
+        }
+    }
 
-    if (get_one_event(&evt, src->kdata.kn_inotifyfd) < 0)
+    /* The mask of a watch that other knotes share is only widened */
+    key.fw_wd = vnode_add_watch(filt, kn, mask | IN_MASK_ADD);
+    if (key.fw_wd < 0)
         return (-1);
 
-    dbg_printf("inotify event: %s", inotify_event_dump(&evt));
-    if (evt.mask & IN_IGNORED) {
-        /* TODO: possibly return error when fs is unmounted */
-        dst->filter = 0;
-        return (0);
+    fw = RB_FIND(file_watches, &filt->kf_watches, &key);
+    if (fw == NULL) {
+        fw = malloc(sizeof(*fw));
+        if (fw == NULL) {
+            (void) inotify_rm_watch(filt->kf_inotifyfd, key.fw_wd);
+            return (-1);
+        }
+        fw->fw_wd = key.fw_wd;
+        fw->fw_mask = 0;
+        fw->fw_dev = sb->st_dev;
+        fw->fw_ino = sb->st_ino;
+        LIST_INIT(&fw->fw_knotes);
+        RB_INSERT(file_watches, &filt->kf_watches, fw);
     }
+    fw->fw_mask |= mask;
+    LIST_INSERT_HEAD(&fw->fw_knotes, kn, kn_watch_entries);
+    kn->kn_watch = fw;
 
-    /* Check if the watched file has been closed, and
-       XXX-this may not exactly match the kevent() behavior if multiple file de
-scriptors reference the same file.
-    */
-    if (evt.mask & IN_CLOSE_WRITE || evt.mask & IN_CLOSE_NOWRITE) {
-        src->kn_flags |= EV_ONESHOT; /* KLUDGE: causes the knote to be deleted */
-        dst->filter = 0; /* KLUDGE: causes the event to be discarded */
-        return (0);
+    return (0);
+}
+
+/*
+ * Take the knote off its watch. The watch is removed with its last knote,
+ * or narrowed to the mask of the knotes that are left.
+ */
+static void
+vnode_unwatch(struct filter *filt, struct knote *kn)
+{
+    struct file_watch *fw = kn->kn_watch;
+    struct knote *other;
+    uint32_t mask = 0;
+
+    if (fw == NULL)
+        return;
+    LIST_REMOVE(kn, kn_watch_entries);
+    kn->kn_watch = NULL;
+
+    if (LIST_EMPTY(&fw->fw_knotes)) {
+        if (inotify_rm_watch(filt->kf_inotifyfd, fw->fw_wd) < 0)
+            dbg_perror("inotify_rm_watch(2)");
+        RB_REMOVE(file_watches, &filt->kf_watches, fw);
+        free(fw);
+        return;
     }
 
-    memcpy(dst, &src->kev, sizeof(*dst));
-    dst->data = 0;
+    LIST_FOREACH(other, &fw->fw_knotes, kn_watch_entries)
+        mask |= vnode_mask(other);
+    if (mask != fw->fw_mask &&
+            vnode_add_watch(filt, LIST_FIRST(&fw->fw_knotes), mask) == fw->fw_wd)
+        fw->fw_mask = mask;
+}
+
+/* Return the changes that an inotify event means to the knote */
+static unsigned int
+vnode_fflags(struct knote *kn, uint32_t mask)
+{
+    unsigned int fflags = 0;
+    struct stat sb;
 
     /* No error checking because fstat(2) should rarely fail */
-    //FIXME: EINTR
-    if ((evt.mask & IN_ATTRIB || evt.mask & IN_MODIFY)
-        && fstat(src->kev.ident, &sb) == 0) {
-        if (sb.st_nlink == 0 && src->kev.fflags & NOTE_DELETE)
-            dst->fflags |= NOTE_DELETE;
-        if (sb.st_nlink != src->data.vnode.nlink && src->kev.fflags & NOTE_LINK)
-            dst->fflags |= NOTE_LINK;
+    if ((mask & (IN_ATTRIB | IN_MODIFY | IN_Q_OVERFLOW))
+            && fstat(kn->kev.ident, &sb) == 0) {
+        if (sb.st_nlink == 0 && kn->kev.fflags & NOTE_DELETE)
+            fflags |= NOTE_DELETE;
+        if (sb.st_nlink != kn->data.vnode.nlink && kn->kev.fflags & NOTE_LINK)
+            fflags |= NOTE_LINK;
 #if HAVE_NOTE_TRUNCATE
-        if (sb.st_nsize == 0 && src->kev.fflags & NOTE_TRUNCATE)
-            dst->fflags |= NOTE_TRUNCATE;
+        if (sb.st_size == 0 && kn->kev.fflags & NOTE_TRUNCATE)
+            fflags |= NOTE_TRUNCATE;
 #endif
-        if (sb.st_size > src->data.vnode.size && src->kev.fflags & NOTE_WRITE)
-            dst->fflags |= NOTE_EXTEND;
-       src->data.vnode.nlink = sb.st_nlink;
-       src->data.vnode.size = sb.st_size;
+        /* BSD kqueue adds NOTE_EXTEND even though it was not requested */
+        if (sb.st_size > kn->data.vnode.size && kn->kev.fflags & NOTE_WRITE)
+            fflags |= NOTE_EXTEND;
+        kn->data.vnode.nlink = sb.st_nlink;
+        kn->data.vnode.size = sb.st_size;
+    }
+
+    if (mask & IN_MODIFY && kn->kev.fflags & NOTE_WRITE)
+        fflags |= NOTE_WRITE;
+    if (mask & IN_ATTRIB && kn->kev.fflags & NOTE_ATTRIB)
+        fflags |= NOTE_ATTRIB;
+    if (mask & IN_MOVE_SELF && kn->kev.fflags & NOTE_RENAME)
+        fflags |= NOTE_RENAME;
+    if (mask & IN_DELETE_SELF && kn->kev.fflags & NOTE_DELETE)
+        fflags |= NOTE_DELETE;
+
+    return (fflags);
+}
+
+/* Whether the descriptor of the knote still refers to the file watched */
+static int
+vnode_is_open(struct knote *kn, struct file_watch *fw)
+{
+    struct stat sb;
+
+    return (fstat(kn->kev.ident, &sb) == 0 &&
+            sb.st_dev == fw->fw_dev && sb.st_ino == fw->fw_ino);
+}
+
+/* Pass an inotify event on to the knotes of the watch */
+static void
+vnode_event(struct filter *filt, struct file_watch *fw, uint32_t mask)
+{
+    struct knote *kn, *next;
+    unsigned int fflags;
+
+    /*
+     * The last knote to be deleted frees the watch, but it is the last
+     * one on the list too.
+     */
+    for (kn = LIST_FIRST(&fw->fw_knotes); kn != NULL; kn = next) {
+        next = LIST_NEXT(kn, kn_watch_entries);
+
+        /* A descriptor of the file was closed, maybe the one of the knote */
+        if ((mask & IN_CLOSE) && !vnode_is_open(kn, fw)) {
+            dbg_printf("fd=%d closed, deleting its knote", (int) kn->kev.ident);
+            knote_delete(filt, kn); //FIXME: Error checking
+            continue;
+        }
+
+        if (kn->kev.flags & EV_DISABLE)
+            continue;
+        fflags = vnode_fflags(kn, mask);
+        if (fflags == 0)
+            continue;
+        kn->kn_vnode_fflags |= fflags;
+        (void) vnode_ready(filt, kn);
     }
+}
+
+/* Read the pending inotify events of the filter */
+static void
+vnode_inotify(struct filter *filt)
+{
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct inotify_event *iev;
+    struct file_watch *fw, *next, key;
+    struct knote *kn;
+    ssize_t n, off;
+
+    for (;;) {
+        n = read(filt->kf_inotifyfd, buf, sizeof(buf));
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN)
+                dbg_perror("read(2)");
+            return;
+        }
+        if (n == 0)
+            return;
 
-    if (evt.mask & IN_MODIFY && src->kev.fflags & NOTE_WRITE)
-        dst->fflags |= NOTE_WRITE;
-    if (evt.mask & IN_ATTRIB && src->kev.fflags & NOTE_ATTRIB)
-        dst->fflags |= NOTE_ATTRIB;
-    if (evt.mask & IN_MOVE_SELF && src->kev.fflags & NOTE_RENAME)
-        dst->fflags |= NOTE_RENAME;
-    if (evt.mask & IN_DELETE_SELF && src->kev.fflags & NOTE_DELETE)
-        dst->fflags |= NOTE_DELETE;
-
-    if (evt.mask & IN_MODIFY && src->kev.fflags & NOTE_WRITE)
-        dst->fflags |= NOTE_WRITE;
-    if (evt.mask & IN_ATTRIB && src->kev.fflags & NOTE_ATTRIB)
-        dst->fflags |= NOTE_ATTRIB;
-    if (evt.mask & IN_MOVE_SELF && src->kev.fflags & NOTE_RENAME)
-        dst->fflags |= NOTE_RENAME;
-    if (evt.mask & IN_DELETE_SELF && src->kev.fflags & NOTE_DELETE)
-        dst->fflags |= NOTE_DELETE;
+        for (off = 0; off < n; off += sizeof(*iev) + iev->len) {
+            iev = (struct inotify_event *) &buf[off];
+            dbg_printf("inotify event: %s", inotify_event_dump(iev));
 
+            /* Some events were lost, so check every file */
+            if (iev->mask & IN_Q_OVERFLOW) {
+                RB_FOREACH_SAFE(fw, file_watches, &filt->kf_watches, next)
+                    vnode_event(filt, fw, IN_Q_OVERFLOW);
+                continue;
+            }
+
+            key.fw_wd = iev->wd;
+            fw = RB_FIND(file_watches, &filt->kf_watches, &key);
+            if (fw == NULL)
+                continue;
+
+            /* The file is gone, or its filesystem was unmounted */
+            if (iev->mask & IN_IGNORED) {
+                while ((kn = LIST_FIRST(&fw->fw_knotes)) != NULL) {
+                    LIST_REMOVE(kn, kn_watch_entries);
+                    kn->kn_watch = NULL;
+                }
+                RB_REMOVE(file_watches, &filt->kf_watches, fw);
+                free(fw);
+                continue;
+            }
+
+            vnode_event(filt, fw, iev->mask);
+        }
+    }
+}
+
+/*
+ * Copy out the knotes on the kf_ready list, after reading the pending
+ * inotify events.
+ */
+int
+evfilt_vnode_copyout_ready(struct filter *filt, struct kevent *eventlist,
+        int nevents)
+{
+    struct knote *kn;
+    int nret = 0;
+
+    if (filt->kf_inotifyfd >= 0)
+        vnode_inotify(filt);
+
+    while (filt->kf_nready > 0 && nret < nevents) {
+        kn = TAILQ_FIRST(&filt->kf_ready);
+        vnode_unready(filt, kn);
+
+        memcpy(&eventlist[nret], &kn->kev, sizeof(eventlist[nret]));
+        eventlist[nret].fflags = kn->kn_vnode_fflags;
+        eventlist[nret].data = 0;
+        kn->kn_vnode_fflags = 0;
+
+        if (kn->kev.flags & EV_DISPATCH)
+            knote_disable(filt, kn); //FIXME: Error checking
+        if (kn->kev.flags & EV_ONESHOT)
+            knote_delete(filt, kn); //FIXME: Error checking
+        nret++;
+    }
+
+    return (nret);
+}
+
+/* Every event comes through evfilt_vnode_copyout_ready() */
+int
+evfilt_vnode_copyout(struct kevent *dst, struct knote *src UNUSED, void *ptr UNUSED)
+{
+    memset(dst, 0, sizeof(*dst));
     return (0);
 }
 
@@ -246,43 +425,88 @@ evfilt_vnode_knote_create(struct filter *filt, struct knote *kn)
     }
     kn->data.vnode.nlink = sb.st_nlink;
     kn->data.vnode.size = sb.st_size;
-    kn->kev.data = -1;
 
-    return (add_watch(filt, kn));
+    return (vnode_watch(filt, kn, &sb));
 }
 
 int
 evfilt_vnode_knote_modify(struct filter *filt, struct knote *kn,
         const struct kevent *kev)
 {
-    (void)filt;
-    (void)kn;
-    (void)kev;
-    return (-1); /* FIXME - STUB */
+    struct file_watch *fw = kn->kn_watch;
+    uint32_t mask;
+
+    kn->kev.flags = (kn->kev.flags & ~(EV_ONESHOT | EV_CLEAR | EV_DISPATCH))
+        | (kev->flags & (EV_ONESHOT | EV_CLEAR | EV_DISPATCH));
+    kn->kev.fflags = kev->fflags;
+
+    /* The file is gone */
+    if (fw == NULL)
+        return (0);
+
+    mask = vnode_mask(kn);
+    if ((fw->fw_mask & mask) == mask)
+        return (0);
+    if (vnode_add_watch(filt, kn, mask | IN_MASK_ADD) != fw->fw_wd)
+        return (-1);
+    fw->fw_mask |= mask;
+
+    return (0);
 }
 
 int
 evfilt_vnode_knote_delete(struct filter *filt, struct knote *kn)
 {
-    return delete_watch(filt, kn);
+    vnode_unready(filt, kn);
+    vnode_unwatch(filt, kn);
+    return (0);
 }
 
 int
-evfilt_vnode_knote_enable(struct filter *filt, struct knote *kn)
+evfilt_vnode_knote_enable(struct filter *filt UNUSED, struct knote *kn)
 {
-    return add_watch(filt, kn);
+    kn->kn_vnode_fflags = 0;
+    return (0);
 }
 
 int
 evfilt_vnode_knote_disable(struct filter *filt, struct knote *kn)
 {
-    return delete_watch(filt, kn);
+    vnode_unready(filt, kn);
+    return (0);
+}
+
+int
+evfilt_vnode_init(struct filter *filt)
+{
+    filt->kf_efd.ef_id = -1;
+    TAILQ_INIT(&filt->kf_ready);
+    filt->kf_nready = 0;
+    filt->kf_inotifyfd = -1;
+    RB_INIT(&filt->kf_watches);
+    return (0);
+}
+
+void
+evfilt_vnode_destroy(struct filter *filt)
+{
+    struct file_watch *fw;
+
+    if (filt->kf_efd.ef_id >= 0)
+        kqops.eventfd_close(&filt->kf_efd);
+    if (filt->kf_inotifyfd >= 0)
+        (void) close(filt->kf_inotifyfd);
+    filt->kf_inotifyfd = -1;
+    while ((fw = RB_MIN(file_watches, &filt->kf_watches)) != NULL) {
+        RB_REMOVE(file_watches, &filt->kf_watches, fw);
+        free(fw);
+    }
 }
 
 const struct filter evfilt_vnode = {
     EVFILT_VNODE,
-    NULL,
-    NULL,
+    evfilt_vnode_init,
+    evfilt_vnode_destroy,
     evfilt_vnode_copyout,
     evfilt_vnode_knote_create,
     evfilt_vnode_knote_modify,
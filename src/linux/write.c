@@ -30,6 +30,78 @@
 
 #include "private.h"
 
+/* Pipes had a fixed size before F_GETPIPE_SZ */
+#if !defined(F_GETPIPE_SZ)
+# define PIPE_DEFAULT_SIZE  65536
+#endif
+
+/*
+ * Cache the size of the send buffer or pipe. It is refreshed when the
+ * knote is modified, and when more data is queued than it would hold,
+ * as when TCP grows the send buffer.
+ */
+static int
+write_buffer_size(struct knote *kn)
+{
+    socklen_t slen;
+
+    if (kn->kn_flags & KNFL_SOCKET) {
+        slen = sizeof(kn->kn_bufsz);
+        if (getsockopt(kn->kev.ident, SOL_SOCKET, SO_SNDBUF,
+                    &kn->kn_bufsz, &slen) < 0) {
+            dbg_perror("getsockopt(2)");
+            return (-1);
+        }
+    } else if (kn->kn_flags & KNFL_PIPE) {
+#if defined(F_GETPIPE_SZ)
+        kn->kn_bufsz = fcntl(kn->kev.ident, F_GETPIPE_SZ);
+        if (kn->kn_bufsz < 0) {
+            dbg_perror("fcntl(2)");
+            kn->kn_bufsz = 0;
+            return (-1);
+        }
+#else
+        kn->kn_bufsz = PIPE_DEFAULT_SIZE;
+#endif
+    } else {
+        kn->kn_bufsz = 0;
+    }
+
+    return (0);
+}
+
+int
+evfilt_socket_knote_data(struct filter *filt UNUSED, struct knote *kn,
+        struct kevent *dst)
+{
+    unsigned long req;
+    int queued;
+
+    /* The size of the buffer is not known for other descriptors */
+    if (kn->kn_flags & KNFL_SOCKET) {
+        req = SIOCOUTQ;
+    } else if (kn->kn_flags & KNFL_PIPE) {
+        req = FIONREAD;
+    } else {
+        dst->data = 0;
+        return (0);
+    }
+
+    if (ioctl(kn->kev.ident, req, &queued) < 0) {
+        /* race condition with close, so ignore this error */
+        dbg_puts("ioctl(2) failed");
+        dst->data = 0;
+        return (0);
+    }
+    if (queued > kn->kn_bufsz)
+        (void) write_buffer_size(kn);
+
+    /* On return, data contains the the amount of space remaining in the write buffer */
+    dst->data = (queued < kn->kn_bufsz) ? kn->kn_bufsz - queued : 0;
+
+    return (0);
+}
+
 int
 evfilt_socket_copyout(struct kevent *dst, struct knote *src, void *ptr)
 {
@@ -47,77 +119,80 @@ evfilt_socket_copyout(struct kevent *dst, struct knote *src, void *ptr)
     if (ev->events & EPOLLERR)
         dst->fflags = 1; /* FIXME: Return the actual socket error */
 
-    /* On return, data contains the the amount of space remaining in the write buffer */
-    if (ioctl(dst->ident, SIOCOUTQ, &dst->data) < 0) {
-            /* race condition with socket close, so ignore this error */
-            dbg_puts("ioctl(2) of socket failed");
-            dst->data = 0;
+    /* The caller will use kevent_data() if it needs the data field */
+    if ((src->kev.fflags & NOTE_NODATA) && src->kn_lowat == 0) {
+        dst->data = 0;
+        return (0);
     }
 
+    (void) evfilt_socket_knote_data(NULL, src, dst);
+    if (dst->data < src->kn_lowat && !(dst->flags & EV_EOF))
+        dst->filter = 0;    /* Will cause the kevent to be discarded */
+
     return (0);
 }
 
 int
 evfilt_socket_knote_create(struct filter *filt, struct knote *kn)
 {
-    struct epoll_event ev;
+    int retried = 0;
 
     if (linux_get_descriptor_type(kn) < 0)
         return (-1);
 
+again:
     /* TODO: return EBADF? */
     if (kn->kn_flags & KNFL_REGULAR_FILE)
-        return (-1);
+        goto errout;
 
     /* Convert the kevent into an epoll_event */
     kn->data.events = EPOLLOUT;
-    if (kn->kev.flags & EV_ONESHOT || kn->kev.flags & EV_DISPATCH)
-        kn->data.events |= EPOLLONESHOT;
-    if (kn->kev.flags & EV_CLEAR)
-        kn->data.events |= EPOLLET;
+    if (write_buffer_size(kn) < 0)
+        goto errout;
+    linux_fd_state_lowat(kn);
+    linux_fd_state_mode(kn);
 
-    memset(&ev, 0, sizeof(ev));
-    ev.events = kn->data.events;
-    ev.data.ptr = kn;
+    if (linux_fd_state_attach(filt, kn) < 0)
+        goto errout;
 
-    return epoll_update(EPOLL_CTL_ADD, filt, kn, &ev);
+    return (0);
+
+errout:
+    /* The cached type of the descriptor may be stale, so look it up once more */
+    if ((kn->kn_flags & KNFL_TYPE_CACHED) && !retried) {
+        retried = 1;
+        if (linux_reset_descriptor_type(kn) < 0)
+            return (-1);
+        goto again;
+    }
+    return (-1);
 }
 
 int
-evfilt_socket_knote_modify(struct filter *filt, struct knote *kn,
+evfilt_socket_knote_modify(struct filter *filt UNUSED, struct knote *kn,
         const struct kevent *kev)
 {
-    (void) filt;
-    (void) kn;
-    (void) kev;
-    return (-1); /* STUB */
+    (void) write_buffer_size(kn);
+
+    return linux_fd_state_modify(kn, kev);
 }
 
 int
 evfilt_socket_knote_delete(struct filter *filt, struct knote *kn)
 {
-    if (kn->kev.flags & EV_DISABLE)
-        return (0);
-    else
-        return epoll_update(EPOLL_CTL_DEL, filt, kn, NULL);
+    return linux_fd_state_detach(filt, kn);
 }
 
 int
-evfilt_socket_knote_enable(struct filter *filt, struct knote *kn)
+evfilt_socket_knote_enable(struct filter *filt UNUSED, struct knote *kn)
 {
-    struct epoll_event ev;
-
-    memset(&ev, 0, sizeof(ev));
-    ev.events = kn->data.events;
-    ev.data.ptr = kn;
-
-    return epoll_update(EPOLL_CTL_ADD, filt, kn, &ev);
+    return linux_fd_state_update(kn);
 }
 
 int
-evfilt_socket_knote_disable(struct filter *filt, struct knote *kn)
+evfilt_socket_knote_disable(struct filter *filt UNUSED, struct knote *kn)
 {
-    return epoll_update(EPOLL_CTL_DEL, filt, kn, NULL);
+    return linux_fd_state_update(kn);
 }
 
 const struct filter evfilt_write = {
@@ -130,4 +205,5 @@ const struct filter evfilt_write = {
     evfilt_socket_knote_delete,
     evfilt_socket_knote_enable,
     evfilt_socket_knote_disable,
+    evfilt_socket_knote_data,
 };
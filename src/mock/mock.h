@@ -0,0 +1,52 @@
+/*
+ * Copyright (c) 2026 libkqueue contributors
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef  _KQUEUE_MOCK_H
+#define  _KQUEUE_MOCK_H
+
+/*
+ * Control interface for the mock kernel. This is linked into the
+ * test suite only (see the kqueue_mock target in CMakeLists.txt).
+ */
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Set the simulated readiness of an EVFILT_READ or EVFILT_WRITE knote.
+ * A non-zero <data> makes the knote fire with that value in kev.data;
+ * zero makes it idle again.
+ */
+int      mock_fd_ready(int kqfd, short filter, uintptr_t ident, intptr_t data);
+
+/* Deliver a simulated signal to every kqueue that is watching it. */
+int      mock_signal_raise(int signum);
+
+/* Move the virtual clock of a kqueue forward, firing any expired timers. */
+int      mock_clock_advance(int kqfd, uint64_t nsec);
+
+/* Return the virtual clock of a kqueue, in nanoseconds. */
+uint64_t mock_clock_now(int kqfd);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* ! _KQUEUE_MOCK_H */
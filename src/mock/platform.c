@@ -0,0 +1,292 @@
+/*
+ * Copyright (c) 2026 libkqueue contributors
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "../common/private.h"
+
+const struct filter evfilt_vnode = EVFILT_NOTIMPL;
+const struct filter evfilt_proc = EVFILT_NOTIMPL;
+
+const struct kqueue_vtable kqops = {
+    mock_kqueue_init,
+    mock_kqueue_free,
+    mock_kevent_wait,
+    mock_kevent_copyout,
+    NULL,
+    NULL,
+    mock_eventfd_init,
+    mock_eventfd_close,
+    mock_eventfd_raise,
+    mock_eventfd_lower,
+    mock_eventfd_descriptor
+};
+
+/*
+ * Every mock kqueue is kept on a list so that simulated signals
+ * can be delivered to all of them.
+ */
+static LIST_HEAD(, kqueue) mock_kqueues = LIST_HEAD_INITIALIZER(mock_kqueues);
+static pthread_mutex_t mock_kqueues_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+/* There are no descriptors, so kqueue IDs are handed out sequentially */
+static uint32_t mock_next_id = 0;
+
+int
+mock_kqueue_init(struct kqueue *kq)
+{
+    kq->kq_id = (int) atomic_inc(&mock_next_id);
+    TAILQ_INIT(&kq->kq_ready);
+    TAILQ_INIT(&kq->kq_timers);
+    kq->kq_nready = 0;
+    kq->kq_now = 0;
+
+    if (filter_register_all(kq) < 0)
+        return (-1);
+
+    pthread_mutex_lock(&mock_kqueues_mtx);
+    LIST_INSERT_HEAD(&mock_kqueues, kq, kq_mock_entries);
+    pthread_mutex_unlock(&mock_kqueues_mtx);
+
+    return (0);
+}
+
+void
+mock_kqueue_free(struct kqueue *kq)
+{
+    pthread_mutex_lock(&mock_kqueues_mtx);
+    LIST_REMOVE(kq, kq_mock_entries);
+    pthread_mutex_unlock(&mock_kqueues_mtx);
+    filter_unregister_all(kq);
+    free(kq);
+}
+
+/*
+ * "Sleep" by moving the virtual clock forward to the next timer
+ * expiration, without going past the timeout. A NULL timeout with
+ * nothing pending would block forever in a real kernel; here it
+ * returns zero immediately.
+ */
+int
+mock_kevent_wait(struct kqueue *kq, int nevents, const struct timespec *ts)
+{
+    uint64_t limit, next;
+    int nret;
+
+    kqueue_lock(kq);
+    if (kq->kq_nready == 0
+            && (ts == NULL || ts->tv_sec > 0 || ts->tv_nsec > 0)) {
+        if (ts == NULL)
+            limit = UINT64_MAX;
+        else
+            limit = kq->kq_now + (uint64_t) ts->tv_sec * 1000000000
+                + ts->tv_nsec;
+
+        next = mock_timer_next(kq);
+        if (next > limit)
+            next = limit;
+        if (next != UINT64_MAX)
+            mock_timer_advance(kq, next);
+    }
+    nret = (kq->kq_nready < nevents) ? kq->kq_nready : nevents;
+    kqueue_unlock(kq);
+
+    return (nret);
+}
+
+int
+mock_kevent_copyout(struct kqueue *kq, int nready,
+        struct kevent *eventlist, int nevents UNUSED)
+{
+    struct filter *filt;
+    struct knote *kn;
+    int i, nret, rv;
+
+    nret = 0;
+    for (i = 0; i < nready; i++) {
+        kn = TAILQ_FIRST(&kq->kq_ready);
+        if (kn == NULL)
+            break;
+        filt = &kq->kq_filt[~(kn->kev.filter)];
+        rv = filt->kf_copyout(eventlist, kn, NULL);
+        if (slowpath(rv < 0)) {
+            dbg_puts("knote_copyout failed");
+            abort();
+        }
+
+        /*
+         * Level-triggered knotes that are still active go to the back
+         * of the queue, like they would in epoll.
+         */
+        if (kn->kn_queued) {
+            TAILQ_REMOVE(&kq->kq_ready, kn, kn_ready);
+            TAILQ_INSERT_TAIL(&kq->kq_ready, kn, kn_ready);
+        }
+
+        if (eventlist->flags & EV_DISPATCH)
+            knote_disable(filt, kn);
+        if (eventlist->flags & EV_ONESHOT)
+            knote_delete(filt, kn);
+
+        if (fastpath(eventlist->filter != 0)) {
+            eventlist++;
+            nret++;
+        }
+    }
+
+    return (nret);
+}
+
+void
+mock_knote_activate(struct knote *kn)
+{
+    struct kqueue *kq = kn->kn_kq;
+
+    if (kn->kn_queued || (kn->kev.flags & EV_DISABLE))
+        return;
+    TAILQ_INSERT_TAIL(&kq->kq_ready, kn, kn_ready);
+    kn->kn_queued = 1;
+    kq->kq_nready++;
+}
+
+void
+mock_knote_deactivate(struct knote *kn)
+{
+    struct kqueue *kq = kn->kn_kq;
+
+    if (!kn->kn_queued)
+        return;
+    TAILQ_REMOVE(&kq->kq_ready, kn, kn_ready);
+    kn->kn_queued = 0;
+    kq->kq_nready--;
+}
+
+int
+mock_eventfd_init(struct eventfd *e)
+{
+    e->ef_id = -1;
+    return (0);
+}
+
+void
+mock_eventfd_close(struct eventfd *e)
+{
+    e->ef_id = -1;
+}
+
+int
+mock_eventfd_raise(struct eventfd *e UNUSED)
+{
+    return (0);
+}
+
+int
+mock_eventfd_lower(struct eventfd *e UNUSED)
+{
+    return (0);
+}
+
+int
+mock_eventfd_descriptor(struct eventfd *e)
+{
+    return (e->ef_id);
+}
+
+/*
+ * Control interface
+ */
+
+int
+mock_fd_ready(int kqfd, short filter, uintptr_t ident, intptr_t data)
+{
+    struct kqueue *kq;
+    struct filter *filt;
+    struct knote *kn;
+    int rv = 0;
+
+    if (filter != EVFILT_READ && filter != EVFILT_WRITE) {
+        errno = EINVAL;
+        return (-1);
+    }
+    if ((kq = kqueue_lookup(kqfd)) == NULL) {
+        errno = EBADF;
+        return (-1);
+    }
+
+    kqueue_lock(kq);
+    if (filter_lookup(&filt, kq, filter) < 0
+            || (kn = knote_lookup(filt, ident)) == NULL) {
+        errno = ENOENT;
+        rv = -1;
+    } else {
+        kn->kn_level = data;
+        if (data != 0)
+            mock_knote_activate(kn);
+        else
+            mock_knote_deactivate(kn);
+    }
+    kqueue_unlock(kq);
+
+    return (rv);
+}
+
+int
+mock_signal_raise(int signum)
+{
+    struct kqueue *kq;
+    int nwatch = 0;
+
+    pthread_mutex_lock(&mock_kqueues_mtx);
+    LIST_FOREACH(kq, &mock_kqueues, kq_mock_entries) {
+        kqueue_lock(kq);
+        nwatch += mock_signal_deliver(kq, signum);
+        kqueue_unlock(kq);
+    }
+    pthread_mutex_unlock(&mock_kqueues_mtx);
+
+    return (nwatch);
+}
+
+int
+mock_clock_advance(int kqfd, uint64_t nsec)
+{
+    struct kqueue *kq;
+
+    if ((kq = kqueue_lookup(kqfd)) == NULL) {
+        errno = EBADF;
+        return (-1);
+    }
+
+    kqueue_lock(kq);
+    mock_timer_advance(kq, kq->kq_now + nsec);
+    kqueue_unlock(kq);
+
+    return (0);
+}
+
+uint64_t
+mock_clock_now(int kqfd)
+{
+    struct kqueue *kq;
+    uint64_t now;
+
+    if ((kq = kqueue_lookup(kqfd)) == NULL)
+        return (0);
+
+    kqueue_lock(kq);
+    now = kq->kq_now;
+    kqueue_unlock(kq);
+
+    return (now);
+}
@@ -0,0 +1,72 @@
+/*
+ * Copyright (c) 2026 libkqueue contributors
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef  _KQUEUE_MOCK_PLATFORM_H
+#define  _KQUEUE_MOCK_PLATFORM_H
+
+/*
+ * The mock platform is an in-process "kernel" that is only used by the
+ * test suite. Readiness, timers and signals are simulated in memory and
+ * time is measured on a virtual clock, so the code in src/common can be
+ * exercised and benchmarked without making any system calls.
+ */
+
+#include <sys/queue.h>
+
+#include "mock.h"
+
+/*
+ * Additional members of struct knote
+ */
+#define KNOTE_PLATFORM_SPECIFIC \
+    TAILQ_ENTRY(knote) kn_ready;    /* Entry in kq_ready */            \
+    int          kn_queued;         /* Non-zero if on kq_ready */      \
+    intptr_t     kn_level;          /* Simulated readiness or count */ \
+    uint64_t     kn_deadline;       /* EVFILT_TIMER: next expiry */    \
+    uint64_t     kn_period;         /* EVFILT_TIMER: interval, in ns */ \
+    TAILQ_ENTRY(knote) kn_timer     /* Entry in kq_timers */
+
+/*
+ * Additional members of struct kqueue
+ */
+#define KQUEUE_PLATFORM_SPECIFIC \
+    TAILQ_HEAD(, knote) kq_ready;   /* Knotes with pending events */   \
+    TAILQ_HEAD(, knote) kq_timers;  /* Armed EVFILT_TIMER knotes */    \
+    int          kq_nready;                                           \
+    uint64_t     kq_now;            /* Virtual clock, in ns */         \
+    LIST_ENTRY(kqueue) kq_mock_entries
+
+int     mock_kqueue_init(struct kqueue *);
+void    mock_kqueue_free(struct kqueue *);
+
+int     mock_kevent_wait(struct kqueue *, int, const struct timespec *);
+int     mock_kevent_copyout(struct kqueue *, int, struct kevent *, int);
+
+int     mock_eventfd_init(struct eventfd *);
+void    mock_eventfd_close(struct eventfd *);
+int     mock_eventfd_raise(struct eventfd *);
+int     mock_eventfd_lower(struct eventfd *);
+int     mock_eventfd_descriptor(struct eventfd *);
+
+/* simulated kernel */
+
+void    mock_knote_activate(struct knote *);
+void    mock_knote_deactivate(struct knote *);
+void    mock_timer_advance(struct kqueue *, uint64_t);
+uint64_t mock_timer_next(struct kqueue *);
+int     mock_signal_deliver(struct kqueue *, int);
+
+#endif  /* ! _KQUEUE_MOCK_PLATFORM_H */
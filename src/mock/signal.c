@@ -0,0 +1,97 @@
+/*
+ * Copyright (c) 2026 libkqueue contributors
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "private.h"
+
+/* Called with the kqueue lock held; returns 1 if the signal is watched */
+int
+mock_signal_deliver(struct kqueue *kq, int signum)
+{
+    struct knote *kn;
+
+    kn = knote_lookup(&kq->kq_filt[~EVFILT_SIGNAL], signum);
+    if (kn == NULL)
+        return (0);
+
+    /* Like a blocked signal, a disabled knote does not count deliveries */
+    if (kn->kev.flags & EV_DISABLE)
+        return (1);
+
+    kn->kn_level++;
+    mock_knote_activate(kn);
+    return (1);
+}
+
+int
+evfilt_signal_copyout(struct kevent *dst, struct knote *src, void *x UNUSED)
+{
+    memcpy(dst, &src->kev, sizeof(*dst));
+    dst->data = src->kn_level;
+    src->kn_level = 0;
+    mock_knote_deactivate(src);
+
+    return (0);
+}
+
+int
+evfilt_signal_knote_create(struct filter *filt UNUSED, struct knote *kn)
+{
+    kn->kev.flags |= EV_CLEAR;
+    kn->kn_queued = 0;
+    kn->kn_level = 0;
+    return (0);
+}
+
+int
+evfilt_signal_knote_modify(struct filter *filt UNUSED,
+        struct knote *kn UNUSED,
+        const struct kevent *kev UNUSED)
+{
+    return (0);
+}
+
+int
+evfilt_signal_knote_delete(struct filter *filt UNUSED, struct knote *kn)
+{
+    mock_knote_deactivate(kn);
+    return (0);
+}
+
+int
+evfilt_signal_knote_enable(struct filter *filt UNUSED, struct knote *kn UNUSED)
+{
+    return (0);
+}
+
+int
+evfilt_signal_knote_disable(struct filter *filt UNUSED, struct knote *kn)
+{
+    kn->kn_level = 0;
+    mock_knote_deactivate(kn);
+    return (0);
+}
+
+const struct filter evfilt_signal = {
+    EVFILT_SIGNAL,
+    NULL,
+    NULL,
+    evfilt_signal_copyout,
+    evfilt_signal_knote_create,
+    evfilt_signal_knote_modify,
+    evfilt_signal_knote_delete,
+    evfilt_signal_knote_enable,
+    evfilt_signal_knote_disable,
+};
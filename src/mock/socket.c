@@ -0,0 +1,99 @@
+/*
+ * Copyright (c) 2026 libkqueue contributors
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "private.h"
+
+/*
+ * EVFILT_READ and EVFILT_WRITE share one implementation; the readiness
+ * of each knote is set from the outside by mock_fd_ready().
+ */
+
+int
+evfilt_socket_copyout(struct kevent *dst, struct knote *src, void *ptr UNUSED)
+{
+    memcpy(dst, &src->kev, sizeof(*dst));
+    dst->data = src->kn_level;
+
+    if (src->kev.flags & EV_CLEAR) {
+        src->kn_level = 0;
+        mock_knote_deactivate(src);
+    }
+
+    return (0);
+}
+
+int
+evfilt_socket_knote_create(struct filter *filt UNUSED, struct knote *kn)
+{
+    kn->kn_queued = 0;
+    kn->kn_level = 0;
+    return (0);
+}
+
+int
+evfilt_socket_knote_modify(struct filter *filt UNUSED, struct knote *kn,
+        const struct kevent *kev)
+{
+    kn->kev.fflags = kev->fflags;
+    kn->kev.data = kev->data;
+    return (0);
+}
+
+int
+evfilt_socket_knote_delete(struct filter *filt UNUSED, struct knote *kn)
+{
+    mock_knote_deactivate(kn);
+    return (0);
+}
+
+int
+evfilt_socket_knote_enable(struct filter *filt UNUSED, struct knote *kn)
+{
+    if (kn->kn_level != 0)
+        mock_knote_activate(kn);
+    return (0);
+}
+
+int
+evfilt_socket_knote_disable(struct filter *filt UNUSED, struct knote *kn)
+{
+    mock_knote_deactivate(kn);
+    return (0);
+}
+
+const struct filter evfilt_read = {
+    EVFILT_READ,
+    NULL,
+    NULL,
+    evfilt_socket_copyout,
+    evfilt_socket_knote_create,
+    evfilt_socket_knote_modify,
+    evfilt_socket_knote_delete,
+    evfilt_socket_knote_enable,
+    evfilt_socket_knote_disable,
+};
+
+const struct filter evfilt_write = {
+    EVFILT_WRITE,
+    NULL,
+    NULL,
+    evfilt_socket_copyout,
+    evfilt_socket_knote_create,
+    evfilt_socket_knote_modify,
+    evfilt_socket_knote_delete,
+    evfilt_socket_knote_enable,
+    evfilt_socket_knote_disable,
+};
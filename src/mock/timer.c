@@ -0,0 +1,147 @@
+/*
+ * Copyright (c) 2026 libkqueue contributors
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "private.h"
+
+/*
+ * Timers run on the virtual clock of their kqueue. The list of armed
+ * timers is unsorted; it is only walked when the clock moves.
+ */
+
+static void
+timer_arm(struct knote *kn)
+{
+    struct kqueue *kq = kn->kn_kq;
+
+    kn->kn_period = (uint64_t) kn->kev.data * 1000000;
+    kn->kn_deadline = kq->kq_now + kn->kn_period;
+    TAILQ_INSERT_TAIL(&kq->kq_timers, kn, kn_timer);
+}
+
+static void
+timer_disarm(struct knote *kn)
+{
+    if (kn->kn_timer.tqe_prev == NULL)
+        return;
+    TAILQ_REMOVE(&kn->kn_kq->kq_timers, kn, kn_timer);
+    kn->kn_timer.tqe_prev = NULL;
+}
+
+uint64_t
+mock_timer_next(struct kqueue *kq)
+{
+    struct knote *kn;
+    uint64_t next = UINT64_MAX;
+
+    TAILQ_FOREACH(kn, &kq->kq_timers, kn_timer) {
+        if (kn->kn_deadline < next)
+            next = kn->kn_deadline;
+    }
+    return (next);
+}
+
+void
+mock_timer_advance(struct kqueue *kq, uint64_t now)
+{
+    struct knote *kn, *tmp;
+    uint64_t expired;
+
+    kq->kq_now = now;
+    for (kn = TAILQ_FIRST(&kq->kq_timers); kn != NULL; kn = tmp) {
+        tmp = TAILQ_NEXT(kn, kn_timer);
+        if (kn->kn_deadline > now)
+            continue;
+
+        if (kn->kev.flags & EV_ONESHOT || kn->kn_period == 0) {
+            expired = 1;
+            timer_disarm(kn);
+        } else {
+            expired = 1 + (now - kn->kn_deadline) / kn->kn_period;
+            kn->kn_deadline += expired * kn->kn_period;
+        }
+        kn->kn_level += expired;
+        mock_knote_activate(kn);
+    }
+}
+
+int
+evfilt_timer_copyout(struct kevent *dst, struct knote *src, void *ptr UNUSED)
+{
+    memcpy(dst, &src->kev, sizeof(*dst));
+    dst->data = src->kn_level;
+    src->kn_level = 0;
+    mock_knote_deactivate(src);
+
+    return (0);
+}
+
+int
+evfilt_timer_knote_create(struct filter *filt UNUSED, struct knote *kn)
+{
+    kn->kev.flags |= EV_CLEAR;
+    kn->kn_queued = 0;
+    kn->kn_level = 0;
+    timer_arm(kn);
+    return (0);
+}
+
+int
+evfilt_timer_knote_modify(struct filter *filt UNUSED, struct knote *kn,
+        const struct kevent *kev)
+{
+    timer_disarm(kn);
+    kn->kev.data = kev->data;
+    if (!(kn->kev.flags & EV_DISABLE))
+        timer_arm(kn);
+    return (0);
+}
+
+int
+evfilt_timer_knote_delete(struct filter *filt UNUSED, struct knote *kn)
+{
+    timer_disarm(kn);
+    mock_knote_deactivate(kn);
+    return (0);
+}
+
+int
+evfilt_timer_knote_enable(struct filter *filt UNUSED, struct knote *kn)
+{
+    timer_disarm(kn);
+    timer_arm(kn);
+    return (0);
+}
+
+int
+evfilt_timer_knote_disable(struct filter *filt UNUSED, struct knote *kn)
+{
+    timer_disarm(kn);
+    kn->kn_level = 0;
+    mock_knote_deactivate(kn);
+    return (0);
+}
+
+const struct filter evfilt_timer = {
+    EVFILT_TIMER,
+    NULL,
+    NULL,
+    evfilt_timer_copyout,
+    evfilt_timer_knote_create,
+    evfilt_timer_knote_modify,
+    evfilt_timer_knote_delete,
+    evfilt_timer_knote_enable,
+    evfilt_timer_knote_disable,
+};
@@ -0,0 +1,123 @@
+/*
+ * Copyright (c) 2026 libkqueue contributors
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "private.h"
+
+/*
+ * Same semantics as src/linux/user.c, with the ready queue taking
+ * the place of the eventfd.
+ */
+
+int
+mock_evfilt_user_copyout(struct kevent *dst, struct knote *src, void *ptr UNUSED)
+{
+    memcpy(dst, &src->kev, sizeof(*dst));
+    dst->fflags &= ~NOTE_FFCTRLMASK;
+    dst->fflags &= ~NOTE_TRIGGER;
+    if (src->kev.flags & EV_ADD) {
+        /* NOTE: True on FreeBSD but not consistent behavior with
+           other filters. */
+        dst->flags &= ~EV_ADD;
+    }
+    if (src->kev.flags & EV_CLEAR)
+        src->kev.fflags &= ~NOTE_TRIGGER;
+    if (src->kev.flags & (EV_DISPATCH | EV_CLEAR | EV_ONESHOT))
+        mock_knote_deactivate(src);
+
+    if (src->kev.flags & EV_DISPATCH)
+        src->kev.fflags &= ~NOTE_TRIGGER;
+
+    return (0);
+}
+
+int
+mock_evfilt_user_knote_create(struct filter *filt UNUSED, struct knote *kn)
+{
+    kn->kn_queued = 0;
+    return (0);
+}
+
+int
+mock_evfilt_user_knote_modify(struct filter *filt UNUSED, struct knote *kn,
+        const struct kevent *kev)
+{
+    unsigned int ffctrl;
+    unsigned int fflags;
+
+    /* Excerpted from sys/kern/kern_event.c in FreeBSD HEAD */
+    ffctrl = kev->fflags & NOTE_FFCTRLMASK;
+    fflags = kev->fflags & NOTE_FFLAGSMASK;
+    switch (ffctrl) {
+        case NOTE_FFNOP:
+            break;
+
+        case NOTE_FFAND:
+            kn->kev.fflags &= fflags;
+            break;
+
+        case NOTE_FFOR:
+            kn->kev.fflags |= fflags;
+            break;
+
+        case NOTE_FFCOPY:
+            kn->kev.fflags = fflags;
+            break;
+
+        default:
+            break;
+    }
+
+    if ((!(kn->kev.flags & EV_DISABLE)) && kev->fflags & NOTE_TRIGGER) {
+        kn->kev.fflags |= NOTE_TRIGGER;
+        mock_knote_activate(kn);
+    }
+
+    return (0);
+}
+
+int
+mock_evfilt_user_knote_delete(struct filter *filt UNUSED, struct knote *kn)
+{
+    mock_knote_deactivate(kn);
+    return (0);
+}
+
+int
+mock_evfilt_user_knote_enable(struct filter *filt UNUSED, struct knote *kn)
+{
+    if (kn->kev.fflags & NOTE_TRIGGER)
+        mock_knote_activate(kn);
+    return (0);
+}
+
+int
+mock_evfilt_user_knote_disable(struct filter *filt UNUSED, struct knote *kn)
+{
+    mock_knote_deactivate(kn);
+    return (0);
+}
+
+const struct filter evfilt_user = {
+    EVFILT_USER,
+    NULL,
+    NULL,
+    mock_evfilt_user_copyout,
+    mock_evfilt_user_knote_create,
+    mock_evfilt_user_knote_modify,
+    mock_evfilt_user_knote_delete,
+    mock_evfilt_user_knote_enable,
+    mock_evfilt_user_knote_disable,
+};
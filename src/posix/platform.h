@@ -78,4 +78,7 @@ int     posix_eventfd_raise(struct eventfd *);
 int     posix_eventfd_lower(struct eventfd *);
 int     posix_eventfd_descriptor(struct eventfd *);
 
+extern const struct filter posix_evfilt_timer;
+int     posix_evfilt_timer_copyout(struct filter *, struct kevent *, int);
+
 #endif  /* ! _KQUEUE_POSIX_PLATFORM_H */
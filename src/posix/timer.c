@@ -14,305 +14,434 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+/*
+ * Timers that need nothing from the system but threads and a clock. A
+ * single service thread, shared by every kqueue of the process, keeps the
+ * timers in a binary min-heap of their deadlines on CLOCK_MONOTONIC (see
+ * common/timer.c), and sleeps on a condition variable until the first
+ * one. An expired timer is put on the ready list of its filter, and the
+ * first one on the list raises the eventfd of the filter, which is the
+ * only descriptor that a kqueue waits on for its timers. Copying out the
+ * ready list lowers it again.
+ *
+ * One mutex protects the heap, the ready lists and the counts of the
+ * timers. The service thread is started with the first timer.
+ *
+ * On Linux, this is the fallback for when timerfds cannot be created, as
+ * under some seccomp policies, or when KQUEUE_POSIX_TIMER is set in the
+ * environment (see linux/timer.c).
+ */
+
 #include <errno.h>
-#include <fcntl.h>
 #include <pthread.h>
+#include <stddef.h>
 #include <signal.h>
 #include <stdlib.h>
-#include <stdio.h>
-#include <sys/queue.h>
-#include <sys/socket.h>
-#include <sys/time.h>
-#include <sys/types.h>
 #include <string.h>
+#include <sys/queue.h>
 #include <time.h>
-#include <unistd.h>
 
 #include "sys/event.h"
 #include "private.h"
 
-/* A request to sleep for a certain time */
-struct sleepreq {
-    int         pfd;            /* fd to poll for ACKs */
-    int         wfd;            /* fd to wake up when sleep is over */
-    uintptr_t   ident;          /* from kevent */
-    intptr_t    interval;       /* sleep time, in milliseconds */
-    pthread_cond_t  cond;
-    pthread_mutex_t mtx;
-    struct sleepstat *stat;
+/* The timer of a knote */
+struct ptimer {
+    struct timer_node   pt_node;        /* Entry in ptimer_heap */
+    uint64_t            pt_period;      /* In nanoseconds, or 0 */
+    uint64_t            pt_count;       /* Expirations not yet reported */
+    int                 pt_ready;       /* Non-zero if on the ready list */
+    TAILQ_ENTRY(ptimer) pt_entries;     /* Entry in ed_ready */
+    struct filter      *pt_filt;
+    struct knote       *pt_kn;
 };
 
-/* Information about a successful sleep operation */
-struct sleepinfo {
-    uintptr_t   ident;          /* from kevent */
-    uintptr_t   counter;        /* number of times the timer expired */
+#define pt_deadline     pt_node.tn_key  /* On CLOCK_MONOTONIC, in ns */
+
+#define ptimer_of(tn) \
+    ((struct ptimer *) ((char *) (tn) - offsetof(struct ptimer, pt_node)))
+
+struct evfilt_data {
+    TAILQ_HEAD(, ptimer) ed_ready;      /* Expired timers */
 };
 
-static void *
-sleeper_thread(void *arg)
+static pthread_mutex_t ptimer_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ptimer_cond;
+static struct timer_heap ptimer_heap;
+
+static pthread_once_t ptimer_once = PTHREAD_ONCE_INIT;
+static int ptimer_error;
+
+static uint64_t
+ptimer_now(clockid_t clock)
 {
-    struct sleepreq *sr = (struct sleepreq *) arg;
-    struct sleepinfo si;
-    struct timeval now;
-    struct timespec req;
-    sigset_t        mask;
-    ssize_t         cnt;
-    bool            cts = true;     /* Clear To Send */
-    char            buf[1];
-    int rv;
-
-#if 0
-    pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
-#endif
+    struct timespec ts;
 
-    /* Initialize the response */
-    si.ident = sr->ident;
-    si.counter = 0;
+    clock_gettime(clock, &ts);
+    return ((uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+static int
+ptimer_insert(struct ptimer *pt)
+{
+    if (timer_heap_insert(&ptimer_heap, &pt->pt_node) < 0)
+        return (-1);
+
+    /* The service thread sleeps until the first deadline */
+    if (pt->pt_node.tn_index == 1)
+        pthread_cond_signal(&ptimer_cond);
+
+    return (0);
+}
+
+/* Put an expired timer on the ready list of its filter */
+static void
+ptimer_ready(struct ptimer *pt)
+{
+    struct filter *filt = pt->pt_filt;
+
+    if (pt->pt_ready)
+        return;
+    if (TAILQ_EMPTY(&filt->kf_data->ed_ready) &&
+            kqops.eventfd_raise(&filt->kf_efd) < 0)
+        dbg_puts("unable to raise the timer eventfd");
+    TAILQ_INSERT_TAIL(&filt->kf_data->ed_ready, pt, pt_entries);
+    pt->pt_ready = 1;
+}
+
+static void
+ptimer_unready(struct ptimer *pt)
+{
+    struct filter *filt = pt->pt_filt;
+
+    if (!pt->pt_ready)
+        return;
+    TAILQ_REMOVE(&filt->kf_data->ed_ready, pt, pt_entries);
+    pt->pt_ready = 0;
+    if (TAILQ_EMPTY(&filt->kf_data->ed_ready))
+        (void) kqops.eventfd_lower(&filt->kf_efd);
+}
+
+/*
+ * A timer in the heap has expired. The next deadline stays on the period
+ * of the first one, however late the expiration is handled.
+ */
+static void
+ptimer_expire(struct ptimer *pt, uint64_t now)
+{
+    uint64_t expired = 1;
+
+    if (pt->pt_period != 0) {
+        expired += (now - pt->pt_deadline) / pt->pt_period;
+        pt->pt_deadline += expired * pt->pt_period;
+        timer_heap_update(&ptimer_heap, &pt->pt_node);
+    } else {
+        timer_heap_remove(&ptimer_heap, &pt->pt_node);
+    }
+    pt->pt_count += expired;
+    ptimer_ready(pt);
+}
+
+static void *
+ptimer_service(void *arg UNUSED)
+{
+    struct timer_node *tn;
+    struct ptimer *pt;
+    struct timespec ts;
+    sigset_t mask;
+    uint64_t now;
 
     /* Block all signals */
     sigfillset(&mask);
     (void) pthread_sigmask(SIG_BLOCK, &mask, NULL);
 
+    pthread_mutex_lock(&ptimer_mtx);
     for (;;) {
-
-        pthread_mutex_lock(&sr->mtx);
-
-        /* Convert the timeout into an absolute time */
-        /* Convert milliseconds into seconds+nanoseconds */
-        gettimeofday(&now, NULL);
-        req.tv_sec  = now.tv_sec + sr->interval / 1000;
-        req.tv_nsec = now.tv_usec + ((sr->interval % 1000) * 1000000);
-
-        /* Sleep */
-        dbg_printf("sleeping for %ld ms", (unsigned long) sr->interval);
-        rv = pthread_cond_timedwait(&sr->cond, &sr->mtx, &req);
-        pthread_mutex_unlock(&sr->mtx);
-        if (rv == 0) {
-            /* _timer_delete() has requested that we terminate */
-            dbg_puts("terminating sleeper thread");
-            break;
-        } else if (rv != 0) {
-            dbg_printf("rv=%d %s", rv, strerror(rv));
-            if (rv == EINTR)
-                abort(); //FIXME should not happen
-
-            //ASSUME: rv == ETIMEDOUT
-        }
-        si.counter++;
-        dbg_printf(" -------- sleep over (CTS=%d)----------", cts);
-
-        /* Test if the previous wakeup has been acknowledged */
-        if (!cts) {
-            cnt = read(sr->wfd, &buf, 1);
-            if (cnt < 0) {
-                if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                    ;
-                } else {
-                    dbg_perror("read(2)");
-                    break;
-                }
-            } else if (cnt == 0) {
-                dbg_perror("short read(2)");
-                break;
-            } else {
-                cts = true;
-            }
+        if ((tn = timer_heap_first(&ptimer_heap)) == NULL) {
+            pthread_cond_wait(&ptimer_cond, &ptimer_mtx);
+            continue;
         }
 
-        /* Wake up kevent waiters if they are ready */
-        if (cts) {
-            cnt = write(sr->wfd, &si, sizeof(si));
-            if (cnt < 0) {
-                /* FIXME: handle EAGAIN */
-                dbg_perror("write(2)");
-            } else if ((size_t)cnt < sizeof(si)) {
-                dbg_puts("FIXME: handle short write");
-            }
-            cts = false;
-            si.counter = 0;
+        pt = ptimer_of(tn);
+        now = ptimer_now(CLOCK_MONOTONIC);
+        if (pt->pt_deadline > now) {
+            ts.tv_sec = pt->pt_deadline / 1000000000;
+            ts.tv_nsec = pt->pt_deadline % 1000000000;
+            (void) pthread_cond_timedwait(&ptimer_cond, &ptimer_mtx, &ts);
+            continue;
         }
+
+        ptimer_expire(pt, now);
     }
+    pthread_mutex_unlock(&ptimer_mtx);
 
-    dbg_puts("sleeper thread exiting");
     return (NULL);
 }
 
-static int
-_timer_create(struct filter *filt, struct knote *kn)
+static void
+ptimer_init(void)
 {
+    pthread_condattr_t cattr;
     pthread_attr_t attr;
     pthread_t tid;
-    struct sleepreq *req;
-    kn->kev.flags |= EV_CLEAR;
 
-    req = malloc(sizeof(*req));
-    if (req == NULL) {
-        dbg_perror("malloc");
-        return (-1);
-    }
-    req->pfd = filt->kf_pfd;
-    req->wfd = filt->kf_wfd;
-    req->ident = kn->kev.ident;
-    req->interval = kn->kev.data;
-    kn->data.sleepreq = req;
-    pthread_cond_init(&req->cond, NULL);
-    pthread_mutex_init(&req->mtx, NULL);
+    pthread_condattr_init(&cattr);
+    pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+    pthread_cond_init(&ptimer_cond, &cattr);
+    pthread_condattr_destroy(&cattr);
 
     pthread_attr_init(&attr);
     pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
-    if (pthread_create(&tid, &attr, sleeper_thread, req) != 0) {
-        dbg_perror("pthread_create");
-        pthread_attr_destroy(&attr);
-        free(req);
-        return (-1);
-    }
+    ptimer_error = pthread_create(&tid, &attr, ptimer_service, NULL);
+    if (ptimer_error != 0)
+        dbg_printf("pthread_create(3): %s", strerror(ptimer_error));
     pthread_attr_destroy(&attr);
-
-    return (0);
 }
 
+/*
+ * Start the timer, with its first expiration one period from now. An
+ * absolute time is on CLOCK_REALTIME, and is converted to CLOCK_MONOTONIC
+ * when the timer is started; CLOCK_BOOTTIME is not available, and
+ * CLOCK_MONOTONIC is used instead.
+ */
 static int
-_timer_delete(struct knote *kn)
+ptimer_arm(struct knote *kn)
 {
-    if (kn->data.sleepreq != NULL) {
-        dbg_puts("deleting timer");
-        pthread_mutex_lock(&kn->data.sleepreq->mtx); //FIXME - error check
-        pthread_cond_signal(&kn->data.sleepreq->cond); //FIXME - error check
-        pthread_mutex_unlock(&kn->data.sleepreq->mtx); //FIXME - error check
-        pthread_cond_destroy(&kn->data.sleepreq->cond); //FIXME - error check
-        free(kn->data.sleepreq);
-        kn->data.sleepreq = NULL;
+    struct ptimer *pt = kn->data.ptimer;
+    uint64_t interval, now, real;
+    int rv = 0;
+
+    if (timer_interval(&kn->kev, &interval) < 0)
+        return (-1);
+
+    now = ptimer_now(CLOCK_MONOTONIC);
+    pthread_mutex_lock(&ptimer_mtx);
+    if (pt->pt_node.tn_index != 0)
+        timer_heap_remove(&ptimer_heap, &pt->pt_node);
+    ptimer_unready(pt);
+    pt->pt_count = 0;
+    if (kn->kev.fflags & NOTE_ABSTIME) {
+        real = ptimer_now(CLOCK_REALTIME);
+        pt->pt_deadline = now + (interval > real ? interval - real : 0);
+        pt->pt_period = 0;
+    } else {
+        pt->pt_deadline = now + interval;
+        pt->pt_period = (kn->kev.flags & EV_ONESHOT) ? 0 : interval;
     }
-    return (0);
+    rv = ptimer_insert(pt);
+
+    /* A timer that is already due is ready without the service thread */
+    if (rv == 0 && pt->pt_deadline <= now)
+        ptimer_expire(pt, now);
+    pthread_mutex_unlock(&ptimer_mtx);
+
+    return (rv);
 }
 
-int
-evfilt_timer_init(struct filter *filt)
+static void
+ptimer_disarm(struct ptimer *pt)
+{
+    pthread_mutex_lock(&ptimer_mtx);
+    if (pt->pt_node.tn_index != 0)
+        timer_heap_remove(&ptimer_heap, &pt->pt_node);
+    ptimer_unready(pt);
+    pt->pt_count = 0;
+    pthread_mutex_unlock(&ptimer_mtx);
+}
+
+static int
+evfilt_ptimer_init(struct filter *filt)
 {
-    int fd[2];
+    filt->kf_data = malloc(sizeof(*filt->kf_data));
+    if (filt->kf_data == NULL)
+        return (-1);
+    TAILQ_INIT(&filt->kf_data->ed_ready);
 
-    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fd) < 0) {
-        dbg_perror("socketpair(3)");
+    if (kqops.eventfd_init(&filt->kf_efd) < 0) {
+        free(filt->kf_data);
+        filt->kf_data = NULL;
         return (-1);
     }
-    if (fcntl(fd[0], F_SETFL, O_NONBLOCK) < 0
-        || fcntl(fd[1], F_SETFL, O_NONBLOCK) < 0) {
-        dbg_perror("fcntl(2)");
-        close(fd[0]);
-        close(fd[1]);
-        return (-1);
+    filt->kf_pfd = kqops.eventfd_descriptor(&filt->kf_efd);
+
+#if defined(__linux__)
+    {
+        struct epoll_event ev;
+
+        /* The kqueue waits on an epoll set, and not on kf_pfd */
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = filt;
+        if (epoll_ctl(filter_epfd(filt), EPOLL_CTL_ADD, filt->kf_pfd, &ev) < 0) {
+            dbg_perror("epoll_ctl(2)");
+            kqops.eventfd_close(&filt->kf_efd);
+            free(filt->kf_data);
+            filt->kf_data = NULL;
+            return (-1);
+        }
     }
-
-    filt->kf_wfd = fd[0];
-    filt->kf_pfd = fd[1];
+#endif
 
     return (0);
 }
 
-void
-evfilt_timer_destroy(struct filter *filt)
+static void
+evfilt_ptimer_destroy(struct filter *filt)
 {
-    (void) close(filt->kf_wfd);
-    (void) close(filt->kf_pfd);
+    kqops.eventfd_close(&filt->kf_efd);
+    free(filt->kf_data);
+    filt->kf_data = NULL;
 }
 
+/*
+ * Copy out the timers on the ready list of the filter, up to nevents of
+ * them, and return the number of kevents. The others stay on the list,
+ * which keeps the eventfd raised.
+ */
 int
-evfilt_timer_copyout(struct kevent *dst, struct knote *src, void *ptr UNUSED)
+posix_evfilt_timer_copyout(struct filter *filt, struct kevent *eventlist,
+        int nevents)
 {
-    struct filter *filt;
-    struct sleepinfo    si;
-    ssize_t       cnt;
+    struct ptimer *pt;
     struct knote *kn;
+    int nret = 0;
 
-    filt = knote_get_filter(src);
-
-    /* Read the ident */
-    cnt = read(filt->kf_pfd, &si, sizeof(si));
-    if (cnt < 0) {
-        if (errno == EINTR)
-            return (-EINTR);
-        /* FIXME: handle EAGAIN */
-        dbg_printf("read(2): %s", strerror(errno));
-        return (-1);
-    } else if ((size_t)cnt < sizeof(si)) {
-        dbg_puts("error: short read");
-        return (-1);
+    while (nret < nevents) {
+        pthread_mutex_lock(&ptimer_mtx);
+        pt = TAILQ_FIRST(&filt->kf_data->ed_ready);
+        if (pt == NULL) {
+            pthread_mutex_unlock(&ptimer_mtx);
+            break;
+        }
+        kn = pt->pt_kn;
+        memcpy(&eventlist[nret], &kn->kev, sizeof(eventlist[nret]));
+        eventlist[nret].data = pt->pt_count;
+        pt->pt_count = 0;
+        ptimer_unready(pt);
+        pthread_mutex_unlock(&ptimer_mtx);
+
+        if (kn->kev.flags & EV_DISPATCH)
+            knote_disable(filt, kn); //FIXME: Error checking
+        else if (kn->kev.flags & EV_ONESHOT)
+            knote_delete(filt, kn); //FIXME: Error checking
+        nret++;
     }
 
-    /* Acknowlege receipt */
-    cnt = write(filt->kf_pfd, ".", 1);
-    if (cnt < 0) {
-        /* FIXME: handle EAGAIN and EINTR */
-        dbg_printf("write(2): %s", strerror(errno));
-        return (-1);
-    } else if (cnt < 1) {
-        dbg_puts("error: short write");
-        return (-1);
-    }
+    return (nret);
+}
 
-    kn = knote_lookup(filt, si.ident);
+/* Timers are copied out by posix_evfilt_timer_copyout() */
+static int
+evfilt_ptimer_copyout(struct kevent *dst, struct knote *src UNUSED,
+        void *ptr UNUSED)
+{
+    memset(dst, 0, sizeof(*dst));
+    return (0);
+}
 
-    /* Race condition: timer events remain queued even after
-       the knote is deleted. Ignore these events */
-    if (kn == NULL)
-        return (0);
+static int
+evfilt_ptimer_knote_create(struct filter *filt, struct knote *kn)
+{
+    struct ptimer *pt;
 
-    dbg_printf("knote=%p", kn);
-    memcpy(dst, &kn->kev, sizeof(*dst));
+#if defined(NOTE_PROCESS_CPUTIME)
+    if (kn->kev.fflags & (NOTE_PROCESS_CPUTIME | NOTE_THREAD_CPUTIME)) {
+        errno = EINVAL;
+        return (-1);
+    }
+#endif
 
-    dst->data = si.counter;
+    (void) pthread_once(&ptimer_once, ptimer_init);
+    if (ptimer_error != 0) {
+        errno = ptimer_error;
+        return (-1);
+    }
 
+    pt = calloc(1, sizeof(*pt));
+    if (pt == NULL)
+        return (-1);
+    pt->pt_filt = filt;
+    pt->pt_kn = kn;
+    kn->data.ptimer = pt;
 
-    return (1);
-}
+    timer_kevent_set(kn, &kn->kev);
+    kn->kev.flags |= EV_CLEAR;
+    if (ptimer_arm(kn) < 0) {
+        kn->data.ptimer = NULL;
+        free(pt);
+        return (-1);
+    }
 
-int
-evfilt_timer_knote_create(struct filter *filt, struct knote *kn)
-{
-    return _timer_create(filt, kn);
+    return (0);
 }
 
-int
-evfilt_timer_knote_modify(struct filter *filt, struct knote *kn,
+static int
+evfilt_ptimer_knote_modify(struct filter *filt UNUSED, struct knote *kn,
         const struct kevent *kev)
 {
-    (void) filt;
-    (void) kn;
-    (void) kev;
-    return (-1); /* STUB */
+    uint64_t interval;
+
+    if (!(kev->flags & EV_ADD))
+        return (0);
+    if (timer_interval(kev, &interval) < 0)
+        return (-1);
+
+    timer_kevent_set(kn, kev);
+    if (kn->kev.flags & EV_DISABLE)
+        return (0);
+
+    return (ptimer_arm(kn));
 }
 
-int
-evfilt_timer_knote_delete(struct filter *filt, struct knote *kn)
+static int
+evfilt_ptimer_knote_delete(struct filter *filt UNUSED, struct knote *kn)
 {
-    (void) filt;
-    if (kn->kev.flags & EV_DISABLE)
+    if (kn->data.ptimer == NULL)
         return (0);
 
-    dbg_printf("deleting timer # %d", (int) kn->kev.ident);
-    return _timer_delete(kn);
+    ptimer_disarm(kn->data.ptimer);
+    free(kn->data.ptimer);
+    kn->data.ptimer = NULL;
+
+    return (0);
 }
 
-int
-evfilt_timer_knote_enable(struct filter *filt, struct knote *kn)
+static int
+evfilt_ptimer_knote_enable(struct filter *filt UNUSED, struct knote *kn)
 {
-    return evfilt_timer_knote_create(filt, kn);
+    return (ptimer_arm(kn));
 }
 
-int
-evfilt_timer_knote_disable(struct filter *filt, struct knote *kn)
+/* Disabling the timer also discards any expirations that were not reported */
+static int
+evfilt_ptimer_knote_disable(struct filter *filt UNUSED, struct knote *kn)
 {
-    return evfilt_timer_knote_delete(filt, kn);
+    ptimer_disarm(kn->data.ptimer);
+    return (0);
 }
 
+const struct filter posix_evfilt_timer = {
+    EVFILT_TIMER,
+    evfilt_ptimer_init,
+    evfilt_ptimer_destroy,
+    evfilt_ptimer_copyout,
+    evfilt_ptimer_knote_create,
+    evfilt_ptimer_knote_modify,
+    evfilt_ptimer_knote_delete,
+    evfilt_ptimer_knote_enable,
+    evfilt_ptimer_knote_disable,
+};
+
+#if !defined(__linux__)
+/* Elsewhere, there are no other timers to fall back from */
 const struct filter evfilt_timer = {
     EVFILT_TIMER,
-    evfilt_timer_init,
-    evfilt_timer_destroy,
-    evfilt_timer_copyout,
-    evfilt_timer_knote_create,
-    evfilt_timer_knote_modify,
-    evfilt_timer_knote_delete,
-    evfilt_timer_knote_enable,
-    evfilt_timer_knote_disable,
+    evfilt_ptimer_init,
+    evfilt_ptimer_destroy,
+    evfilt_ptimer_copyout,
+    evfilt_ptimer_knote_create,
+    evfilt_ptimer_knote_modify,
+    evfilt_ptimer_knote_delete,
+    evfilt_ptimer_knote_enable,
+    evfilt_ptimer_knote_disable,
 };
+#endif
@@ -0,0 +1,360 @@
+/*
+ * Copyright (c) 2026 libkqueue contributors
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Verify that the steady-state kevent() path does not allocate memory
+ * or create descriptors.
+ *
+ * The memory allocator and the descriptor-creating system calls used by
+ * the library are interposed here. While a hot loop is being measured,
+ * every call made by the measuring thread is counted; the loop passes
+ * if both counts are zero.
+ */
+
+#include "common.h"
+
+#include <dlfcn.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+
+static __thread int hot_armed;
+static __thread unsigned long hot_nalloc;
+static __thread unsigned long hot_nfd;
+
+static void
+hot_begin(void)
+{
+    hot_nalloc = 0;
+    hot_nfd = 0;
+    hot_armed = 1;
+}
+
+static void
+hot_end(unsigned long *nalloc, unsigned long *nfd)
+{
+    hot_armed = 0;
+    *nalloc = hot_nalloc;
+    *nfd = hot_nfd;
+}
+
+extern "C" {
+
+void *__libc_malloc(size_t);
+void *__libc_calloc(size_t, size_t);
+void *__libc_realloc(void *, size_t);
+void *__libc_memalign(size_t, size_t);
+
+void *
+malloc(size_t size)
+{
+    if (hot_armed)
+        hot_nalloc++;
+    return __libc_malloc(size);
+}
+
+void *
+calloc(size_t nmemb, size_t size)
+{
+    if (hot_armed)
+        hot_nalloc++;
+    return __libc_calloc(nmemb, size);
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+    if (hot_armed)
+        hot_nalloc++;
+    return __libc_realloc(ptr, size);
+}
+
+int
+posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+    void *p;
+
+    if (hot_armed)
+        hot_nalloc++;
+    p = __libc_memalign(alignment, size);
+    if (p == NULL)
+        return (ENOMEM);
+    *memptr = p;
+    return (0);
+}
+
+/*
+ * Wrap a descriptor-creating function, forwarding to the next
+ * definition of <name> (normally the one in the C library).
+ */
+#define FD_INTERPOSE(rtype, name, proto, args)                  \
+rtype                                                           \
+name proto                                                      \
+{                                                               \
+    static rtype (*real) proto;                                 \
+                                                                \
+    if (real == NULL)                                           \
+        *(void **) &real = dlsym(RTLD_NEXT, #name);             \
+    if (hot_armed)                                              \
+        hot_nfd++;                                              \
+    return real args;                                           \
+}
+
+FD_INTERPOSE(int, epoll_create, (int size), (size))
+FD_INTERPOSE(int, epoll_create1, (int flags), (flags))
+FD_INTERPOSE(int, eventfd, (unsigned int initval, int flags), (initval, flags))
+FD_INTERPOSE(int, timerfd_create, (int clockid, int flags), (clockid, flags))
+FD_INTERPOSE(int, signalfd, (int fd, const sigset_t *mask, int flags),
+        (fd, mask, flags))
+FD_INTERPOSE(int, inotify_init, (void), ())
+FD_INTERPOSE(int, inotify_init1, (int flags), (flags))
+FD_INTERPOSE(int, socket, (int domain, int type, int protocol),
+        (domain, type, protocol))
+FD_INTERPOSE(int, socketpair, (int domain, int type, int protocol, int sv[2]),
+        (domain, type, protocol, sv))
+FD_INTERPOSE(int, pipe, (int fds[2]), (fds))
+FD_INTERPOSE(int, dup, (int fd), (fd))
+
+}   /* extern "C" */
+
+/* Run <loop> <n> times after a warm-up pass, and count what it did */
+#define EXPECT_HOT_LOOP(n, loop) do {                               \
+    unsigned long _nalloc, _nfd;                                    \
+    int _i;                                                         \
+                                                                    \
+    loop;                                                           \
+    hot_begin();                                                    \
+    for (_i = 0; _i < (n); _i++) {                                  \
+        loop;                                                       \
+    }                                                               \
+    hot_end(&_nalloc, &_nfd);                                       \
+    EXPECT_EQ(0UL, _nalloc) << "heap allocations in the hot loop";  \
+    EXPECT_EQ(0UL, _nfd) << "descriptors created in the hot loop";  \
+} while (0)
+
+static const struct timespec zero_ts = { 0, 0 };
+
+/* Sanity check of the harness itself */
+TEST(Alloc, Harness)
+{
+    unsigned long nalloc, nfd;
+    void *p;
+    int fd;
+
+    hot_begin();
+    p = malloc(1);
+    fd = eventfd(0, 0);
+    hot_end(&nalloc, &nfd);
+    free(p);
+    close(fd);
+
+    EXPECT_EQ(1UL, nalloc);
+    EXPECT_EQ(1UL, nfd);
+}
+
+TEST(Alloc, ReadWait)
+{
+    struct kevent kev;
+    int kqfd, sv[2];
+    char c = 'x';
+
+    ASSERT_GE(kqfd = kqueue(), 0);
+    ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, sv));
+
+    kev = KEventCreate(sv[0], EVFILT_READ, EV_ADD);
+    ASSERT_EQ(0, kevent(kqfd, &kev, 1, NULL, 0, NULL)) << strerror(errno);
+
+    EXPECT_HOT_LOOP(100, {
+        ASSERT_EQ(1, write(sv[1], &c, 1));
+        ASSERT_EQ(1, kevent(kqfd, NULL, 0, &kev, 1, NULL));
+        ASSERT_EQ(1, read(sv[0], &c, 1));
+        ASSERT_EQ(0, kevent(kqfd, NULL, 0, &kev, 1, &zero_ts));
+    });
+
+    close(sv[0]);
+    close(sv[1]);
+    close(kqfd);
+}
+
+/* Knotes are recycled, so add/delete churn does not reach malloc() */
+TEST(Alloc, ReadAddDelete)
+{
+    struct kevent kev[2];
+    int kqfd, sv[2];
+
+    ASSERT_GE(kqfd = kqueue(), 0);
+    ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, sv));
+
+    kev[0] = KEventCreate(sv[0], EVFILT_READ, EV_ADD);
+    kev[1] = KEventCreate(sv[0], EVFILT_READ, EV_DELETE);
+
+    EXPECT_HOT_LOOP(100, {
+        ASSERT_EQ(0, kevent(kqfd, kev, 2, NULL, 0, NULL)) << strerror(errno);
+    });
+
+    close(sv[0]);
+    close(sv[1]);
+    close(kqfd);
+}
+
+TEST(Alloc, ReadDispatch)
+{
+    struct kevent kev;
+    int kqfd, sv[2];
+    char c = 'x';
+
+    ASSERT_GE(kqfd = kqueue(), 0);
+    ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, sv));
+    ASSERT_EQ(1, write(sv[1], &c, 1));
+
+    kev = KEventCreate(sv[0], EVFILT_READ, EV_ADD | EV_DISPATCH);
+    ASSERT_EQ(0, kevent(kqfd, &kev, 1, NULL, 0, NULL)) << strerror(errno);
+
+    EXPECT_HOT_LOOP(100, {
+        ASSERT_EQ(1, kevent(kqfd, NULL, 0, &kev, 1, NULL));
+        kev.flags = EV_ENABLE;
+        ASSERT_EQ(0, kevent(kqfd, &kev, 1, NULL, 0, NULL)) << strerror(errno);
+    });
+
+    close(sv[0]);
+    close(sv[1]);
+    close(kqfd);
+}
+
+TEST(Alloc, TimerDispatch)
+{
+    struct kevent kev;
+    int kqfd;
+
+    ASSERT_GE(kqfd = kqueue(), 0);
+
+    kev = KEventCreate(1, EVFILT_TIMER, EV_ADD | EV_DISPATCH, 0, 1);
+    ASSERT_EQ(0, kevent(kqfd, &kev, 1, NULL, 0, NULL)) << strerror(errno);
+
+    EXPECT_HOT_LOOP(20, {
+        ASSERT_EQ(1, kevent(kqfd, NULL, 0, &kev, 1, NULL));
+        kev.flags = EV_ENABLE;
+        ASSERT_EQ(0, kevent(kqfd, &kev, 1, NULL, 0, NULL)) << strerror(errno);
+    });
+
+    close(kqfd);
+}
+
+TEST(Alloc, TimerDisableEnable)
+{
+    struct kevent kev;
+    int kqfd;
+
+    ASSERT_GE(kqfd = kqueue(), 0);
+
+    kev = KEventCreate(1, EVFILT_TIMER, EV_ADD, 0, 1000);
+    ASSERT_EQ(0, kevent(kqfd, &kev, 1, NULL, 0, NULL)) << strerror(errno);
+
+    EXPECT_HOT_LOOP(100, {
+        kev.flags = EV_DISABLE;
+        ASSERT_EQ(0, kevent(kqfd, &kev, 1, NULL, 0, NULL)) << strerror(errno);
+        kev.flags = EV_ENABLE;
+        ASSERT_EQ(0, kevent(kqfd, &kev, 1, NULL, 0, NULL)) << strerror(errno);
+    });
+
+    close(kqfd);
+}
+
+TEST(Alloc, UserTrigger)
+{
+    struct kevent kev, trigger;
+    int kqfd;
+
+    ASSERT_GE(kqfd = kqueue(), 0);
+
+    kev = KEventCreate(1, EVFILT_USER, EV_ADD | EV_CLEAR);
+    ASSERT_EQ(0, kevent(kqfd, &kev, 1, NULL, 0, NULL)) << strerror(errno);
+    trigger = KEventCreate(1, EVFILT_USER, 0, NOTE_TRIGGER);
+
+    EXPECT_HOT_LOOP(100, {
+        ASSERT_EQ(1, kevent(kqfd, &trigger, 1, &kev, 1, &zero_ts));
+    });
+
+    close(kqfd);
+}
+
+TEST(Alloc, UserDispatch)
+{
+    struct kevent kev, trigger;
+    int kqfd;
+
+    ASSERT_GE(kqfd = kqueue(), 0);
+
+    kev = KEventCreate(1, EVFILT_USER, EV_ADD | EV_CLEAR | EV_DISPATCH);
+    ASSERT_EQ(0, kevent(kqfd, &kev, 1, NULL, 0, NULL)) << strerror(errno);
+    trigger = KEventCreate(1, EVFILT_USER, 0, NOTE_TRIGGER);
+
+    EXPECT_HOT_LOOP(100, {
+        ASSERT_EQ(1, kevent(kqfd, &trigger, 1, &kev, 1, &zero_ts));
+        kev = KEventCreate(1, EVFILT_USER, EV_ENABLE);
+        ASSERT_EQ(0, kevent(kqfd, &kev, 1, NULL, 0, NULL)) << strerror(errno);
+    });
+
+    close(kqfd);
+}
+
+TEST(Alloc, SignalDispatch)
+{
+    struct kevent kev;
+    int kqfd;
+
+    ASSERT_GE(kqfd = kqueue(), 0);
+
+    kev = KEventCreate(SIGUSR2, EVFILT_SIGNAL, EV_ADD | EV_DISPATCH);
+    ASSERT_EQ(0, kevent(kqfd, &kev, 1, NULL, 0, NULL)) << strerror(errno);
+
+    EXPECT_HOT_LOOP(100, {
+        ASSERT_EQ(0, kill(getpid(), SIGUSR2));
+        ASSERT_EQ(1, kevent(kqfd, NULL, 0, &kev, 1, NULL));
+        kev.flags = EV_ENABLE;
+        ASSERT_EQ(0, kevent(kqfd, &kev, 1, NULL, 0, NULL)) << strerror(errno);
+    });
+
+    kev.flags = EV_DELETE;
+    EXPECT_EQ(0, kevent(kqfd, &kev, 1, NULL, 0, NULL)) << strerror(errno);
+    close(kqfd);
+}
+
+TEST(Alloc, VnodeDisableEnable)
+{
+    struct kevent kev;
+    char path[] = "/tmp/kqueue-alloc.XXXXXX";
+    int kqfd, fd;
+
+    ASSERT_GE(kqfd = kqueue(), 0);
+    ASSERT_GE(fd = mkstemp(path), 0);
+
+    kev = KEventCreate(fd, EVFILT_VNODE, EV_ADD, NOTE_ATTRIB);
+    ASSERT_EQ(0, kevent(kqfd, &kev, 1, NULL, 0, NULL)) << strerror(errno);
+
+    EXPECT_HOT_LOOP(100, {
+        kev.flags = EV_DISABLE;
+        ASSERT_EQ(0, kevent(kqfd, &kev, 1, NULL, 0, NULL)) << strerror(errno);
+        kev.flags = EV_ENABLE;
+        ASSERT_EQ(0, kevent(kqfd, &kev, 1, NULL, 0, NULL)) << strerror(errno);
+    });
+
+    close(fd);
+    unlink(path);
+    close(kqfd);
+}
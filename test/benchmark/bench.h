@@ -0,0 +1,111 @@
+/*
+ * Copyright (c) 2026 libkqueue contributors
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _BENCH_H
+#define _BENCH_H
+
+/*
+ * A minimal benchmark harness.
+ *
+ * Each benchmark is a function declared with BENCHMARK(name). It does its
+ * own setup, then brackets the measured loop with b.Start() and
+ * b.Stop(ops). Extra figures of merit (wakeups, syscalls per operation,
+ * etc.) are attached with b.Report().
+ *
+ * The size of every run is scaled by the command line, so that the same
+ * binary can be used for a quick smoke test or a long measurement.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/event.h>
+
+#define BENCH_MAX_COUNTERS 8
+
+class Benchmark {
+public:
+    typedef void (*func_t)(Benchmark &);
+
+    Benchmark(const char *name, func_t func);
+
+    const char *Name() const { return name_; }
+
+    /* Scale a default iteration count by the command line settings */
+    unsigned long Iterations(unsigned long n) const;
+
+    void Start();
+    void Stop(unsigned long ops);
+    void Report(const char *counter, double value);
+    void Fail(const char *fmt, ...);
+
+    /* Elapsed time of the last Start()/Stop() pair, in nanoseconds */
+    uint64_t Elapsed() const { return elapsed_; }
+
+    bool Run();
+
+    static Benchmark *head;
+    static double scale;
+
+private:
+    const char *name_;
+    func_t func_;
+    Benchmark *next_;
+
+    struct timespec start_;
+    uint64_t elapsed_;
+    unsigned long ops_;
+    bool failed_;
+
+    int ncounters_;
+    const char *counter_name_[BENCH_MAX_COUNTERS];
+    double counter_val_[BENCH_MAX_COUNTERS];
+
+    friend int bench_main(int, char **);
+};
+
+#define BENCHMARK(name)                                      \
+    static void bench_##name(Benchmark &);                   \
+    static Benchmark bench_reg_##name(#name, bench_##name);  \
+    static void bench_##name(Benchmark &b)
+
+/* Monotonic time in nanoseconds */
+static inline uint64_t
+bench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+/* Process CPU time (user + system) in nanoseconds */
+static inline uint64_t
+bench_cputime(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ((uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+int bench_main(int, char **);
+
+#endif  /* _BENCH_H */
@@ -0,0 +1,1548 @@
+/*
+ * Copyright (c) 2026 libkqueue contributors
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Benchmarks of the kqueue()/kevent() interface against the real kernel.
+ *
+ * This file is linked both with libkqueue (libkqueue-bench) and with
+ * kqlite (libkqueue-litebench), so that the two implementations can be
+ * compared by running the same benchmark in each binary.
+ */
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#if defined(__linux__)
+# include <dlfcn.h>
+# include <sys/epoll.h>
+#endif
+
+#include "bench.h"
+
+#define MAX_OUT 512
+
+static const struct timespec zero_ts = { 0, 0 };
+
+#if defined(__linux__)
+/* The number of epoll_ctl() calls, counted by interposing on libc */
+static unsigned long nepoll_ctl;
+
+extern "C" int
+epoll_ctl(int epfd, int op, int fd, struct epoll_event *ev)
+{
+    static int (*real)(int, int, int, struct epoll_event *);
+
+    if (real == NULL)
+        *(void **) &real = dlsym(RTLD_NEXT, "epoll_ctl");
+    nepoll_ctl++;
+    return real(epfd, op, fd, ev);
+}
+
+# define REPORT_EPOLL_CTL(b, start, n) \
+    (b).Report("epoll_ctl/op", (double) (nepoll_ctl - (start)) / (n))
+#else
+static unsigned long nepoll_ctl;
+# define REPORT_EPOLL_CTL(b, start, n) do { } while (0)
+#endif
+
+/* Write a byte, wait for the READ event, then read the byte back */
+BENCHMARK(engine_read_pingpong)
+{
+    unsigned long i, n = b.Iterations(200000);
+    struct kevent kev;
+    int sv[2], kqfd;
+    char c = 'x';
+
+    if ((kqfd = kqueue()) < 0)
+        return b.Fail("kqueue");
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+        return b.Fail("socketpair");
+
+    EV_SET(&kev, sv[0], EVFILT_READ, EV_ADD, 0, 0, NULL);
+    if (kevent(kqfd, &kev, 1, NULL, 0, NULL) < 0)
+        return b.Fail("kevent");
+
+    b.Start();
+    for (i = 0; i < n; i++) {
+        if (write(sv[1], &c, 1) != 1)
+            return b.Fail("write");
+        if (kevent(kqfd, NULL, 0, &kev, 1, NULL) != 1)
+            return b.Fail("kevent");
+        if (read(sv[0], &c, 1) != 1)
+            return b.Fail("read");
+    }
+    b.Stop(n);
+
+    close(sv[0]);
+    close(sv[1]);
+    close(kqfd);
+}
+
+/* EV_ADD followed by EV_DELETE of a READ knote on a socket */
+BENCHMARK(engine_read_add_delete)
+{
+    unsigned long i, n = b.Iterations(200000);
+    struct kevent kev[2];
+    int sv[2], kqfd;
+
+    if ((kqfd = kqueue()) < 0)
+        return b.Fail("kqueue");
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+        return b.Fail("socketpair");
+
+    EV_SET(&kev[0], sv[0], EVFILT_READ, EV_ADD, 0, 0, NULL);
+    EV_SET(&kev[1], sv[0], EVFILT_READ, EV_DELETE, 0, 0, NULL);
+
+    b.Start();
+    for (i = 0; i < n; i++) {
+        if (kevent(kqfd, kev, 2, NULL, 0, NULL) < 0)
+            return b.Fail("kevent");
+    }
+    b.Stop(n);
+
+    close(sv[0]);
+    close(sv[1]);
+    close(kqfd);
+}
+
+/*
+ * Connection churn: READ and WRITE knotes are added for a socket and then
+ * deleted. The WRITE knote finds the type of the descriptor in the cache,
+ * and NOTE_FD_SOCKET lets both knotes skip looking it up.
+ */
+static void
+rw_add_delete(Benchmark &b, unsigned int fflags)
+{
+    unsigned long i, n = b.Iterations(200000);
+    struct kevent kev[4];
+    int sv[2], kqfd;
+
+    if ((kqfd = kqueue()) < 0)
+        return b.Fail("kqueue");
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+        return b.Fail("socketpair");
+
+    EV_SET(&kev[0], sv[0], EVFILT_READ, EV_ADD, fflags, 0, NULL);
+    EV_SET(&kev[1], sv[0], EVFILT_WRITE, EV_ADD | EV_DISABLE, fflags, 0, NULL);
+    EV_SET(&kev[2], sv[0], EVFILT_READ, EV_DELETE, 0, 0, NULL);
+    EV_SET(&kev[3], sv[0], EVFILT_WRITE, EV_DELETE, 0, 0, NULL);
+
+    b.Start();
+    for (i = 0; i < n; i++) {
+        if (kevent(kqfd, kev, 4, NULL, 0, NULL) < 0)
+            return b.Fail("kevent");
+    }
+    b.Stop(n);
+
+    close(sv[0]);
+    close(sv[1]);
+    close(kqfd);
+}
+
+BENCHMARK(engine_rw_add_delete)         { rw_add_delete(b, 0); }
+#if defined(NOTE_FD_SOCKET)
+BENCHMARK(engine_rw_add_delete_hint)    { rw_add_delete(b, NOTE_FD_SOCKET); }
+BENCHMARK(engine_read_add_delete_hint)
+{
+    unsigned long i, n = b.Iterations(200000);
+    struct kevent kev[2];
+    int sv[2], kqfd;
+
+    if ((kqfd = kqueue()) < 0)
+        return b.Fail("kqueue");
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+        return b.Fail("socketpair");
+
+    EV_SET(&kev[0], sv[0], EVFILT_READ, EV_ADD, NOTE_FD_SOCKET, 0, NULL);
+    EV_SET(&kev[1], sv[0], EVFILT_READ, EV_DELETE, 0, 0, NULL);
+
+    b.Start();
+    for (i = 0; i < n; i++) {
+        if (kevent(kqfd, kev, 2, NULL, 0, NULL) < 0)
+            return b.Fail("kevent");
+    }
+    b.Stop(n);
+
+    close(sv[0]);
+    close(sv[1]);
+    close(kqfd);
+}
+#endif
+
+/*
+ * A dispatch-style server loop: each connection has an EV_DISPATCH READ
+ * knote that is re-enabled after its request has been answered.
+ */
+BENCHMARK(engine_dispatch_http)
+{
+    unsigned long i, n = b.Iterations(100000), ctl;
+    const int nconn = 64;
+    struct kevent kev, change;
+    int j, kqfd, sv[2 * nconn];
+    char buf[64];
+
+    if ((kqfd = kqueue()) < 0)
+        return b.Fail("kqueue");
+    for (j = 0; j < nconn; j++) {
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, &sv[2 * j]) < 0)
+            return b.Fail("socketpair");
+        EV_SET(&kev, sv[2 * j], EVFILT_READ, EV_ADD | EV_DISPATCH, 0, 0, NULL);
+        if (kevent(kqfd, &kev, 1, NULL, 0, NULL) < 0)
+            return b.Fail("kevent");
+    }
+
+    ctl = nepoll_ctl;
+    b.Start();
+    for (i = 0; i < n; i++) {
+        j = i % nconn;
+        if (write(sv[2 * j + 1], "GET /", 5) != 5)
+            return b.Fail("write");
+
+        if (kevent(kqfd, NULL, 0, &kev, 1, NULL) != 1)
+            return b.Fail("kevent");
+        if (read(kev.ident, buf, sizeof(buf)) != 5)
+            return b.Fail("read");
+        if (write(kev.ident, "200", 3) != 3)
+            return b.Fail("write");
+        if (read(sv[2 * j + 1], buf, sizeof(buf)) != 3)
+            return b.Fail("read");
+
+        EV_SET(&change, kev.ident, EVFILT_READ, EV_ENABLE, 0, 0, NULL);
+        if (kevent(kqfd, &change, 1, NULL, 0, NULL) < 0)
+            return b.Fail("kevent");
+    }
+    b.Stop(n);
+    REPORT_EPOLL_CTL(b, ctl, n);
+
+    for (j = 0; j < 2 * nconn; j++)
+        close(sv[j]);
+    close(kqfd);
+}
+
+/*
+ * Flow control: a READ knote is disabled while a request is processed,
+ * and enabled again when the next one may be read.
+ */
+static void
+read_toggle(Benchmark &b, unsigned int fflags)
+{
+    unsigned long i, n = b.Iterations(100000), ctl;
+    struct kevent kev, change;
+    int sv[2], kqfd;
+    char c = 'x';
+
+    if ((kqfd = kqueue()) < 0)
+        return b.Fail("kqueue");
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+        return b.Fail("socketpair");
+
+    EV_SET(&kev, sv[0], EVFILT_READ, EV_ADD, fflags, 0, NULL);
+    if (kevent(kqfd, &kev, 1, NULL, 0, NULL) < 0)
+        return b.Fail("kevent");
+
+    ctl = nepoll_ctl;
+    b.Start();
+    for (i = 0; i < n; i++) {
+        if (write(sv[1], &c, 1) != 1)
+            return b.Fail("write");
+        if (kevent(kqfd, NULL, 0, &kev, 1, NULL) != 1)
+            return b.Fail("kevent");
+        if (read(sv[0], &c, 1) != 1)
+            return b.Fail("read");
+
+        EV_SET(&change, sv[0], EVFILT_READ, EV_DISABLE, fflags, 0, NULL);
+        if (kevent(kqfd, &change, 1, NULL, 0, NULL) < 0)
+            return b.Fail("kevent");
+        change.flags = EV_ENABLE;
+        if (kevent(kqfd, &change, 1, NULL, 0, NULL) < 0)
+            return b.Fail("kevent");
+    }
+    b.Stop(n);
+    REPORT_EPOLL_CTL(b, ctl, n);
+
+    close(sv[0]);
+    close(sv[1]);
+    close(kqfd);
+}
+
+BENCHMARK(engine_read_toggle)       { read_toggle(b, 0); }
+#if defined(NOTE_LAZYDISABLE)
+BENCHMARK(engine_read_toggle_lazy)  { read_toggle(b, NOTE_LAZYDISABLE); }
+#endif
+
+/* Return <batch> level-triggered READ events per call */
+static void
+copyout(Benchmark &b, int batch, unsigned int fflags)
+{
+    unsigned long i, n = b.Iterations(20000);
+    unsigned long nev = 0;
+    struct kevent kev, *out;
+    int j, rv, kqfd, *sv;
+
+    if ((kqfd = kqueue()) < 0)
+        return b.Fail("kqueue");
+
+    sv = new int[2 * batch];
+    out = new struct kevent[batch];
+    for (j = 0; j < batch; j++) {
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, &sv[2 * j]) < 0)
+            return b.Fail("socketpair");
+        if (write(sv[2 * j + 1], "x", 1) != 1)
+            return b.Fail("write");
+        EV_SET(&kev, sv[2 * j], EVFILT_READ, EV_ADD, fflags, 0, NULL);
+        if (kevent(kqfd, &kev, 1, NULL, 0, NULL) < 0)
+            return b.Fail("kevent");
+    }
+
+    b.Start();
+    for (i = 0; i < n; i++) {
+        rv = kevent(kqfd, NULL, 0, out, batch, &zero_ts);
+        if (rv != batch)
+            return b.Fail("kevent returned %d, expected %d", rv, batch);
+        nev += rv;
+    }
+    b.Stop(nev);
+    b.Report("events/call", (double) nev / n);
+
+    for (j = 0; j < 2 * batch; j++)
+        close(sv[j]);
+    delete[] sv;
+    delete[] out;
+    close(kqfd);
+}
+
+BENCHMARK(engine_copyout_1)     { copyout(b, 1, 0); }
+BENCHMARK(engine_copyout_64)    { copyout(b, 64, 0); }
+#if defined(NOTE_NODATA)
+BENCHMARK(engine_copyout_64_nodata) { copyout(b, 64, NOTE_NODATA); }
+#endif
+
+/*
+ * READ events on <nfiles> descriptors of a regular file, which is always
+ * readable. The descriptors opened by kqueue for the knotes are reported.
+ */
+static void
+regular_files(Benchmark &b, int nfiles)
+{
+    unsigned long i, n = b.Iterations(20000);
+    unsigned long nev = 0;
+    char path[] = "/tmp/kqueue-bench.XXXXXX";
+    struct kevent kev, *out;
+    int j, rv, kqfd, tmp, next, *fd;
+
+    if ((kqfd = kqueue()) < 0)
+        return b.Fail("kqueue");
+    if ((tmp = mkstemp(path)) < 0)
+        return b.Fail("mkstemp");
+    if (write(tmp, "data", 4) != 4)
+        return b.Fail("write");
+
+    fd = new int[nfiles];
+    out = new struct kevent[nfiles];
+    for (j = 0; j < nfiles; j++) {
+        if ((fd[j] = open(path, O_RDONLY)) < 0)
+            return b.Fail("open");
+    }
+    unlink(path);
+
+    /* The lowest free descriptor, before and after adding the knotes */
+    next = dup(tmp);
+    close(next);
+    for (j = 0; j < nfiles; j++) {
+        EV_SET(&kev, fd[j], EVFILT_READ, EV_ADD, 0, 0, NULL);
+        if (kevent(kqfd, &kev, 1, NULL, 0, NULL) < 0)
+            return b.Fail("kevent");
+    }
+    rv = dup(tmp);
+    close(rv);
+    b.Report("fds/knote", (double) (rv - next) / nfiles);
+
+    b.Start();
+    for (i = 0; i < n; i++) {
+        rv = kevent(kqfd, NULL, 0, out, nfiles, &zero_ts);
+        if (rv != nfiles)
+            return b.Fail("kevent returned %d, expected %d", rv, nfiles);
+        nev += rv;
+    }
+    b.Stop(nev);
+
+    for (j = 0; j < nfiles; j++)
+        close(fd[j]);
+    delete[] fd;
+    delete[] out;
+    close(tmp);
+    close(kqfd);
+}
+
+BENCHMARK(engine_regular_files_256) { regular_files(b, 256); }
+
+/*
+ * tail -f of 256 log files: 4 writer threads append lines to the files
+ * while the reader follows them with level-triggered READ knotes. The
+ * kevent() calls and the CPU time of the process are reported per line.
+ */
+#define TAIL_FILES      256
+#define TAIL_WRITERS    4
+#define TAIL_LINE       "0123456789abcdef0123456789abcde\n"
+
+struct tail_writer {
+    int          *fd;
+    int           first;
+    unsigned long lines;
+};
+
+static void *
+tail_write(void *arg)
+{
+    struct tail_writer *w = (struct tail_writer *) arg;
+    unsigned long i;
+    int j = w->first;
+
+    for (i = 0; i < w->lines; i++) {
+        if (write(w->fd[j], TAIL_LINE, sizeof(TAIL_LINE) - 1) < 0)
+            break;
+        j = (j + TAIL_WRITERS) % TAIL_FILES;
+
+        /* Let the reader keep up, as it would with real loggers */
+        if (i % 16 == 15)
+            sched_yield();
+    }
+
+    return (NULL);
+}
+
+BENCHMARK(engine_tail)
+{
+    unsigned long n = b.Iterations(200000) / TAIL_WRITERS * TAIL_WRITERS;
+    unsigned long total, nread = 0, ncalls = 0;
+    const struct timespec ts = { 1, 0 };
+    uint64_t cpu, last;
+    struct tail_writer w[TAIL_WRITERS];
+    pthread_t tid[TAIL_WRITERS];
+    char path[] = "/tmp/kqueue-bench.XXXXXX";
+    struct kevent kev, out[64];
+    int i, rv, kqfd, wfd[TAIL_FILES], rfd[TAIL_FILES];
+    char buf[4096];
+    ssize_t len;
+
+    if ((kqfd = kqueue()) < 0)
+        return b.Fail("kqueue");
+    for (i = 0; i < TAIL_FILES; i++) {
+        strcpy(path + strlen(path) - 6, "XXXXXX");
+        if ((wfd[i] = mkstemp(path)) < 0)
+            return b.Fail("mkstemp");
+        if ((rfd[i] = open(path, O_RDONLY)) < 0)
+            return b.Fail("open");
+        unlink(path);
+        EV_SET(&kev, rfd[i], EVFILT_READ, EV_ADD, 0, 0, NULL);
+        if (kevent(kqfd, &kev, 1, NULL, 0, NULL) < 0)
+            return b.Fail("kevent");
+    }
+    total = n * (sizeof(TAIL_LINE) - 1);
+
+    b.Start();
+    cpu = bench_cputime();
+    for (i = 0; i < TAIL_WRITERS; i++) {
+        w[i].fd = wfd;
+        w[i].first = i;
+        w[i].lines = n / TAIL_WRITERS;
+        if (pthread_create(&tid[i], NULL, tail_write, &w[i]) != 0)
+            return b.Fail("pthread_create");
+    }
+    last = bench_now();
+    while (nread < total) {
+        rv = kevent(kqfd, NULL, 0, out, 64, &ts);
+        if (rv < 0)
+            return b.Fail("kevent");
+        ncalls++;
+        for (i = 0; i < rv; i++) {
+            /* Read what was reported, without looking for the end */
+            for (; out[i].data > 0; out[i].data -= len) {
+                len = read(out[i].ident, buf, (out[i].data < (intptr_t) sizeof(buf))
+                        ? out[i].data : sizeof(buf));
+                if (len <= 0)
+                    return b.Fail("read");
+                nread += len;
+            }
+            last = bench_now();
+        }
+        if (bench_now() - last > 5000000000ULL)
+            return b.Fail("%lu of %lu bytes read", nread, total);
+    }
+    for (i = 0; i < TAIL_WRITERS; i++)
+        pthread_join(tid[i], NULL);
+    cpu = bench_cputime() - cpu;
+    b.Stop(n);
+    b.Report("kevent/line", (double) ncalls / n);
+    b.Report("cpu-ns/line", (double) cpu / n);
+
+    for (i = 0; i < TAIL_FILES; i++) {
+        close(wfd[i]);
+        close(rfd[i]);
+    }
+    close(kqfd);
+}
+
+/*
+ * READ events at a steady 100k events/s: every millisecond, one byte is
+ * written to each of 100 sockets and the events are collected. The time
+ * spent in kevent() is reported per event.
+ */
+static void
+read_paced(Benchmark &b, unsigned int fflags)
+{
+    const int nsock = 100;
+    unsigned long tick, nticks = b.Iterations(1000), nev = 0;
+    uint64_t t, tkevent = 0, cpu;
+    struct timespec deadline;
+    struct kevent kev, out[nsock];
+    int j, rv, got, kqfd, sv[2 * nsock];
+    char c = 'x';
+
+    if ((kqfd = kqueue()) < 0)
+        return b.Fail("kqueue");
+    for (j = 0; j < nsock; j++) {
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, &sv[2 * j]) < 0)
+            return b.Fail("socketpair");
+        EV_SET(&kev, sv[2 * j], EVFILT_READ, EV_ADD, fflags, 0, NULL);
+        if (kevent(kqfd, &kev, 1, NULL, 0, NULL) < 0)
+            return b.Fail("kevent");
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    cpu = bench_cputime();
+    b.Start();
+    for (tick = 0; tick < nticks; tick++) {
+        for (j = 0; j < nsock; j++) {
+            if (write(sv[2 * j + 1], &c, 1) != 1)
+                return b.Fail("write");
+        }
+        for (got = 0; got < nsock; got += rv) {
+            t = bench_now();
+            rv = kevent(kqfd, NULL, 0, out, nsock - got, NULL);
+            tkevent += bench_now() - t;
+            if (rv < 0)
+                return b.Fail("kevent");
+            for (j = 0; j < rv; j++) {
+                if (read(out[j].ident, &c, 1) != 1)
+                    return b.Fail("read");
+            }
+        }
+        nev += nsock;
+
+        deadline.tv_nsec += 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL);
+    }
+    b.Stop(nev);
+    b.Report("kevent_ns/event", (double) tkevent / nev);
+    b.Report("cpu_ms", (bench_cputime() - cpu) / 1e6);
+
+    for (j = 0; j < 2 * nsock; j++)
+        close(sv[j]);
+    close(kqfd);
+}
+
+BENCHMARK(engine_read_100k)         { read_paced(b, 0); }
+#if defined(NOTE_NODATA)
+BENCHMARK(engine_read_100k_nodata)  { read_paced(b, NOTE_NODATA); }
+#endif
+
+/*
+ * A child process streams data over loopback TCP in 1 KB writes while the
+ * parent waits for READ events and drains the socket after each one. The
+ * number of wakeups needed per megabyte shows how well a NOTE_LOWAT
+ * threshold batches the incoming data.
+ */
+static void
+read_stream(Benchmark &b, unsigned int fflags, intptr_t lowat)
+{
+    unsigned long mb = b.Iterations(64), nwakeup = 0, total = 0;
+    struct sockaddr_in sa;
+    socklen_t slen = sizeof(sa);
+    struct kevent kev;
+    int lfd, fd, kqfd, one = 1;
+    char buf[65536];
+    ssize_t n;
+    pid_t pid;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if ((lfd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+        return b.Fail("socket");
+    if (bind(lfd, (struct sockaddr *) &sa, sizeof(sa)) < 0 || listen(lfd, 1) < 0)
+        return b.Fail("bind");
+    if (getsockname(lfd, (struct sockaddr *) &sa, &slen) < 0)
+        return b.Fail("getsockname");
+
+    pid = fork();
+    if (pid < 0)
+        return b.Fail("fork");
+    if (pid == 0) {
+        close(lfd);
+        if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0 ||
+                connect(fd, (struct sockaddr *) &sa, sizeof(sa)) < 0)
+            _exit(1);
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        memset(buf, 'x', 1024);
+        for (total = 0; total < (mb << 20); total += 1024) {
+            if (write(fd, buf, 1024) != 1024)
+                _exit(1);
+        }
+        _exit(0);
+    }
+
+    if ((fd = accept(lfd, NULL, NULL)) < 0)
+        return b.Fail("accept");
+    close(lfd);
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    if ((kqfd = kqueue()) < 0)
+        return b.Fail("kqueue");
+    EV_SET(&kev, fd, EVFILT_READ, EV_ADD, fflags, lowat, NULL);
+    if (kevent(kqfd, &kev, 1, NULL, 0, NULL) < 0)
+        return b.Fail("kevent");
+
+    b.Start();
+    for (;;) {
+        if (kevent(kqfd, NULL, 0, &kev, 1, NULL) != 1)
+            return b.Fail("kevent");
+        nwakeup++;
+        while ((n = read(fd, buf, sizeof(buf))) > 0)
+            total += n;
+        if (n == 0)
+            break;
+        if (errno != EAGAIN)
+            return b.Fail("read");
+    }
+    b.Stop(total >> 20);
+    b.Report("wakeups/MB", (double) nwakeup / (total >> 20));
+
+    waitpid(pid, NULL, 0);
+    close(fd);
+    close(kqfd);
+}
+
+BENCHMARK(engine_read_stream)       { read_stream(b, 0, 0); }
+#if defined(NOTE_LOWAT)
+BENCHMARK(engine_read_stream_lowat) { read_stream(b, NOTE_LOWAT, 65536); }
+#endif
+
+/*
+ * A child process opens connections to a loopback listener as fast as it
+ * can. The parent either accepts the number of connections reported in
+ * the data field of each event, or calls accept() until EAGAIN.
+ */
+static void
+accept_storm(Benchmark &b, bool use_data)
+{
+    unsigned long i, n = b.Iterations(20000), naccepted = 0;
+    unsigned long nwakeup = 0, ncalls = 0;
+    struct sockaddr_in sa;
+    socklen_t slen = sizeof(sa);
+    struct kevent kev;
+    int lfd, fd, kqfd;
+    intptr_t j;
+    pid_t pid;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if ((lfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0)
+        return b.Fail("socket");
+    if (bind(lfd, (struct sockaddr *) &sa, sizeof(sa)) < 0 || listen(lfd, 4096) < 0)
+        return b.Fail("bind");
+    if (getsockname(lfd, (struct sockaddr *) &sa, &slen) < 0)
+        return b.Fail("getsockname");
+    if ((kqfd = kqueue()) < 0)
+        return b.Fail("kqueue");
+    EV_SET(&kev, lfd, EVFILT_READ, EV_ADD, 0, 0, NULL);
+    if (kevent(kqfd, &kev, 1, NULL, 0, NULL) < 0)
+        return b.Fail("kevent");
+
+    b.Start();
+    pid = fork();
+    if (pid < 0)
+        return b.Fail("fork");
+    if (pid == 0) {
+        for (i = 0; i < n; i++) {
+            if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0 ||
+                    connect(fd, (struct sockaddr *) &sa, sizeof(sa)) < 0)
+                _exit(1);
+            close(fd);
+        }
+        _exit(0);
+    }
+
+    while (naccepted < n) {
+        if (kevent(kqfd, NULL, 0, &kev, 1, NULL) != 1)
+            return b.Fail("kevent");
+        nwakeup++;
+        for (j = 0; !use_data || j < kev.data; j++) {
+            ncalls++;
+            if ((fd = accept(lfd, NULL, NULL)) < 0) {
+                if (errno == EAGAIN)
+                    break;
+                return b.Fail("accept");
+            }
+            close(fd);
+            naccepted++;
+        }
+    }
+    b.Stop(n);
+    b.Report("accept/conn", (double) ncalls / n);
+    b.Report("conn/wakeup", (double) n / nwakeup);
+
+    waitpid(pid, NULL, 0);
+    close(lfd);
+    close(kqfd);
+}
+
+BENCHMARK(engine_accept_storm)      { accept_storm(b, true); }
+BENCHMARK(engine_accept_storm_eagain) { accept_storm(b, false); }
+
+/*
+ * The same connect storm from four processes, but every accepted socket
+ * is watched for READ before it is closed again. The classic server loop
+ * calls accept() until EAGAIN and then adds the new sockets in one
+ * kevent() call; NOTE_ACCEPT does both during copyout. The accept() and
+ * kevent() calls needed per connection are reported.
+ */
+static void
+accept_register(Benchmark &b, bool batch)
+{
+    unsigned long i, n = b.Iterations(20000), naccepted = 0, ncalls = 0;
+    const int nout = 64, nproc = 4;
+    struct sockaddr_in sa;
+    socklen_t slen = sizeof(sa);
+    struct kevent kev, tmpl, out[nout], change[nout];
+    int j, nev, nchange, lfd, fd, kqfd;
+    bool has_tmpl = false;
+    pid_t pid[nproc];
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if ((lfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0)
+        return b.Fail("socket");
+    if (bind(lfd, (struct sockaddr *) &sa, sizeof(sa)) < 0 || listen(lfd, 4096) < 0)
+        return b.Fail("bind");
+    if (getsockname(lfd, (struct sockaddr *) &sa, &slen) < 0)
+        return b.Fail("getsockname");
+    if ((kqfd = kqueue()) < 0)
+        return b.Fail("kqueue");
+    EV_SET(&kev, lfd, EVFILT_READ, EV_ADD, batch ? NOTE_ACCEPT : 0, 0, NULL);
+    if (kevent(kqfd, &kev, 1, NULL, 0, NULL) < 0)
+        return b.Fail("kevent");
+
+    /* kqlite accepts the connections, but cannot register them */
+    EV_SET(&tmpl, 0, EVFILT_READ, EV_ADD, 0, 0, NULL);
+    if (batch)
+        has_tmpl = (kevent_accept_template(kqfd, lfd, &tmpl, 1) == 0);
+
+    b.Start();
+    for (j = 0; j < nproc; j++) {
+        pid[j] = fork();
+        if (pid[j] < 0)
+            return b.Fail("fork");
+        if (pid[j] > 0)
+            continue;
+        for (i = 0; i < n / nproc; i++) {
+            if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0 ||
+                    connect(fd, (struct sockaddr *) &sa, sizeof(sa)) < 0)
+                _exit(1);
+            close(fd);
+        }
+        _exit(0);
+    }
+    n = (n / nproc) * nproc;
+
+    while (naccepted < n) {
+        nev = kevent(kqfd, NULL, 0, out, nout, NULL);
+        ncalls++;
+        if (nev < 0)
+            return b.Fail("kevent");
+
+        /* Collect the new sockets, which are closed at the end */
+        nchange = 0;
+        for (j = 0; j < nev; j++) {
+            if ((int) out[j].ident != lfd)
+                continue;
+            if (!batch)
+                break;
+            if (out[j].flags & EV_ERROR)
+                return b.Fail("accept");
+            EV_SET(&change[nchange++], out[j].data, EVFILT_READ, EV_ADD, 0, 0, NULL);
+        }
+        if (!batch && j < nev) {
+            while (nchange < nout) {
+                ncalls++;
+                if ((fd = accept(lfd, NULL, NULL)) < 0)
+                    break;
+                EV_SET(&change[nchange++], fd, EVFILT_READ, EV_ADD, 0, 0, NULL);
+            }
+        }
+        if (nchange > 0 && !has_tmpl) {
+            ncalls++;
+            if (kevent(kqfd, change, nchange, NULL, 0, NULL) < 0)
+                return b.Fail("kevent");
+        }
+
+        for (j = 0; j < nchange; j++)
+            change[j].flags = EV_DELETE;
+        if (kevent(kqfd, change, nchange, NULL, 0, NULL) < 0)
+            return b.Fail("kevent");
+        for (j = 0; j < nchange; j++)
+            close(change[j].ident);
+        naccepted += nchange;
+    }
+    b.Stop(n);
+    b.Report("syscalls/conn", (double) ncalls / n);
+
+    for (j = 0; j < nproc; j++)
+        waitpid(pid[j], NULL, 0);
+    close(lfd);
+    close(kqfd);
+}
+
+BENCHMARK(engine_accept_register)   { accept_register(b, false); }
+#if defined(NOTE_ACCEPT)
+BENCHMARK(engine_accept_register_batch) { accept_register(b, true); }
+#endif
+
+/*
+ * A thundering herd: eight threads, each with its own kqueue, watch one
+ * listening socket and accept until EAGAIN whenever it is readable. The
+ * wakeups that find no connection to accept are wasted.
+ */
+struct herd_worker {
+    pthread_t       tid;
+    int             lfd;
+    unsigned int    fflags;
+    unsigned long   nwakeup;
+    unsigned long   nempty;
+};
+
+static unsigned long herd_accepted;
+static int herd_stop;
+
+static void *
+herd_worker_main(void *arg)
+{
+    struct herd_worker *w = (struct herd_worker *) arg;
+    const struct timespec ts = { 0, 10000000 };
+    struct kevent kev;
+    int fd, kqfd, n;
+
+    if ((kqfd = kqueue()) < 0)
+        return (NULL);
+    EV_SET(&kev, w->lfd, EVFILT_READ, EV_ADD, w->fflags, 0, NULL);
+    if (kevent(kqfd, &kev, 1, NULL, 0, NULL) < 0)
+        return (NULL);
+
+    while (!__atomic_load_n(&herd_stop, __ATOMIC_ACQUIRE)) {
+        if (kevent(kqfd, NULL, 0, &kev, 1, &ts) != 1)
+            continue;
+        w->nwakeup++;
+        for (n = 0; (fd = accept(w->lfd, NULL, NULL)) >= 0; n++)
+            close(fd);
+        if (n == 0)
+            w->nempty++;
+        __atomic_add_fetch(&herd_accepted, n, __ATOMIC_RELEASE);
+    }
+    close(kqfd);
+
+    return (NULL);
+}
+
+static void
+herd(Benchmark &b, unsigned int fflags)
+{
+    unsigned long i, n = b.Iterations(20000), nwakeup = 0, nempty = 0, ncsw;
+    const int nthread = 8;
+    struct rusage ru;
+    struct herd_worker w[nthread];
+    struct sockaddr_in sa;
+    socklen_t slen = sizeof(sa);
+    int j, lfd, fd;
+    pid_t pid;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if ((lfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0)
+        return b.Fail("socket");
+    if (bind(lfd, (struct sockaddr *) &sa, sizeof(sa)) < 0 || listen(lfd, 4096) < 0)
+        return b.Fail("bind");
+    if (getsockname(lfd, (struct sockaddr *) &sa, &slen) < 0)
+        return b.Fail("getsockname");
+
+    herd_accepted = 0;
+    herd_stop = 0;
+    memset(w, 0, sizeof(w));
+    for (j = 0; j < nthread; j++) {
+        w[j].lfd = lfd;
+        w[j].fflags = fflags;
+        if (pthread_create(&w[j].tid, NULL, herd_worker_main, &w[j]) != 0)
+            return b.Fail("pthread_create");
+    }
+    usleep(10000);
+
+    getrusage(RUSAGE_SELF, &ru);
+    ncsw = ru.ru_nvcsw + ru.ru_nivcsw;
+    b.Start();
+    pid = fork();
+    if (pid < 0)
+        return b.Fail("fork");
+    if (pid == 0) {
+        for (i = 0; i < n; i++) {
+            if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0 ||
+                    connect(fd, (struct sockaddr *) &sa, sizeof(sa)) < 0)
+                _exit(1);
+            close(fd);
+        }
+        _exit(0);
+    }
+    while (__atomic_load_n(&herd_accepted, __ATOMIC_ACQUIRE) < n)
+        usleep(1000);
+    b.Stop(n);
+    getrusage(RUSAGE_SELF, &ru);
+    ncsw = ru.ru_nvcsw + ru.ru_nivcsw - ncsw;
+
+    __atomic_store_n(&herd_stop, 1, __ATOMIC_RELEASE);
+    for (j = 0; j < nthread; j++) {
+        pthread_join(w[j].tid, NULL);
+        nwakeup += w[j].nwakeup;
+        nempty += w[j].nempty;
+    }
+    b.Report("wakeups/conn", (double) nwakeup / n);
+    b.Report("empty/conn", (double) nempty / n);
+    b.Report("csw/conn", (double) ncsw / n);
+
+    waitpid(pid, NULL, 0);
+    close(lfd);
+}
+
+BENCHMARK(engine_herd)              { herd(b, 0); }
+#if defined(NOTE_EXCLUSIVE)
+BENCHMARK(engine_herd_exclusive)    { herd(b, NOTE_EXCLUSIVE); }
+#endif
+
+/* Many periodic timers running for a fixed amount of wall time */
+static void
+timers(Benchmark &b, int ntimers)
+{
+    uint64_t deadline, cpu;
+    unsigned long nev = 0, ncalls = 0;
+    struct kevent kev, out[MAX_OUT];
+    int j, rv, kqfd;
+
+    if ((kqfd = kqueue()) < 0)
+        return b.Fail("kqueue");
+
+    /* 1ms .. 10ms periods, so each wakeup fires a varying subset */
+    for (j = 0; j < ntimers; j++) {
+        EV_SET(&kev, j, EVFILT_TIMER, EV_ADD, 0, 1 + j % 10, NULL);
+        if (kevent(kqfd, &kev, 1, NULL, 0, NULL) < 0)
+            return b.Fail("kevent");
+    }
+
+    cpu = bench_cputime();
+    b.Start();
+    deadline = bench_now() + b.Iterations(1000) * 1000000;
+    while (bench_now() < deadline) {
+        rv = kevent(kqfd, NULL, 0, out, MAX_OUT, NULL);
+        if (rv < 0)
+            return b.Fail("kevent");
+        nev += rv;
+        ncalls++;
+    }
+    b.Stop(nev);
+    b.Report("wakeups", ncalls);
+    b.Report("cpu_ms", (bench_cputime() - cpu) / 1e6);
+
+    close(kqfd);
+}
+
+BENCHMARK(engine_timer_10)      { timers(b, 10); }
+BENCHMARK(engine_timer_1000)    { timers(b, 1000); }
+
+/* EV_ADD followed by EV_DELETE of a timer */
+BENCHMARK(engine_timer_add_delete)
+{
+    unsigned long i, n = b.Iterations(200000);
+    struct kevent kev[2];
+    int kqfd;
+
+    if ((kqfd = kqueue()) < 0)
+        return b.Fail("kqueue");
+
+    EV_SET(&kev[0], 1, EVFILT_TIMER, EV_ADD, 0, 1000, NULL);
+    EV_SET(&kev[1], 1, EVFILT_TIMER, EV_DELETE, 0, 0, NULL);
+
+    b.Start();
+    for (i = 0; i < n; i++) {
+        if (kevent(kqfd, kev, 2, NULL, 0, NULL) < 0)
+            return b.Fail("kevent");
+    }
+    b.Stop(n);
+
+    close(kqfd);
+}
+
+/*
+ * Request deadlines: each of 1000 timers of 5s is pushed back over and
+ * over, and never fires. It is restarted by EV_ADD in place, by deleting
+ * and adding it again, or by disabling and enabling it.
+ */
+#define REARM_ADD       0
+#define REARM_DELETE    1
+#define REARM_TOGGLE    2
+
+static void
+timer_rearm(Benchmark &b, int how)
+{
+    const unsigned long ntimers = 1000;
+    unsigned long i, n = b.Iterations(1000000);
+    struct kevent kev[2];
+    int nchanges, kqfd;
+
+    if ((kqfd = kqueue()) < 0)
+        return b.Fail("kqueue");
+    for (i = 0; i < ntimers; i++) {
+        EV_SET(&kev[0], i, EVFILT_TIMER, EV_ADD, 0, 5000, NULL);
+        if (kevent(kqfd, kev, 1, NULL, 0, NULL) < 0)
+            return b.Fail("kevent");
+    }
+
+    b.Start();
+    for (i = 0; i < n; i++) {
+        switch (how) {
+        case REARM_ADD:
+            EV_SET(&kev[0], i % ntimers, EVFILT_TIMER, EV_ADD, 0, 5000, NULL);
+            nchanges = 1;
+            break;
+        case REARM_DELETE:
+            EV_SET(&kev[0], i % ntimers, EVFILT_TIMER, EV_DELETE, 0, 0, NULL);
+            EV_SET(&kev[1], i % ntimers, EVFILT_TIMER, EV_ADD, 0, 5000, NULL);
+            nchanges = 2;
+            break;
+        default:
+            EV_SET(&kev[0], i % ntimers, EVFILT_TIMER, EV_DISABLE, 0, 0, NULL);
+            EV_SET(&kev[1], i % ntimers, EVFILT_TIMER, EV_ENABLE, 0, 0, NULL);
+            nchanges = 2;
+            break;
+        }
+        if (kevent(kqfd, kev, nchanges, NULL, 0, NULL) < 0)
+            return b.Fail("kevent");
+    }
+    b.Stop(n);
+
+    close(kqfd);
+}
+
+BENCHMARK(engine_timer_rearm)           { timer_rearm(b, REARM_ADD); }
+BENCHMARK(engine_timer_rearm_delete_add) { timer_rearm(b, REARM_DELETE); }
+BENCHMARK(engine_timer_rearm_toggle)    { timer_rearm(b, REARM_TOGGLE); }
+
+#if defined(NOTE_USECONDS)
+/*
+ * A rate limiter: one timer with a period of 50us. Every expiration is
+ * counted, whether or not it had a wakeup of its own.
+ */
+BENCHMARK(engine_timer_pacing_50us)
+{
+    unsigned long nev = 0, ncalls = 0;
+    uint64_t deadline, cpu, elapsed;
+    struct kevent kev;
+    int kqfd;
+
+    if ((kqfd = kqueue()) < 0)
+        return b.Fail("kqueue");
+    EV_SET(&kev, 1, EVFILT_TIMER, EV_ADD, NOTE_USECONDS, 50, NULL);
+    if (kevent(kqfd, &kev, 1, NULL, 0, NULL) < 0)
+        return b.Fail("kevent");
+
+    cpu = bench_cputime();
+    b.Start();
+    deadline = bench_now() + b.Iterations(1000) * 1000000;
+    while (bench_now() < deadline) {
+        if (kevent(kqfd, NULL, 0, &kev, 1, NULL) != 1)
+            return b.Fail("kevent");
+        nev += kev.data;
+        ncalls++;
+    }
+    b.Stop(nev);
+    elapsed = b.Elapsed();
+    b.Report("wakeups/s", ncalls * 1e9 / elapsed);
+    b.Report("expiry/s", nev * 1e9 / elapsed);
+    b.Report("cpu_%", (bench_cputime() - cpu) * 100.0 / elapsed);
+
+    close(kqfd);
+}
+#endif
+
+/*
+ * A large number of periodic timers, with periods of 1s to 10s: the cost
+ * of adding them, of handling their expirations for a while, and of
+ * deleting them.
+ */
+static void
+timer_scale(Benchmark &b, unsigned long ntimers)
+{
+    const struct timespec ts = { 0, 10000000 };
+    unsigned long j, nev = 0, ncalls = 0;
+    uint64_t t, tadd, tdel, deadline, cpu;
+    struct kevent kev, out[MAX_OUT];
+    int rv, kqfd;
+
+    ntimers = b.Iterations(ntimers);
+    if ((kqfd = kqueue()) < 0)
+        return b.Fail("kqueue");
+
+    t = bench_now();
+    for (j = 0; j < ntimers; j++) {
+        EV_SET(&kev, j, EVFILT_TIMER, EV_ADD, 0, 1000 * (1 + j % 10), NULL);
+        if (kevent(kqfd, &kev, 1, NULL, 0, NULL) < 0)
+            return b.Fail("kevent: %lu timers: %s", j, strerror(errno));
+    }
+    tadd = bench_now() - t;
+
+    cpu = bench_cputime();
+    b.Start();
+    deadline = bench_now() + b.Iterations(2000) * 1000000;
+    while (bench_now() < deadline) {
+        rv = kevent(kqfd, NULL, 0, out, MAX_OUT, &ts);
+        if (rv < 0)
+            return b.Fail("kevent");
+        for (j = 0; j < (unsigned long) rv; j++)
+            nev += out[j].data;
+        ncalls++;
+    }
+    b.Stop(nev);
+    cpu = bench_cputime() - cpu;
+
+    t = bench_now();
+    for (j = 0; j < ntimers; j++) {
+        EV_SET(&kev, j, EVFILT_TIMER, EV_DELETE, 0, 0, NULL);
+        if (kevent(kqfd, &kev, 1, NULL, 0, NULL) < 0)
+            return b.Fail("kevent");
+    }
+    tdel = bench_now() - t;
+
+    b.Report("add_ns/timer", (double) tadd / ntimers);
+    b.Report("del_ns/timer", (double) tdel / ntimers);
+    b.Report("cpu_ns/expiry", (double) cpu / (nev ? nev : 1));
+    b.Report("expiry/call", (double) nev / ncalls);
+
+    close(kqfd);
+}
+
+BENCHMARK(engine_timer_scale_1k)    { timer_scale(b, 1000); }
+BENCHMARK(engine_timer_scale_100k)  { timer_scale(b, 100000); }
+BENCHMARK(engine_timer_scale_1m)    { timer_scale(b, 1000000); }
+
+/*
+ * Heartbeats: 50k periodic timers of about 1s, jittered by up to 50ms
+ * either way, so that their expirations spread out over the second. With a
+ * leeway, those that are close together share a wakeup. In kqlite, or
+ * without kevent_timer_leeway(), the leeway is ignored.
+ */
+static void
+timer_coalesce(Benchmark &b, intptr_t leeway)
+{
+    unsigned long j, ntimers = b.Iterations(50000), nev = 0, ncalls = 0;
+    uint64_t deadline, cpu, elapsed;
+    struct kevent kev, out[MAX_OUT];
+    int rv, kqfd;
+
+    if ((kqfd = kqueue()) < 0)
+        return b.Fail("kqueue");
+    for (j = 0; j < ntimers; j++) {
+        EV_SET(&kev, j, EVFILT_TIMER, EV_ADD, 0, 950 + (j * 7919) % 101, NULL);
+        if (kevent(kqfd, &kev, 1, NULL, 0, NULL) < 0)
+            return b.Fail("kevent: %lu timers: %s", j, strerror(errno));
+        if (leeway > 0 && kevent_timer_leeway(kqfd, j, leeway) < 0)
+            leeway = 0;
+    }
+
+    cpu = bench_cputime();
+    b.Start();
+    deadline = bench_now() + b.Iterations(3000) * 1000000;
+    while (bench_now() < deadline) {
+        rv = kevent(kqfd, NULL, 0, out, MAX_OUT, NULL);
+        if (rv < 0)
+            return b.Fail("kevent");
+        for (j = 0; j < (unsigned long) rv; j++)
+            nev += out[j].data;
+        ncalls++;
+    }
+    b.Stop(nev);
+    elapsed = b.Elapsed();
+    b.Report("wakeups/s", ncalls * 1e9 / elapsed);
+    b.Report("expiry/s", nev * 1e9 / elapsed);
+    b.Report("cpu_%", (bench_cputime() - cpu) * 100.0 / elapsed);
+
+    close(kqfd);
+}
+
+BENCHMARK(engine_timer_coalesce_50k)        { timer_coalesce(b, 0); }
+BENCHMARK(engine_timer_coalesce_50k_10ms)   { timer_coalesce(b, 10); }
+BENCHMARK(engine_timer_coalesce_50k_100ms)  { timer_coalesce(b, 100); }
+
+/*
+ * Idle timeouts of connections: each read pushes back a 10s timeout of its
+ * connection, which never fires. Without kevent_idle_timeout() (or in
+ * kqlite), each connection has an EVFILT_TIMER that is deleted and added
+ * again on every read.
+ */
+static void
+idle_timeouts(Benchmark &b, bool attr)
+{
+    const int nsock = 256;
+    unsigned long i, n = b.Iterations(100000), ctl;
+    struct kevent kev, change[2];
+    int j, fd, kqfd, sv[2 * nsock];
+    char c = 'x';
+
+    if ((kqfd = kqueue()) < 0)
+        return b.Fail("kqueue");
+    for (j = 0; j < nsock; j++) {
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, &sv[2 * j]) < 0)
+            return b.Fail("socketpair");
+        EV_SET(&kev, sv[2 * j], EVFILT_READ, EV_ADD, 0, 0, NULL);
+        if (kevent(kqfd, &kev, 1, NULL, 0, NULL) < 0)
+            return b.Fail("kevent");
+        if (attr && kevent_idle_timeout(kqfd, sv[2 * j], EVFILT_READ, 10000) < 0)
+            attr = false;
+        if (!attr) {
+            EV_SET(&kev, sv[2 * j], EVFILT_TIMER, EV_ADD, 0, 10000, NULL);
+            if (kevent(kqfd, &kev, 1, NULL, 0, NULL) < 0)
+                return b.Fail("kevent");
+        }
+    }
+
+    ctl = nepoll_ctl;
+    b.Start();
+    for (i = 0; i < n; i++) {
+        if (write(sv[2 * (i % nsock) + 1], &c, 1) != 1)
+            return b.Fail("write");
+        if (kevent(kqfd, NULL, 0, &kev, 1, NULL) != 1 || kev.filter != EVFILT_READ)
+            return b.Fail("kevent");
+        fd = kev.ident;
+        if (read(fd, &c, 1) != 1)
+            return b.Fail("read");
+        if (attr)
+            continue;
+
+        EV_SET(&change[0], fd, EVFILT_TIMER, EV_DELETE, 0, 0, NULL);
+        EV_SET(&change[1], fd, EVFILT_TIMER, EV_ADD, 0, 10000, NULL);
+        if (kevent(kqfd, change, 2, NULL, 0, NULL) < 0)
+            return b.Fail("kevent");
+    }
+    b.Stop(n);
+    REPORT_EPOLL_CTL(b, ctl, n);
+
+    for (j = 0; j < 2 * nsock; j++)
+        close(sv[j]);
+    close(kqfd);
+}
+
+BENCHMARK(engine_idle_timer)        { idle_timeouts(b, false); }
+#if defined(NOTE_IDLE)
+BENCHMARK(engine_idle_attr)         { idle_timeouts(b, true); }
+#endif
+
+/* Delivery of a signal to a kqueue watching it */
+BENCHMARK(engine_signal)
+{
+    unsigned long i, n = b.Iterations(100000);
+    struct kevent kev;
+    int kqfd;
+
+    if ((kqfd = kqueue()) < 0)
+        return b.Fail("kqueue");
+
+    EV_SET(&kev, SIGUSR1, EVFILT_SIGNAL, EV_ADD, 0, 0, NULL);
+    if (kevent(kqfd, &kev, 1, NULL, 0, NULL) < 0)
+        return b.Fail("kevent");
+
+    b.Start();
+    for (i = 0; i < n; i++) {
+        if (kill(getpid(), SIGUSR1) < 0)
+            return b.Fail("kill");
+        if (kevent(kqfd, NULL, 0, &kev, 1, NULL) != 1)
+            return b.Fail("kevent");
+    }
+    b.Stop(n);
+
+    close(kqfd);
+}
+
+/*
+ * Bursts of queued signals, as a supervisor gets SIGCHLD. Each burst is
+ * reported by one kevent, whose data should count all of its signals.
+ */
+BENCHMARK(engine_signal_burst)
+{
+    unsigned long i, n = b.Iterations(20000), burst = 32, counted = 0;
+    int j, kqfd, signo = SIGRTMIN + 1;
+    struct kevent kev;
+    union sigval val;
+
+    if ((kqfd = kqueue()) < 0)
+        return b.Fail("kqueue");
+
+    EV_SET(&kev, signo, EVFILT_SIGNAL, EV_ADD, 0, 0, NULL);
+    if (kevent(kqfd, &kev, 1, NULL, 0, NULL) < 0)
+        return b.Fail("kevent");
+
+    b.Start();
+    for (i = 0; i < n; i++) {
+        for (j = 0; j < (int) burst; j++) {
+            val.sival_int = j;
+            if (sigqueue(getpid(), signo, val) < 0)
+                return b.Fail("sigqueue");
+        }
+        if (kevent(kqfd, NULL, 0, &kev, 1, NULL) != 1)
+            return b.Fail("kevent");
+        counted += kev.data;
+    }
+    b.Stop(n * burst);
+    b.Report("counted_%", counted * 100.0 / (n * burst));
+
+    close(kqfd);
+}
+
+/*
+ * Delivery of a signal to several kqueues watching it. A kqueue that does
+ * not get the signal within 10ms counts as missed.
+ */
+static void
+signal_fanout(Benchmark &b, int nkq)
+{
+    unsigned long i, n = b.Iterations(20000), missed = 0;
+    struct timespec ts = { 0, 10000000 };
+    struct kevent kev;
+    int j, rv, kqs[8];
+
+    EV_SET(&kev, SIGUSR1, EVFILT_SIGNAL, EV_ADD, 0, 0, NULL);
+    for (j = 0; j < nkq; j++) {
+        if ((kqs[j] = kqueue()) < 0)
+            return b.Fail("kqueue");
+        if (kevent(kqs[j], &kev, 1, NULL, 0, NULL) < 0)
+            return b.Fail("kevent");
+    }
+
+    b.Start();
+    for (i = 0; i < n; i++) {
+        if (kill(getpid(), SIGUSR1) < 0)
+            return b.Fail("kill");
+        for (j = 0; j < nkq; j++) {
+            rv = kevent(kqs[j], NULL, 0, &kev, 1, &ts);
+            if (rv < 0)
+                return b.Fail("kevent");
+            if (rv == 0)
+                missed++;
+        }
+    }
+    b.Stop(n);
+    b.Report("missed_%", missed * 100.0 / (n * nkq));
+
+    EV_SET(&kev, SIGUSR1, EVFILT_SIGNAL, EV_DELETE, 0, 0, NULL);
+    for (j = 0; j < nkq; j++) {
+        (void) kevent(kqs[j], &kev, 1, NULL, 0, NULL);
+        close(kqs[j]);
+    }
+}
+
+BENCHMARK(engine_signal_fanout_2)   { signal_fanout(b, 2); }
+BENCHMARK(engine_signal_fanout_8)   { signal_fanout(b, 8); }
+
+/*
+ * Spawn short-lived children in batches, wait for their NOTE_EXIT, and
+ * reap them, as a job runner does.
+ */
+BENCHMARK(engine_proc_spawn)
+{
+    unsigned long i, j, n = b.Iterations(10000), batch = 100, missed = 0;
+    struct timespec ts = { 1, 0 };
+    struct kevent kev[100];
+    pid_t pids[100];
+    int kqfd, rv, nev;
+
+    if ((kqfd = kqueue()) < 0)
+        return b.Fail("kqueue");
+
+    b.Start();
+    for (i = 0; i < n; i += batch) {
+        if (batch > n - i)
+            batch = n - i;
+        for (j = 0; j < batch; j++) {
+            if ((pids[j] = fork()) < 0)
+                return b.Fail("fork");
+            if (pids[j] == 0)
+                _exit(0);
+            EV_SET(&kev[j], pids[j], EVFILT_PROC, EV_ADD, NOTE_EXIT, 0, NULL);
+        }
+        if (kevent(kqfd, kev, batch, NULL, 0, NULL) < 0) {
+            missed += batch;
+        } else {
+            for (nev = 0; nev < (int) batch; nev += rv) {
+                rv = kevent(kqfd, NULL, 0, kev, batch - nev, &ts);
+                if (rv < 0)
+                    return b.Fail("kevent");
+                if (rv == 0) {
+                    missed += batch - nev;
+                    break;
+                }
+            }
+        }
+        for (j = 0; j < batch; j++)
+            (void) waitpid(pids[j], NULL, 0);
+    }
+    b.Stop(n);
+    b.Report("missed_%", missed * 100.0 / n);
+
+    close(kqfd);
+}
+
+/* EV_ADD followed by EV_DELETE of a VNODE knote */
+BENCHMARK(engine_vnode_add_delete)
+{
+    unsigned long i, n = b.Iterations(50000);
+    char path[] = "/tmp/kqueue-bench-XXXXXX";
+    struct kevent kev[2];
+    int fd, kqfd;
+
+    if ((kqfd = kqueue()) < 0)
+        return b.Fail("kqueue");
+    if ((fd = mkstemp(path)) < 0)
+        return b.Fail("mkstemp");
+
+    EV_SET(&kev[0], fd, EVFILT_VNODE, EV_ADD, NOTE_WRITE, 0, NULL);
+    EV_SET(&kev[1], fd, EVFILT_VNODE, EV_DELETE, 0, 0, NULL);
+
+    b.Start();
+    for (i = 0; i < n; i++) {
+        if (kevent(kqfd, kev, 2, NULL, 0, NULL) < 0)
+            return b.Fail("kevent");
+    }
+    b.Stop(n);
+
+    unlink(path);
+    close(fd);
+    close(kqfd);
+}
+
+/* The resident memory of the process in kilobytes, or 0 if unknown */
+static long
+resident_kb(void)
+{
+    long kb = 0;
+#if defined(__linux__)
+    long pages;
+    FILE *fp;
+
+    if ((fp = fopen("/proc/self/statm", "r")) != NULL) {
+        if (fscanf(fp, "%*s %ld", &pages) == 1)
+            kb = pages * (sysconf(_SC_PAGESIZE) / 1024);
+        fclose(fp);
+    }
+#endif
+    return (kb);
+}
+
+/*
+ * Add a VNODE knote on each of <nfiles> files, as many as the descriptor
+ * and watch limits allow, and report the time, descriptors and memory
+ * that each watch costs.
+ */
+static void
+vnode_watch_setup(Benchmark &b, unsigned long nfiles)
+{
+    unsigned long i, n = b.Iterations(nfiles), nopen, nwatch;
+    char dir[] = "/tmp/kqueue-bench.XXXXXX", path[64];
+    struct kevent kev;
+    struct rlimit rl;
+    int kqfd, tmp, next, *fd;
+    long rss;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        (void) setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    if ((kqfd = kqueue()) < 0)
+        return b.Fail("kqueue");
+    if (mkdtemp(dir) == NULL)
+        return b.Fail("mkdtemp");
+
+    fd = new int[n];
+    for (nopen = 0; nopen < n; nopen++) {
+        snprintf(path, sizeof(path), "%s/%lu", dir, nopen);
+        if ((fd[nopen] = open(path, O_CREAT | O_RDONLY, 0600)) < 0)
+            break;
+    }
+    /* At the descriptor limit, leave room for the ones the knotes may need */
+    for (i = 0; nopen < n && i < 16 && nopen > 0; i++)
+        close(fd[--nopen]);
+
+    next = tmp = dup(0);
+    close(tmp);
+    rss = resident_kb();
+    b.Start();
+    for (nwatch = 0; nwatch < nopen; nwatch++) {
+        EV_SET(&kev, fd[nwatch], EVFILT_VNODE, EV_ADD, NOTE_WRITE | NOTE_DELETE, 0, NULL);
+        if (kevent(kqfd, &kev, 1, NULL, 0, NULL) < 0)
+            break;
+    }
+    b.Stop(nwatch);
+    tmp = dup(0);
+    close(tmp);
+    rss = resident_kb() - rss;
+
+    b.Report("files", nwatch);
+    if (nwatch > 0) {
+        b.Report("fds/knote", (double) (tmp - next) / nwatch);
+        b.Report("kb/knote", (double) rss / nwatch);
+    }
+
+    close(kqfd);
+    for (i = 0; i < nopen; i++)
+        close(fd[i]);
+    for (i = 0; i < n; i++) {
+        snprintf(path, sizeof(path), "%s/%lu", dir, i);
+        (void) unlink(path);
+    }
+    rmdir(dir);
+    delete[] fd;
+}
+
+BENCHMARK(engine_vnode_watch_1k)    { vnode_watch_setup(b, 1000); }
+BENCHMARK(engine_vnode_watch_10k)   { vnode_watch_setup(b, 10000); }
+BENCHMARK(engine_vnode_watch_100k)  { vnode_watch_setup(b, 100000); }
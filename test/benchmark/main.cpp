@@ -0,0 +1,176 @@
+/*
+ * Copyright (c) 2026 libkqueue contributors
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdarg.h>
+#include <unistd.h>
+
+#include "bench.h"
+
+Benchmark *Benchmark::head = NULL;
+double Benchmark::scale = 1.0;
+
+Benchmark::Benchmark(const char *name, func_t func)
+    : name_(name), func_(func), elapsed_(0), ops_(0), failed_(false),
+      ncounters_(0)
+{
+    Benchmark **p;
+
+    /* Keep the list in registration order */
+    for (p = &head; *p != NULL; p = &(*p)->next_)
+        ;
+    next_ = NULL;
+    *p = this;
+}
+
+unsigned long
+Benchmark::Iterations(unsigned long n) const
+{
+    unsigned long rv = (unsigned long) (n * scale);
+
+    return (rv > 0 ? rv : 1);
+}
+
+void
+Benchmark::Start()
+{
+    clock_gettime(CLOCK_MONOTONIC, &start_);
+}
+
+void
+Benchmark::Stop(unsigned long ops)
+{
+    struct timespec end;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    elapsed_ = (uint64_t) (end.tv_sec - start_.tv_sec) * 1000000000
+        + end.tv_nsec - start_.tv_nsec;
+    ops_ = ops;
+}
+
+void
+Benchmark::Report(const char *counter, double value)
+{
+    if (ncounters_ == BENCH_MAX_COUNTERS)
+        abort();
+    counter_name_[ncounters_] = counter;
+    counter_val_[ncounters_] = value;
+    ncounters_++;
+}
+
+void
+Benchmark::Fail(const char *fmt, ...)
+{
+    va_list ap;
+
+    fprintf(stderr, "%s: ", name_);
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    if (errno != 0)
+        fprintf(stderr, " (%s)", strerror(errno));
+    fputc('\n', stderr);
+    failed_ = true;
+}
+
+bool
+Benchmark::Run()
+{
+    int i;
+
+    elapsed_ = 0;
+    ops_ = 0;
+    ncounters_ = 0;
+    failed_ = false;
+
+    func_(*this);
+    if (failed_) {
+        printf("%-40s FAILED\n", name_);
+        return (false);
+    }
+
+    if (ops_ > 0 && elapsed_ > 0) {
+        printf("%-40s %10lu ops %10.1f ns/op %12.0f ops/s",
+                name_, ops_, (double) elapsed_ / ops_,
+                ops_ * 1e9 / elapsed_);
+    } else {
+        printf("%-40s", name_);
+    }
+    for (i = 0; i < ncounters_; i++)
+        printf("  %s=%.2f", counter_name_[i], counter_val_[i]);
+    putchar('\n');
+    fflush(stdout);
+
+    return (true);
+}
+
+static void
+usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [-l] [-q] [-s scale] [name ...]\n"
+            "  -l        list the benchmarks and exit\n"
+            "  -q        quick run (same as -s 0.01)\n"
+            "  -s scale  multiply every iteration count by <scale>\n"
+            "  name      only run benchmarks whose name contains <name>\n",
+            prog);
+    exit(1);
+}
+
+int
+bench_main(int argc, char **argv)
+{
+    Benchmark *b;
+    int c, i, failures = 0;
+    bool match;
+
+    while ((c = getopt(argc, argv, "lqs:")) != -1) {
+        switch (c) {
+        case 'l':
+            for (b = Benchmark::head; b != NULL; b = b->next_)
+                puts(b->Name());
+            return (0);
+        case 'q':
+            Benchmark::scale = 0.01;
+            break;
+        case 's':
+            Benchmark::scale = atof(optarg);
+            if (Benchmark::scale <= 0)
+                usage(argv[0]);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    for (b = Benchmark::head; b != NULL; b = b->next_) {
+        match = (optind == argc);
+        for (i = optind; i < argc && !match; i++)
+            match = (strstr(b->Name(), argv[i]) != NULL);
+        if (!match)
+            continue;
+        errno = 0;
+        if (!b->Run())
+            failures++;
+    }
+
+    return (failures == 0 ? 0 : 1);
+}
+
+int
+main(int argc, char **argv)
+{
+    return bench_main(argc, argv);
+}
@@ -0,0 +1,219 @@
+/*
+ * Copyright (c) 2026 libkqueue contributors
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Microbenchmarks of the platform independent code, run against the
+ * in-process mock kernel (src/mock). No system calls are made inside
+ * the measured loops, so the numbers reflect the cost of copyin, knote
+ * lookup, locking and copyout alone.
+ */
+
+#include <signal.h>
+
+#include "bench.h"
+#include "mock.h"
+
+#define MAX_OUT 512
+
+static const struct timespec zero_ts = { 0, 0 };
+
+/* EV_ADD followed by EV_DELETE of the same READ knote */
+BENCHMARK(mock_add_delete)
+{
+    unsigned long i, n = b.Iterations(1000000);
+    struct kevent kev[2];
+    int kqfd;
+
+    if ((kqfd = kqueue()) < 0)
+        return b.Fail("kqueue");
+
+    EV_SET(&kev[0], 1, EVFILT_READ, EV_ADD, 0, 0, NULL);
+    EV_SET(&kev[1], 1, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+
+    b.Start();
+    for (i = 0; i < n; i++) {
+        if (kevent(kqfd, kev, 2, NULL, 0, NULL) < 0)
+            return b.Fail("kevent");
+    }
+    b.Stop(n);
+}
+
+/* Modify one knote among many, exercising knote_lookup() */
+static void
+lookup(Benchmark &b, int nknotes)
+{
+    unsigned long i, n = b.Iterations(1000000);
+    struct kevent kev;
+    int j, kqfd;
+
+    if ((kqfd = kqueue()) < 0)
+        return b.Fail("kqueue");
+
+    for (j = 0; j < nknotes; j++) {
+        EV_SET(&kev, j, EVFILT_READ, EV_ADD, 0, 0, NULL);
+        if (kevent(kqfd, &kev, 1, NULL, 0, NULL) < 0)
+            return b.Fail("kevent");
+    }
+
+    b.Start();
+    for (i = 0; i < n; i++) {
+        EV_SET(&kev, i % nknotes, EVFILT_READ, EV_ADD, 0, 0, NULL);
+        if (kevent(kqfd, &kev, 1, NULL, 0, NULL) < 0)
+            return b.Fail("kevent");
+    }
+    b.Stop(n);
+}
+
+BENCHMARK(mock_lookup_100)      { lookup(b, 100); }
+BENCHMARK(mock_lookup_10000)    { lookup(b, 10000); }
+
+/* Return <batch> level-triggered READ events per call */
+static void
+copyout(Benchmark &b, int batch)
+{
+    unsigned long i, n = b.Iterations(100000);
+    unsigned long nev = 0;
+    struct kevent kev, *out;
+    int j, rv, kqfd;
+
+    if ((kqfd = kqueue()) < 0)
+        return b.Fail("kqueue");
+
+    for (j = 0; j < batch; j++) {
+        EV_SET(&kev, j, EVFILT_READ, EV_ADD, 0, 0, NULL);
+        if (kevent(kqfd, &kev, 1, NULL, 0, NULL) < 0)
+            return b.Fail("kevent");
+        mock_fd_ready(kqfd, EVFILT_READ, j, 1);
+    }
+    out = new struct kevent[batch];
+
+    b.Start();
+    for (i = 0; i < n; i++) {
+        rv = kevent(kqfd, NULL, 0, out, batch, &zero_ts);
+        if (rv != batch) {
+            delete[] out;
+            return b.Fail("kevent returned %d, expected %d", rv, batch);
+        }
+        nev += rv;
+    }
+    b.Stop(nev);
+    delete[] out;
+    b.Report("events/call", (double) nev / n);
+}
+
+BENCHMARK(mock_copyout_1)       { copyout(b, 1); }
+BENCHMARK(mock_copyout_64)      { copyout(b, 64); }
+BENCHMARK(mock_copyout_512)     { copyout(b, 512); }
+
+/* A call that finds nothing: the fixed cost of kevent() */
+BENCHMARK(mock_empty_poll)
+{
+    unsigned long i, n = b.Iterations(1000000);
+    struct kevent kev;
+    int kqfd;
+
+    if ((kqfd = kqueue()) < 0)
+        return b.Fail("kqueue");
+
+    b.Start();
+    for (i = 0; i < n; i++) {
+        if (kevent(kqfd, NULL, 0, &kev, 1, &zero_ts) != 0)
+            return b.Fail("kevent");
+    }
+    b.Stop(n);
+}
+
+/* NOTE_TRIGGER followed by the copyout of the EV_CLEAR user event */
+BENCHMARK(mock_user_trigger)
+{
+    unsigned long i, n = b.Iterations(1000000);
+    struct kevent kev, trigger;
+    int kqfd;
+
+    if ((kqfd = kqueue()) < 0)
+        return b.Fail("kqueue");
+
+    EV_SET(&kev, 1, EVFILT_USER, EV_ADD | EV_CLEAR, 0, 0, NULL);
+    if (kevent(kqfd, &kev, 1, NULL, 0, NULL) < 0)
+        return b.Fail("kevent");
+    EV_SET(&trigger, 1, EVFILT_USER, 0, NOTE_TRIGGER, 0, NULL);
+
+    b.Start();
+    for (i = 0; i < n; i++) {
+        if (kevent(kqfd, &trigger, 1, &kev, 1, &zero_ts) != 1)
+            return b.Fail("kevent");
+    }
+    b.Stop(n);
+}
+
+/* Many periodic timers, driven by the virtual clock */
+static void
+timers(Benchmark &b, int ntimers)
+{
+    unsigned long i, n = b.Iterations(1000);
+    unsigned long nev = 0;
+    struct kevent kev, out[MAX_OUT];
+    struct timespec ts = { 0, 1000000 };
+    int j, rv, kqfd;
+
+    if ((kqfd = kqueue()) < 0)
+        return b.Fail("kqueue");
+
+    /* 1ms .. 10ms periods, so each tick fires a varying subset */
+    for (j = 0; j < ntimers; j++) {
+        EV_SET(&kev, j, EVFILT_TIMER, EV_ADD, 0, 1 + j % 10, NULL);
+        if (kevent(kqfd, &kev, 1, NULL, 0, NULL) < 0)
+            return b.Fail("kevent");
+    }
+
+    b.Start();
+    for (i = 0; i < n; i++) {
+        do {
+            rv = kevent(kqfd, NULL, 0, out, MAX_OUT, &ts);
+            if (rv < 0)
+                return b.Fail("kevent");
+            nev += rv;
+        } while (rv == MAX_OUT);
+    }
+    b.Stop(nev);
+    b.Report("virtual_ms", mock_clock_now(kqfd) / 1e6);
+}
+
+BENCHMARK(mock_timer_100)       { timers(b, 100); }
+BENCHMARK(mock_timer_10000)     { timers(b, 10000); }
+
+/* Delivery of a signal to a kqueue watching it */
+BENCHMARK(mock_signal)
+{
+    unsigned long i, n = b.Iterations(1000000);
+    struct kevent kev;
+    int kqfd;
+
+    if ((kqfd = kqueue()) < 0)
+        return b.Fail("kqueue");
+
+    EV_SET(&kev, SIGUSR1, EVFILT_SIGNAL, EV_ADD, 0, 0, NULL);
+    if (kevent(kqfd, &kev, 1, NULL, 0, NULL) < 0)
+        return b.Fail("kevent");
+
+    b.Start();
+    for (i = 0; i < n; i++) {
+        mock_signal_raise(SIGUSR1);
+        if (kevent(kqfd, NULL, 0, &kev, 1, &zero_ts) != 1)
+            return b.Fail("kevent");
+    }
+    b.Stop(n);
+}
@@ -34,6 +34,7 @@
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <unistd.h>
 #include <sys/event.h>
 #include <arpa/inet.h>
@@ -228,6 +229,7 @@ private:
 void test_evfilt_read(struct test_context *);
 void test_evfilt_signal(struct test_context *);
 void test_evfilt_vnode(struct test_context *);
+void test_evfilt_write(struct test_context *);
 void test_evfilt_timer(struct test_context *);
 void test_evfilt_proc(struct test_context *);
 void test_evfilt_user(struct test_context *);
@@ -239,6 +241,7 @@ void test_evfilt_user(struct test_context *);
     } while (/*CONSTCOND*/ 0)
 
 void kevent_get_hires(struct kevent *, int);
+void create_socket_connection(int *, int *);
 
 inline struct kevent
 KEventCreate(uintptr_t ident, short filter, u_short flags, u_int fflags = 0,
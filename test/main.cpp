@@ -122,6 +122,7 @@ TEST_F(KQLegacyTests, Signal) { test_evfilt_signal(context()); }
 TEST_F(KQLegacyTests, Timer) { test_evfilt_timer(context()); }
 TEST_F(KQLegacyTests, User) { test_evfilt_user(context()); }
 TEST_F(KQLegacyTests, VNode) { test_evfilt_vnode(context()); }
+TEST_F(KQLegacyTests, Write) { test_evfilt_write(context()); }
 
 int
 main(int argc, char** argv)
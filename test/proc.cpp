@@ -16,9 +16,11 @@
 
 #include "common.h"
 
+#include <sys/resource.h>
+#include <sys/wait.h>
+
 static int sigusr1_caught = 0;
 static pid_t pid;
-static int kqfd;
 
 static void
 sig_handler(int signum)
@@ -31,11 +33,11 @@ test_kevent_proc_add(struct test_context *ctx)
 {
     struct kevent kev;
 
-    EXPECT_NO_EVENT(kqfd);
+    EXPECT_NO_EVENT(ctx->kqfd);
     kev = KEventCreate(pid, EVFILT_PROC, EV_ADD);
-    EXPECT_EQ(0, kevent(kqfd, &kev, 1, NULL, 0, NULL)) << strerror(errno)
+    EXPECT_EQ(0, kevent(ctx->kqfd, &kev, 1, NULL, 0, NULL)) << strerror(errno)
                                                        << " - " << kev;
-    EXPECT_NO_EVENT(kqfd);
+    EXPECT_NO_EVENT(ctx->kqfd);
 }
 
 static void
@@ -43,44 +45,139 @@ test_kevent_proc_delete(struct test_context *ctx)
 {
     struct kevent kev;
 
-    EXPECT_NO_EVENT(kqfd);
+    EXPECT_NO_EVENT(ctx->kqfd);
     kev = KEventCreate(pid, EVFILT_PROC, EV_DELETE);
-    EXPECT_EQ(0, kevent(kqfd, &kev, 1, NULL, 0, NULL)) << strerror(errno)
+    EXPECT_EQ(0, kevent(ctx->kqfd, &kev, 1, NULL, 0, NULL)) << strerror(errno)
                                                        << " - " << kev;
     if (kill(pid, SIGKILL) < 0)
         FAIL() << "kill";
     sleep(1);
-    EXPECT_NO_EVENT(kqfd);
+    EXPECT_NO_EVENT(ctx->kqfd);
+    (void) waitpid(pid, NULL, 0);
 }
 
 static void
 test_kevent_proc_get(struct test_context *ctx)
 {
+    struct timespec timeout = { 1, 0 };
     struct kevent kev, buf;
+    sigset_t mask, omask;
 
-    /* Create a child that waits to be killed and then exits */
+    /*
+     * Create a child that waits to be killed and then exits. The signal
+     * is blocked until the child waits for it, so that it is not lost.
+     */
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGUSR1);
+    sigprocmask(SIG_BLOCK, &mask, &omask);
     pid = fork();
     if (pid == 0) {
-        pause();
+        sigsuspend(&omask);
         printf(" -- child caught signal, exiting\n");
         exit(2);
     }
+    sigprocmask(SIG_SETMASK, &omask, NULL);
     printf(" -- child created (pid %d)\n", (int) pid);
 
-    EXPECT_NO_EVENT(kqfd);
-    kev = KEventCreate(pid, EVFILT_PROC, EV_ADD);
-    EXPECT_EQ(0, kevent(kqfd, &kev, 1, NULL, 0, NULL)) << strerror(errno)
+    EXPECT_NO_EVENT(ctx->kqfd);
+    kev = KEventCreate(pid, EVFILT_PROC, EV_ADD, NOTE_EXIT);
+    EXPECT_EQ(0, kevent(ctx->kqfd, &kev, 1, NULL, 0, NULL)) << strerror(errno)
                                                        << " - " << kev;
 
     /* Cause the child to exit, then retrieve the event */
     printf(" -- killing process %d\n", (int) pid);
     if (kill(pid, SIGUSR1) < 0)
         FAIL() << "kill";
-    EXPECT_EVENT(kqfd, &buf);
+    EXPECT_EQ(1, kevent(ctx->kqfd, NULL, 0, &buf, 1, &timeout)) << strerror(errno);
+
+    /* The exit status is in data, and the knote is gone */
+    kev.flags |= EV_ONESHOT | EV_EOF;
+    kev.data = 2 << 8;
     EXPECT_EQ(kev, buf);
-    EXPECT_NO_EVENT(kqfd);
+    EXPECT_NO_EVENT(ctx->kqfd);
+    (void) waitpid(pid, NULL, 0);
+}
+
+#if LIBKQUEUE
+/* A child killed by a signal, and its resource usage before it is reaped */
+TEST_F(KQLegacyTests, ProcKilled)
+{
+    struct timespec timeout = { 1, 0 };
+    struct kevent kev, ret;
+    struct rusage ru;
+    pid_t child;
+    int status;
+
+    child = fork();
+    if (child == 0) {
+        pause();
+        _exit(0);
+    }
+    ASSERT_LT(0, child);
+
+    kev = KEventCreate(child, EVFILT_PROC, EV_ADD, NOTE_EXIT);
+    ASSERT_EQ(0, kevent(kqfd(), &kev, 1, NULL, 0, NULL)) << strerror(errno);
+    EXPECT_EQ(-1, kevent_proc_rusage(kqfd(), child, &ru));
+    ASSERT_EQ(0, kill(child, SIGKILL));
+
+    ASSERT_EQ(1, kevent(kqfd(), NULL, 0, &ret, 1, &timeout)) << strerror(errno);
+    EXPECT_EQ(NOTE_EXIT, (int) ret.fflags);
+    EXPECT_TRUE(ret.flags & EV_EOF);
+    EXPECT_TRUE(WIFSIGNALED((int) ret.data));
+    EXPECT_EQ(SIGKILL, WTERMSIG((int) ret.data));
+
+    /* The child is left for the caller to reap */
+    EXPECT_EQ(0, kevent_proc_rusage(kqfd(), child, &ru)) << strerror(errno);
+    ASSERT_EQ(child, waitpid(child, &status, 0));
+    EXPECT_EQ((int) ret.data, status);
+    EXPECT_EQ(-1, kevent_proc_rusage(kqfd(), child, &ru));
+    EXPECT_EQ(ECHILD, errno);
+    EXPECT_NO_EVENT(kqfd());
 }
 
+/* The exit of a process that is not a child, with no status */
+TEST_F(KQLegacyTests, ProcNotChild)
+{
+    struct timespec timeout = { 1, 0 };
+    struct kevent kev, ret;
+    int pfd[2], gfd[2];
+    pid_t child, grandchild;
+
+    ASSERT_EQ(0, pipe(pfd));
+    ASSERT_EQ(0, pipe(gfd));
+    child = fork();
+    if (child == 0) {
+        char c;
+
+        /* The grandchild exits when the write end of gfd is closed */
+        grandchild = fork();
+        if (grandchild == 0) {
+            close(gfd[1]);
+            (void) read(gfd[0], &c, 1);
+            _exit(3);
+        }
+        (void) write(pfd[1], &grandchild, sizeof(grandchild));
+        _exit(0);
+    }
+    ASSERT_LT(0, child);
+    close(gfd[0]);
+    close(pfd[1]);
+    ASSERT_EQ((ssize_t) sizeof(grandchild), read(pfd[0], &grandchild, sizeof(grandchild)));
+    close(pfd[0]);
+    ASSERT_EQ(child, waitpid(child, NULL, 0));
+
+    kev = KEventCreate(grandchild, EVFILT_PROC, EV_ADD, NOTE_EXIT);
+    ASSERT_EQ(0, kevent(kqfd(), &kev, 1, NULL, 0, NULL)) << strerror(errno);
+    EXPECT_NO_EVENT(kqfd());
+    close(gfd[1]);
+
+    ASSERT_EQ(1, kevent(kqfd(), NULL, 0, &ret, 1, &timeout)) << strerror(errno);
+    kev.flags |= EV_ONESHOT | EV_EOF;
+    EXPECT_EQ(kev, ret);
+    EXPECT_NO_EVENT(kqfd());
+}
+#endif
+
 #ifdef TODO
 void
 test_kevent_signal_disable(struct test_context *ctx)
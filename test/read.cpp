@@ -20,7 +20,7 @@
 /*
  * Create a connected TCP socket.
  */
-static void
+void
 create_socket_connection(int *client, int *server)
 {
     struct sockaddr_in sain;
@@ -292,6 +292,354 @@ TEST_F(KQLegacyTests, ReadSocketListenBacklog)
     EXPECT_NO_EVENT(kqfd());
 }
 
+/* The data field is the number of connections waiting to be accepted */
+static void
+kevent_listen_backlog(int kqfd, int srvr, const struct sockaddr *sa,
+        socklen_t salen)
+{
+    struct kevent kev, ret;
+    int i, clnt[3];
+
+    kev = KEventCreate(srvr, EVFILT_READ, EV_ADD);
+    EXPECT_EQ(0, kevent(kqfd, &kev, 1, NULL, 0, NULL)) << strerror(errno);
+    EXPECT_NO_EVENT(kqfd);
+
+    for (i = 0; i < 3; i++) {
+        if ((clnt[i] = socket(sa->sa_family, SOCK_STREAM, 0)) < 0)
+            FAIL() << "socket(): " << strerror(errno);
+        if (connect(clnt[i], sa, salen) < 0)
+            FAIL() << "connect(): " << strerror(errno);
+    }
+    EXPECT_EVENT(kqfd, &ret);
+    EXPECT_EQ(3, ret.data);
+
+    i = accept(srvr, NULL, NULL);
+    ASSERT_LE(0, i) << strerror(errno);
+    close(i);
+    EXPECT_EVENT(kqfd, &ret);
+    EXPECT_EQ(2, ret.data);
+
+    kev.flags = EV_DELETE;
+    EXPECT_EQ(0, kevent(kqfd, &kev, 1, NULL, 0, NULL)) << strerror(errno);
+    for (i = 0; i < 3; i++)
+        close(clnt[i]);
+}
+
+TEST_F(KQLegacyTests, ReadSocketListenBacklogDepth)
+{
+    struct sockaddr_in sain;
+    socklen_t addrlen = sizeof(sain);
+    int srvr;
+
+    memset(&sain, 0, sizeof(sain));
+    sain.sin_family = AF_INET;
+    sain.sin_addr.s_addr = inet_addr("127.0.0.1");
+    if ((srvr = socket(PF_INET, SOCK_STREAM, 0)) < 0)
+        FAIL() << "socket(): " << strerror(errno);
+    if (bind(srvr, (const struct sockaddr *)&sain, sizeof(sain)) < 0)
+        FAIL() << "bind(): " << strerror(errno);
+    if (listen(srvr, 100) < 0)
+        FAIL() << "listen(): " << strerror(errno);
+    if (getsockname(srvr, (struct sockaddr *)&sain, &addrlen))
+        FAIL() << "getsockname: " << strerror(errno);
+
+    kevent_listen_backlog(kqfd(), srvr, (struct sockaddr *)&sain, addrlen);
+    close(srvr);
+}
+
+TEST_F(KQLegacyTests, ReadUnixListenBacklogDepth)
+{
+    struct sockaddr_un saun;
+    int srvr;
+
+    /* An abstract address, so that there is nothing to clean up */
+    memset(&saun, 0, sizeof(saun));
+    saun.sun_family = AF_UNIX;
+    snprintf(&saun.sun_path[1], sizeof(saun.sun_path) - 1,
+            "kqueue-test-%d", (int) getpid());
+    if ((srvr = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+        FAIL() << "socket(): " << strerror(errno);
+    if (bind(srvr, (const struct sockaddr *)&saun, sizeof(saun)) < 0)
+        FAIL() << "bind(): " << strerror(errno);
+    if (listen(srvr, 100) < 0)
+        FAIL() << "listen(): " << strerror(errno);
+
+    kevent_listen_backlog(kqfd(), srvr, (struct sockaddr *)&saun, sizeof(saun));
+    close(srvr);
+}
+
+static const struct timespec zero_ts = { 0, 0 };
+
+/* Create a listening TCP socket on the loopback address */
+static int
+create_listener(struct sockaddr_in *sain)
+{
+    socklen_t addrlen = sizeof(*sain);
+    int srvr;
+
+    memset(sain, 0, sizeof(*sain));
+    sain->sin_family = AF_INET;
+    sain->sin_addr.s_addr = inet_addr("127.0.0.1");
+    if ((srvr = socket(PF_INET, SOCK_STREAM, 0)) < 0)
+        return (-1);
+    if (bind(srvr, (const struct sockaddr *)sain, sizeof(*sain)) < 0
+            || listen(srvr, 100) < 0
+            || getsockname(srvr, (struct sockaddr *)sain, &addrlen) < 0) {
+        close(srvr);
+        return (-1);
+    }
+
+    return (srvr);
+}
+
+/*
+ * A descriptor that is reused for a listening socket is seen as one, even
+ * while a knote of the socket it replaced has not been deleted.
+ */
+TEST_F(KQLegacyTests, ReadSocketListenReused)
+{
+    struct timespec ts = { 1, 0 };
+    struct kevent kev, ret;
+    struct sockaddr_in sain;
+    int kq1, kq2, sv[2], srvr, clnt;
+
+    ASSERT_LE(0, kq1 = kqueue()) << strerror(errno);
+    ASSERT_LE(0, kq2 = kqueue()) << strerror(errno);
+    ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) << strerror(errno);
+    kev = KEventCreate(sv[0], EVFILT_READ, EV_ADD);
+    EXPECT_EQ(0, kevent(kq1, &kev, 1, NULL, 0, NULL)) << strerror(errno);
+
+    ASSERT_LE(0, srvr = create_listener(&sain)) << strerror(errno);
+    ASSERT_EQ(sv[0], dup2(srvr, sv[0])) << strerror(errno);
+    close(srvr);
+    ASSERT_LE(0, clnt = socket(AF_INET, SOCK_STREAM, 0)) << strerror(errno);
+    ASSERT_EQ(0, connect(clnt, (const struct sockaddr *)&sain, sizeof(sain)))
+        << strerror(errno);
+
+    kev = KEventCreate(sv[0], EVFILT_READ, EV_ADD);
+    EXPECT_EQ(0, kevent(kq2, &kev, 1, NULL, 0, NULL)) << strerror(errno);
+    EXPECT_EQ(1, kevent(kq2, NULL, 0, &ret, 1, &ts)) << strerror(errno);
+    EXPECT_EQ(sv[0], (int) ret.ident);
+    EXPECT_EQ(1, ret.data);
+
+    close(kq1);
+    close(kq2);
+    close(clnt);
+    close(sv[0]);
+    close(sv[1]);
+}
+
+/* NOTE_ACCEPT returns one kevent per accepted connection */
+TEST_F(KQLegacyTests, ReadSocketAccept)
+{
+    struct kevent kev, ret[4];
+    struct sockaddr_in sain;
+    int i, srvr, clnt[3];
+
+    ASSERT_LE(0, srvr = create_listener(&sain)) << strerror(errno);
+
+#if LIBKQUEUE
+    /* A blocking listener could block kevent() */
+    EV_SET(&kev, srvr, EVFILT_READ, EV_ADD, NOTE_ACCEPT, 2, NULL);
+    EXPECT_EQ(-1, kevent(kqfd(), &kev, 1, NULL, 0, NULL));
+    EXPECT_EQ(EINVAL, errno);
+#endif
+    ASSERT_EQ(0, fcntl(srvr, F_SETFL, O_NONBLOCK));
+
+    /* At most two connections per call */
+    EV_SET(&kev, srvr, EVFILT_READ, EV_ADD, NOTE_ACCEPT, 2, NULL);
+    EXPECT_EQ(0, kevent(kqfd(), &kev, 1, NULL, 0, NULL)) << strerror(errno);
+    EXPECT_NO_EVENT(kqfd());
+
+    for (i = 0; i < 3; i++) {
+        if ((clnt[i] = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+            FAIL() << "socket(): " << strerror(errno);
+        if (connect(clnt[i], (const struct sockaddr *)&sain, sizeof(sain)) < 0)
+            FAIL() << "connect(): " << strerror(errno);
+    }
+
+    EXPECT_EQ(2, kevent(kqfd(), NULL, 0, ret, 4, &zero_ts));
+    EXPECT_EQ(1, kevent(kqfd(), NULL, 0, &ret[2], 4, &zero_ts));
+    for (i = 0; i < 3; i++) {
+        EXPECT_EQ(srvr, (int) ret[i].ident);
+        EXPECT_FALSE(ret[i].flags & EV_ERROR);
+        EXPECT_EQ(O_NONBLOCK, fcntl(ret[i].data, F_GETFL) & O_NONBLOCK);
+        EXPECT_EQ(1, write(clnt[i], "x", 1));
+        close(ret[i].data);
+        close(clnt[i]);
+    }
+    EXPECT_NO_EVENT(kqfd());
+
+    kev.flags = EV_DELETE;
+    EXPECT_EQ(0, kevent(kqfd(), &kev, 1, NULL, 0, NULL)) << strerror(errno);
+    close(srvr);
+}
+
+/* Accepted sockets are registered with the template changes */
+TEST_F(KQLegacyTests, ReadSocketAcceptTemplate)
+{
+    struct kevent kev, tmpl, ret;
+    struct sockaddr_in sain;
+    int srvr, clnt, fd;
+
+    ASSERT_LE(0, srvr = create_listener(&sain)) << strerror(errno);
+    ASSERT_EQ(0, fcntl(srvr, F_SETFL, O_NONBLOCK));
+
+    EV_SET(&kev, srvr, EVFILT_READ, EV_ADD, NOTE_ACCEPT, 0, NULL);
+    EXPECT_EQ(0, kevent(kqfd(), &kev, 1, NULL, 0, NULL)) << strerror(errno);
+    EV_SET(&tmpl, 0, EVFILT_READ, EV_ADD, 0, 0, &sain);
+    EXPECT_EQ(0, kevent_accept_template(kqfd(), srvr, &tmpl, 1)) << strerror(errno);
+
+    if ((clnt = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+        FAIL() << "socket(): " << strerror(errno);
+    if (connect(clnt, (const struct sockaddr *)&sain, sizeof(sain)) < 0)
+        FAIL() << "connect(): " << strerror(errno);
+    EXPECT_EQ(1, write(clnt, "x", 1));
+
+    EXPECT_EVENT(kqfd(), &ret);
+    EXPECT_EQ(srvr, (int) ret.ident);
+    fd = ret.data;
+
+    /* The new socket is already being watched */
+    EXPECT_EVENT(kqfd(), &ret);
+    EXPECT_EQ(fd, (int) ret.ident);
+    EXPECT_EQ(EVFILT_READ, ret.filter);
+    EXPECT_EQ(1, ret.data);
+    EXPECT_EQ(&sain, ret.udata);
+
+    EV_SET(&kev, fd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+    EXPECT_EQ(0, kevent(kqfd(), &kev, 1, NULL, 0, NULL)) << strerror(errno);
+    EV_SET(&kev, srvr, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+    EXPECT_EQ(0, kevent(kqfd(), &kev, 1, NULL, 0, NULL)) << strerror(errno);
+    close(fd);
+    close(clnt);
+    close(srvr);
+}
+
+/* NOTE_EXCLUSIVE knotes can be disabled, dispatched and modified */
+TEST_F(KQLegacyTests, ReadSocketExclusive)
+{
+    struct kevent kev, ret;
+    struct sockaddr_in sain;
+    int srvr, clnt;
+
+    ASSERT_LE(0, srvr = create_listener(&sain)) << strerror(errno);
+
+    EV_SET(&kev, srvr, EVFILT_READ, EV_ADD, NOTE_EXCLUSIVE, 0, NULL);
+    EXPECT_EQ(0, kevent(kqfd(), &kev, 1, NULL, 0, NULL)) << strerror(errno);
+    EXPECT_NO_EVENT(kqfd());
+
+    if ((clnt = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+        FAIL() << "socket(): " << strerror(errno);
+    if (connect(clnt, (const struct sockaddr *)&sain, sizeof(sain)) < 0)
+        FAIL() << "connect(): " << strerror(errno);
+    EXPECT_EVENT(kqfd(), &ret);
+    EXPECT_EQ(1, ret.data);
+
+    kev.flags = EV_DISABLE;
+    EXPECT_EQ(0, kevent(kqfd(), &kev, 1, NULL, 0, NULL)) << strerror(errno);
+    EXPECT_NO_EVENT(kqfd());
+    kev.flags = EV_ENABLE;
+    EXPECT_EQ(0, kevent(kqfd(), &kev, 1, NULL, 0, NULL)) << strerror(errno);
+    EXPECT_EVENT(kqfd(), &ret);
+
+    /* EV_DISPATCH without EPOLLONESHOT */
+    kev.flags = EV_ADD | EV_DISPATCH;
+    EXPECT_EQ(0, kevent(kqfd(), &kev, 1, NULL, 0, NULL)) << strerror(errno);
+    EXPECT_EVENT(kqfd(), &ret);
+    EXPECT_NO_EVENT(kqfd());
+    kev.flags = EV_ENABLE;
+    EXPECT_EQ(0, kevent(kqfd(), &kev, 1, NULL, 0, NULL)) << strerror(errno);
+    EXPECT_EVENT(kqfd(), &ret);
+    EXPECT_NO_EVENT(kqfd());
+
+    /* Back to a plain registration */
+    kev.flags = EV_ADD;
+    kev.fflags = 0;
+    EXPECT_EQ(0, kevent(kqfd(), &kev, 1, NULL, 0, NULL)) << strerror(errno);
+    EXPECT_NO_EVENT(kqfd());
+    kev.flags = EV_ENABLE;
+    EXPECT_EQ(0, kevent(kqfd(), &kev, 1, NULL, 0, NULL)) << strerror(errno);
+    EXPECT_EVENT(kqfd(), &ret);
+    EXPECT_EVENT(kqfd(), &ret);
+
+    kev.flags = EV_DELETE;
+    EXPECT_EQ(0, kevent(kqfd(), &kev, 1, NULL, 0, NULL)) << strerror(errno);
+    close(clnt);
+    close(srvr);
+}
+
+#if defined(NOTE_IDLE)
+/* Wait up to 200ms for an event */
+static int
+kevent_wait_200ms(int kqfd, struct kevent *ret)
+{
+    struct timespec ts = { 0, 200000000 };
+
+    return (kevent(kqfd, NULL, 0, ret, 1, &ts));
+}
+
+TEST_F(KQLegacyTests, ReadSocketIdleTimeout)
+{
+    struct kevent kev, ret;
+    char buf[1];
+    int i, sv[2];
+
+    ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) << strerror(errno);
+
+    /* The knote must exist, and the filter must be READ or WRITE */
+    EXPECT_EQ(-1, kevent_idle_timeout(kqfd(), sv[0], EVFILT_READ, 50));
+    EXPECT_EQ(ENOENT, errno);
+    EV_SET(&kev, sv[0], EVFILT_READ, EV_ADD, 0, 0, NULL);
+    EXPECT_EQ(0, kevent(kqfd(), &kev, 1, NULL, 0, NULL)) << strerror(errno);
+    EXPECT_EQ(-1, kevent_idle_timeout(kqfd(), sv[0], EVFILT_TIMER, 50));
+    EXPECT_EQ(EINVAL, errno);
+    EXPECT_EQ(-1, kevent_idle_timeout(kqfd(), sv[0], EVFILT_READ, -1));
+    EXPECT_EQ(EINVAL, errno);
+
+    /* A quiet descriptor reports the timeout */
+    ASSERT_EQ(0, kevent_idle_timeout(kqfd(), sv[0], EVFILT_READ, 100)) << strerror(errno);
+    ASSERT_EQ(1, kevent_wait_200ms(kqfd(), &ret)) << strerror(errno);
+    EXPECT_EQ(sv[0], (int) ret.ident);
+    EXPECT_EQ(EVFILT_TIMER, ret.filter);
+    EXPECT_EQ(NOTE_IDLE, (int) ret.fflags);
+    EXPECT_EQ(0, (int) (ret.fflags & ~NOTE_FFLAGSMASK));
+    EXPECT_LE(1, ret.data);
+
+    /* Activity pushes it back */
+    for (i = 0; i < 10; i++) {
+        ASSERT_EQ(1, send(sv[1], ".", 1, 0));
+        ASSERT_EQ(1, kevent_wait_200ms(kqfd(), &ret)) << strerror(errno);
+        EXPECT_EQ(EVFILT_READ, ret.filter);
+        ASSERT_EQ(1, recv(sv[0], buf, 1, 0));
+        usleep(20000);
+    }
+    EXPECT_NO_EVENT(kqfd());
+
+    ASSERT_EQ(1, kevent_wait_200ms(kqfd(), &ret)) << strerror(errno);
+    EXPECT_EQ(EVFILT_TIMER, ret.filter);
+    EXPECT_EQ(NOTE_IDLE, (int) ret.fflags);
+
+    /* A zero timeout disarms it */
+    ASSERT_EQ(0, kevent_idle_timeout(kqfd(), sv[0], EVFILT_READ, 0)) << strerror(errno);
+    EXPECT_EQ(0, kevent_wait_200ms(kqfd(), &ret));
+
+    /* The longest timeout never expires, rather than wrap around */
+    ASSERT_EQ(0, kevent_idle_timeout(kqfd(), sv[0], EVFILT_READ, INTPTR_MAX))
+        << strerror(errno);
+    EXPECT_EQ(0, kevent_wait_200ms(kqfd(), &ret));
+
+    /* So does deleting the knote */
+    ASSERT_EQ(0, kevent_idle_timeout(kqfd(), sv[0], EVFILT_READ, 100)) << strerror(errno);
+    kev.flags = EV_DELETE;
+    EXPECT_EQ(0, kevent(kqfd(), &kev, 1, NULL, 0, NULL)) << strerror(errno);
+    EXPECT_EQ(0, kevent_wait_200ms(kqfd(), &ret));
+
+    close(sv[0]);
+    close(sv[1]);
+}
+#endif
+
 void
 test_kevent_socket_dispatch(struct test_context *ctx)
 {
@@ -331,31 +679,178 @@ test_kevent_socket_dispatch(struct test_context *ctx)
 }
 
 void
-test_kevent_socket_lowat(struct test_context *ctx)
+test_kevent_socket_modify(struct test_context *ctx)
 {
-#if defined(NOTE_LOWAT)
-    struct kevent kev;
-    /* Re-add the watch and make sure no events are pending */
-    puts("-- re-adding knote, setting low watermark to 2 bytes");
-    EV_SET(&kev, ctx->client_fd, EVFILT_READ, EV_ADD | EV_ONESHOT, NOTE_LOWAT, 2, &ctx->client_fd);
-    if (kevent(ctx->kqfd, &kev, 1, NULL, 0, NULL) < 0)
-        die("%s", test_id);
-    EXPECT_NO_EVENT();
+    struct kevent kev, ret;
+
+    kev = KEventCreate(ctx->client_fd, EVFILT_READ, EV_ADD);
+    EXPECT_EQ(0, kevent(ctx->kqfd, &kev, 1, NULL, 0, NULL)) << strerror(errno)
+                                                            << " - " << kev;
+
+    /* Turn the level-triggered knote into an EV_DISPATCH knote */
+    kev = KEventCreate(ctx->client_fd, EVFILT_READ, EV_ADD | EV_DISPATCH);
+    EXPECT_EQ(0, kevent(ctx->kqfd, &kev, 1, NULL, 0, NULL)) << strerror(errno)
+                                                            << " - " << kev;
 
-    puts("-- checking that one byte does not trigger an event..");
     kevent_socket_fill(ctx);
-    EXPECT_NO_EVENT();
+    kev.data = 1;
+    EXPECT_EVENT(ctx->kqfd, &ret);
+    EXPECT_EQ(kev, ret);
+    EXPECT_NO_EVENT(ctx->kqfd);
+
+    /* And back again, which also re-arms it */
+    kev = KEventCreate(ctx->client_fd, EVFILT_READ, EV_ENABLE);
+    EXPECT_EQ(0, kevent(ctx->kqfd, &kev, 1, NULL, 0, NULL)) << strerror(errno)
+                                                            << " - " << kev;
+    kev = KEventCreate(ctx->client_fd, EVFILT_READ, EV_ADD);
+    EXPECT_EQ(0, kevent(ctx->kqfd, &kev, 1, NULL, 0, NULL)) << strerror(errno)
+                                                            << " - " << kev;
+    kev.data = 1;
+    EXPECT_EVENT(ctx->kqfd, &ret);
+    EXPECT_EQ(kev, ret);
+    EXPECT_EVENT(ctx->kqfd, &ret);
+    EXPECT_EQ(kev, ret);
+
+    kevent_socket_drain(ctx);
+    EXPECT_NO_EVENT(ctx->kqfd);
+
+    kev = KEventCreate(ctx->client_fd, EVFILT_READ, EV_DELETE);
+    EXPECT_EQ(0, kevent(ctx->kqfd, &kev, 1, NULL, 0, NULL)) << strerror(errno)
+                                                            << " - " << kev;
+}
 
-    puts("-- checking that two bytes triggers an event..");
+#if defined(NOTE_LAZYDISABLE)
+void
+test_kevent_socket_lazy_disable(struct test_context *ctx)
+{
+    struct kevent kev, ret;
+
+    kev = KEventCreate(ctx->client_fd, EVFILT_READ, EV_ADD, NOTE_LAZYDISABLE);
+    EXPECT_EQ(0, kevent(ctx->kqfd, &kev, 1, NULL, 0, NULL)) << strerror(errno)
+                                                            << " - " << kev;
+    kev.flags = EV_DISABLE;
+    EXPECT_EQ(0, kevent(ctx->kqfd, &kev, 1, NULL, 0, NULL)) << strerror(errno)
+                                                            << " - " << kev;
+
+    /* The descriptor is still armed, but the event is dropped */
     kevent_socket_fill(ctx);
-    if (kevent(ctx->kqfd, NULL, 0, &kev, 1, NULL) != 1)
-        die("%s", test_id);
-    KEV_CMP(kev, ctx->client_fd, EVFILT_READ, 0);
-    EXPECT_NO_EVENT();
+    EXPECT_NO_EVENT(ctx->kqfd);
+    EXPECT_NO_EVENT(ctx->kqfd);
+
+    kev.flags = EV_ENABLE;
+    EXPECT_EQ(0, kevent(ctx->kqfd, &kev, 1, NULL, 0, NULL)) << strerror(errno)
+                                                            << " - " << kev;
+    kev.flags = EV_ADD;
+    kev.data = 1;
+    EXPECT_EVENT(ctx->kqfd, &ret);
+    EXPECT_EQ(kev, ret);
+
+    kevent_socket_drain(ctx);
+    EXPECT_NO_EVENT(ctx->kqfd);
+
+    kev = KEventCreate(ctx->client_fd, EVFILT_READ, EV_DELETE);
+    EXPECT_EQ(0, kevent(ctx->kqfd, &kev, 1, NULL, 0, NULL)) << strerror(errno)
+                                                            << " - " << kev;
+}
+#endif
+
+#if defined(NOTE_NODATA)
+void
+test_kevent_socket_nodata(struct test_context *ctx)
+{
+    struct kevent kev, ret;
+
+    kev = KEventCreate(ctx->client_fd, EVFILT_READ, EV_ADD, NOTE_NODATA);
+    EXPECT_EQ(0, kevent(ctx->kqfd, &kev, 1, NULL, 0, NULL)) << strerror(errno)
+                                                            << " - " << kev;
+
+    /* The data field is only filled in on request */
+    kevent_socket_fill(ctx);
+    kevent_socket_fill(ctx);
+    EXPECT_EVENT(ctx->kqfd, &ret);
+    EXPECT_EQ(kev, ret);
+    EXPECT_EQ(0, kevent_data(ctx->kqfd, &ret)) << strerror(errno);
+    EXPECT_EQ(2, ret.data);
 
     kevent_socket_drain(ctx);
     kevent_socket_drain(ctx);
-#endif  // NOTE_LOWAT
+    EXPECT_NO_EVENT(ctx->kqfd);
+
+    kev.flags = EV_DELETE;
+    EXPECT_EQ(0, kevent(ctx->kqfd, &kev, 1, NULL, 0, NULL)) << strerror(errno)
+                                                            << " - " << kev;
+    EXPECT_EQ(-1, kevent_data(ctx->kqfd, &ret));
+}
+#endif
+
+static void
+kevent_socket_lowat(int kqfd, int fd, int peer)
+{
+    struct kevent kev, ret;
+    char buf[4];
+
+    /* Re-add the watch and make sure no events are pending */
+    EV_SET(&kev, fd, EVFILT_READ, EV_ADD | EV_ONESHOT, NOTE_LOWAT, 2, NULL);
+    EXPECT_EQ(0, kevent(kqfd, &kev, 1, NULL, 0, NULL)) << strerror(errno)
+                                                       << " - " << kev;
+    EXPECT_NO_EVENT(kqfd);
+
+    /* One byte does not trigger an event */
+    ASSERT_EQ(1, send(peer, ".", 1, 0));
+    EXPECT_NO_EVENT(kqfd);
+
+    /* Two bytes do */
+    ASSERT_EQ(1, send(peer, ".", 1, 0));
+    EXPECT_EVENT(kqfd, &ret);
+    EXPECT_EQ(fd, (int) ret.ident);
+    EXPECT_EQ(EVFILT_READ, ret.filter);
+    EXPECT_EQ(2, ret.data);
+    EXPECT_NO_EVENT(kqfd);
+
+    /* Raise the threshold of the existing knote */
+    EV_SET(&kev, fd, EVFILT_READ, EV_ADD, NOTE_LOWAT, 3, NULL);
+    EXPECT_EQ(0, kevent(kqfd, &kev, 1, NULL, 0, NULL)) << strerror(errno)
+                                                       << " - " << kev;
+    EXPECT_NO_EVENT(kqfd);
+    ASSERT_EQ(1, send(peer, ".", 1, 0));
+    EXPECT_EVENT(kqfd, &ret);
+    EXPECT_EQ(3, ret.data);
+
+    /* Level-triggered: reported until it drops below the threshold */
+    EXPECT_EVENT(kqfd, &ret);
+    ASSERT_EQ(1, recv(fd, buf, 1, 0));
+    EXPECT_NO_EVENT(kqfd);
+
+    /* And without a threshold, one byte is enough */
+    EV_SET(&kev, fd, EVFILT_READ, EV_ADD, 0, 0, NULL);
+    EXPECT_EQ(0, kevent(kqfd, &kev, 1, NULL, 0, NULL)) << strerror(errno)
+                                                       << " - " << kev;
+    EXPECT_EVENT(kqfd, &ret);
+    EXPECT_EQ(2, ret.data);
+
+    ASSERT_EQ(2, recv(fd, buf, 2, 0));
+    kev.flags = EV_DELETE;
+    EXPECT_EQ(0, kevent(kqfd, &kev, 1, NULL, 0, NULL)) << strerror(errno)
+                                                       << " - " << kev;
+}
+
+/* TCP applies the threshold in the kernel */
+void
+test_kevent_socket_lowat(struct test_context *ctx)
+{
+    kevent_socket_lowat(ctx->kqfd, ctx->client_fd, ctx->server_fd);
+}
+
+/* Other sockets are filtered on copyout */
+void
+test_kevent_socket_lowat_unix(struct test_context *ctx)
+{
+    int sv[2];
+
+    ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) << strerror(errno);
+    kevent_socket_lowat(ctx->kqfd, sv[0], sv[1]);
+    close(sv[0]);
+    close(sv[1]);
 }
 
 void
@@ -426,6 +921,115 @@ TEST_F(KQLegacyTests, ReadRegularFile)
     close(fd);
 }
 
+/* Regular files take turns when the eventlist is too small for all of them */
+TEST_F(KQLegacyTests, ReadRegularFileMany)
+{
+    struct kevent kev, ret;
+    char path[] = "/tmp/kqueue-test.XXXXXX";
+    int fd[3], seen[3] = { 0 };
+    unsigned int i, j;
+
+    for (i = 0; i < 3; i++) {
+        ASSERT_GE(fd[i] = mkstemp(path), 0);
+        unlink(path);
+        strcpy(path + strlen(path) - 6, "XXXXXX");
+        ASSERT_EQ(4, write(fd[i], "data", 4));
+        ASSERT_EQ(0, lseek(fd[i], 0, SEEK_SET));
+
+        kev = KEventCreate(fd[i], EVFILT_READ, EV_ADD);
+        ASSERT_EQ(0, kevent(kqfd(), &kev, 1, NULL, 0, NULL)) << strerror(errno);
+    }
+
+    for (i = 0; i < 3; i++) {
+        ASSERT_EQ(1, kevent(kqfd(), NULL, 0, &ret, 1, &zero_ts));
+        EXPECT_EQ(4, ret.data);
+        for (j = 0; j < 3; j++) {
+            if (ret.ident == (uintptr_t) fd[j])
+                seen[j]++;
+        }
+    }
+    EXPECT_EQ(1, seen[0]);
+    EXPECT_EQ(1, seen[1]);
+    EXPECT_EQ(1, seen[2]);
+
+    /* Files at the end are not reported, until the knote is modified */
+    ASSERT_EQ(4, lseek(fd[0], 0, SEEK_END));
+    ASSERT_EQ(4, lseek(fd[1], 0, SEEK_END));
+    kev = KEventCreate(fd[2], EVFILT_READ, EV_DELETE);
+    ASSERT_EQ(0, kevent(kqfd(), &kev, 1, NULL, 0, NULL)) << strerror(errno);
+    EXPECT_NO_EVENT(kqfd());
+
+    ASSERT_EQ(2, lseek(fd[0], 2, SEEK_SET));
+    EXPECT_NO_EVENT(kqfd());
+    kev = KEventCreate(fd[0], EVFILT_READ, EV_ADD | EV_CLEAR);
+    ASSERT_EQ(0, kevent(kqfd(), &kev, 1, NULL, 0, NULL)) << strerror(errno);
+    kev.data = 2;
+    EXPECT_EVENT(kqfd(), &ret);
+    EXPECT_EQ(kev, ret);
+
+    /* With EV_CLEAR, the file is only reported once */
+    EXPECT_NO_EVENT(kqfd());
+
+    for (i = 0; i < 2; i++) {
+        kev = KEventCreate(fd[i], EVFILT_READ, EV_DELETE);
+        ASSERT_EQ(0, kevent(kqfd(), &kev, 1, NULL, 0, NULL)) << strerror(errno);
+    }
+    for (i = 0; i < 3; i++)
+        close(fd[i]);
+}
+
+/* A regular file at the end is reported again when it grows */
+TEST_F(KQLegacyTests, ReadRegularFileGrow)
+{
+    struct kevent kev, ret;
+    char path[] = "/tmp/kqueue-test.XXXXXX";
+    int fd, wfd;
+
+    ASSERT_GE(wfd = mkstemp(path), 0);
+    ASSERT_GE(fd = open(path, O_RDONLY), 0);
+    unlink(path);
+    ASSERT_EQ(4, write(wfd, "data", 4));
+    ASSERT_EQ(4, lseek(fd, 0, SEEK_END));
+
+    kev = KEventCreate(fd, EVFILT_READ, EV_ADD);
+    ASSERT_EQ(0, kevent(kqfd(), &kev, 1, NULL, 0, NULL)) << strerror(errno);
+    EXPECT_NO_EVENT(kqfd());
+
+    ASSERT_EQ(3, write(wfd, "abc", 3));
+    kev.data = 3;
+    EXPECT_EVENT(kqfd(), &ret);
+    EXPECT_EQ(kev, ret);
+
+    /* It stays readable until the new data is read */
+    EXPECT_EVENT(kqfd(), &ret);
+    EXPECT_EQ(kev, ret);
+    ASSERT_EQ(7, lseek(fd, 0, SEEK_END));
+    EXPECT_NO_EVENT(kqfd());
+
+    /* With EV_CLEAR, each write is reported once */
+    kev = KEventCreate(fd, EVFILT_READ, EV_ADD | EV_CLEAR);
+    ASSERT_EQ(0, kevent(kqfd(), &kev, 1, NULL, 0, NULL)) << strerror(errno);
+    EXPECT_NO_EVENT(kqfd());
+    ASSERT_EQ(2, write(wfd, "de", 2));
+    kev.data = 2;
+    EXPECT_EVENT(kqfd(), &ret);
+    EXPECT_EQ(kev, ret);
+    EXPECT_NO_EVENT(kqfd());
+    ASSERT_EQ(2, write(wfd, "fg", 2));
+    kev.data = 4;
+    EXPECT_EVENT(kqfd(), &ret);
+    EXPECT_EQ(kev, ret);
+    EXPECT_NO_EVENT(kqfd());
+
+    kev = KEventCreate(fd, EVFILT_READ, EV_DELETE);
+    ASSERT_EQ(0, kevent(kqfd(), &kev, 1, NULL, 0, NULL)) << strerror(errno);
+    ASSERT_EQ(2, write(wfd, "hi", 2));
+    EXPECT_NO_EVENT(kqfd());
+
+    close(fd);
+    close(wfd);
+}
+
 void
 test_evfilt_read(struct test_context *ctx)
 {
@@ -439,6 +1043,15 @@ test_evfilt_read(struct test_context *ctx)
     test(kevent_socket_oneshot, ctx);
     test(kevent_socket_clear, ctx);
     test(kevent_socket_dispatch, ctx);
+    test(kevent_socket_modify, ctx);
+    test(kevent_socket_lowat, ctx);
+    test(kevent_socket_lowat_unix, ctx);
+#if defined(NOTE_LAZYDISABLE)
+    test(kevent_socket_lazy_disable, ctx);
+#endif
+#if defined(NOTE_NODATA)
+    test(kevent_socket_nodata, ctx);
+#endif
     test(kevent_socket_eof, ctx);
 
     close(ctx->client_fd);
@@ -198,6 +198,147 @@ test_kevent_signal_dispatch(struct test_context *ctx)
 }
 #endif  /* EV_DISPATCH */
 
+#if LIBKQUEUE
+/* Queued signals are all counted, and the last sender is kept */
+TEST_F(KQLegacyTests, SignalCount)
+{
+    struct timespec ts = { 1, 0 };
+    struct kevent kev, ret[4];
+    struct kevent_siginfo info;
+    union sigval val;
+    int i, signo = SIGRTMIN + 1;
+
+    kev = KEventCreate(signo, EVFILT_SIGNAL, EV_ADD);
+    ASSERT_EQ(0, kevent(kqfd(), &kev, 1, NULL, 0, NULL)) << strerror(errno);
+    kev = KEventCreate(SIGUSR2, EVFILT_SIGNAL, EV_ADD);
+    ASSERT_EQ(0, kevent(kqfd(), &kev, 1, NULL, 0, NULL)) << strerror(errno);
+
+    for (i = 0; i < 5; i++) {
+        val.sival_int = 100 + i;
+        ASSERT_EQ(0, sigqueue(getpid(), signo, val)) << strerror(errno);
+    }
+    ASSERT_EQ(0, kill(getpid(), SIGUSR2));
+
+    ASSERT_EQ(2, kevent(kqfd(), NULL, 0, ret, 4, &ts)) << strerror(errno);
+    for (i = 0; i < 2; i++) {
+        EXPECT_EQ(EVFILT_SIGNAL, ret[i].filter);
+        EXPECT_EQ((int) ret[i].ident == signo ? 5 : 1, (int) ret[i].data);
+    }
+    EXPECT_NO_EVENT(kqfd());
+
+    ASSERT_EQ(0, kevent_signal_info(kqfd(), signo, &info)) << strerror(errno);
+    EXPECT_EQ(SI_QUEUE, info.ksi_code);
+    EXPECT_EQ(getpid(), info.ksi_pid);
+    EXPECT_EQ(getuid(), info.ksi_uid);
+    EXPECT_EQ(104, (int) info.ksi_value);
+
+    kev = KEventCreate(signo, EVFILT_SIGNAL, EV_DELETE);
+    ASSERT_EQ(0, kevent(kqfd(), &kev, 1, NULL, 0, NULL)) << strerror(errno);
+    kev = KEventCreate(SIGUSR2, EVFILT_SIGNAL, EV_DELETE);
+    ASSERT_EQ(0, kevent(kqfd(), &kev, 1, NULL, 0, NULL)) << strerror(errno);
+    EXPECT_EQ(-1, kevent_signal_info(kqfd(), signo, &info));
+    EXPECT_EQ(ENOENT, errno);
+}
+
+/*
+ * Every kqueue that watches a signal gets it, with its own count, and the
+ * signal is unblocked when the last knote is deleted.
+ */
+TEST_F(KQLegacyTests, SignalShared)
+{
+    struct kevent kev, ret;
+    sigset_t mask, omask;
+    int kq1, kq2, blocked;
+
+    /*
+     * Kqueues of its own, and the mask as it was, which earlier tests may
+     * have left with SIGUSR2 blocked.
+     */
+    ASSERT_EQ(0, pthread_sigmask(SIG_BLOCK, NULL, &omask));
+    blocked = sigismember(&omask, SIGUSR2);
+    ASSERT_LE(0, (kq1 = kqueue())) << strerror(errno);
+    if ((kq2 = kqueue()) < 0) {
+        close(kq1);
+        FAIL() << "kqueue: " << strerror(errno);
+    }
+
+    kev = KEventCreate(SIGUSR2, EVFILT_SIGNAL, EV_ADD);
+    EXPECT_EQ(0, kevent(kq1, &kev, 1, NULL, 0, NULL)) << strerror(errno);
+    EXPECT_EQ(0, kevent(kq2, &kev, 1, NULL, 0, NULL)) << strerror(errno);
+    EXPECT_EQ(0, pthread_sigmask(SIG_BLOCK, NULL, &mask));
+    EXPECT_TRUE(sigismember(&mask, SIGUSR2));
+
+    kev.flags = EV_ADD | EV_CLEAR;
+    kev.data = 1;
+    EXPECT_EQ(0, kill(getpid(), SIGUSR2));
+    EXPECT_EVENT(kq1, &ret);
+    EXPECT_EQ(kev, ret);
+    EXPECT_EQ(0, kill(getpid(), SIGUSR2));
+    EXPECT_EVENT(kq1, &ret);
+    EXPECT_EQ(kev, ret);
+
+    /* The second kqueue has seen both */
+    kev.data = 2;
+    EXPECT_EVENT(kq2, &ret);
+    EXPECT_EQ(kev, ret);
+    EXPECT_NO_EVENT(kq2);
+
+    /* Still blocked while the other kqueue watches it */
+    kev.flags = EV_DELETE;
+    EXPECT_EQ(0, kevent(kq2, &kev, 1, NULL, 0, NULL)) << strerror(errno);
+    EXPECT_EQ(0, pthread_sigmask(SIG_BLOCK, NULL, &mask));
+    EXPECT_TRUE(sigismember(&mask, SIGUSR2));
+    EXPECT_EQ(0, kill(getpid(), SIGUSR2));
+    EXPECT_EVENT(kq1, &ret);
+    EXPECT_NO_EVENT(kq2);
+
+    /* Back to the mask it had once the last knote is gone */
+    EXPECT_EQ(0, kevent(kq1, &kev, 1, NULL, 0, NULL)) << strerror(errno);
+    EXPECT_EQ(0, pthread_sigmask(SIG_BLOCK, NULL, &mask));
+    EXPECT_EQ(blocked, sigismember(&mask, SIGUSR2));
+
+    close(kq1);
+    close(kq2);
+    (void) pthread_sigmask(SIG_SETMASK, &omask, NULL);
+}
+
+static void *
+signal_add_thread(void *arg)
+{
+    struct kevent kev;
+
+    kev = KEventCreate(SIGUSR2, EVFILT_SIGNAL, EV_ADD);
+    return ((void *) (intptr_t) kevent(*(int *) arg, &kev, 1, NULL, 0, NULL));
+}
+
+/* Deleting the knote of another thread does not change the signal mask */
+TEST_F(KQLegacyTests, SignalOtherThread)
+{
+    struct kevent kev;
+    sigset_t mask, omask;
+    pthread_t tid;
+    void *rv;
+    int kq;
+
+    ASSERT_LE(0, (kq = kqueue())) << strerror(errno);
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGUSR2);
+    ASSERT_EQ(0, pthread_sigmask(SIG_BLOCK, &mask, &omask));
+
+    ASSERT_EQ(0, pthread_create(&tid, NULL, signal_add_thread, &kq));
+    ASSERT_EQ(0, pthread_join(tid, &rv));
+    EXPECT_EQ(0, (int) (intptr_t) rv);
+
+    kev = KEventCreate(SIGUSR2, EVFILT_SIGNAL, EV_DELETE);
+    EXPECT_EQ(0, kevent(kq, &kev, 1, NULL, 0, NULL)) << strerror(errno);
+    ASSERT_EQ(0, pthread_sigmask(SIG_BLOCK, NULL, &mask));
+    EXPECT_TRUE(sigismember(&mask, SIGUSR2));
+
+    (void) pthread_sigmask(SIG_SETMASK, &omask, NULL);
+    close(kq);
+}
+#endif
+
 void
 test_evfilt_signal(struct test_context *ctx)
 {
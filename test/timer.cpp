@@ -16,6 +16,8 @@
 
 #include "common.h"
 
+#include <sys/wait.h>
+
 void
 test_kevent_timer_add(struct test_context *ctx)
 {
@@ -175,6 +177,346 @@ test_kevent_timer_dispatch(struct test_context *ctx)
 }
 #endif  /* EV_DISPATCH */
 
+/* Many one-shot timers, which all expire within a few ticks */
+TEST_F(KQLegacyTests, TimerMany)
+{
+    const int ntimers = 1000;
+    struct timespec ts = { 1, 0 };
+    struct kevent kev, ret[64];
+    static char seen[ntimers];
+    int i, rv, nseen = 0;
+
+    memset(seen, 0, sizeof(seen));
+    for (i = 0; i < ntimers; i++) {
+        kev = KEventCreate(i, EVFILT_TIMER, EV_ADD | EV_ONESHOT, 0, 10 + i % 50);
+        ASSERT_EQ(0, kevent(kqfd(), &kev, 1, NULL, 0, NULL)) << strerror(errno);
+    }
+
+    while (nseen < ntimers) {
+        rv = kevent(kqfd(), NULL, 0, ret, 64, &ts);
+        ASSERT_LE(0, rv) << strerror(errno);
+        for (i = 0; i < rv; i++) {
+            ASSERT_EQ(EVFILT_TIMER, ret[i].filter);
+            ASSERT_GT(ntimers, (int) ret[i].ident);
+            EXPECT_EQ(0, seen[ret[i].ident]) << ret[i].ident;
+            EXPECT_EQ(1, ret[i].data);
+            seen[ret[i].ident] = 1;
+            nseen++;
+        }
+    }
+    EXPECT_NO_EVENT(kqfd());
+}
+
+/* The expirations that were not collected are counted exactly */
+TEST_F(KQLegacyTests, TimerOverrun)
+{
+    struct kevent kev, ret;
+
+    kev = KEventCreate(1, EVFILT_TIMER, EV_ADD, 0, 20);
+    ASSERT_EQ(0, kevent(kqfd(), &kev, 1, NULL, 0, NULL)) << strerror(errno);
+
+    /* 10 periods, and half of one for the timer to be handled */
+    usleep(210000);
+    EXPECT_EVENT(kqfd(), &ret);
+    EXPECT_EQ(10, ret.data);
+
+    /* The next expiration stays on the period */
+    usleep(100000);
+    EXPECT_EVENT(kqfd(), &ret);
+    EXPECT_EQ(5, ret.data);
+
+    /* Disabling the timer discards the expirations, enabling restarts it */
+    kev.flags = EV_DISABLE;
+    ASSERT_EQ(0, kevent(kqfd(), &kev, 1, NULL, 0, NULL)) << strerror(errno);
+    usleep(50000);
+    EXPECT_NO_EVENT(kqfd());
+    kev.flags = EV_ENABLE;
+    ASSERT_EQ(0, kevent(kqfd(), &kev, 1, NULL, 0, NULL)) << strerror(errno);
+    EXPECT_NO_EVENT(kqfd());
+    usleep(30000);
+    EXPECT_EVENT(kqfd(), &ret);
+    EXPECT_EQ(1, ret.data);
+
+    kev.flags = EV_DELETE;
+    ASSERT_EQ(0, kevent(kqfd(), &kev, 1, NULL, 0, NULL)) << strerror(errno);
+    usleep(30000);
+    EXPECT_NO_EVENT(kqfd());
+
+    /* A negative period is rejected */
+    kev = KEventCreate(1, EVFILT_TIMER, EV_ADD, 0, -1);
+    EXPECT_EQ(-1, kevent(kqfd(), &kev, 1, NULL, 0, NULL));
+}
+
+/* EV_ADD on an existing timer restarts it with the new period */
+TEST_F(KQLegacyTests, TimerModify)
+{
+    struct timespec ts = { 2, 0 }, t0, t1;
+    struct kevent kev, ret;
+
+    kev = KEventCreate(1, EVFILT_TIMER, EV_ADD, 0, 10000);
+    ASSERT_EQ(0, kevent(kqfd(), &kev, 1, NULL, 0, NULL)) << strerror(errno);
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    kev.data = 20;
+    ASSERT_EQ(0, kevent(kqfd(), &kev, 1, NULL, 0, NULL)) << strerror(errno);
+    ASSERT_EQ(1, kevent(kqfd(), NULL, 0, &ret, 1, &ts)) << strerror(errno);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    EXPECT_EQ(1, (int) ret.ident);
+    EXPECT_GT(1000, (t1.tv_sec - t0.tv_sec) * 1000 + (t1.tv_nsec - t0.tv_nsec) / 1000000);
+
+    /* Pushing it back discards the pending expirations */
+    usleep(50000);
+    kev.data = 10000;
+    ASSERT_EQ(0, kevent(kqfd(), &kev, 1, NULL, 0, NULL)) << strerror(errno);
+    EXPECT_NO_EVENT(kqfd());
+
+    /* A disabled timer keeps the new period until it is enabled */
+    kev.flags = EV_DISABLE;
+    ASSERT_EQ(0, kevent(kqfd(), &kev, 1, NULL, 0, NULL)) << strerror(errno);
+    kev.flags = EV_ADD;
+    kev.data = 20;
+    ASSERT_EQ(0, kevent(kqfd(), &kev, 1, NULL, 0, NULL)) << strerror(errno);
+    usleep(50000);
+    EXPECT_NO_EVENT(kqfd());
+    kev.flags = EV_ENABLE;
+    ASSERT_EQ(0, kevent(kqfd(), &kev, 1, NULL, 0, NULL)) << strerror(errno);
+    ASSERT_EQ(1, kevent(kqfd(), NULL, 0, &ret, 1, &ts)) << strerror(errno);
+    EXPECT_EQ(1, (int) ret.ident);
+
+    /* An invalid period leaves the timer running */
+    kev = KEventCreate(1, EVFILT_TIMER, EV_ADD, 0, -1);
+    EXPECT_EQ(-1, kevent(kqfd(), &kev, 1, NULL, 0, NULL));
+    ASSERT_EQ(1, kevent(kqfd(), NULL, 0, &ret, 1, &ts)) << strerror(errno);
+    EXPECT_EQ(1, (int) ret.ident);
+
+    kev.flags = EV_DELETE;
+    ASSERT_EQ(0, kevent(kqfd(), &kev, 1, NULL, 0, NULL)) << strerror(errno);
+}
+
+#if defined(NOTE_USECONDS)
+/* Wait up to 2s for an event */
+static int
+kevent_wait_timer(int kqfd, struct kevent *ret)
+{
+    struct timespec ts = { 2, 0 };
+
+    return (kevent(kqfd, NULL, 0, ret, 1, &ts));
+}
+
+TEST_F(KQLegacyTests, TimerUnits)
+{
+    struct timespec t0, t1;
+    struct kevent kev, ret;
+
+    /* 500us, for 50ms */
+    kev = KEventCreate(1, EVFILT_TIMER, EV_ADD, NOTE_USECONDS, 500);
+    ASSERT_EQ(0, kevent(kqfd(), &kev, 1, NULL, 0, NULL)) << strerror(errno);
+    usleep(50000);
+    EXPECT_EVENT(kqfd(), &ret);
+    EXPECT_LE(90, ret.data);
+    EXPECT_GE(110, ret.data);
+    kev.flags = EV_DELETE;
+    ASSERT_EQ(0, kevent(kqfd(), &kev, 1, NULL, 0, NULL)) << strerror(errno);
+
+    /* 20ms, in nanoseconds and in seconds */
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    kev = KEventCreate(2, EVFILT_TIMER, EV_ADD | EV_ONESHOT, NOTE_NSECONDS, 20000000);
+    ASSERT_EQ(0, kevent(kqfd(), &kev, 1, NULL, 0, NULL)) << strerror(errno);
+    ASSERT_EQ(1, kevent_wait_timer(kqfd(), &ret)) << strerror(errno);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    EXPECT_EQ(2, (int) ret.ident);
+    EXPECT_LE(20000000, (t1.tv_sec - t0.tv_sec) * 1000000000 + t1.tv_nsec - t0.tv_nsec);
+
+    kev = KEventCreate(3, EVFILT_TIMER, EV_ADD | EV_ONESHOT, NOTE_SECONDS, 1);
+    ASSERT_EQ(0, kevent(kqfd(), &kev, 1, NULL, 0, NULL)) << strerror(errno);
+    EXPECT_NO_EVENT(kqfd());
+    ASSERT_EQ(1, kevent_wait_timer(kqfd(), &ret)) << strerror(errno);
+    EXPECT_EQ(3, (int) ret.ident);
+
+    /* Only one unit can be given */
+    kev = KEventCreate(4, EVFILT_TIMER, EV_ADD, NOTE_SECONDS | NOTE_USECONDS, 1);
+    EXPECT_EQ(-1, kevent(kqfd(), &kev, 1, NULL, 0, NULL));
+}
+
+TEST_F(KQLegacyTests, TimerAbsolute)
+{
+    struct timespec now;
+    struct kevent kev, ret;
+
+    /* 50ms from now on the wall clock, in microseconds */
+    clock_gettime(CLOCK_REALTIME, &now);
+    kev = KEventCreate(1, EVFILT_TIMER, EV_ADD, NOTE_ABSTIME | NOTE_USECONDS,
+            now.tv_sec * 1000000 + now.tv_nsec / 1000 + 50000);
+    ASSERT_EQ(0, kevent(kqfd(), &kev, 1, NULL, 0, NULL)) << strerror(errno);
+    EXPECT_NO_EVENT(kqfd());
+    ASSERT_EQ(1, kevent_wait_timer(kqfd(), &ret)) << strerror(errno);
+    EXPECT_EQ(1, (int) ret.ident);
+    EXPECT_EQ(1, ret.data);
+
+    /* It only fires once */
+    usleep(100000);
+    EXPECT_NO_EVENT(kqfd());
+    kev.flags = EV_DELETE;
+    ASSERT_EQ(0, kevent(kqfd(), &kev, 1, NULL, 0, NULL)) << strerror(errno);
+
+    /* A time in the past fires at once */
+    kev = KEventCreate(2, EVFILT_TIMER, EV_ADD | EV_ONESHOT, NOTE_ABSTIME | NOTE_SECONDS,
+            now.tv_sec - 1);
+    ASSERT_EQ(0, kevent(kqfd(), &kev, 1, NULL, 0, NULL)) << strerror(errno);
+    ASSERT_EQ(1, kevent_wait_timer(kqfd(), &ret)) << strerror(errno);
+    EXPECT_EQ(2, (int) ret.ident);
+
+    /* And so does a periodic timer on CLOCK_BOOTTIME */
+    kev = KEventCreate(3, EVFILT_TIMER, EV_ADD, NOTE_BOOTTIME, 20);
+    ASSERT_EQ(0, kevent(kqfd(), &kev, 1, NULL, 0, NULL)) << strerror(errno);
+    ASSERT_EQ(1, kevent_wait_timer(kqfd(), &ret)) << strerror(errno);
+    EXPECT_EQ(3, (int) ret.ident);
+    ASSERT_EQ(1, kevent_wait_timer(kqfd(), &ret)) << strerror(errno);
+    EXPECT_EQ(3, (int) ret.ident);
+    kev.flags = EV_DELETE;
+    ASSERT_EQ(0, kevent(kqfd(), &kev, 1, NULL, 0, NULL)) << strerror(errno);
+}
+
+/* Timers whose leeways overlap expire together, and never early */
+TEST_F(KQLegacyTests, TimerLeeway)
+{
+    struct timespec ts = { 2, 0 }, t0, t1;
+    struct kevent kev, ret[16];
+    int i;
+
+    EXPECT_EQ(-1, kevent_timer_leeway(kqfd(), 1, 10));
+    EXPECT_EQ(ENOENT, errno);
+
+    /* 20ms to 38ms, each with 30ms of leeway */
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (i = 0; i < 10; i++) {
+        kev = KEventCreate(i, EVFILT_TIMER, EV_ADD | EV_ONESHOT, 0, 20 + 2 * i);
+        ASSERT_EQ(0, kevent(kqfd(), &kev, 1, NULL, 0, NULL)) << strerror(errno);
+        ASSERT_EQ(0, kevent_timer_leeway(kqfd(), i, 30)) << strerror(errno);
+    }
+    EXPECT_EQ(-1, kevent_timer_leeway(kqfd(), 0, -1));
+
+    ASSERT_EQ(10, kevent(kqfd(), NULL, 0, ret, 16, &ts)) << strerror(errno);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    EXPECT_LE(38000000, (t1.tv_sec - t0.tv_sec) * 1000000000 + t1.tv_nsec - t0.tv_nsec);
+    for (i = 0; i < 10; i++)
+        EXPECT_EQ(EVFILT_TIMER, ret[i].filter);
+    EXPECT_NO_EVENT(kqfd());
+}
+
+/* A leeway that takes the latest time past the end of the clock saturates */
+TEST_F(KQLegacyTests, TimerLeewayOverflow)
+{
+    struct timespec ts = { 0, 100000000 }, t0, t1;
+    struct kevent kev, ret;
+    int kq;
+
+    ASSERT_LE(0, (kq = kqueue())) << strerror(errno);
+    kev = KEventCreate(1, EVFILT_TIMER, EV_ADD, NOTE_NSECONDS, INTPTR_MAX);
+    EXPECT_EQ(0, kevent(kq, &kev, 1, NULL, 0, NULL)) << strerror(errno);
+    EXPECT_EQ(0, kevent_timer_leeway(kq, 1, INTPTR_MAX)) << strerror(errno);
+
+    /* The kqueue does not spin on it */
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t0);
+    EXPECT_EQ(0, kevent(kq, NULL, 0, &ret, 1, &ts)) << strerror(errno);
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t1);
+    EXPECT_GT(20000000, (t1.tv_sec - t0.tv_sec) * 1000000000 + t1.tv_nsec - t0.tv_nsec);
+
+    close(kq);
+}
+#endif
+
+#if defined(NOTE_THREAD_CPUTIME)
+/* Use up CPU time on a clock, in milliseconds */
+static void
+burn_cpu(clockid_t clock, long ms)
+{
+    struct timespec t0, t;
+
+    clock_gettime(clock, &t0);
+    do {
+        clock_gettime(clock, &t);
+    } while ((t.tv_sec - t0.tv_sec) * 1000 + (t.tv_nsec - t0.tv_nsec) / 1000000 < ms);
+}
+
+TEST_F(KQLegacyTests, TimerCPUTime)
+{
+    const struct timespec zero_ts = { 0, 0 };
+    struct timespec ts = { 0, 100000000 }, t0, t1;
+    struct kevent kev, ret;
+    int i, rv = 0;
+
+    /* Sleeping uses no CPU time */
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t0);
+    kev = KEventCreate(1, EVFILT_TIMER, EV_ADD | EV_ONESHOT, NOTE_THREAD_CPUTIME, 20);
+    ASSERT_EQ(0, kevent(kqfd(), &kev, 1, NULL, 0, NULL)) << strerror(errno);
+    usleep(50000);
+    EXPECT_NO_EVENT(kqfd());
+
+    for (i = 0; i < 200 && rv == 0; i++) {
+        burn_cpu(CLOCK_THREAD_CPUTIME_ID, 5);
+        rv = kevent(kqfd(), NULL, 0, &ret, 1, &zero_ts);
+    }
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t1);
+    ASSERT_EQ(1, rv) << strerror(errno);
+    EXPECT_EQ(1, (int) ret.ident);
+    EXPECT_EQ(1, ret.data);
+    EXPECT_LE(20, (t1.tv_sec - t0.tv_sec) * 1000 + (t1.tv_nsec - t0.tv_nsec) / 1000000);
+
+    /* A periodic timer counts the expirations that were not collected */
+    kev = KEventCreate(2, EVFILT_TIMER, EV_ADD, NOTE_PROCESS_CPUTIME, 5);
+    ASSERT_EQ(0, kevent(kqfd(), &kev, 1, NULL, 0, NULL)) << strerror(errno);
+    burn_cpu(CLOCK_PROCESS_CPUTIME_ID, 52);
+    ASSERT_EQ(1, kevent(kqfd(), NULL, 0, &ret, 1, &ts)) << strerror(errno);
+    EXPECT_EQ(2, (int) ret.ident);
+    EXPECT_LE(5, ret.data);
+    EXPECT_GE(12, ret.data);
+
+    kev.flags = EV_DELETE;
+    ASSERT_EQ(0, kevent(kqfd(), &kev, 1, NULL, 0, NULL)) << strerror(errno);
+    burn_cpu(CLOCK_PROCESS_CPUTIME_ID, 20);
+    EXPECT_NO_EVENT(kqfd());
+
+    /* Only one CPU-time clock can be given */
+    kev = KEventCreate(3, EVFILT_TIMER, EV_ADD,
+            NOTE_PROCESS_CPUTIME | NOTE_THREAD_CPUTIME, 5);
+    EXPECT_EQ(-1, kevent(kqfd(), &kev, 1, NULL, 0, NULL));
+}
+
+static void
+cputime_handler(int)
+{
+}
+
+/* The signal of the CPU-time clocks is not taken from the application */
+TEST_F(KQLegacyTests, TimerCPUTimeBusy)
+{
+    struct sigaction sa;
+    struct kevent kev;
+    int kq, status;
+    pid_t pid;
+
+    /* In a child, as the handler of the library stays once installed */
+    pid = fork();
+    ASSERT_LE(0, pid) << strerror(errno);
+    if (pid == 0) {
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = cputime_handler;
+        if (sigaction(SIGRTMAX, &sa, NULL) < 0 || (kq = kqueue()) < 0)
+            _exit(2);
+        kev = KEventCreate(1, EVFILT_TIMER, EV_ADD, NOTE_THREAD_CPUTIME, 5);
+        if (kevent(kq, &kev, 1, NULL, 0, NULL) != -1 || errno != EBUSY)
+            _exit(1);
+        if (sigaction(SIGRTMAX, NULL, &sa) < 0 || sa.sa_handler != cputime_handler)
+            _exit(1);
+        _exit(0);
+    }
+    ASSERT_EQ(pid, waitpid(pid, &status, 0)) << strerror(errno);
+    EXPECT_TRUE(WIFEXITED(status));
+    EXPECT_EQ(0, WEXITSTATUS(status));
+}
+#endif
+
 void
 test_evfilt_timer(struct test_context *ctx)
 {
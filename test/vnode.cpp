@@ -260,6 +260,56 @@ test_kevent_vnode_dispatch(struct test_context *ctx)
 }
 #endif     /* EV_DISPATCH */
 
+/*
+ * Two descriptors of the same file, watched for different changes. Each
+ * knote only gets the changes it asked for, and the one of a descriptor
+ * that is closed goes away.
+ */
+TEST_F(KQLegacyTests, VNodeSameFile)
+{
+    struct kevent kev, ret;
+    char path[] = "/tmp/kqueue-test.XXXXXX";
+    int fd1, fd2;
+
+    ASSERT_LE(0, fd1 = mkstemp(path));
+    ASSERT_LE(0, fd2 = open(path, O_RDONLY));
+
+    kev = KEventCreate(fd1, EVFILT_VNODE, EV_ADD, NOTE_WRITE);
+    ASSERT_EQ(0, kevent(kqfd(), &kev, 1, NULL, 0, NULL)) << strerror(errno);
+    kev = KEventCreate(fd2, EVFILT_VNODE, EV_ADD, NOTE_ATTRIB);
+    ASSERT_EQ(0, kevent(kqfd(), &kev, 1, NULL, 0, NULL)) << strerror(errno);
+    EXPECT_NO_EVENT(kqfd());
+
+    ASSERT_EQ(2, write(fd1, "hi", 2));
+    EXPECT_EVENT(kqfd(), &ret);
+    EXPECT_EQ(fd1, (int) ret.ident);
+    EXPECT_EQ(NOTE_WRITE | NOTE_EXTEND, (int) ret.fflags);
+    EXPECT_NO_EVENT(kqfd());
+
+    ASSERT_EQ(0, fchmod(fd1, 0644));
+    EXPECT_EVENT(kqfd(), &ret);
+    EXPECT_EQ(fd2, (int) ret.ident);
+    EXPECT_EQ(NOTE_ATTRIB, (int) ret.fflags);
+    EXPECT_NO_EVENT(kqfd());
+
+    /* The other knote keeps the watch */
+    kev = KEventCreate(fd1, EVFILT_VNODE, EV_DELETE);
+    ASSERT_EQ(0, kevent(kqfd(), &kev, 1, NULL, 0, NULL)) << strerror(errno);
+    ASSERT_EQ(0, fchmod(fd1, 0600));
+    EXPECT_EVENT(kqfd(), &ret);
+    EXPECT_EQ(fd2, (int) ret.ident);
+    EXPECT_NO_EVENT(kqfd());
+
+    /* Closing the descriptor deletes its knote */
+    close(fd2);
+    EXPECT_NO_EVENT(kqfd());
+    kev = KEventCreate(fd2, EVFILT_VNODE, EV_DELETE);
+    EXPECT_EQ(-1, kevent(kqfd(), &kev, 1, NULL, 0, NULL));
+
+    close(fd1);
+    unlink(path);
+}
+
 void
 test_evfilt_vnode(struct test_context *ctx)
 {
@@ -0,0 +1,469 @@
+/*
+ * Copyright (c) 2026 libkqueue contributors
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "common.h"
+
+/* Bits returned by kevent_socket_poll() */
+#define SAW_READ    0x1
+#define SAW_WRITE   0x2
+
+static void
+kevent_socket_update(struct test_context *ctx, short filter, u_short flags)
+{
+    struct kevent kev;
+
+    kev = KEventCreate(ctx->client_fd, filter, flags);
+    ASSERT_EQ(0, kevent(ctx->kqfd, &kev, 1, NULL, 0, NULL)) << strerror(errno)
+                                                            << " - " << kev;
+}
+
+/*
+ * Return the filters of the client socket that have events, fetching
+ * at most <nevents> kevents per call.
+ */
+static int
+kevent_socket_poll(struct test_context *ctx, int nevents)
+{
+    struct kevent buf[4];
+    struct timespec ts = { 0, 0 };
+    int i, n, saw = 0;
+
+    while ((n = kevent(ctx->kqfd, NULL, 0, buf, nevents, &ts)) > 0) {
+        for (i = 0; i < n; i++) {
+            EXPECT_EQ(ctx->client_fd, (int) buf[i].ident);
+            if (buf[i].filter == EVFILT_READ)
+                saw |= SAW_READ;
+            else if (buf[i].filter == EVFILT_WRITE)
+                saw |= SAW_WRITE;
+            else
+                ADD_FAILURE() << "unexpected event: " << buf[i];
+        }
+        /* Level-triggered knotes would be returned forever */
+        if (nevents > 1 || saw == (SAW_READ | SAW_WRITE))
+            break;
+    }
+    EXPECT_LE(0, n) << strerror(errno);
+
+    return (saw);
+}
+
+static void
+kevent_socket_fill(struct test_context *ctx)
+{
+    if (send(ctx->server_fd, ".", 1, 0) < 1)
+        FAIL() << "send(2)";
+}
+
+static void
+kevent_socket_drain(struct test_context *ctx)
+{
+    char buf[1];
+
+    if (recv(ctx->client_fd, &buf[0], 1, 0) < 1)
+        FAIL() << "recv(2)";
+}
+
+void
+test_kevent_write_add(struct test_context *ctx)
+{
+    struct kevent kev, ret;
+
+    kevent_socket_update(ctx, EVFILT_WRITE, EV_ADD);
+
+    EXPECT_EVENT(ctx->kqfd, &ret);
+    EXPECT_EQ(EVFILT_WRITE, ret.filter);
+    EXPECT_EQ(ctx->client_fd, (int) ret.ident);
+
+    kev = KEventCreate(ctx->client_fd, EVFILT_WRITE, EV_DELETE);
+    EXPECT_EQ(0, kevent(ctx->kqfd, &kev, 1, NULL, 0, NULL));
+    EXPECT_NO_EVENT(ctx->kqfd);
+}
+
+/* A READ and a WRITE knote on the same socket */
+void
+test_kevent_write_full_duplex(struct test_context *ctx)
+{
+    kevent_socket_update(ctx, EVFILT_READ, EV_ADD);
+    kevent_socket_update(ctx, EVFILT_WRITE, EV_ADD);
+
+    EXPECT_EQ(SAW_WRITE, kevent_socket_poll(ctx, 4));
+
+    kevent_socket_fill(ctx);
+    EXPECT_EQ(SAW_READ | SAW_WRITE, kevent_socket_poll(ctx, 4));
+
+    /* Both events must be returned, even one at a time */
+    EXPECT_EQ(SAW_READ | SAW_WRITE, kevent_socket_poll(ctx, 1));
+
+    kevent_socket_drain(ctx);
+    EXPECT_EQ(SAW_WRITE, kevent_socket_poll(ctx, 4));
+
+    kevent_socket_update(ctx, EVFILT_READ, EV_DELETE);
+    kevent_socket_update(ctx, EVFILT_WRITE, EV_DELETE);
+    EXPECT_NO_EVENT(ctx->kqfd);
+}
+
+/* Deleting one knote must not affect the other */
+void
+test_kevent_write_del_one(struct test_context *ctx)
+{
+    kevent_socket_update(ctx, EVFILT_READ, EV_ADD);
+    kevent_socket_update(ctx, EVFILT_WRITE, EV_ADD);
+
+    kevent_socket_update(ctx, EVFILT_WRITE, EV_DELETE);
+    EXPECT_NO_EVENT(ctx->kqfd);
+
+    kevent_socket_fill(ctx);
+    EXPECT_EQ(SAW_READ, kevent_socket_poll(ctx, 4));
+    kevent_socket_drain(ctx);
+
+    kevent_socket_update(ctx, EVFILT_WRITE, EV_ADD);
+    kevent_socket_update(ctx, EVFILT_READ, EV_DELETE);
+    EXPECT_EQ(SAW_WRITE, kevent_socket_poll(ctx, 4));
+
+    kevent_socket_update(ctx, EVFILT_WRITE, EV_DELETE);
+    EXPECT_NO_EVENT(ctx->kqfd);
+}
+
+/* Disabling one knote must not affect the other */
+void
+test_kevent_write_disable_one(struct test_context *ctx)
+{
+    kevent_socket_update(ctx, EVFILT_READ, EV_ADD);
+    kevent_socket_update(ctx, EVFILT_WRITE, EV_ADD);
+    kevent_socket_fill(ctx);
+
+    kevent_socket_update(ctx, EVFILT_WRITE, EV_DISABLE);
+    EXPECT_EQ(SAW_READ, kevent_socket_poll(ctx, 4));
+
+    kevent_socket_update(ctx, EVFILT_READ, EV_DISABLE);
+    EXPECT_NO_EVENT(ctx->kqfd);
+
+    kevent_socket_update(ctx, EVFILT_WRITE, EV_ENABLE);
+    EXPECT_EQ(SAW_WRITE, kevent_socket_poll(ctx, 4));
+
+    kevent_socket_update(ctx, EVFILT_READ, EV_ENABLE);
+    EXPECT_EQ(SAW_READ | SAW_WRITE, kevent_socket_poll(ctx, 4));
+
+    kevent_socket_drain(ctx);
+    kevent_socket_update(ctx, EVFILT_READ, EV_DELETE);
+    kevent_socket_update(ctx, EVFILT_WRITE, EV_DELETE);
+}
+
+/* An EV_DISPATCH WRITE knote next to a level-triggered READ knote */
+void
+test_kevent_write_dispatch(struct test_context *ctx)
+{
+    kevent_socket_update(ctx, EVFILT_READ, EV_ADD);
+    kevent_socket_update(ctx, EVFILT_WRITE, EV_ADD | EV_DISPATCH);
+    kevent_socket_fill(ctx);
+
+    EXPECT_EQ(SAW_READ | SAW_WRITE, kevent_socket_poll(ctx, 4));
+    EXPECT_EQ(SAW_READ, kevent_socket_poll(ctx, 4));
+
+    kevent_socket_update(ctx, EVFILT_WRITE, EV_ENABLE);
+    EXPECT_EQ(SAW_READ | SAW_WRITE, kevent_socket_poll(ctx, 4));
+    EXPECT_EQ(SAW_READ, kevent_socket_poll(ctx, 4));
+
+    kevent_socket_drain(ctx);
+    EXPECT_NO_EVENT(ctx->kqfd);
+
+    kevent_socket_update(ctx, EVFILT_READ, EV_DELETE);
+    kevent_socket_update(ctx, EVFILT_WRITE, EV_DELETE);
+}
+
+/* An EV_ONESHOT WRITE knote next to a level-triggered READ knote */
+void
+test_kevent_write_oneshot(struct test_context *ctx)
+{
+    struct kevent kev;
+
+    kevent_socket_update(ctx, EVFILT_READ, EV_ADD);
+    kevent_socket_update(ctx, EVFILT_WRITE, EV_ADD | EV_ONESHOT);
+    kevent_socket_fill(ctx);
+
+    EXPECT_EQ(SAW_READ | SAW_WRITE, kevent_socket_poll(ctx, 4));
+    EXPECT_EQ(SAW_READ, kevent_socket_poll(ctx, 4));
+
+    /* The WRITE knote is gone */
+    kev = KEventCreate(ctx->client_fd, EVFILT_WRITE, EV_DELETE);
+    EXPECT_EQ(-1, kevent(ctx->kqfd, &kev, 1, NULL, 0, NULL));
+
+    kevent_socket_drain(ctx);
+    EXPECT_NO_EVENT(ctx->kqfd);
+
+    kevent_socket_update(ctx, EVFILT_READ, EV_DELETE);
+}
+
+/* An EV_CLEAR READ knote next to a level-triggered WRITE knote */
+void
+test_kevent_write_clear(struct test_context *ctx)
+{
+    kevent_socket_update(ctx, EVFILT_READ, EV_ADD | EV_CLEAR);
+    kevent_socket_update(ctx, EVFILT_WRITE, EV_ADD);
+    kevent_socket_fill(ctx);
+
+    EXPECT_EQ(SAW_READ | SAW_WRITE, kevent_socket_poll(ctx, 4));
+
+    /*
+     * The WRITE knote must keep being reported. The READ knote may be
+     * reported again as a side effect of re-arming the descriptor.
+     */
+    EXPECT_TRUE(kevent_socket_poll(ctx, 4) & SAW_WRITE);
+    EXPECT_TRUE(kevent_socket_poll(ctx, 4) & SAW_WRITE);
+
+    /* New data is a new edge */
+    kevent_socket_fill(ctx);
+    EXPECT_EQ(SAW_READ | SAW_WRITE, kevent_socket_poll(ctx, 4));
+
+    kevent_socket_drain(ctx);
+    kevent_socket_drain(ctx);
+    kevent_socket_update(ctx, EVFILT_READ, EV_DELETE);
+    kevent_socket_update(ctx, EVFILT_WRITE, EV_DELETE);
+}
+
+/* Return the data field of the WRITE event for <fd> */
+static intptr_t
+kevent_write_space(int kqfd, int fd)
+{
+    struct kevent kev, ret;
+    intptr_t data;
+
+    kev = KEventCreate(fd, EVFILT_WRITE, EV_ADD);
+    EXPECT_EQ(0, kevent(kqfd, &kev, 1, NULL, 0, NULL)) << strerror(errno);
+    EXPECT_EVENT(kqfd, &ret);
+    EXPECT_EQ(fd, (int) ret.ident);
+    data = ret.data;
+    kev.flags = EV_DELETE;
+    EXPECT_EQ(0, kevent(kqfd, &kev, 1, NULL, 0, NULL)) << strerror(errno);
+
+    return (data);
+}
+
+static int
+kevent_write_sndbuf(int fd)
+{
+    socklen_t slen;
+    int sndbuf;
+
+    slen = sizeof(sndbuf);
+    EXPECT_EQ(0, getsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, &slen));
+
+    return (sndbuf);
+}
+
+/* data is the free space in the send buffer */
+void
+test_kevent_write_space_unix(struct test_context *ctx)
+{
+    char buf[1000];
+    intptr_t data;
+    int sndbuf;
+
+    sndbuf = kevent_write_sndbuf(ctx->client_fd);
+    EXPECT_EQ(sndbuf, kevent_write_space(ctx->kqfd, ctx->client_fd));
+
+    memset(buf, 'x', sizeof(buf));
+    ASSERT_EQ((ssize_t) sizeof(buf), send(ctx->client_fd, buf, sizeof(buf), 0));
+    data = kevent_write_space(ctx->kqfd, ctx->client_fd);
+    EXPECT_GT(data, 0);
+    EXPECT_LE(data, sndbuf - (intptr_t) sizeof(buf));
+
+    ASSERT_EQ((ssize_t) sizeof(buf), recv(ctx->server_fd, buf, sizeof(buf), 0));
+    EXPECT_EQ(sndbuf, kevent_write_space(ctx->kqfd, ctx->client_fd));
+}
+
+void
+test_kevent_write_space_tcp(struct test_context *ctx)
+{
+    intptr_t data;
+    int clnt, srvr, sndbuf;
+
+    create_socket_connection(&clnt, &srvr);
+
+    sndbuf = kevent_write_sndbuf(clnt);
+    data = kevent_write_space(ctx->kqfd, clnt);
+    EXPECT_GT(data, 0);
+    EXPECT_LE(data, sndbuf);
+
+    close(clnt);
+    close(srvr);
+}
+
+/* NOTE_LOWAT is the free space needed for an event */
+void
+test_kevent_write_lowat(struct test_context *ctx)
+{
+    struct kevent kev, ret;
+    char buf[1000];
+    int sndbuf;
+
+    sndbuf = kevent_write_sndbuf(ctx->client_fd);
+
+    EV_SET(&kev, ctx->client_fd, EVFILT_WRITE, EV_ADD, NOTE_LOWAT, sndbuf + 1, NULL);
+    EXPECT_EQ(0, kevent(ctx->kqfd, &kev, 1, NULL, 0, NULL)) << strerror(errno);
+    EXPECT_NO_EVENT(ctx->kqfd);
+
+    /* Lower the threshold of the existing knote */
+    kev.data = sndbuf;
+    EXPECT_EQ(0, kevent(ctx->kqfd, &kev, 1, NULL, 0, NULL)) << strerror(errno);
+    EXPECT_EVENT(ctx->kqfd, &ret);
+    EXPECT_EQ(sndbuf, ret.data);
+
+    /* Queued data takes up space until it is read */
+    memset(buf, 'x', sizeof(buf));
+    ASSERT_EQ((ssize_t) sizeof(buf), send(ctx->client_fd, buf, sizeof(buf), 0));
+    EXPECT_NO_EVENT(ctx->kqfd);
+    ASSERT_EQ((ssize_t) sizeof(buf), recv(ctx->server_fd, buf, sizeof(buf), 0));
+    EXPECT_EVENT(ctx->kqfd, &ret);
+    EXPECT_EQ(sndbuf, ret.data);
+
+    kev.flags = EV_DELETE;
+    EXPECT_EQ(0, kevent(ctx->kqfd, &kev, 1, NULL, 0, NULL)) << strerror(errno);
+}
+
+#if defined(F_GETPIPE_SZ)
+static void
+kevent_write_space_pipe(struct test_context *ctx, int rfd, int wfd)
+{
+    char buf[1000];
+    int size;
+
+    size = fcntl(wfd, F_GETPIPE_SZ);
+    ASSERT_LT(0, size) << strerror(errno);
+    EXPECT_EQ(size, kevent_write_space(ctx->kqfd, wfd));
+
+    memset(buf, 'x', sizeof(buf));
+    ASSERT_EQ((ssize_t) sizeof(buf), write(wfd, buf, sizeof(buf)));
+    EXPECT_EQ(size - (intptr_t) sizeof(buf), kevent_write_space(ctx->kqfd, wfd));
+
+    /* A resized pipe is noticed when the knote is added again */
+    ASSERT_LT(0, fcntl(wfd, F_SETPIPE_SZ, 2 * size)) << strerror(errno);
+    size = fcntl(wfd, F_GETPIPE_SZ);
+    EXPECT_EQ(size - (intptr_t) sizeof(buf), kevent_write_space(ctx->kqfd, wfd));
+
+    ASSERT_EQ((ssize_t) sizeof(buf), read(rfd, buf, sizeof(buf)));
+    EXPECT_EQ(size, kevent_write_space(ctx->kqfd, wfd));
+}
+
+void
+test_kevent_write_space_pipe(struct test_context *ctx)
+{
+    int fd[2];
+
+    ASSERT_EQ(0, pipe(fd)) << strerror(errno);
+    kevent_write_space_pipe(ctx, fd[0], fd[1]);
+    close(fd[0]);
+    close(fd[1]);
+}
+
+void
+test_kevent_write_space_fifo(struct test_context *ctx)
+{
+    char path[] = "/tmp/kqueue-test-fifo.XXXXXX";
+    int rfd, wfd;
+
+    ASSERT_TRUE(mkdtemp(path) != NULL) << strerror(errno);
+    std::string fifo = std::string(path) + "/fifo";
+    ASSERT_EQ(0, mkfifo(fifo.c_str(), 0600)) << strerror(errno);
+
+    rfd = open(fifo.c_str(), O_RDONLY | O_NONBLOCK);
+    ASSERT_LE(0, rfd) << strerror(errno);
+    wfd = open(fifo.c_str(), O_WRONLY | O_NONBLOCK);
+    ASSERT_LE(0, wfd) << strerror(errno);
+
+    kevent_write_space_pipe(ctx, rfd, wfd);
+
+    close(rfd);
+    close(wfd);
+    unlink(fifo.c_str());
+    rmdir(path);
+}
+
+/* The type of a descriptor is looked up again after it is reused */
+void
+test_kevent_write_fd_reuse(struct test_context *ctx)
+{
+    struct kevent kev, ret;
+    int sv[2], fd[2], size;
+
+    ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) << strerror(errno);
+    ASSERT_EQ(0, pipe(fd)) << strerror(errno);
+    size = fcntl(fd[1], F_GETPIPE_SZ);
+    ASSERT_LT(0, size) << strerror(errno);
+
+    kev = KEventCreate(sv[0], EVFILT_READ, EV_ADD);
+    EXPECT_EQ(0, kevent(ctx->kqfd, &kev, 1, NULL, 0, NULL)) << strerror(errno);
+    EXPECT_EQ(kevent_write_sndbuf(sv[0]), kevent_write_space(ctx->kqfd, sv[0]));
+    kev.flags = EV_DELETE;
+    EXPECT_EQ(0, kevent(ctx->kqfd, &kev, 1, NULL, 0, NULL)) << strerror(errno);
+
+    ASSERT_EQ(sv[0], dup2(fd[1], sv[0])) << strerror(errno);
+    EXPECT_EQ(size, kevent_write_space(ctx->kqfd, sv[0]));
+
+    /* The caller can vouch for the type instead */
+    EV_SET(&kev, fd[1], EVFILT_WRITE, EV_ADD, NOTE_FD_PIPE, 0, NULL);
+    EXPECT_EQ(0, kevent(ctx->kqfd, &kev, 1, NULL, 0, NULL)) << strerror(errno);
+    EXPECT_EVENT(ctx->kqfd, &ret);
+    EXPECT_EQ(size, ret.data);
+    kev.flags = EV_DELETE;
+    EXPECT_EQ(0, kevent(ctx->kqfd, &kev, 1, NULL, 0, NULL)) << strerror(errno);
+
+    close(sv[0]);
+    close(sv[1]);
+    close(fd[0]);
+    close(fd[1]);
+}
+#endif
+
+void
+test_evfilt_write(struct test_context *ctx)
+{
+    int sv[2], kqfd;
+
+    /*
+     * A kqueue of its own, so that the knotes and events left behind by
+     * earlier tests that failed are not seen here.
+     */
+    if ((kqfd = kqueue()) < 0)
+        FAIL() << "kqueue: " << strerror(errno);
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+        close(kqfd);
+        FAIL() << "socketpair: " << strerror(errno);
+    }
+    ctx->kqfd = kqfd;
+    ctx->client_fd = sv[0];
+    ctx->server_fd = sv[1];
+
+    test(kevent_write_add, ctx);
+    test(kevent_write_full_duplex, ctx);
+    test(kevent_write_del_one, ctx);
+    test(kevent_write_disable_one, ctx);
+    test(kevent_write_dispatch, ctx);
+    test(kevent_write_oneshot, ctx);
+    test(kevent_write_clear, ctx);
+    test(kevent_write_space_unix, ctx);
+    test(kevent_write_space_tcp, ctx);
+    test(kevent_write_lowat, ctx);
+#if defined(F_GETPIPE_SZ)
+    test(kevent_write_space_pipe, ctx);
+    test(kevent_write_space_fifo, ctx);
+    test(kevent_write_fd_reuse, ctx);
+#endif
+
+    close(ctx->client_fd);
+    close(ctx->server_fd);
+    close(kqfd);
+}